@@ -0,0 +1,148 @@
+#pragma once
+
+#include <absl/synchronization/mutex.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace llm {
+
+// a bounded single-producer/multi-consumer ring where every consumer sees
+// every element in order. the producer publishes a command by bumping an
+// atomic sequence number and each consumer tracks its own cursor, so the
+// dispatch path is a handful of atomic operations without locks or
+// allocations. waiters spin for a short while before blocking on a mutex,
+// which keeps the latency low for back-to-back commands without burning cpu
+// when idle.
+template <typename T>
+class BroadcastRing final {
+ public:
+  BroadcastRing(size_t num_consumers, size_t capacity)
+      : slots_(capacity), cursors_(num_consumers) {}
+
+  // disable copy/move constructor and assignment
+  BroadcastRing(const BroadcastRing&) = delete;
+  BroadcastRing& operator=(const BroadcastRing&) = delete;
+  BroadcastRing(BroadcastRing&&) = delete;
+  BroadcastRing& operator=(BroadcastRing&&) = delete;
+
+  // publish a command to all consumers, returns its sequence number.
+  // blocks when the slowest consumer is a full ring behind.
+  // must only be called from one thread.
+  uint64_t publish(const T& command) {
+    const uint64_t seq = published_.load(std::memory_order_relaxed);
+    await([this, seq]() {
+      return seq - std::min(seq, min_cursor()) < slots_.size();
+    });
+    slots_[seq % slots_.size()] = command;
+    published_.store(seq + 1);
+    notify();
+    return seq;
+  }
+
+  // wait until all consumers are done with the command with the given
+  // sequence number and every command before it.
+  void wait(uint64_t seq) {
+    await([this, seq]() { return min_cursor() > seq; });
+  }
+
+  // wait for the next command of the consumer.
+  // returns nullptr once the ring is closed and all commands are consumed.
+  const T* next(size_t consumer) {
+    const uint64_t cursor =
+        cursors_[consumer].value.load(std::memory_order_relaxed);
+    await([this, cursor]() { return published_.load() > cursor || closed_; });
+    if (published_.load() > cursor) {
+      return &slots_[cursor % slots_.size()];
+    }
+    return nullptr;
+  }
+
+  // mark the command returned by next() as done.
+  void done(size_t consumer) {
+    cursors_[consumer].value.fetch_add(1);
+    notify();
+  }
+
+  // wake up all consumers and make next() return nullptr once drained.
+  void close() {
+    closed_.store(true);
+    absl::MutexLock lock(&mutex_);
+  }
+
+  size_t num_consumers() const { return cursors_.size(); }
+
+ private:
+  // number of spins before falling back to blocking
+  static constexpr int kSpinIterations = 1 << 10;
+
+  // keep each cursor on its own cache line to avoid false sharing
+  struct alignas(64) Cursor {
+    std::atomic<uint64_t> value{0};
+  };
+
+  uint64_t min_cursor() const {
+    uint64_t result = UINT64_MAX;
+    for (const auto& cursor : cursors_) {
+      result = std::min(result, cursor.value.load());
+    }
+    return result;
+  }
+
+  template <typename Predicate>
+  void await(const Predicate& pred) {
+    for (int i = 0; i < kSpinIterations; ++i) {
+      if (pred()) {
+        return;
+      }
+      cpu_relax();
+    }
+    // the waiter count is bumped before the last check under the mutex, so
+    // that a notify() either sees the waiter or the waiter sees the update.
+    waiters_.fetch_add(1);
+    {
+      absl::MutexLock lock(&mutex_);
+      mutex_.Await(absl::Condition(&pred));
+    }
+    waiters_.fetch_sub(1);
+  }
+
+  void notify() {
+    if (waiters_.load() > 0) {
+      // releasing the mutex re-evaluates the conditions of all waiters
+      absl::MutexLock lock(&mutex_);
+    }
+  }
+
+  static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+  }
+
+  // the command slots, indexed by sequence number modulo capacity
+  std::vector<T> slots_;
+
+  // number of commands done by each consumer
+  std::vector<Cursor> cursors_;
+
+  // number of commands published by the producer
+  alignas(64) std::atomic<uint64_t> published_{0};
+
+  std::atomic<bool> closed_{false};
+
+  // number of threads blocked on the mutex
+  std::atomic<int32_t> waiters_{0};
+
+  // mutex used to block waiters after spinning
+  absl::Mutex mutex_;
+};
+
+}  // namespace llm
@@ -0,0 +1,113 @@
+#include "broadcast_ring.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+namespace llm {
+
+TEST(BroadcastRingTest, Basic) {
+  BroadcastRing<int> ring(/*num_consumers=*/2, /*capacity=*/4);
+  const uint64_t seq = ring.publish(42);
+  EXPECT_EQ(seq, 0);
+
+  for (size_t consumer = 0; consumer < 2; ++consumer) {
+    const int* command = ring.next(consumer);
+    ASSERT_NE(command, nullptr);
+    EXPECT_EQ(*command, 42);
+    ring.done(consumer);
+  }
+  // all consumers are done, should return immediately
+  ring.wait(seq);
+
+  ring.close();
+  EXPECT_EQ(ring.next(0), nullptr);
+  EXPECT_EQ(ring.next(1), nullptr);
+}
+
+TEST(BroadcastRingTest, DrainBeforeClose) {
+  BroadcastRing<int> ring(/*num_consumers=*/1, /*capacity=*/4);
+  ring.publish(1);
+  ring.publish(2);
+  ring.close();
+
+  // published commands are still delivered after close
+  const int* command = ring.next(0);
+  ASSERT_NE(command, nullptr);
+  EXPECT_EQ(*command, 1);
+  ring.done(0);
+  command = ring.next(0);
+  ASSERT_NE(command, nullptr);
+  EXPECT_EQ(*command, 2);
+  ring.done(0);
+  EXPECT_EQ(ring.next(0), nullptr);
+}
+
+TEST(BroadcastRingTest, MultipleConsumers) {
+  const size_t num_consumers = 8;
+  const int num_commands = 1000;
+  // small capacity to exercise the back pressure on the producer
+  BroadcastRing<int> ring(num_consumers, /*capacity=*/4);
+
+  std::vector<int64_t> sums(num_consumers, 0);
+  std::vector<int> counts(num_consumers, 0);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_consumers; ++i) {
+    threads.emplace_back([&ring, &sums, &counts, i]() {
+      int expected = 0;
+      while (const int* command = ring.next(i)) {
+        // commands are delivered in order
+        EXPECT_EQ(*command, expected++);
+        sums[i] += *command;
+        ++counts[i];
+        ring.done(i);
+      }
+    });
+  }
+
+  uint64_t last_seq = 0;
+  for (int i = 0; i < num_commands; ++i) {
+    last_seq = ring.publish(i);
+  }
+  ring.wait(last_seq);
+  ring.close();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const int64_t expected_sum = int64_t(num_commands) * (num_commands - 1) / 2;
+  for (size_t i = 0; i < num_consumers; ++i) {
+    EXPECT_EQ(counts[i], num_commands);
+    EXPECT_EQ(sums[i], expected_sum);
+  }
+}
+
+TEST(BroadcastRingTest, WaitActsAsBarrier) {
+  const int num_consumers = 4;
+  BroadcastRing<int> ring(num_consumers, /*capacity=*/2);
+
+  std::atomic<int> finished{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_consumers; ++i) {
+    threads.emplace_back([&ring, &finished, i]() {
+      while (ring.next(i) != nullptr) {
+        // take long enough for the producer to fall back to blocking
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        finished.fetch_add(1);
+        ring.done(i);
+      }
+    });
+  }
+
+  for (int step = 1; step <= 3; ++step) {
+    ring.wait(ring.publish(step));
+    // every consumer has finished the command once wait returns
+    EXPECT_EQ(finished.load(), step * num_consumers);
+  }
+  ring.close();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+}  // namespace llm
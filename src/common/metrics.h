@@ -1,9 +1,11 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 #include <prometheus/counter.h>
 #include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
 #include <prometheus/registry.h>
 #include <prometheus/text_serializer.h>
 
@@ -39,6 +41,31 @@ class Metrics final {
   prometheus::Registry registry_;
 };
 
+// bucket boundaries: start, start * factor, ..., start * factor^(count - 1)
+inline prometheus::Histogram::BucketBoundaries exponential_buckets(
+    double start,
+    double factor,
+    size_t count) {
+  prometheus::Histogram::BucketBoundaries buckets;
+  buckets.reserve(count);
+  double bound = start;
+  for (size_t i = 0; i < count; ++i) {
+    buckets.push_back(bound);
+    bound *= factor;
+  }
+  return buckets;
+}
+
+// buckets for step phase latencies in seconds: 100us ~ 13s
+inline prometheus::Histogram::BucketBoundaries latency_buckets() {
+  return exponential_buckets(1e-4, 2.0, 18);
+}
+
+// buckets for batch sizes in sequences or tokens: 1 ~ 32768
+inline prometheus::Histogram::BucketBoundaries size_buckets() {
+  return exponential_buckets(1.0, 2.0, 16);
+}
+
 // define helpful macros to hide boilerplate code
 // NOLINTBEGIN(bugprone-macro-parentheses)
 #define DEFINE_GAUGE(name, desc)                                \
@@ -53,9 +80,17 @@ class Metrics final {
           Metrics::Instance().GetRegistry());                     \
   prometheus::Counter& name = name##_family.Add({});
 
+#define DEFINE_HISTOGRAM(name, desc, buckets)                       \
+  prometheus::Family<prometheus::Histogram>& name##_family =        \
+      prometheus::BuildHistogram().Name(#name).Help(desc).Register( \
+          Metrics::Instance().GetRegistry());                       \
+  prometheus::Histogram& name = name##_family.Add({}, buckets);
+
 #define DECLARE_GAUGE(name) extern prometheus::Gauge& name;
 
 #define DECLARE_COUNTER(name) extern prometheus::Counter& name;
+
+#define DECLARE_HISTOGRAM(name) extern prometheus::Histogram& name;
 // NOLINTEND(bugprone-macro-parentheses)
 
 }  // namespace llm
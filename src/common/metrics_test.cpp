@@ -0,0 +1,37 @@
+#include "metrics.h"
+
+#include <gtest/gtest.h>
+
+namespace llm {
+
+DEFINE_HISTOGRAM(metrics_test_latency_seconds,
+                 "Latency histogram for testing",
+                 exponential_buckets(0.5, 2.0, 3));
+
+TEST(MetricsTest, ExponentialBuckets) {
+  EXPECT_EQ(exponential_buckets(1.0, 2.0, 4),
+            prometheus::Histogram::BucketBoundaries({1.0, 2.0, 4.0, 8.0}));
+  EXPECT_TRUE(exponential_buckets(1.0, 2.0, 0).empty());
+  EXPECT_EQ(latency_buckets().size(), 18);
+  EXPECT_EQ(size_buckets().back(), 32768.0);
+}
+
+TEST(MetricsTest, Histogram) {
+  metrics_test_latency_seconds.Observe(0.3);
+  metrics_test_latency_seconds.Observe(1.5);
+  metrics_test_latency_seconds.Observe(10.0);
+
+  const std::string metrics = Metrics::Instance().GetString();
+  // buckets are cumulative: [0.5, 1, 2, +Inf]
+  EXPECT_NE(metrics.find("metrics_test_latency_seconds_bucket{le=\"0.5\"} 1"),
+            std::string::npos);
+  EXPECT_NE(metrics.find("metrics_test_latency_seconds_bucket{le=\"2\"} 2"),
+            std::string::npos);
+  EXPECT_NE(
+      metrics.find("metrics_test_latency_seconds_bucket{le=\"+Inf\"} 3"),
+      std::string::npos);
+  EXPECT_NE(metrics.find("metrics_test_latency_seconds_count 3"),
+            std::string::npos);
+}
+
+}  // namespace llm
@@ -0,0 +1,146 @@
+#include "tracer.h"
+
+#include <glog/logging.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <nlohmann/json.hpp>
+
+namespace llm {
+
+void Tracer::enable(size_t capacity) {
+  CHECK_GT(capacity, 0);
+  CHECK(!enabled()) << "Tracer is already enabled";
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  slots_ = std::make_unique<Slot[]>(size);
+  mask_ = size - 1;
+  enabled_.store(true, std::memory_order_release);
+}
+
+void Tracer::record(const char* name,
+                    int64_t start_us,
+                    int64_t end_us,
+                    const char* arg_name,
+                    int64_t arg,
+                    const int64_t* seq_ids,
+                    size_t num_seq_ids,
+                    int64_t num_seqs) {
+  const uint64_t ticket = head_.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots_[ticket & mask_];
+  // mark the slot as being written before touching the payload
+  slot.version.store(2 * ticket + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.start_us.store(start_us, std::memory_order_relaxed);
+  slot.end_us.store(end_us, std::memory_order_relaxed);
+  slot.tid.store(thread_id(), std::memory_order_relaxed);
+  slot.arg_name.store(arg_name, std::memory_order_relaxed);
+  slot.arg.store(arg, std::memory_order_relaxed);
+  slot.num_seqs.store(num_seqs, std::memory_order_relaxed);
+  num_seq_ids = std::min(num_seq_ids, kMaxSeqIds);
+  slot.num_seq_ids.store(static_cast<uint32_t>(num_seq_ids),
+                         std::memory_order_relaxed);
+  for (size_t i = 0; i < num_seq_ids; ++i) {
+    slot.seq_ids[i].store(seq_ids[i], std::memory_order_relaxed);
+  }
+
+  slot.version.store(2 * ticket + 2, std::memory_order_release);
+}
+
+std::vector<TraceEvent> Tracer::collect(int64_t window_us) const {
+  std::vector<TraceEvent> events;
+  if (!enabled()) {
+    return events;
+  }
+  const int64_t since_us = now_us() - window_us;
+  const uint64_t head = head_.load(std::memory_order_acquire);
+  const uint64_t capacity = mask_ + 1;
+  const uint64_t tail = head > capacity ? head - capacity : 0;
+  events.reserve(head - tail);
+  for (uint64_t ticket = tail; ticket < head; ++ticket) {
+    const Slot& slot = slots_[ticket & mask_];
+    const uint64_t version = slot.version.load(std::memory_order_acquire);
+    if (version != 2 * ticket + 2) {
+      // being written or already overwritten
+      continue;
+    }
+    TraceEvent event;
+    event.name = slot.name.load(std::memory_order_relaxed);
+    event.start_us = slot.start_us.load(std::memory_order_relaxed);
+    const int64_t end_us = slot.end_us.load(std::memory_order_relaxed);
+    event.duration_us = end_us - event.start_us;
+    event.tid = slot.tid.load(std::memory_order_relaxed);
+    event.arg_name = slot.arg_name.load(std::memory_order_relaxed);
+    event.arg = slot.arg.load(std::memory_order_relaxed);
+    event.num_seqs = slot.num_seqs.load(std::memory_order_relaxed);
+    const size_t num_seq_ids =
+        std::min<size_t>(slot.num_seq_ids.load(std::memory_order_relaxed),
+                         kMaxSeqIds);
+    event.seq_ids.reserve(num_seq_ids);
+    for (size_t i = 0; i < num_seq_ids; ++i) {
+      event.seq_ids.push_back(slot.seq_ids[i].load(std::memory_order_relaxed));
+    }
+    // drop the span if a writer took over the slot while reading it
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.version.load(std::memory_order_relaxed) != version) {
+      continue;
+    }
+    if (end_us >= since_us) {
+      events.push_back(std::move(event));
+    }
+  }
+  std::sort(events.begin(),
+            events.end(),
+            [](const TraceEvent& lhs, const TraceEvent& rhs) {
+              return lhs.start_us < rhs.start_us;
+            });
+  return events;
+}
+
+std::string Tracer::dump_chrome_trace(double seconds) const {
+  const auto window_us = static_cast<int64_t>(seconds * 1e6);
+  auto trace_events = nlohmann::json::array();
+  for (const auto& event : collect(window_us)) {
+    nlohmann::json args = nlohmann::json::object();
+    if (event.arg_name != nullptr) {
+      args[event.arg_name] = event.arg;
+    }
+    if (event.num_seqs > 0) {
+      args["seq_ids"] = event.seq_ids;
+      args["num_seqs"] = event.num_seqs;
+    }
+    // a complete event ('X') of the chrome trace event format
+    trace_events.push_back({{"name", event.name},
+                            {"ph", "X"},
+                            {"ts", event.start_us},
+                            {"dur", event.duration_us},
+                            {"pid", 1},
+                            {"tid", event.tid},
+                            {"args", std::move(args)}});
+  }
+  nlohmann::json trace;
+  trace["traceEvents"] = std::move(trace_events);
+  trace["displayTimeUnit"] = "ms";
+  return trace.dump();
+}
+
+int64_t Tracer::now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+uint32_t Tracer::thread_id() {
+  // same as the thread id shown by top and perf
+  static thread_local const auto tid =
+      static_cast<uint32_t>(::syscall(SYS_gettid));
+  return tid;
+}
+
+}  // namespace llm
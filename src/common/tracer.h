@@ -0,0 +1,171 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llm {
+
+// a finished span read back from the tracer
+struct TraceEvent {
+  // names are string literals owned by the code recording the span
+  const char* name = nullptr;
+
+  // start time in microseconds of steady clock
+  int64_t start_us = 0;
+
+  int64_t duration_us = 0;
+
+  // id of the thread recording the span
+  uint32_t tid = 0;
+
+  // optional integer argument, e.g. layer index or rank
+  const char* arg_name = nullptr;
+  int64_t arg = 0;
+
+  // ids of sequences covered by the span, at most kMaxSeqIds are kept
+  std::vector<int64_t> seq_ids;
+
+  // total number of sequences covered by the span
+  int64_t num_seqs = 0;
+};
+
+// Tracer records spans into a fixed size ring buffer without locks, so that
+// the timeline of the last seconds can be dumped as chrome trace json and
+// viewed with chrome://tracing or https://ui.perfetto.dev.
+// Writers never block: each span claims a slot with one atomic increment and
+// the oldest spans are overwritten. Readers skip slots being written.
+class Tracer final {
+ public:
+  // max number of sequence ids kept per span
+  static constexpr size_t kMaxSeqIds = 8;
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  // a singleton class
+  static Tracer& Instance() {
+    static Tracer instance;
+    return instance;
+  }
+
+  // start tracing with a ring buffer holding the last `capacity` spans,
+  // rounded up to a power of two. should be called once before any spans are
+  // recorded.
+  void enable(size_t capacity);
+
+  bool enabled() const { return enabled_.load(std::memory_order_acquire); }
+
+  // record a finished span, thread safe
+  void record(const char* name,
+              int64_t start_us,
+              int64_t end_us,
+              const char* arg_name,
+              int64_t arg,
+              const int64_t* seq_ids,
+              size_t num_seq_ids,
+              int64_t num_seqs);
+
+  // spans finished within the last window_us microseconds, sorted by start
+  std::vector<TraceEvent> collect(int64_t window_us) const;
+
+  // spans of the last `seconds` seconds in chrome trace event format
+  std::string dump_chrome_trace(double seconds) const;
+
+  // current time in microseconds of steady clock
+  static int64_t now_us();
+
+  // id of the calling thread as shown in the trace
+  static uint32_t thread_id();
+
+ private:
+  Tracer() = default;
+  ~Tracer() = default;
+
+  // one span in the ring buffer, guarded by a sequence lock: version is odd
+  // while the span is being written, and 2 * (ticket + 1) once it is done.
+  struct Slot {
+    std::atomic<uint64_t> version{0};
+    std::atomic<const char*> name{nullptr};
+    std::atomic<int64_t> start_us{0};
+    std::atomic<int64_t> end_us{0};
+    std::atomic<uint32_t> tid{0};
+    std::atomic<const char*> arg_name{nullptr};
+    std::atomic<int64_t> arg{0};
+    std::atomic<int64_t> num_seqs{0};
+    std::atomic<uint32_t> num_seq_ids{0};
+    std::array<std::atomic<int64_t>, kMaxSeqIds> seq_ids{};
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+
+  // capacity - 1, capacity is a power of two
+  uint64_t mask_ = 0;
+
+  // ticket of the next span to write
+  std::atomic<uint64_t> head_{0};
+
+  std::atomic<bool> enabled_{false};
+};
+
+// TraceSpan records the lifetime of a scope as a span if tracing is enabled.
+// the name and arg_name should be string literals.
+// example:
+//   TraceSpan span("forward");
+//   TraceSpan layer_span("layer", "index", i);
+class TraceSpan final {
+ public:
+  explicit TraceSpan(const char* name,
+                     const char* arg_name = nullptr,
+                     int64_t arg = 0)
+      : enabled_(Tracer::Instance().enabled()),
+        name_(name),
+        arg_name_(arg_name),
+        arg_(arg) {
+    if (enabled_) {
+      start_us_ = Tracer::now_us();
+    }
+  }
+
+  ~TraceSpan() {
+    if (enabled_) {
+      Tracer::Instance().record(name_,
+                                start_us_,
+                                Tracer::now_us(),
+                                arg_name_,
+                                arg_,
+                                seq_ids_.data(),
+                                num_seq_ids_,
+                                num_seqs_);
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  bool enabled() const { return enabled_; }
+
+  // attach a sequence to the span, only the first kMaxSeqIds ids are kept
+  void add_seq_id(int64_t seq_id) {
+    if (num_seq_ids_ < seq_ids_.size()) {
+      seq_ids_[num_seq_ids_++] = seq_id;
+    }
+    ++num_seqs_;
+  }
+
+ private:
+  bool enabled_ = false;
+  const char* name_ = nullptr;
+  const char* arg_name_ = nullptr;
+  int64_t arg_ = 0;
+  int64_t start_us_ = 0;
+  std::array<int64_t, Tracer::kMaxSeqIds> seq_ids_{};
+  size_t num_seq_ids_ = 0;
+  int64_t num_seqs_ = 0;
+};
+
+}  // namespace llm
@@ -0,0 +1,122 @@
+#include "tracer.h"
+
+#include <gtest/gtest.h>
+
+#include <nlohmann/json.hpp>
+#include <thread>
+
+namespace llm {
+
+class TracerTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() { Tracer::Instance().enable(kCapacity); }
+
+  static constexpr size_t kCapacity = 64;
+};
+
+TEST_F(TracerTest, Span) {
+  auto& tracer = Tracer::Instance();
+  ASSERT_TRUE(tracer.enabled());
+  {
+    TraceSpan span("span_test", "layer", 3);
+    EXPECT_TRUE(span.enabled());
+    for (int64_t i = 0; i < 10; ++i) {
+      span.add_seq_id(i);
+    }
+  }
+
+  const auto events = tracer.collect(/*window_us=*/10 * 1000 * 1000);
+  auto it = std::find_if(
+      events.begin(), events.end(), [](const TraceEvent& event) {
+        return std::string(event.name) == "span_test";
+      });
+  ASSERT_NE(it, events.end());
+  EXPECT_GE(it->duration_us, 0);
+  EXPECT_EQ(it->tid, Tracer::thread_id());
+  EXPECT_EQ(std::string(it->arg_name), "layer");
+  EXPECT_EQ(it->arg, 3);
+  // only the first ids are kept
+  EXPECT_EQ(it->seq_ids.size(), Tracer::kMaxSeqIds);
+  EXPECT_EQ(it->seq_ids.front(), 0);
+  EXPECT_EQ(it->num_seqs, 10);
+}
+
+TEST_F(TracerTest, Overwrite) {
+  auto& tracer = Tracer::Instance();
+  const int64_t now = Tracer::now_us();
+  for (int64_t i = 0; i < 3 * kCapacity; ++i) {
+    tracer.record("overwrite_test",
+                  now - 1000 + i,
+                  now - 1000 + i + 1,
+                  "index",
+                  i,
+                  /*seq_ids=*/nullptr,
+                  /*num_seq_ids=*/0,
+                  /*num_seqs=*/0);
+  }
+  // only the last spans are kept, sorted by start time
+  const auto events = tracer.collect(/*window_us=*/1000 * 1000);
+  ASSERT_EQ(events.size(), kCapacity);
+  for (size_t i = 0; i < events.size(); ++i) {
+    EXPECT_EQ(events[i].arg, 2 * kCapacity + i);
+  }
+}
+
+TEST_F(TracerTest, Window) {
+  auto& tracer = Tracer::Instance();
+  const int64_t now = Tracer::now_us();
+  tracer.record("old", now - 2000, now - 1000, nullptr, 0, nullptr, 0, 0);
+  tracer.record("new", now - 10, now, nullptr, 0, nullptr, 0, 0);
+  const auto events = tracer.collect(/*window_us=*/500);
+  ASSERT_FALSE(events.empty());
+  for (const auto& event : events) {
+    EXPECT_NE(std::string(event.name), "old");
+  }
+  EXPECT_EQ(std::string(events.back().name), "new");
+}
+
+TEST_F(TracerTest, ConcurrentWriters) {
+  auto& tracer = Tracer::Instance();
+  const int num_threads = 4;
+  const int num_spans = 1000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([]() {
+      for (int j = 0; j < num_spans; ++j) {
+        TraceSpan span("concurrent_test", "index", j);
+        span.add_seq_id(j);
+      }
+    });
+  }
+  // read while writing, torn spans should be skipped
+  for (int i = 0; i < 100; ++i) {
+    for (const auto& event : tracer.collect(/*window_us=*/1000 * 1000)) {
+      if (std::string(event.name) == "concurrent_test") {
+        ASSERT_EQ(event.seq_ids.size(), 1);
+        EXPECT_EQ(event.seq_ids[0], event.arg);
+      }
+    }
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(tracer.collect(/*window_us=*/1000 * 1000).size(), kCapacity);
+}
+
+TEST_F(TracerTest, ChromeTrace) {
+  {
+    TraceSpan span("chrome_trace_test");
+    span.add_seq_id(42);
+  }
+  const auto trace = nlohmann::json::parse(
+      Tracer::Instance().dump_chrome_trace(/*seconds=*/10));
+  ASSERT_TRUE(trace["traceEvents"].is_array());
+  const auto& event = trace["traceEvents"].back();
+  EXPECT_EQ(event["name"], "chrome_trace_test");
+  EXPECT_EQ(event["ph"], "X");
+  EXPECT_EQ(event["tid"], Tracer::thread_id());
+  EXPECT_EQ(event["args"]["seq_ids"], std::vector<int64_t>({42}));
+  EXPECT_EQ(event["args"]["num_seqs"], 1);
+}
+
+}  // namespace llm
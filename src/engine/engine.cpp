@@ -1,17 +1,26 @@
 #include "engine.h"
 
 #include <ATen/cuda/CUDAContext.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
 #include <gflags/gflags_declare.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
+#include <deque>
 #include <memory>
 
+#include "common/metrics.h"
 #include "common/pretty_print.h"
+#include "layers/lora.h"
 #include "memory/memory.h"
 #include "model_loader/model_loader.h"
 #include "model_parallel/parallel_args.h"
 #include "models/model_args.h"
+#include "sampling/sampler.h"
 #include "utils.h"
 #include "worker.h"
 
@@ -31,10 +40,37 @@ DEFINE_int64(max_num_tokens_per_batch,
 DEFINE_int64(max_num_seqs_per_batch,
              32,
              "Maximum number of sequences per batch for profiling.");
+DEFINE_int32(max_score_tokens_per_step,
+             4096,
+             "max number of prompt tokens of scoring and embedding requests "
+             "to process per step, which bounds the memory of their logits "
+             "and hidden states");
+
+DEFINE_string(decode_batch_buckets,
+              "",
+              "comma separated batch sizes, e.g. 1,2,4,8,16,32,64. decode "
+              "batches are padded up to the next bucket so that each step "
+              "reuses the same shapes. empty to disable.");
+
+DEFINE_string(warmup_num_seqs,
+              "",
+              "comma separated numbers of sequences for the startup warmup, "
+              "e.g. 1,8,32. empty to skip the warmup.");
+DEFINE_string(warmup_seq_lens,
+              "128,512",
+              "comma separated prompt lengths for the startup warmup");
+DEFINE_int32(warmup_decode_steps,
+             4,
+             "number of decode steps to run for each warmup shape");
 
 DECLARE_bool(disable_custom_kernels);
 
 namespace llm {
+
+DEFINE_HISTOGRAM(engine_prepare_inputs_seconds,
+                 "Latency of preparing model inputs per step in seconds",
+                 latency_buckets());
+
 namespace {
 torch::ScalarType parse_dtype(const std::string& dtype_str,
                               const torch::Device& device) {
@@ -59,9 +95,70 @@ torch::ScalarType parse_dtype(const std::string& dtype_str,
   }
   CHECK(false) << "Unsupported dtype: " << dtype_str << " on device " << device;
 }
+
+// parse comma separated positive sizes into a sorted list without duplicates
+std::vector<int64_t> parse_sizes(const std::string& sizes_str) {
+  std::vector<int64_t> sizes;
+  if (sizes_str.empty()) {
+    return sizes;
+  }
+  for (const auto& size_str : absl::StrSplit(sizes_str, ',')) {
+    int64_t size = 0;
+    CHECK(absl::SimpleAtoi(size_str, &size) && size > 0)
+        << "Invalid size: " << size_str << " in " << sizes_str;
+    sizes.push_back(size);
+  }
+  std::sort(sizes.begin(), sizes.end());
+  sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+  return sizes;
+}
+
+// whether the weights of a checkpoint with args can be loaded into the model
+// created with model_args, i.e. all weights have the same shapes.
+bool is_same_architecture(const ModelArgs& args,
+                          const QuantArgs& quant_args,
+                          const ModelArgs& model_args,
+                          const QuantArgs& model_quant_args) {
+  // the vocab size of the model may come from the tokenizer
+  const bool same_vocab_size =
+      args.vocab_size() <= 0 || args.vocab_size() == model_args.vocab_size();
+  return args.model_type() == model_args.model_type() && same_vocab_size &&
+         args.hidden_size() == model_args.hidden_size() &&
+         args.intermediate_size() == model_args.intermediate_size() &&
+         args.n_layers() == model_args.n_layers() &&
+         args.n_heads() == model_args.n_heads() &&
+         args.n_kv_heads() == model_args.n_kv_heads() &&
+         quant_args.quant_method() == model_quant_args.quant_method() &&
+         quant_args.bits() == model_quant_args.bits() &&
+         quant_args.group_size() == model_quant_args.group_size() &&
+         quant_args.desc_act() == model_quant_args.desc_act();
+}
+
+// log the size and the load bandwidth of a weights file
+void log_shard_loaded(const StateDict& state_dict,
+                      size_t index,
+                      size_t num_shards,
+                      absl::Duration duration) {
+  const auto num_bytes = static_cast<size_t>(state_dict.num_bytes());
+  const double seconds = std::max(absl::ToDoubleSeconds(duration), 1e-6);
+  LOG(INFO) << "Loaded weights file " << index + 1 << "/" << num_shards
+            << " (" << readable_size(num_bytes) << ") in "
+            << absl::FormatDuration(duration) << ", "
+            << readable_size(static_cast<size_t>(num_bytes / seconds))
+            << "/s";
+}
+
 }  // namespace
 
-Engine::Engine(const std::vector<torch::Device>& devices) : devices_(devices) {
+Engine::Engine(const std::vector<torch::Device>& devices)
+    : Engine(devices, /*pipeline_parallel_size=*/1) {}
+
+Engine::Engine(const std::vector<torch::Device>& devices,
+               int32_t pipeline_parallel_size)
+    : devices_(devices),
+      pipeline_size_(pipeline_parallel_size),
+      staging_arena_(/*pin_memory=*/!devices.empty() &&
+                     devices[0].is_cuda()) {
   CHECK_GT(devices.size(), 0) << "At least one device is required";
 
   const auto device_type = devices[0].type();
@@ -79,25 +176,103 @@ Engine::Engine(const std::vector<torch::Device>& devices) : devices_(devices) {
     }
   }
 
-  // initialize process groups if there are multiple devices
+  // devices are split into pipeline stages of consecutive devices, each
+  // stage runs its layers with tensor parallelism across its devices.
   const int32_t world_size = static_cast<int32_t>(devices.size());
-  if (world_size > 1) {
+  CHECK(pipeline_size_ > 0 && world_size % pipeline_size_ == 0)
+      << "Number of devices " << world_size
+      << " is not divisible by pipeline parallel size " << pipeline_size_;
+  const int32_t tp_size = world_size / pipeline_size_;
+  for (int32_t stage = 0; stage < pipeline_size_; ++stage) {
+    const std::vector<torch::Device> stage_devices(
+        devices.begin() + stage * tp_size,
+        devices.begin() + (stage + 1) * tp_size);
+
     // create a process group for each device if there are multiple gpus
-    process_groups_ = ProcessGroup::create_process_groups(devices);
+    std::vector<std::unique_ptr<ProcessGroup>> process_groups;
+    if (tp_size > 1) {
+      process_groups = ProcessGroup::create_process_groups(stage_devices);
+    }
+
+    // create a worker for each device
+    for (int32_t rank = 0; rank < tp_size; ++rank) {
+      ProcessGroup* pg = tp_size > 1 ? process_groups[rank].get() : nullptr;
+      ParallelArgs parallel_args(rank, tp_size, pg);
+      parallel_args.pipeline_rank(stage).pipeline_size(pipeline_size_);
+      workers_.emplace_back(
+          std::make_unique<Worker>(parallel_args, stage_devices[rank]));
+    }
+    for (auto& process_group : process_groups) {
+      process_groups_.push_back(std::move(process_group));
+    }
   }
 
-  // create a worker for each device
-  for (size_t i = 0; i < devices.size(); ++i) {
-    const int32_t rank = static_cast<int32_t>(i);
-    ProcessGroup* pg = world_size > 1 ? process_groups_[i].get() : nullptr;
-    ParallelArgs parallel_args(rank, world_size, pg);
-    workers_.emplace_back(std::make_unique<Worker>(parallel_args, devices[i]));
+  // start persistent step threads for all ranks but the first one, which runs
+  // in the calling thread. the ring holds at most one command at a time since
+  // run_on_workers waits for each command to finish.
+  if (world_size > 1) {
+    step_ring_ = std::make_unique<BroadcastRing<StepCommand>>(
+        world_size - 1, /*capacity=*/2);
+    step_errors_.resize(world_size);
+    for (int32_t rank = 1; rank < world_size; ++rank) {
+      step_threads_.emplace_back([this, rank]() { step_loop(rank); });
+    }
   }
 
   if (FLAGS_disable_custom_kernels) {
     LOG(WARNING) << "Custom kernels are disabled. You may experience "
                     "performance degradation.";
   }
+
+  decode_buckets_ = parse_sizes(FLAGS_decode_batch_buckets);
+}
+
+Engine::~Engine() {
+  if (step_ring_ != nullptr) {
+    step_ring_->close();
+  }
+  for (auto& thread : step_threads_) {
+    thread.join();
+  }
+}
+
+void Engine::step_loop(size_t rank) {
+  while (const StepCommand* command = step_ring_->next(rank - 1)) {
+    try {
+      (**command)(rank);
+    } catch (...) {
+      step_errors_[rank] = std::current_exception();
+    }
+    step_ring_->done(rank - 1);
+  }
+}
+
+void Engine::run_on_workers(folly::FunctionRef<void(size_t)> fn) {
+  if (workers_.size() == 1) {
+    fn(0);
+    return;
+  }
+
+  const uint64_t seq = step_ring_->publish(&fn);
+  try {
+    fn(0);
+  } catch (...) {
+    step_errors_[0] = std::current_exception();
+  }
+  // wait for all other ranks, fn must stay alive until then
+  step_ring_->wait(seq);
+
+  // rethrow the first exception if any
+  std::exception_ptr error;
+  for (auto& step_error : step_errors_) {
+    if (step_error != nullptr && error == nullptr) {
+      error = step_error;
+    }
+    step_error = nullptr;
+  }
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
 }
 
 bool Engine::init(const std::string& model_weights_path) {
@@ -106,14 +281,115 @@ bool Engine::init(const std::string& model_weights_path) {
     return false;
   }
 
+  // lora slots are allocated before profiling to be excluded from kv cache
+  if (lora_registry_ != nullptr && !init_lora()) {
+    LOG(ERROR) << "Failed to initialize lora adapters";
+    return false;
+  }
+
   const int64_t kv_cache_size_in_bytes = profile_memory_for_kv_cache();
   if (!init_kv_cache(kv_cache_size_in_bytes)) {
     LOG(ERROR) << "Failed to initialize kv cache";
     return false;
   }
+
+  warmup_decode_buckets();
+  warmup();
   return true;
 }
 
+void Engine::warmup() {
+  const auto num_seqs_list = parse_sizes(FLAGS_warmup_num_seqs);
+  const auto seq_lens = parse_sizes(FLAGS_warmup_seq_lens);
+  if (num_seqs_list.empty() || seq_lens.empty()) {
+    return;
+  }
+
+  SamplingParameter sampling_param;
+  sampling_param.temperature = 0;
+  StoppingCriteria stopping_criteria;
+  stopping_criteria.ignore_eos_token = true;
+
+  const auto warmup_start = absl::Now();
+  for (const int64_t num_seqs : num_seqs_list) {
+    for (const int64_t seq_len : seq_lens) {
+      if (num_seqs * seq_len > FLAGS_max_num_tokens_per_batch) {
+        LOG(INFO) << "Skipping warmup with " << num_seqs
+                  << " sequences of length " << seq_len
+                  << ", exceeds max_num_tokens_per_batch";
+        continue;
+      }
+
+      const std::vector<int32_t> token_ids(seq_len, 0);
+      std::deque<Sequence> seqs;
+      std::vector<Sequence*> batch;
+      batch.reserve(num_seqs);
+      for (int64_t i = 0; i < num_seqs; ++i) {
+        seqs.emplace_back(sampling_param,
+                          stopping_criteria,
+                          token_ids,
+                          /*echo=*/false,
+                          /*on_stream=*/nullptr);
+        batch.push_back(&seqs.back());
+      }
+
+      // run prefill and decode steps with real kv cache slots
+      const auto run_step = [&]() {
+        if (!block_manager_->allocate_slots_for_sequences(batch)) {
+          return false;
+        }
+        const auto output = execute_model(batch);
+        const int64_t* next_tokens = output.next_tokens.data_ptr<int64_t>();
+        for (int64_t i = 0; i < num_seqs; ++i) {
+          batch[i]->append_new_token_id(static_cast<int32_t>(next_tokens[i]));
+        }
+        return true;
+      };
+
+      const auto prefill_start = absl::Now();
+      bool ok = run_step();
+      const auto prefill_time = absl::Now() - prefill_start;
+      const auto decode_start = absl::Now();
+      int32_t num_decode_steps = 0;
+      for (; ok && num_decode_steps < FLAGS_warmup_decode_steps;
+           ++num_decode_steps) {
+        ok = run_step();
+      }
+      const auto decode_time = absl::Now() - decode_start;
+      block_manager_->release_slots_for_sequences(batch);
+
+      if (!ok) {
+        LOG(WARNING) << "Not enough kv cache for warmup with " << num_seqs
+                     << " sequences of length " << seq_len;
+        continue;
+      }
+      LOG(INFO) << "Warmup with " << num_seqs << " sequences of length "
+                << seq_len
+                << ", prefill: " << absl::FormatDuration(prefill_time)
+                << ", decode: "
+                << absl::FormatDuration(decode_time /
+                                        std::max(num_decode_steps, 1))
+                << " per step";
+    }
+  }
+  LOG(INFO) << "Warmup finished in "
+            << absl::FormatDuration(absl::Now() - warmup_start);
+}
+
+void Engine::warmup_decode_buckets() {
+  // run each bucket once so that the caching allocator holds buffers of all
+  // shapes, and steady state decode steps don't allocate new device memory.
+  for (const int64_t bucket : decode_buckets_) {
+    LOG(INFO) << "Warming up decode batch bucket: " << bucket;
+    std::vector<Sequence*> batch;
+    batch.reserve(bucket);
+    for (int64_t i = 0; i < bucket; ++i) {
+      batch.push_back(padding_seqs_[i].get());
+    }
+    execute_batch(batch);
+  }
+}
+
 bool Engine::init_model(const std::string& model_weights_path) {
   auto model_loader = ModelLoader::create(model_weights_path);
   LOG(INFO) << "Initializing model from: " << model_weights_path;
@@ -151,9 +427,18 @@ bool Engine::init_model(const std::string& model_weights_path) {
     if (!worker->init_model(dtype_, args_, quant_args_)) {
       return false;
     }
-    // load the weights from the checkpoint
+    // load the weights from the checkpoint, the time of each file includes
+    // waiting for its prefetch
+    size_t shard = 0;
+    auto shard_start = absl::Now();
     for (const auto& state_dict : *model_loader) {
       worker->load_state_dict(state_dict);
+      const auto now = absl::Now();
+      log_shard_loaded(state_dict,
+                       shard++,
+                       model_loader->weights_files_count(),
+                       now - shard_start);
+      shard_start = now;
     }
     worker->verify_loaded_weights();
     return true;
@@ -175,6 +460,8 @@ bool Engine::init_model(const std::string& model_weights_path) {
   }
 
   // load the weights from the checkpoint in parallel
+  size_t shard = 0;
+  auto shard_start = absl::Now();
   for (const auto& state_dict : *model_loader) {
     std::vector<folly::SemiFuture<folly::Unit>> futures;
     futures.reserve(workers_.size());
@@ -188,6 +475,12 @@ bool Engine::init_model(const std::string& model_weights_path) {
         return false;
       }
     }
+    const auto now = absl::Now();
+    log_shard_loaded(state_dict,
+                     shard++,
+                     model_loader->weights_files_count(),
+                     now - shard_start);
+    shard_start = now;
   }
 
   // verify the weights are loaded correctly
@@ -197,6 +490,96 @@ bool Engine::init_model(const std::string& model_weights_path) {
   return true;
 }
 
+bool Engine::stage_weights(const std::string& model_weights_path) {
+  auto model_loader = ModelLoader::try_create(model_weights_path);
+  if (model_loader == nullptr) {
+    LOG(ERROR) << "Can't reload weights from " << model_weights_path;
+    return false;
+  }
+  if (!is_same_architecture(model_loader->model_args(),
+                            model_loader->quant_args(),
+                            args_,
+                            quant_args_)) {
+    LOG(ERROR) << "Can't reload weights from " << model_weights_path
+               << " with different " << model_loader->model_args() << ", "
+               << model_loader->quant_args();
+    return false;
+  }
+
+  LOG(INFO) << "Staging weights from: " << model_weights_path;
+  const auto start = absl::Now();
+  // fused weights are only merged once, always start from a fresh copy
+  clear_staged_weights();
+  // stage the weights in parallel on the working threads of workers, which
+  // are idle while serving.
+  for (const auto& state_dict : *model_loader) {
+    std::vector<folly::SemiFuture<folly::Unit>> futures;
+    futures.reserve(workers_.size());
+    for (auto& worker : workers_) {
+      futures.push_back(worker->stage_state_dict_async(state_dict));
+    }
+    // wait for all futures to complete
+    auto results = folly::collectAll(futures).get();
+    for (const auto& result : results) {
+      if (result.hasException()) {
+        LOG(ERROR) << "Failed to stage weights from " << model_weights_path;
+        clear_staged_weights();
+        return false;
+      }
+    }
+  }
+
+  // reject checkpoints with missing weights here, the swap can't fail
+  for (const auto& worker : workers_) {
+    if (!worker->verify_staged_weights()) {
+      LOG(ERROR) << "Missing weights in " << model_weights_path;
+      clear_staged_weights();
+      return false;
+    }
+  }
+  LOG(INFO) << "Staged weights in "
+            << absl::FormatDuration(absl::Now() - start);
+  return true;
+}
+
+void Engine::swap_weights() {
+  const auto start = absl::Now();
+  run_on_workers(
+      [this](size_t rank) { workers_[rank]->swap_staged_weights(); });
+  LOG(INFO) << "Swapped weights in "
+            << absl::FormatDuration(absl::Now() - start);
+}
+
+void Engine::clear_staged_weights() {
+  for (auto& worker : workers_) {
+    worker->clear_staged_weights();
+  }
+}
+
+void Engine::set_lora_registry(const LoRARegistry* lora_registry) {
+  CHECK(lora_registry != nullptr);
+  lora_registry_ = lora_registry;
+}
+
+bool Engine::init_lora() {
+  if (!quant_args_.quant_method().empty()) {
+    LOG(ERROR) << "lora is not supported for quantized models";
+    return false;
+  }
+  for (size_t id = 0; id < lora_registry_->size(); ++id) {
+    const auto& adapter = lora_registry_->get(static_cast<int32_t>(id));
+    if (adapter.rank > FLAGS_max_lora_rank) {
+      LOG(ERROR) << "rank of lora adapter " << adapter.name
+                 << " exceeds --max_lora_rank";
+      return false;
+    }
+  }
+  for (auto& worker : workers_) {
+    worker->set_lora_registry(lora_registry_);
+  }
+  return true;
+}
+
 int64_t Engine::profile_memory_for_kv_cache() {
   // use first device to profile memory usage
   const auto& device = workers_[0]->device();
@@ -229,6 +612,27 @@ int64_t Engine::profile_memory_for_kv_cache() {
         flatten_token_ids, flatten_positions, input_params));
   }
 
+  // the profile run projects the last token of each sequence with the lm
+  // head, while scoring projects all prompt tokens of a step at once and
+  // converts them to float32 logprobs chunk by chunk.
+  int64_t score_memory = 0;
+  if (pipeline_size_ == 1) {
+    const int64_t num_score_rows =
+        std::min<int64_t>(FLAGS_max_score_tokens_per_step,
+                          FLAGS_max_num_tokens_per_batch);
+    const int64_t num_extra_rows =
+        std::max<int64_t>(num_score_rows - FLAGS_max_num_seqs_per_batch, 0);
+    const auto dtype_size = torch::scalarTypeToTypeMeta(dtype_).itemsize();
+    score_memory =
+        args_.vocab_size() *
+        (num_extra_rows * static_cast<int64_t>(dtype_size) +
+         std::min(num_score_rows, Sampler::kScoreChunkSize) *
+             static_cast<int64_t>(sizeof(float)));
+    LOG(INFO) << "Reserving " << readable_size(score_memory)
+              << " for the logits of scoring " << num_score_rows
+              << " tokens per step";
+  }
+
   // pick smallest available memory from all devices
   int64_t smallest_available_memory = std::numeric_limits<int64_t>::max();
   // wait for all futures to complete
@@ -253,6 +657,7 @@ int64_t Engine::profile_memory_for_kv_cache() {
           total_memory * (1.0 - FLAGS_max_memory_utilization);
       available_memory -= buffer_memory;
     }
+    available_memory -= score_memory;
     if (FLAGS_max_cache_size > 0) {
       available_memory = std::min(available_memory, FLAGS_max_cache_size);
     }
@@ -270,19 +675,23 @@ bool Engine::init_kv_cache(int64_t cache_size_in_bytes) {
   const int64_t block_size = FLAGS_block_size;
 
   // init kv cache
-  const int world_size = static_cast<int>(workers_.size());
+  const int tp_size = static_cast<int>(workers_.size()) / pipeline_size_;
   const int64_t n_heads = args_.n_heads();
   const int64_t n_kv_heads = args_.n_kv_heads().value_or(n_heads);
-  const int64_t n_local_kv_heads = n_kv_heads / world_size;
+  const int64_t n_local_kv_heads = n_kv_heads / tp_size;
   const int64_t head_dim = args_.hidden_size() / n_heads;
   const auto dtype_size = torch::scalarTypeToTypeMeta(dtype_).itemsize();
-  // key + value for all layers
+  // each pipeline stage only holds its own layers, size the blocks for the
+  // stage with the most layers
+  const int64_t n_local_layers =
+      (args_.n_layers() + pipeline_size_ - 1) / pipeline_size_;
+  // key + value for all local layers
   const int64_t block_size_in_bytes = 2 * block_size * n_local_kv_heads *
-                                      head_dim * args_.n_layers() * dtype_size;
+                                      head_dim * n_local_layers * dtype_size;
   LOG(INFO) << "Block size in bytes: " << readable_size(block_size_in_bytes)
             << ", block_size: " << block_size << ", head_dim: " << head_dim
             << ", n_local_kv_heads: " << n_local_kv_heads
-            << ", n_layers: " << args_.n_layers()
+            << ", n_local_layers: " << n_local_layers
             << ", dtype_size: " << dtype_size;
 
   const int64_t n_blocks = cache_size_in_bytes / block_size_in_bytes;
@@ -294,7 +703,28 @@ bool Engine::init_kv_cache(int64_t cache_size_in_bytes) {
   LOG(INFO) << "Initializing kv cache with shape: [" << kv_cache_shape << "]";
 
   // initialize block manager
-  block_manager_ = std::make_unique<BlockManager>(n_blocks, block_size);
+  if (decode_buckets_.empty()) {
+    block_manager_ = std::make_unique<BlockManager>(n_blocks, block_size);
+  } else {
+    // keep the last block as scratch space for padding sequences, they all
+    // write to its first slot.
+    CHECK_GT(n_blocks, 1) << "Not enough memory for the scratch block";
+    block_manager_ = std::make_unique<BlockManager>(n_blocks - 1, block_size);
+    const int32_t scratch_block = static_cast<int32_t>(n_blocks - 1);
+    padding_sampling_param_.temperature = 0;
+    // a one-token sequence has the same shape as a decode sequence
+    const std::vector<int32_t> padding_token_ids = {0};
+    padding_seqs_.reserve(decode_buckets_.back());
+    for (int64_t i = 0; i < decode_buckets_.back(); ++i) {
+      auto seq = std::make_unique<Sequence>(padding_sampling_param_,
+                                            padding_stopping_criteria_,
+                                            padding_token_ids,
+                                            /*echo=*/false,
+                                            /*on_stream=*/nullptr);
+      seq->append_blocks({scratch_block});
+      padding_seqs_.push_back(std::move(seq));
+    }
+  }
 
   // init kv cache for each worker in parallel
   if (workers_.size() == 1) {
@@ -318,46 +748,248 @@ bool Engine::init_kv_cache(int64_t cache_size_in_bytes) {
 }
 
 OutputParameters Engine::execute_model(const std::vector<Sequence*>& batch) {
+  const int64_t num_seqs = static_cast<int64_t>(batch.size());
+  const int64_t bucket = decode_bucket_size(batch);
+  if (bucket <= num_seqs) {
+    return execute_batch(batch);
+  }
+
+  // pad the decode batch up to the bucket size with padding sequences
+  std::vector<Sequence*> padded_batch(batch);
+  padded_batch.reserve(bucket);
+  for (int64_t i = num_seqs; i < bucket; ++i) {
+    padded_batch.push_back(padding_seqs_[i - num_seqs].get());
+  }
+  auto output = execute_batch(padded_batch);
+
+  // drop outputs of padding sequences
+  const auto truncate = [num_seqs](torch::Tensor& tensor) {
+    if (tensor.defined()) {
+      tensor = tensor.narrow(/*dim=*/0, /*start=*/0, /*length=*/num_seqs);
+    }
+  };
+  truncate(output.next_tokens);
+  truncate(output.top_tokens);
+  truncate(output.top_logprobs);
+  truncate(output.next_logprobs);
+  return output;
+}
+
+int64_t Engine::decode_bucket_size(const std::vector<Sequence*>& batch) const {
+  if (decode_buckets_.empty()) {
+    return 0;
+  }
+  // only pad batches where each sequence feeds exactly one token
+  for (const Sequence* seq : batch) {
+    if (seq->is_prefill() ||
+        seq->num_tokens() != seq->num_tokens_in_cache() + 1) {
+      return 0;
+    }
+  }
+  const int64_t num_seqs = static_cast<int64_t>(batch.size());
+  auto it = std::lower_bound(
+      decode_buckets_.begin(), decode_buckets_.end(), num_seqs);
+  return it == decode_buckets_.end() ? 0 : *it;
+}
+
+OutputParameters Engine::execute_batch(const std::vector<Sequence*>& batch) {
+  if (pipeline_size_ > 1) {
+    return execute_model_pipelined(batch);
+  }
+
   // prepare inputs for workers
   torch::Tensor flatten_token_ids;
   torch::Tensor flatten_positions;
   InputParameters input_params;
   SamplingParameters sampling_params;
+  const auto prepare_start = absl::Now();
   Utils::prepare_inputs(batch,
                         FLAGS_block_size,
                         &flatten_token_ids,
                         &flatten_positions,
                         &input_params,
-                        &sampling_params);
-  if (workers_.size() == 1) {
-    // only one worker, call blocking forward
-    auto output = workers_[0]->execute_model(
+                        &sampling_params,
+                        &staging_arena_);
+  engine_prepare_inputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - prepare_start));
+  // all workers share the same inputs, return the output of the first one
+  OutputParameters output;
+  run_on_workers([&](size_t rank) {
+    auto worker_output = workers_[rank]->execute_model(
         flatten_token_ids, flatten_positions, input_params, sampling_params);
-    return output;
+    if (rank == 0) {
+      output = std::move(worker_output);
+    }
+  });
+  return output;
+}
+
+OutputParameters Engine::execute_model_pipelined(
+    const std::vector<Sequence*>& batch) {
+  const int64_t num_stages = pipeline_size_;
+  const int64_t tp_size = static_cast<int64_t>(workers_.size()) / num_stages;
+
+  // split the batch into one micro-batch per stage, so that every stage is
+  // busy once the pipeline is filled.
+  struct MicroBatch {
+    torch::Tensor flatten_token_ids;
+    torch::Tensor flatten_positions;
+    InputParameters input_params;
+    SamplingParameters sampling_params;
+    // input of the next stage, token ids for the first stage
+    torch::Tensor hidden_states;
+    OutputParameters output;
+  };
+  const int64_t num_seqs = static_cast<int64_t>(batch.size());
+  const int64_t num_micro_batches = std::min(num_seqs, num_stages);
+  std::vector<MicroBatch> micro_batches(num_micro_batches);
+  int64_t num_top_logprobs = 0;
+  bool logprobs = false;
+  const auto prepare_start = absl::Now();
+  for (int64_t i = 0; i < num_micro_batches; ++i) {
+    const std::vector<Sequence*> seqs(
+        batch.begin() + num_seqs * i / num_micro_batches,
+        batch.begin() + num_seqs * (i + 1) / num_micro_batches);
+    auto& micro_batch = micro_batches[i];
+    // the staging arena is reused by each call, use plain tensors instead
+    Utils::prepare_inputs(seqs,
+                          FLAGS_block_size,
+                          &micro_batch.flatten_token_ids,
+                          &micro_batch.flatten_positions,
+                          &micro_batch.input_params,
+                          &micro_batch.sampling_params);
+    micro_batch.hidden_states = micro_batch.flatten_token_ids;
+    num_top_logprobs = std::max<int64_t>(
+        num_top_logprobs, micro_batch.sampling_params.num_top_logprobs);
+    logprobs = logprobs || micro_batch.sampling_params.logprobs;
+  }
+  // use the same outputs for all micro-batches so that they can be merged
+  for (auto& micro_batch : micro_batches) {
+    micro_batch.sampling_params.num_top_logprobs = num_top_logprobs;
+    micro_batch.sampling_params.logprobs = logprobs;
   }
+  engine_prepare_inputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - prepare_start));
 
-  // multiple workers, call async forward
-  std::vector<folly::SemiFuture<OutputParameters>> futures;
-  futures.reserve(workers_.size());
-  for (auto& worker : workers_) {
-    futures.push_back(worker->execute_model_async(
-        flatten_token_ids, flatten_positions, input_params, sampling_params));
+  // at each tick, stage s runs micro-batch (tick - s) and hands its hidden
+  // states over to stage s + 1 for the next tick.
+  std::vector<torch::Tensor> stage_outputs(num_stages);
+  for (int64_t tick = 0; tick < num_micro_batches + num_stages - 1; ++tick) {
+    run_on_workers([&](size_t rank) {
+      const int64_t stage = static_cast<int64_t>(rank) / tp_size;
+      const int64_t idx = tick - stage;
+      if (idx < 0 || idx >= num_micro_batches) {
+        return;
+      }
+      // all tensor parallel ranks of a stage produce the same outputs
+      const bool is_first_rank = rank % tp_size == 0;
+      auto& micro_batch = micro_batches[idx];
+      Worker* worker = workers_[rank].get();
+      if (stage == num_stages - 1) {
+        // micro-batches keep their sequences while the batch is unchanged
+        auto output = worker->execute_model(micro_batch.hidden_states,
+                                            micro_batch.flatten_positions,
+                                            micro_batch.input_params,
+                                            micro_batch.sampling_params,
+                                            static_cast<size_t>(idx));
+        if (is_first_rank) {
+          micro_batch.output = std::move(output);
+        }
+        return;
+      }
+      auto hidden_states = worker->execute_stage(micro_batch.hidden_states,
+                                                 micro_batch.flatten_positions,
+                                                 micro_batch.input_params);
+      if (is_first_rank) {
+        stage_outputs[stage] = hidden_states;
+      }
+    });
+
+    for (int64_t stage = 0; stage < num_stages - 1; ++stage) {
+      const int64_t idx = tick - stage;
+      if (idx >= 0 && idx < num_micro_batches) {
+        micro_batches[idx].hidden_states = stage_outputs[stage];
+      }
+    }
   }
-  // wait for the all future to complete
-  auto results = folly::collectAll(futures).get();
-  // return the result from the first worker
-  auto first_output = results.front().value();
-  return first_output;
+
+  // merge outputs of micro-batches in the order of the batch
+  std::vector<torch::Tensor> next_tokens;
+  std::vector<torch::Tensor> top_tokens;
+  std::vector<torch::Tensor> top_logprobs;
+  std::vector<torch::Tensor> next_logprobs;
+  for (const auto& micro_batch : micro_batches) {
+    next_tokens.push_back(micro_batch.output.next_tokens);
+    if (logprobs) {
+      next_logprobs.push_back(micro_batch.output.next_logprobs);
+    }
+    if (num_top_logprobs > 0) {
+      top_tokens.push_back(micro_batch.output.top_tokens);
+      top_logprobs.push_back(micro_batch.output.top_logprobs);
+    }
+  }
+  OutputParameters output;
+  output.next_tokens = torch::cat(next_tokens);
+  if (num_top_logprobs > 0) {
+    output.top_tokens = torch::cat(top_tokens);
+    output.top_logprobs = torch::cat(top_logprobs);
+  }
+  if (logprobs) {
+    output.next_logprobs = torch::cat(next_logprobs);
+  }
+  return output;
+}
+
+OutputParameters Engine::execute_model_multi_steps(
+    const std::vector<Sequence*>& batch,
+    int32_t num_steps) {
+  // the scheduler decodes one step at a time for pipelined engines
+  DCHECK_EQ(pipeline_size_, 1)
+      << "Multi-step decoding is not supported with pipeline parallelism";
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  InputParameters input_params;
+  SamplingParameters sampling_params;
+  const auto prepare_start = absl::Now();
+  Utils::prepare_inputs(batch,
+                        FLAGS_block_size,
+                        &flatten_token_ids,
+                        &flatten_positions,
+                        &input_params,
+                        &sampling_params,
+                        &staging_arena_);
+  torch::Tensor cache_slots;
+  Utils::prepare_multi_step_cache_slots(
+      batch, FLAGS_block_size, num_steps, &cache_slots);
+  engine_prepare_inputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - prepare_start));
+  OutputParameters output;
+  run_on_workers([&](size_t rank) {
+    auto worker_output =
+        workers_[rank]->execute_model_multi_steps(flatten_token_ids,
+                                                  flatten_positions,
+                                                  input_params,
+                                                  sampling_params,
+                                                  cache_slots,
+                                                  num_steps);
+    if (rank == 0) {
+      output = std::move(worker_output);
+    }
+  });
+  return output;
 }
 
-// TODO
 OutputParameters Engine::validate(const std::vector<Sequence*>& batch) {
+  // the scheduler doesn't speculate for pipelined engines
+  DCHECK_EQ(pipeline_size_, 1)
+      << "Speculative decoding is not supported with pipeline parallelism";
   torch::Tensor flatten_token_ids;
   torch::Tensor flatten_positions;
   torch::Tensor seq_idxes;
   InputParameters input_params;
   SamplingParameters sampling_params;
 
+  const auto prepare_start = absl::Now();
   Utils::prepare_validate_inputs(batch,
                                  FLAGS_block_size,
                                  &flatten_token_ids,
@@ -365,24 +997,167 @@ OutputParameters Engine::validate(const std::vector<Sequence*>& batch) {
                                  &seq_idxes,
                                  &input_params,
                                  &sampling_params);
-  if (workers_.size() == 1) {
-    auto output = workers_[0]->validate(
+  engine_prepare_inputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - prepare_start));
+  OutputParameters output;
+  run_on_workers([&](size_t rank) {
+    auto worker_output = workers_[rank]->validate(
         flatten_token_ids, flatten_positions, input_params, sampling_params);
-    output.index_select(seq_idxes);
-    return output;
+    if (rank == 0) {
+      output = std::move(worker_output);
+    }
+  });
+  output.index_select(seq_idxes);
+  return output;
+}
+
+OutputParameters Engine::score(const std::vector<Sequence*>& batch) {
+  // scoring requests are rejected by the handlers for pipelined engines
+  DCHECK_EQ(pipeline_size_, 1)
+      << "Scoring prompts is not supported with pipeline parallelism";
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  torch::Tensor target_token_ids;
+  InputParameters input_params;
+
+  const auto prepare_start = absl::Now();
+  Utils::prepare_score_inputs(batch,
+                              &flatten_token_ids,
+                              &flatten_positions,
+                              &target_token_ids,
+                              &input_params);
+  int64_t num_top_logprobs = 0;
+  for (const auto* sequence : batch) {
+    num_top_logprobs =
+        std::max(num_top_logprobs, sequence->sampling_param().top_logprobs);
   }
+  engine_prepare_inputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - prepare_start));
+  OutputParameters output;
+  run_on_workers([&](size_t rank) {
+    auto worker_output = workers_[rank]->score(flatten_token_ids,
+                                               flatten_positions,
+                                               input_params,
+                                               target_token_ids,
+                                               num_top_logprobs);
+    if (rank == 0) {
+      output = std::move(worker_output);
+    }
+  });
+  return output;
+}
 
-  std::vector<folly::SemiFuture<OutputParameters>> futures;
-  futures.reserve(workers_.size());
-  for (auto& worker : workers_) {
-    futures.emplace_back(worker->validate_async(
-        flatten_token_ids, flatten_positions, input_params, sampling_params));
+OutputParameters Engine::embed(const std::vector<Sequence*>& batch) {
+  // embedding requests are rejected by the handlers for pipelined engines
+  DCHECK_EQ(pipeline_size_, 1)
+      << "Embedding is not supported with pipeline parallelism";
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  torch::Tensor target_token_ids;
+  InputParameters input_params;
+
+  const auto prepare_start = absl::Now();
+  // same inputs as scoring, the hidden states of all tokens are pooled
+  Utils::prepare_score_inputs(batch,
+                              &flatten_token_ids,
+                              &flatten_positions,
+                              &target_token_ids,
+                              &input_params);
+  std::vector<uint8_t> use_mean;
+  std::vector<uint8_t> normalize;
+  use_mean.reserve(batch.size());
+  normalize.reserve(batch.size());
+  for (const auto* sequence : batch) {
+    const auto& sampling_param = sequence->sampling_param();
+    CHECK(sampling_param.pooling != PoolingType::NONE);
+    use_mean.push_back(sampling_param.pooling == PoolingType::MEAN);
+    normalize.push_back(sampling_param.normalize);
   }
-  auto results = folly::collectAll(futures).get();
-  auto first_output = results.front().value();
+  const auto use_mean_tensor =
+      torch::tensor(use_mean, torch::kUInt8).to(torch::kBool);
+  const auto normalize_tensor =
+      torch::tensor(normalize, torch::kUInt8).to(torch::kBool);
+  engine_prepare_inputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - prepare_start));
+  OutputParameters output;
+  run_on_workers([&](size_t rank) {
+    auto worker_output = workers_[rank]->embed(flatten_token_ids,
+                                               flatten_positions,
+                                               input_params,
+                                               use_mean_tensor,
+                                               normalize_tensor);
+    if (rank == 0) {
+      output = std::move(worker_output);
+    }
+  });
+  return output;
+}
+
+void Engine::compact_kv_cache(const std::vector<Sequence*>& batch) {
+  torch::Tensor src_slot_ids;
+  torch::Tensor dst_slot_ids;
+  Utils::prepare_kv_cache_moves(
+      batch, FLAGS_block_size, &src_slot_ids, &dst_slot_ids);
+  if (src_slot_ids.numel() == 0) {
+    return;
+  }
+
+  run_on_workers([&](size_t rank) {
+    workers_[rank]->copy_kv_cache(src_slot_ids, dst_slot_ids);
+  });
+}
+
+void Engine::copy_kv_blocks(
+    const std::vector<std::pair<int32_t, int32_t>>& block_copies) {
+  if (block_copies.empty()) {
+    return;
+  }
+
+  // copy all slots of each block
+  const int32_t block_size = FLAGS_block_size;
+  std::vector<int32_t> src_slots;
+  std::vector<int32_t> dst_slots;
+  src_slots.reserve(block_copies.size() * block_size);
+  dst_slots.reserve(block_copies.size() * block_size);
+  for (const auto& [src_block_id, dst_block_id] : block_copies) {
+    for (int32_t i = 0; i < block_size; ++i) {
+      src_slots.push_back(src_block_id * block_size + i);
+      dst_slots.push_back(dst_block_id * block_size + i);
+    }
+  }
+  const auto src_slot_ids = torch::tensor(src_slots, torch::kInt);
+  const auto dst_slot_ids = torch::tensor(dst_slots, torch::kInt);
+
+  run_on_workers([&](size_t rank) {
+    workers_[rank]->copy_kv_cache(src_slot_ids, dst_slot_ids);
+  });
+}
+
+std::vector<torch::Tensor> Engine::get_kv_blocks(
+    const std::vector<int32_t>& block_ids) {
+  const auto block_ids_tensor = torch::tensor(block_ids, torch::kLong);
+  std::vector<torch::Tensor> kv_blocks(workers_.size());
+  run_on_workers([&](size_t rank) {
+    kv_blocks[rank] = workers_[rank]->get_kv_blocks(block_ids_tensor);
+  });
+  return kv_blocks;
+}
 
-  first_output.index_select(seq_idxes);
-  return first_output;
+bool Engine::set_kv_blocks(const std::vector<int32_t>& block_ids,
+                           const std::vector<torch::Tensor>& kv_blocks) {
+  if (kv_blocks.size() != workers_.size()) {
+    return false;
+  }
+  for (size_t rank = 0; rank < workers_.size(); ++rank) {
+    if (!workers_[rank]->can_set_kv_blocks(kv_blocks[rank])) {
+      return false;
+    }
+  }
+  const auto block_ids_tensor = torch::tensor(block_ids, torch::kLong);
+  run_on_workers([&](size_t rank) {
+    workers_[rank]->set_kv_blocks(block_ids_tensor, kv_blocks[rank]);
+  });
+  return true;
 }
 
 }  // namespace llm
@@ -1,13 +1,23 @@
 #pragma once
 
 #include <ATen/core/TensorBody.h>
+#include <folly/Function.h>
 
+#include <exception>
 #include <memory>
+#include <thread>
+#include <utility>
 #include <torch/csrc/distributed/c10d/Backend.hpp>
 
+#include "common/broadcast_ring.h"
 #include "memory/block_manager.h"
+#include "model_loader/lora_registry.h"
 #include "quantization/quant_args.h"
+#include "request/sampling_parameter.h"
+#include "request/sequence.h"
+#include "request/stopping_criteria.h"
 #include "tokenizer/tokenizer.h"
+#include "staging_arena.h"
 #include "tokenizer/tokenizer_args.h"
 #include "worker.h"
 
@@ -35,16 +45,81 @@ class Engine {
   // create an engine with the given devices
   Engine(const std::vector<torch::Device>& devices);
 
-  virtual ~Engine() = default;
+  // create an engine that splits the layers of the model into
+  // pipeline_parallel_size stages. devices are assigned to stages in order,
+  // and the devices of each stage use tensor parallelism.
+  Engine(const std::vector<torch::Device>& devices,
+         int32_t pipeline_parallel_size);
+
+  virtual ~Engine();
 
   virtual bool init(const std::string& model_weights_path);
 
   // step the engine forward by one step with the batch
   virtual OutputParameters execute_model(const std::vector<Sequence*>& batch);
 
+  // run num_steps decode steps for a decode-only batch in one call. slots
+  // for the generated tokens should be allocated before calling.
+  // returns next tokens with shape [num_seqs, num_steps]
+  virtual OutputParameters execute_model_multi_steps(
+      const std::vector<Sequence*>& batch,
+      int32_t num_steps);
+
   // validate multiple speculative tokens when use speculative decoding
+  // returns next tokens with shape [num_seqs, max_num_spec_tokens + 1]
   virtual OutputParameters validate(const std::vector<Sequence*>& batch);
 
+  // score the prompts of prefill only sequences without writing kv cache.
+  // returns next_logprobs with shape [num_rows] and top tokens with their
+  // logprobs, where each sequence has num_tokens - 1 rows in order.
+  virtual OutputParameters score(const std::vector<Sequence*>& batch);
+
+  // pool the final hidden states of prefill only sequences into embeddings
+  // without writing kv cache, following the pooling of each sequence.
+  // returns embeddings with shape [num_seqs, hidden_size]
+  virtual OutputParameters embed(const std::vector<Sequence*>& batch);
+
+  // compact the kv cache of accepted speculative tokens from token trees
+  virtual void compact_kv_cache(const std::vector<Sequence*>& batch);
+
+  // copy kv cache blocks (src_block_id, dst_block_id) for copy-on-write
+  virtual void copy_kv_blocks(
+      const std::vector<std::pair<int32_t, int32_t>>& block_copies);
+
+  // gather kv cache blocks into host memory to migrate them to another engine.
+  // returns one tensor per worker with shape
+  // [num_layers, 2, num_blocks, block_size, num_kv_heads, head_dim]
+  virtual std::vector<torch::Tensor> get_kv_blocks(
+      const std::vector<int32_t>& block_ids);
+
+  // write kv cache blocks gathered by get_kv_blocks from another engine with
+  // the same model and the same number of workers. returns false without
+  // writing any block if the blocks are sharded differently.
+  virtual bool set_kv_blocks(const std::vector<int32_t>& block_ids,
+                             const std::vector<torch::Tensor>& kv_blocks);
+
+  // load the weights of a checkpoint with the same architecture into host
+  // memory while the engine keeps serving. can be called from any thread,
+  // but not concurrently with init or another stage_weights.
+  // returns false if the checkpoint is invalid, doesn't match the model or
+  // misses any weight.
+  virtual bool stage_weights(const std::string& model_weights_path);
+
+  // replace the weights of the model with the staged ones in place. should be
+  // called between steps from the thread running the steps.
+  virtual void swap_weights();
+
+  // release the weights staged by stage_weights without swapping them in
+  virtual void clear_staged_weights();
+
+  // serve the lora adapters of the registry, which should outlive the
+  // engine. should be called before init, which checks every adapter against
+  // the model and allocates their device slots before sizing the kv cache.
+  virtual void set_lora_registry(const LoRARegistry* lora_registry);
+
+  // lora adapters served by the engine, nullptr if none
+  const LoRARegistry* lora_registry() const { return lora_registry_; }
+
   virtual std::unique_ptr<Tokenizer> tokenizer() const {
     return tokenizer_->clone();
   }
@@ -53,6 +128,9 @@ class Engine {
 
   const ModelArgs& model_args() const { return args_; }
 
+  // number of pipeline stages
+  int32_t pipeline_size() const { return pipeline_size_; }
+
   const QuantArgs& quant_args() const { return quant_args_; }
 
   const TokenizerArgs& tokenizer_args() const { return tokenizer_args_; }
@@ -62,12 +140,46 @@ class Engine {
 
   bool init_kv_cache(int64_t cache_size_in_bytes);
 
+  // load every lora adapter into a device slot once, so that adapters not
+  // matching the model fail at startup rather than on their first request.
+  bool init_lora();
+
   // returns the memory size for the kv cache
   int64_t profile_memory_for_kv_cache();
 
+  // run the model on the batch without padding
+  OutputParameters execute_batch(const std::vector<Sequence*>& batch);
+
+  // returns the bucket size to pad a decode batch to, or 0 if the batch
+  // should not be padded
+  int64_t decode_bucket_size(const std::vector<Sequence*>& batch) const;
+
+  // run each decode bucket once with padding sequences
+  void warmup_decode_buckets();
+
+  // run prefill and decode steps for a grid of (num_seqs, seq_len) so that
+  // the first requests of each shape don't pay for kernel selection, memory
+  // allocation and page faults. logs the timing of each shape.
+  void warmup();
+
+  // split the batch into micro-batches and run them through the pipeline
+  // stages, with different stages working on different micro-batches.
+  OutputParameters execute_model_pipelined(const std::vector<Sequence*>& batch);
+
+  // run fn(rank) for all workers in parallel and wait for all of them.
+  // rank 0 runs in the calling thread and the other ranks run on their step
+  // threads. only one thread may call it at a time.
+  void run_on_workers(folly::FunctionRef<void(size_t)> fn);
+
+  // the loop of the step thread for the given rank
+  void step_loop(size_t rank);
+
   // devices
   const std::vector<torch::Device> devices_;
 
+  // number of pipeline stages
+  const int32_t pipeline_size_ = 1;
+
   // dtype
   torch::ScalarType dtype_;
 
@@ -80,6 +192,9 @@ class Engine {
   // Tokenizer args
   TokenizerArgs tokenizer_args_;
 
+  // lora adapters served by the engine, not owned
+  const LoRARegistry* lora_registry_ = nullptr;
+
   // a list of process groups, with each process group handling a single device
   std::vector<std::unique_ptr<ProcessGroup>> process_groups_;
 
@@ -91,6 +206,29 @@ class Engine {
 
   // block manager
   std::unique_ptr<BlockManager> block_manager_;
+
+  // reusable host buffer for input tensors of each step
+  StagingArena staging_arena_;
+
+  // sorted batch sizes to pad decode batches to, empty if disabled
+  std::vector<int64_t> decode_buckets_;
+
+  // one-token sequences writing to a scratch block, used to pad decode
+  // batches. they refer to the sampling parameter and stopping criteria.
+  SamplingParameter padding_sampling_param_;
+  StoppingCriteria padding_stopping_criteria_;
+  std::vector<std::unique_ptr<Sequence>> padding_seqs_;
+
+  // commands broadcast to the step threads of ranks [1, world_size). each
+  // command references a function on the stack of run_on_workers.
+  using StepCommand = const folly::FunctionRef<void(size_t)>*;
+  std::unique_ptr<BroadcastRing<StepCommand>> step_ring_;
+
+  // persistent threads running the commands for ranks [1, world_size)
+  std::vector<std::thread> step_threads_;
+
+  // exception thrown by the last command of each rank
+  std::vector<std::exception_ptr> step_errors_;
 };
 
 }  // namespace llm
@@ -0,0 +1,42 @@
+#include "lora_pool.h"
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <utility>
+
+namespace llm {
+
+LoRAPool::LoRAPool(int32_t num_slots)
+    : slot_ids_(num_slots, -1), slot_batches_(num_slots, 0) {
+  CHECK_GT(num_slots, 0);
+}
+
+void LoRAPool::begin_batch() { ++batch_; }
+
+std::pair<int32_t, bool> LoRAPool::acquire(int32_t lora_id) {
+  CHECK_GE(lora_id, 0);
+  CHECK_GT(batch_, 0) << "begin_batch should be called first";
+  // find the adapter, or the victim with the oldest batch
+  int32_t victim = -1;
+  for (int32_t slot = 0; slot < num_slots(); ++slot) {
+    if (slot_ids_[slot] == lora_id) {
+      slot_batches_[slot] = batch_;
+      return {slot, false};
+    }
+    if (slot_batches_[slot] == batch_) {
+      // used by the current batch
+      continue;
+    }
+    if (victim < 0 || slot_batches_[slot] < slot_batches_[victim]) {
+      victim = slot;
+    }
+  }
+  CHECK_GE(victim, 0) << "more than " << num_slots()
+                      << " lora adapters in one batch";
+  slot_ids_[victim] = lora_id;
+  slot_batches_[victim] = batch_;
+  return {victim, true};
+}
+
+}  // namespace llm
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+// LoRAPool assigns the device slots of lora adapters. An adapter missing from
+// the pool takes an empty slot, or the slot of the least recently used
+// adapter that is not used by the current batch.
+class LoRAPool final {
+ public:
+  explicit LoRAPool(int32_t num_slots);
+
+  // start a new batch, adapters of previous batches become evictable
+  void begin_batch();
+
+  // returns the slot of the adapter and whether the adapter should be loaded
+  // into the slot. all adapters of a batch should fit into the pool.
+  std::pair<int32_t, bool> acquire(int32_t lora_id);
+
+  int32_t num_slots() const { return static_cast<int32_t>(slot_ids_.size()); }
+
+ private:
+  // adapter id held by each slot, -1 if empty
+  std::vector<int32_t> slot_ids_;
+
+  // the last batch using each slot
+  std::vector<uint64_t> slot_batches_;
+
+  // id of the current batch, starting from 1
+  uint64_t batch_ = 0;
+};
+
+}  // namespace llm
@@ -0,0 +1,31 @@
+#include "lora_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <utility>
+
+namespace llm {
+
+TEST(LoRAPoolTest, LeastRecentlyUsed) {
+  LoRAPool pool(/*num_slots=*/2);
+
+  // adapters 0 and 1 take the empty slots
+  pool.begin_batch();
+  EXPECT_EQ(pool.acquire(0), std::make_pair(0, true));
+  EXPECT_EQ(pool.acquire(1), std::make_pair(1, true));
+  EXPECT_EQ(pool.acquire(0), std::make_pair(0, false));
+
+  // adapter 1 is used more recently than adapter 0
+  pool.begin_batch();
+  EXPECT_EQ(pool.acquire(1), std::make_pair(1, false));
+  pool.begin_batch();
+  EXPECT_EQ(pool.acquire(2), std::make_pair(0, true));
+
+  // adapter 2 is used by the current batch, adapter 1 is evicted
+  EXPECT_EQ(pool.acquire(0), std::make_pair(1, true));
+  pool.begin_batch();
+  EXPECT_EQ(pool.acquire(2), std::make_pair(0, false));
+  EXPECT_EQ(pool.acquire(0), std::make_pair(1, false));
+}
+
+}  // namespace llm
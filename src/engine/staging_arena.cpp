@@ -0,0 +1,74 @@
+#include "staging_arena.h"
+
+#include <c10/util/accumulate.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cstdint>
+
+namespace llm {
+namespace {
+// align allocations so that any dtype can be viewed at their offsets
+constexpr int64_t kAlignment = 16;
+}  // namespace
+
+StagingArena::StagingArena(bool pin_memory) : pin_memory_(pin_memory) {}
+
+void StagingArena::reset(int64_t num_bytes) {
+  offset_ = 0;
+  const int64_t capacity = buffer_.defined() ? buffer_.numel() : 0;
+  if (num_bytes <= capacity) {
+    return;
+  }
+  // grow geometrically to avoid reallocating for slightly larger batches
+  const int64_t new_capacity = std::max(num_bytes, capacity * 2);
+  // tensors from the old buffer are still valid since they hold its storage
+  buffer_ = torch::empty(
+      {new_capacity},
+      torch::dtype(torch::kUInt8).pinned_memory(pin_memory_));
+}
+
+torch::Tensor StagingArena::allocate(torch::IntArrayRef sizes,
+                                     torch::ScalarType dtype) {
+  CHECK(buffer_.defined()) << "reset should be called before allocate";
+  const int64_t numel = c10::multiply_integers(sizes);
+  const int64_t bytes = num_bytes(numel, dtype);
+  CHECK_LE(offset_ + bytes, buffer_.numel()) << "staging arena is full";
+
+  const int64_t element_size = static_cast<int64_t>(c10::elementSize(dtype));
+  auto tensor =
+      buffer_.slice(/*dim=*/0, offset_, offset_ + numel * element_size)
+          .view(dtype);
+  offset_ += bytes;
+  return tensor.view(sizes);
+}
+
+int64_t StagingArena::num_bytes(int64_t numel, torch::ScalarType dtype) {
+  const int64_t bytes = numel * static_cast<int64_t>(c10::elementSize(dtype));
+  return (bytes + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+torch::Tensor StagingArena::buffer() const {
+  CHECK(buffer_.defined());
+  return buffer_.slice(/*dim=*/0, 0, offset_);
+}
+
+torch::Tensor StagingArena::rebase(const torch::Tensor& tensor,
+                                   const torch::Tensor& src_buffer,
+                                   const torch::Tensor& dst_buffer) {
+  if (!tensor.defined()) {
+    return tensor;
+  }
+  const auto* src = static_cast<const uint8_t*>(src_buffer.data_ptr());
+  const auto* data = static_cast<const uint8_t*>(tensor.data_ptr());
+  const int64_t offset = data - src;
+  const int64_t bytes = static_cast<int64_t>(tensor.nbytes());
+  CHECK(offset >= 0 && offset + bytes <= src_buffer.numel())
+      << "tensor is not allocated from the buffer";
+  return dst_buffer.slice(/*dim=*/0, offset, offset + bytes)
+      .view(tensor.scalar_type())
+      .view(tensor.sizes());
+}
+
+}  // namespace llm
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstdint>
+
+namespace llm {
+
+// StagingArena packs the input tensors of a step into one reusable host
+// buffer, so that they can be uploaded to device with a single copy and
+// sliced back into views on the device. The buffer is pinned for cuda devices
+// and only grows, so most steps don't allocate at all.
+// Tensors allocated from the arena are valid until the next reset, the caller
+// should make sure the previous step is done before resetting.
+class StagingArena final {
+ public:
+  explicit StagingArena(bool pin_memory);
+
+  // release all allocations and make sure the buffer can hold num_bytes
+  void reset(int64_t num_bytes);
+
+  // allocate a contiguous tensor from the buffer
+  torch::Tensor allocate(torch::IntArrayRef sizes, torch::ScalarType dtype);
+
+  // bytes taken by a tensor with numel elements, including padding
+  static int64_t num_bytes(int64_t numel, torch::ScalarType dtype);
+
+  // the part of the buffer used since last reset, UInt8Tensor: [num_bytes]
+  torch::Tensor buffer() const;
+
+  // map a tensor allocated from src_buffer to the same offset in dst_buffer,
+  // which holds a copy of src_buffer on another device.
+  static torch::Tensor rebase(const torch::Tensor& tensor,
+                              const torch::Tensor& src_buffer,
+                              const torch::Tensor& dst_buffer);
+
+ private:
+  bool pin_memory_ = false;
+
+  // UInt8Tensor: [capacity]
+  torch::Tensor buffer_;
+
+  // bytes allocated since last reset
+  int64_t offset_ = 0;
+};
+
+}  // namespace llm
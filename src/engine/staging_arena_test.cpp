@@ -0,0 +1,58 @@
+#include "staging_arena.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+TEST(StagingArenaTest, Allocate) {
+  StagingArena arena(/*pin_memory=*/false);
+  arena.reset(StagingArena::num_bytes(3, torch::kInt) +
+              StagingArena::num_bytes(4, torch::kInt64));
+  auto a = arena.allocate({3}, torch::kInt);
+  auto b = arena.allocate({2, 2}, torch::kInt64);
+  EXPECT_EQ(a.sizes().vec(), std::vector<int64_t>({3}));
+  EXPECT_EQ(b.sizes().vec(), std::vector<int64_t>({2, 2}));
+  EXPECT_EQ(b.scalar_type(), torch::kInt64);
+  a.copy_(torch::tensor({1, 2, 3}, torch::kInt));
+  b.copy_(torch::tensor({{4, 5}, {6, 7}}, torch::kInt64));
+
+  // allocations are aligned and packed in order
+  const auto buffer = arena.buffer();
+  EXPECT_EQ(buffer.numel(), 16 + 32);
+  EXPECT_EQ(buffer.data_ptr(), a.data_ptr());
+
+  // map tensors onto a copy of the buffer
+  const auto copy = buffer.clone();
+  auto a_copy = StagingArena::rebase(a, buffer, copy);
+  auto b_copy = StagingArena::rebase(b, buffer, copy);
+  EXPECT_NE(a_copy.data_ptr(), a.data_ptr());
+  EXPECT_TRUE(torch::equal(a_copy, a));
+  EXPECT_TRUE(torch::equal(b_copy, b));
+  EXPECT_FALSE(StagingArena::rebase(torch::Tensor(), buffer, copy).defined());
+}
+
+TEST(StagingArenaTest, Reuse) {
+  StagingArena arena(/*pin_memory=*/false);
+  arena.reset(64);
+  auto a = arena.allocate({4}, torch::kInt);
+  auto* data = a.data_ptr();
+
+  // the buffer is reused if it is large enough
+  arena.reset(32);
+  EXPECT_EQ(arena.allocate({4}, torch::kInt).data_ptr(), data);
+  EXPECT_EQ(arena.buffer().numel(), 16);
+
+  // grow the buffer, old tensors are still valid
+  a.fill_(7);
+  arena.reset(1024);
+  auto b = arena.allocate({256}, torch::kInt);
+  EXPECT_NE(b.data_ptr(), data);
+  EXPECT_TRUE(torch::equal(a, torch::full({4}, 7, torch::kInt)));
+
+  // empty tensors
+  arena.reset(0);
+  EXPECT_EQ(arena.allocate({0, 3}, torch::kInt64).numel(), 0);
+}
+
+}  // namespace llm
@@ -4,6 +4,9 @@
 #include <torch/torch.h>
 #include <torch/types.h>
 
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "models/input_parameters.h"
@@ -46,6 +49,28 @@ torch::Tensor create_2d_tensor(std::vector<std::vector<T>>& vec,
   return tensor;
 }
 
+// lora adapter id of each new token, undefined if no sequence uses lora
+// q_cu_seq_lens: [num_seqs + 1] IntTensor on host
+torch::Tensor prepare_lora_ids(const std::vector<Sequence*>& batch,
+                               const torch::Tensor& q_cu_seq_lens) {
+  const bool has_lora =
+      std::any_of(batch.begin(), batch.end(), [](const Sequence* sequence) {
+        return sequence->sampling_param().lora_id >= 0;
+      });
+  if (!has_lora) {
+    return {};
+  }
+  const int32_t* cu_lens = q_cu_seq_lens.data_ptr<int32_t>();
+  auto lora_ids = torch::empty({cu_lens[batch.size()]}, torch::kInt);
+  int32_t* lora_ids_ptr = lora_ids.data_ptr<int32_t>();
+  for (size_t i = 0; i < batch.size(); ++i) {
+    std::fill(lora_ids_ptr + cu_lens[i],
+              lora_ids_ptr + cu_lens[i + 1],
+              batch[i]->sampling_param().lora_id);
+  }
+  return lora_ids;
+}
+
 }  // namespace
 
 void Utils::prepare_profile_inputs(int64_t max_num_tokens,
@@ -92,20 +117,166 @@ void Utils::prepare_inputs(const std::vector<Sequence*>& batch,
                            torch::Tensor* flatten_token_ids,
                            torch::Tensor* flatten_positions,
                            InputParameters* input_params,
-                           SamplingParameters* sampling_params) {
+                           SamplingParameters* sampling_params,
+                           StagingArena* arena) {
+  // use a temporary arena if not provided
+  std::unique_ptr<StagingArena> local_arena;
+  if (arena == nullptr) {
+    local_arena = std::make_unique<StagingArena>(/*pin_memory=*/false);
+    arena = local_arena.get();
+  }
+
+  // get tensor sizes first so that inputs can be written into the arena
+  const int64_t num_sequences = static_cast<int64_t>(batch.size());
+  int64_t num_tokens = 0;
+  int64_t max_unique_tokens = 0;
+  int64_t max_block_table_len = 0;
+  for (const auto* sequence : batch) {
+    CHECK(!sequence->is_finished());
+    CHECK(has_enough_cache_slots(*sequence, block_size));
+    num_tokens += static_cast<int64_t>(sequence->num_tokens() -
+                                       sequence->num_tokens_in_cache());
+    max_unique_tokens =
+        std::max(max_unique_tokens,
+                 static_cast<int64_t>(sequence->token_to_count_map().size()));
+    max_block_table_len = std::max(
+        max_block_table_len, static_cast<int64_t>(sequence->num_blocks()));
+  }
+
+  const auto num_bytes = [](int64_t numel, torch::ScalarType dtype) {
+    return StagingArena::num_bytes(numel, dtype);
+  };
+  arena->reset(num_bytes(num_tokens, torch::kInt) * 3 +
+               num_bytes(num_sequences + 1, torch::kInt) * 2 +
+               num_bytes(num_sequences, torch::kInt) * 2 +
+               num_bytes(num_sequences * max_block_table_len, torch::kInt) +
+               num_bytes(num_sequences * max_unique_tokens, torch::kInt64) +
+               num_bytes(num_sequences * max_unique_tokens, torch::kInt));
+
+  auto tokens = arena->allocate({num_tokens}, torch::kInt);
+  auto positions = arena->allocate({num_tokens}, torch::kInt);
+  // slot ids for new tokens
+  auto new_cache_slots = arena->allocate({num_tokens}, torch::kInt);
+  auto cu_seq_lens = arena->allocate({num_sequences + 1}, torch::kInt);
+  auto q_cu_seq_lens = arena->allocate({num_sequences + 1}, torch::kInt);
+  // track the last token index in the flattened tokens
+  auto last_token_idxes = arena->allocate({num_sequences}, torch::kInt);
+  auto block_tables = arena->allocate(
+      {num_sequences, max_block_table_len}, torch::kInt);
+  // track the token ids and counts in the batch
+  auto token_ids = arena->allocate(
+      {num_sequences, max_unique_tokens}, torch::kInt64);
+  auto token_counts = arena->allocate(
+      {num_sequences, max_unique_tokens}, torch::kInt);
+  auto token_ids_lens = arena->allocate({num_sequences}, torch::kInt);
+
+  int32_t* tokens_ptr = tokens.data_ptr<int32_t>();
+  int32_t* positions_ptr = positions.data_ptr<int32_t>();
+  int32_t* new_cache_slots_ptr = new_cache_slots.data_ptr<int32_t>();
+  int32_t* cu_seq_lens_ptr = cu_seq_lens.data_ptr<int32_t>();
+  int32_t* q_cu_seq_lens_ptr = q_cu_seq_lens.data_ptr<int32_t>();
+  int32_t* last_token_idxes_ptr = last_token_idxes.data_ptr<int32_t>();
+  int32_t* block_tables_ptr = block_tables.data_ptr<int32_t>();
+  int64_t* token_ids_ptr = token_ids.data_ptr<int64_t>();
+  int32_t* token_counts_ptr = token_counts.data_ptr<int32_t>();
+  int32_t* token_ids_lens_ptr = token_ids_lens.data_ptr<int32_t>();
+  // pad unused entries with 0
+  std::fill_n(block_tables_ptr, num_sequences * max_block_table_len, 0);
+  std::fill_n(token_ids_ptr, num_sequences * max_unique_tokens, 0);
+  std::fill_n(token_counts_ptr, num_sequences * max_unique_tokens, 0);
+
+  bool all_prefill_sequences = true;
+  int32_t max_seq_len = 0;
+  int32_t q_max_seq_len = 0;
+  cu_seq_lens_ptr[0] = 0;
+  q_cu_seq_lens_ptr[0] = 0;
+  int32_t num_flatten_tokens = 0;
+  for (int64_t i = 0; i < num_sequences; ++i) {
+    const auto* sequence = batch[i];
+    all_prefill_sequences &= sequence->is_prefill();
+
+    const auto& seq_token_ids = sequence->token_ids();
+    const int32_t seq_len = static_cast<int32_t>(seq_token_ids.size());
+    const int32_t kvcache_seq_len = sequence->num_tokens_in_cache();
+    const int32_t q_seq_len = seq_len - kvcache_seq_len;
+    // pack the token ids, positions and slot ids for new tokens
+    // [n_tokens_in_kvcache, total_tokens) into one-dimensional tensors
+    const auto& blocks = sequence->blocks();
+    for (int32_t j = kvcache_seq_len; j < seq_len; ++j) {
+      tokens_ptr[num_flatten_tokens] = seq_token_ids[j];
+      positions_ptr[num_flatten_tokens] = j;
+      new_cache_slots_ptr[num_flatten_tokens] =
+          blocks[j / block_size] * block_size + j % block_size;
+      ++num_flatten_tokens;
+    }
+    last_token_idxes_ptr[i] = num_flatten_tokens - 1;
+
+    // add token id and count for each sequence
+    const auto& seq_token_counts = sequence->token_to_count_map();
+    int64_t k = i * max_unique_tokens;
+    for (const auto& [token_id, count] : seq_token_counts) {
+      token_ids_ptr[k] = token_id;
+      token_counts_ptr[k] = count;
+      ++k;
+    }
+    token_ids_lens_ptr[i] = static_cast<int32_t>(seq_token_counts.size());
+
+    max_seq_len = std::max(max_seq_len, seq_len);
+    q_max_seq_len = std::max(q_max_seq_len, q_seq_len);
+    cu_seq_lens_ptr[i + 1] = cu_seq_lens_ptr[i] + seq_len;
+    q_cu_seq_lens_ptr[i + 1] = q_cu_seq_lens_ptr[i] + q_seq_len;
+
+    // add sampling parameters
+    sampling_params->add(sequence->sampling_param());
+    sampling_params->seq_ids.push_back(sequence->id());
+
+    std::copy(blocks.begin(),
+              blocks.end(),
+              block_tables_ptr + i * max_block_table_len);
+  }
+
+  *flatten_token_ids = tokens;
+  *flatten_positions = positions;
+
+  input_params->all_prefill_sequences = all_prefill_sequences;
+  input_params->num_sequences = static_cast<int32_t>(num_sequences);
+  input_params->kv_max_seq_len = max_seq_len;
+  input_params->q_max_seq_len = q_max_seq_len;
+  input_params->kv_cu_seq_lens = cu_seq_lens;
+  input_params->q_cu_seq_lens = q_cu_seq_lens;
+  input_params->new_cache_slots = new_cache_slots;
+  input_params->block_tables = block_tables;
+  input_params->last_token_idxes = last_token_idxes;
+  input_params->token_ids = token_ids;
+  input_params->token_counts = token_counts;
+  input_params->token_ids_lens = token_ids_lens;
+  input_params->lora_ids = prepare_lora_ids(batch, q_cu_seq_lens);
+  input_params->staging_buffer = arena->buffer();
+}
+
+void Utils::prepare_validate_inputs(const std::vector<Sequence*>& batch,
+                                    int32_t block_size,
+                                    torch::Tensor* flatten_token_ids,
+                                    torch::Tensor* flatten_positions,
+                                    torch::Tensor* seq_idxes,
+                                    InputParameters* input_params,
+                                    SamplingParameters* sampling_params) {
   // flatten the token ids and positions
   std::vector<int32_t> flatten_tokens_vec;
   std::vector<int32_t> flatten_positions_vec;
-  // track the last token index in the flattened tokens
+  // track the token indexes used for sampling, one row for each position
+  // [last_token, spec_token_0, ..., spec_token_n-1]
   std::vector<int32_t> last_token_idxes;
+  // rows for each sequence
+  std::vector<std::vector<int32_t>> seq_idxes_vec;
+  size_t max_num_rows = 0;
 
-  // track the token ids and counts in the batch
+  // track the token ids and counts for each row
   std::vector<std::vector<int64_t>> token_ids_vec;
   std::vector<int32_t> token_ids_lens_vec;
   std::vector<std::vector<int32_t>> token_counts_vec;
   size_t max_unique_tokens = 0;
 
-  // process prefill requests
   bool all_prefill_sequences = true;
   int32_t max_seq_len = 0;
   int32_t q_max_seq_len = 0;
@@ -115,53 +286,114 @@ void Utils::prepare_inputs(const std::vector<Sequence*>& batch,
   std::vector<int32_t> new_token_slot_ids;
   std::vector<std::vector<int32_t>> block_tables_vec;
   int32_t max_block_table_len = 0;
+
+  // tree mask is only needed when any of the spec tokens form a tree
+  bool has_token_tree = false;
+  for (const auto* sequence : batch) {
+    has_token_tree |= !sequence->is_spec_token_chain();
+  }
+  std::vector<std::vector<int32_t>> tree_mask_vec;
+
   const int32_t num_sequences = static_cast<int32_t>(batch.size());
   for (int32_t i = 0; i < num_sequences; ++i) {
+    // the sequence may be finished by speculative tokens, which is decided
+    // after validation.
     const auto* sequence = batch[i];
-    CHECK(!sequence->is_finished());
     CHECK(has_enough_cache_slots(*sequence, block_size));
 
     all_prefill_sequences &= sequence->is_prefill();
 
     const auto& seq_token_ids = sequence->token_ids();
     const int32_t seq_len = static_cast<int32_t>(seq_token_ids.size());
-    const int32_t kvcache_seq_len = sequence->num_tokens_in_cache();
+    const int32_t num_spec_tokens =
+        static_cast<int32_t>(sequence->num_spec_tokens());
+    // position of the last accepted token
+    const int32_t last_token_pos = seq_len - num_spec_tokens - 1;
+    CHECK_GE(last_token_pos, 0);
+    const int32_t kvcache_seq_len =
+        std::min(static_cast<int32_t>(sequence->num_tokens_in_cache()),
+                 last_token_pos);
     const int32_t q_seq_len = seq_len - kvcache_seq_len;
+    const int32_t q_start = static_cast<int32_t>(flatten_tokens_vec.size());
+
+    // spec tokens are placed by their depth in the token tree
+    const auto& parents = sequence->spec_token_parents();
+    std::vector<int32_t> depths(num_spec_tokens);
+    for (int32_t k = 0; k < num_spec_tokens; ++k) {
+      depths[k] = parents[k] < 0 ? 1 : depths[parents[k]] + 1;
+    }
     // pack the token ids and positions into one-dimensional tensors
-    for (int32_t i = kvcache_seq_len; i < seq_len; ++i) {
-      flatten_tokens_vec.push_back(seq_token_ids[i]);
-      flatten_positions_vec.push_back(static_cast<int32_t>(i));
+    for (int32_t j = kvcache_seq_len; j < seq_len; ++j) {
+      const int32_t spec_idx = j - last_token_pos - 1;
+      const int32_t pos = spec_idx < 0 ? j : last_token_pos + depths[spec_idx];
+      flatten_tokens_vec.push_back(seq_token_ids[j]);
+      flatten_positions_vec.push_back(pos);
     }
-    last_token_idxes.push_back(
-        static_cast<int32_t>(flatten_tokens_vec.size() - 1));
 
-    // add token id and count for each sequence
-    const auto& seq_token_counts = sequence->token_to_count_map();
-    const auto unique_tokens = seq_token_counts.size();
+    if (has_token_tree) {
+      // new tokens before the spec tokens use causal mask, spec tokens attend
+      // to them and their ancestors in the token tree.
+      const int32_t n_prefix = last_token_pos - kvcache_seq_len + 1;
+      for (int32_t j = 0; j < q_seq_len; ++j) {
+        auto& row = tree_mask_vec.emplace_back(q_seq_len, 0);
+        if (j < n_prefix) {
+          std::fill(row.begin(), row.begin() + j + 1, 1);
+          continue;
+        }
+        std::fill(row.begin(), row.begin() + n_prefix, 1);
+        for (int32_t k = j - n_prefix; k >= 0; k = parents[k]) {
+          row[n_prefix + k] = 1;
+        }
+      }
+    }
 
-    auto& ids = token_ids_vec.emplace_back();
-    auto& counts = token_counts_vec.emplace_back();
-    ids.reserve(unique_tokens);
-    counts.reserve(unique_tokens);
-    for (const auto& [token_id, count] : seq_token_counts) {
-      ids.push_back(token_id);
-      counts.push_back(count);
+    // token counts without spec tokens
+    std::unordered_map<int32_t, int32_t> base_token_counts =
+        sequence->token_to_count_map();
+    for (int32_t j = last_token_pos + 1; j < seq_len; ++j) {
+      auto it = base_token_counts.find(seq_token_ids[j]);
+      if (--it->second == 0) {
+        base_token_counts.erase(it);
+      }
+    }
+
+    // one row for the last accepted token and each spec token. the logits of
+    // each row are processed as if the spec tokens on its path in the token
+    // tree have been accepted.
+    auto& seq_rows = seq_idxes_vec.emplace_back();
+    for (int32_t j = last_token_pos; j < seq_len; ++j) {
+      auto seq_token_counts = base_token_counts;
+      for (int32_t k = j - last_token_pos - 1; k >= 0; k = parents[k]) {
+        ++seq_token_counts[seq_token_ids[last_token_pos + k + 1]];
+      }
+      seq_rows.push_back(static_cast<int32_t>(last_token_idxes.size()));
+      last_token_idxes.push_back(q_start + j - kvcache_seq_len);
+
+      const auto unique_tokens = seq_token_counts.size();
+      auto& ids = token_ids_vec.emplace_back();
+      auto& counts = token_counts_vec.emplace_back();
+      ids.reserve(unique_tokens);
+      counts.reserve(unique_tokens);
+      for (const auto& [token_id, count] : seq_token_counts) {
+        ids.push_back(token_id);
+        counts.push_back(count);
+      }
+      token_ids_lens_vec.push_back(static_cast<int32_t>(unique_tokens));
+      max_unique_tokens = std::max(max_unique_tokens, unique_tokens);
+
+      sampling_params->add(sequence->sampling_param());
     }
-    token_ids_lens_vec.push_back(static_cast<int32_t>(unique_tokens));
-    max_unique_tokens = std::max(max_unique_tokens, unique_tokens);
+    max_num_rows = std::max(max_num_rows, seq_rows.size());
 
     max_seq_len = std::max(max_seq_len, seq_len);
     q_max_seq_len = std::max(q_max_seq_len, q_seq_len);
     cu_seq_lens.push_back(cu_seq_lens.back() + seq_len);
     q_cu_seq_lens.push_back(q_cu_seq_lens.back() + q_seq_len);
 
-    // add sampling parameters
-    sampling_params->add(sequence->sampling_param());
-
-    // assign slot ids for new tokens [n_tokens_in_kvcache, total_tokens)
+    // assign slot ids for new tokens [kvcache_seq_len, seq_len)
     const auto& blocks = sequence->blocks();
-    const auto slot_ids = cache_slots_for_pos(
-        sequence->blocks(), block_size, kvcache_seq_len, seq_len);
+    const auto slot_ids =
+        cache_slots_for_pos(blocks, block_size, kvcache_seq_len, seq_len);
     new_token_slot_ids.insert(
         new_token_slot_ids.end(), slot_ids.begin(), slot_ids.end());
 
@@ -170,15 +402,21 @@ void Utils::prepare_inputs(const std::vector<Sequence*>& batch,
         std::max(max_block_table_len, static_cast<int32_t>(blocks.size()));
   }
 
-  using torch::indexing::Slice;
-  // construct two-dimensional tensors for token ids and counts
+  // pad rows for each sequence with its last row
+  for (auto& seq_rows : seq_idxes_vec) {
+    seq_rows.resize(max_num_rows, seq_rows.back());
+  }
+  *seq_idxes = create_2d_tensor(seq_idxes_vec,
+                                max_num_rows,
+                                torch::kInt64,
+                                /*pad_value=*/int32_t(0));
+
   auto token_ids = create_2d_tensor(token_ids_vec,
                                     max_unique_tokens,
                                     torch::kInt64,
                                     /*pad_value=*/int64_t(0));
   auto token_counts = create_2d_tensor(
       token_counts_vec, max_unique_tokens, torch::kInt, /*pad_value=*/0);
-
   auto block_tables = create_2d_tensor(
       block_tables_vec, max_block_table_len, torch::kInt, /*pad_value=*/0);
 
@@ -198,120 +436,100 @@ void Utils::prepare_inputs(const std::vector<Sequence*>& batch,
   input_params->token_ids = token_ids;
   input_params->token_counts = token_counts;
   input_params->token_ids_lens = torch::tensor(token_ids_lens_vec, torch::kInt);
+  input_params->lora_ids =
+      prepare_lora_ids(batch, input_params->q_cu_seq_lens);
+  if (has_token_tree) {
+    auto tree_mask = create_2d_tensor(
+        tree_mask_vec, q_max_seq_len, torch::kInt, /*pad_value=*/0);
+    input_params->tree_mask = tree_mask.to(torch::kBool);
+  }
 }
 
-void Utils::prepare_validate_inputs(const std::vector<Sequence*>& batch,
-                                    int32_t block_size,
-                                    torch::Tensor* flatten_token_ids,
-                                    torch::Tensor* flatten_positions,
-                                    torch::Tensor* seq_idxes,
-                                    InputParameters* input_params,
-                                    SamplingParameters* sampling_params) {
-  // TODO(michael): update this function to use the new input parameters
-  /*std::vector<int32_t> flatten_tokens_vec;
+void Utils::prepare_score_inputs(const std::vector<Sequence*>& batch,
+                                 torch::Tensor* flatten_token_ids,
+                                 torch::Tensor* flatten_positions,
+                                 torch::Tensor* target_token_ids,
+                                 InputParameters* input_params) {
+  std::vector<int32_t> flatten_tokens_vec;
   std::vector<int32_t> flatten_positions_vec;
   std::vector<int32_t> last_token_idxes;
-
-  std::vector<std::vector<int64_t>> token_ids_vec;
-  std::vector<int32_t> token_ids_lens_vec;
-  std::vector<std::vector<int32_t>> token_counts_vec;
-  size_t max_unique_tokens = 0;
-
-  std::vector<int32_t> seq_idxes_vec(batch.size());
-
-  int32_t num_total_tokens = 0;
+  std::vector<int64_t> target_tokens_vec;
   int32_t max_seq_len = 0;
   std::vector<int32_t> cu_seq_lens = {0};
-  std::vector<int32_t> slot_ids;
-
-  for (int32_t i = 0; i < static_cast<int32_t>(batch.size()); ++i) {
-    const auto* sequence = batch[i];
-    CHECK(has_enough_cache_slots(*sequence, block_size));
-
-    seq_idxes_vec[i] = static_cast<int32_t>(token_ids_vec.size());
-
+  for (const auto* sequence : batch) {
+    CHECK(sequence->is_prefill_only());
+    // the whole prompt is processed from scratch without kv cache
     const auto& seq_token_ids = sequence->token_ids();
-    const int32_t num_tokens = static_cast<int32_t>(seq_token_ids.size());
-    for (int32_t i = 0; i < num_tokens; ++i) {
-      flatten_tokens_vec.emplace_back(seq_token_ids[i]);
-      flatten_positions_vec.emplace_back(i);
-    }
-
-    auto& ids = token_ids_vec.emplace_back();
-    auto& counts = token_counts_vec.emplace_back();
-
-    const auto& seq_token_counts = sequence->token_to_count_map();
-    const auto unique_tokens = seq_token_counts.size();
-    ids.reserve(unique_tokens);
-    counts.reserve(unique_tokens);
-    for (const auto& [token_id, count] : seq_token_counts) {
-      ids.emplace_back(token_id);
-      counts.emplace_back(count);
+    const int32_t seq_len = static_cast<int32_t>(seq_token_ids.size());
+    const int32_t start = static_cast<int32_t>(flatten_tokens_vec.size());
+    for (int32_t j = 0; j < seq_len; ++j) {
+      flatten_tokens_vec.push_back(seq_token_ids[j]);
+      flatten_positions_vec.push_back(j);
+      if (j + 1 < seq_len) {
+        last_token_idxes.push_back(start + j);
+        target_tokens_vec.push_back(seq_token_ids[j + 1]);
+      }
     }
-    token_ids_lens_vec.emplace_back(static_cast<int32_t>(unique_tokens));
-    max_unique_tokens = std::max(max_unique_tokens, unique_tokens);
+    max_seq_len = std::max(max_seq_len, seq_len);
+    cu_seq_lens.push_back(cu_seq_lens.back() + seq_len);
+  }
 
-    num_total_tokens += num_tokens;
-    max_seq_len = std::max(max_seq_len, num_tokens);
-    cu_seq_lens.emplace_back(num_total_tokens);
-    sampling_params->add(sequence->sampling_param());
-    last_token_idxes.emplace_back(
-        static_cast<int32_t>(flatten_tokens_vec.size() - 1));
+  *flatten_token_ids = torch::tensor(flatten_tokens_vec, torch::kInt);
+  *flatten_positions = torch::tensor(flatten_positions_vec, torch::kInt);
+  *target_token_ids = torch::tensor(target_tokens_vec, torch::kInt64);
 
-    const auto slots = cache_slots(*sequence, block_size);
-    slot_ids.insert(slot_ids.end(), slots.begin(), slots.end());
-  }
+  const auto cu_seq_lens_tensor = torch::tensor(cu_seq_lens, torch::kInt);
+  input_params->all_prefill_sequences = true;
+  input_params->num_sequences = static_cast<int32_t>(batch.size());
+  input_params->kv_max_seq_len = max_seq_len;
+  input_params->q_max_seq_len = max_seq_len;
+  input_params->kv_cu_seq_lens = cu_seq_lens_tensor;
+  input_params->q_cu_seq_lens = cu_seq_lens_tensor;
+  input_params->last_token_idxes = torch::tensor(last_token_idxes, torch::kInt);
+  input_params->lora_ids = prepare_lora_ids(batch, cu_seq_lens_tensor);
+  // new_cache_slots and block_tables are left undefined
+}
 
-  using torch::indexing::Slice;
-  auto token_ids_tensor =
-      torch::empty({static_cast<int64_t>(token_ids_vec.size()),
-                    static_cast<int64_t>(max_unique_tokens)},
-                   torch::kInt64);
-  auto token_counts_tensor =
-      torch::empty({static_cast<int64_t>(token_counts_vec.size()),
-                    static_cast<int64_t>(max_unique_tokens)},
-                   torch::kInt);
-  for (int64_t i = 0; i < token_ids_vec.size(); ++i) {
-    auto& ids = token_ids_vec[i];
-    ids.resize(max_unique_tokens, 0);
-    token_ids_tensor.index_put_({i, Slice()},
-                                torch::tensor(ids, torch::kInt64));
-
-    auto& counts = token_counts_vec[i];
-    counts.resize(max_unique_tokens, 0);
-    token_counts_tensor.index_put_({i, Slice()},
-                                   torch::tensor(counts, torch::kInt));
+void Utils::prepare_multi_step_cache_slots(const std::vector<Sequence*>& batch,
+                                           int32_t block_size,
+                                           int32_t num_steps,
+                                           torch::Tensor* cache_slots) {
+  const int64_t num_sequences = static_cast<int64_t>(batch.size());
+  std::vector<int32_t> slots;
+  slots.reserve((num_steps - 1) * num_sequences);
+  for (int32_t step = 1; step < num_steps; ++step) {
+    for (const auto* sequence : batch) {
+      // the token sampled by previous step is placed right after the sequence
+      const int32_t pos =
+          static_cast<int32_t>(sequence->num_tokens()) + step - 1;
+      CHECK_LT(pos / block_size,
+               static_cast<int32_t>(sequence->num_blocks()));
+      const auto slot =
+          cache_slots_for_pos(sequence->blocks(), block_size, pos, pos + 1);
+      slots.push_back(slot[0]);
+    }
   }
+  *cache_slots = torch::tensor(slots, torch::kInt)
+                     .view({num_steps - 1, num_sequences});
+}
 
-  std::vector<std::vector<int32_t>> block_tables;
-  int32_t max_block_table_len = 0;
-  auto block_tables_tensor = torch::empty(
-      {static_cast<int64_t>(block_tables.size()), max_block_table_len},
-      torch::kInt);
-
-  for (int64_t i = 0; i < block_tables.size(); ++i) {
-    auto& block_table = block_tables[i];
-    block_table.resize(max_block_table_len, 0);
-    block_tables_tensor.index_put_({i, Slice()},
-                                   torch::tensor(block_table, torch::kInt));
+void Utils::prepare_kv_cache_moves(const std::vector<Sequence*>& batch,
+                                   int32_t block_size,
+                                   torch::Tensor* src_slot_ids,
+                                   torch::Tensor* dst_slot_ids) {
+  std::vector<int32_t> src_slots;
+  std::vector<int32_t> dst_slots;
+  for (const auto* sequence : batch) {
+    const auto& blocks = sequence->blocks();
+    for (const auto& [src_pos, dst_pos] : sequence->kv_cache_moves()) {
+      src_slots.push_back(
+          cache_slots_for_pos(blocks, block_size, src_pos, src_pos + 1)[0]);
+      dst_slots.push_back(
+          cache_slots_for_pos(blocks, block_size, dst_pos, dst_pos + 1)[0]);
+    }
   }
-
-  *flatten_token_ids = torch::tensor(flatten_tokens_vec, torch::kInt);
-  *flatten_positions = torch::tensor(flatten_positions_vec, torch::kInt);
-  *seq_idxes = torch::tensor(seq_idxes_vec, torch::kInt);
-
-  input_params->num_prompt_tokens = num_total_tokens;
-  input_params->max_seq_len = max_seq_len;
-  // input_params->max_context_len = 0;
-  input_params->cu_seq_lens = torch::tensor(cu_seq_lens, torch::kInt);
-  input_params->slot_ids = torch::tensor(slot_ids, torch::kInt);
-  input_params->block_tables = block_tables_tensor;
-  // input_params->context_lens = torch::tensor({}, torch::kInt);
-  input_params->last_token_idxes = torch::tensor(last_token_idxes, torch::kInt);
-  input_params->token_ids = token_ids_tensor;
-  input_params->token_counts = token_counts_tensor;
-  input_params->token_ids_lens = torch::tensor(token_ids_lens_vec, torch::kInt);
-  */
+  *src_slot_ids = torch::tensor(src_slots, torch::kInt);
+  *dst_slot_ids = torch::tensor(dst_slots, torch::kInt);
 }
 
 }  // namespace llm
@@ -6,17 +6,21 @@
 
 #include "models/input_parameters.h"
 #include "request/sequence.h"
+#include "staging_arena.h"
 
 namespace llm {
 
 class Utils {
  public:
+  // input tensors are allocated from the arena so that they can be uploaded
+  // with a single copy, a temporary arena is used if not provided.
   static void prepare_inputs(const std::vector<Sequence*>& batch,
                              int32_t block_size,
                              torch::Tensor* flatten_token_ids,
                              torch::Tensor* flatten_positions,
                              InputParameters* input_params,
-                             SamplingParameters* sampling_params);
+                             SamplingParameters* sampling_params,
+                             StagingArena* arena = nullptr);
 
   static void prepare_profile_inputs(int64_t max_num_tokens,
                                      int64_t max_num_seqs,
@@ -31,6 +35,32 @@ class Utils {
                                       torch::Tensor* seq_idxes,
                                       InputParameters* input_params,
                                       SamplingParameters* sampling_params);
+
+  // prepare inputs to score the prompts of prefill only sequences. each token
+  // but the last one of a sequence has a row in last_token_idxes, and the
+  // token following it is the target to score. no cache slots are assigned,
+  // so the kv cache is not written.
+  // target_token_ids: [num_rows] LongTensor
+  static void prepare_score_inputs(const std::vector<Sequence*>& batch,
+                                   torch::Tensor* flatten_token_ids,
+                                   torch::Tensor* flatten_positions,
+                                   torch::Tensor* target_token_ids,
+                                   InputParameters* input_params);
+
+  // prepare cache slots for decode steps after the first one. the i-th row
+  // holds the slots of the tokens sampled by the i-th step.
+  // cache_slots: [num_steps - 1, num_seqs] IntTensor
+  static void prepare_multi_step_cache_slots(
+      const std::vector<Sequence*>& batch,
+      int32_t block_size,
+      int32_t num_steps,
+      torch::Tensor* cache_slots);
+
+  // collect the kv cache moves of accepted speculative tokens
+  static void prepare_kv_cache_moves(const std::vector<Sequence*>& batch,
+                                     int32_t block_size,
+                                     torch::Tensor* src_slot_ids,
+                                     torch::Tensor* dst_slot_ids);
 };
 
 }  // namespace llm
@@ -135,4 +135,287 @@ TEST(UtilsTest, Basic) {
   // clang-format on
 }
 
+TEST(UtilsTest, ValidateInputs) {
+  const int32_t block_size = 4;
+
+  SamplingParameter sampling_param;
+  StoppingCriteria stopping_criteria;
+
+  // seq in decode phase with two spec tokens
+  Sequence seq1(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{1, 2, 3, 4, 5},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq1.append_blocks({1, 2});
+  seq1.append_new_token_id(6);
+  seq1.append_spec_token_ids({7, 8});
+
+  // seq in prefill phase without spec tokens
+  Sequence seq2(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{1, 2, 3},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq2.append_blocks({3});
+
+  std::vector<Sequence*> batch = {&seq1, &seq2};
+
+  // define outputs
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  torch::Tensor seq_idxes;
+  InputParameters input_params;
+  SamplingParameters sampling_params;
+
+  Utils::prepare_validate_inputs(batch,
+                                 block_size,
+                                 &flatten_token_ids,
+                                 &flatten_positions,
+                                 &seq_idxes,
+                                 &input_params,
+                                 &sampling_params);
+
+  // clang-format off
+  const std::vector<int32_t> expcted_tokens = {
+      /*seq1*/ 6, 7, 8,
+      /*seq2*/ 1, 2, 3};
+  EXPECT_TRUE(equal(flatten_token_ids, expcted_tokens));
+
+  const std::vector<int32_t> expected_pos = {
+    /*seq1*/ 5, 6, 7,
+    /*seq2*/ 0, 1, 2};
+  EXPECT_TRUE(equal(flatten_positions, expected_pos));
+
+  EXPECT_FALSE(input_params.all_prefill_sequences);
+  EXPECT_EQ(input_params.num_sequences, 2);
+  EXPECT_EQ(input_params.q_max_seq_len, 3);
+  EXPECT_EQ(input_params.kv_max_seq_len, 8);
+
+  const std::vector<int32_t> q_cu_seq_lens = {0, 3, 6};
+  EXPECT_TRUE(equal(input_params.q_cu_seq_lens, q_cu_seq_lens));
+
+  const std::vector<int32_t> kv_cu_seq_lens = {0, 8, 11};
+  EXPECT_TRUE(equal(input_params.kv_cu_seq_lens, kv_cu_seq_lens));
+
+  const std::vector<int32_t> new_cache_slots = {
+    /*seq1*/ 9, 10, 11,
+    /*seq2*/ 12, 13, 14};
+  EXPECT_TRUE(equal(input_params.new_cache_slots, new_cache_slots));
+
+  // one row for the last token and each spec token
+  const std::vector<int32_t> last_token_idxes = {
+    /*seq1*/ 0, 1, 2,
+    /*seq2*/ 5};
+  EXPECT_TRUE(equal(input_params.last_token_idxes, last_token_idxes));
+
+  // rows of seq2 are padded with its last row
+  const std::vector<int64_t> expected_seq_idxes = {
+    /*seq1*/ 0, 1, 2,
+    /*seq2*/ 3, 3, 3};
+  EXPECT_TRUE(equal(seq_idxes, expected_seq_idxes));
+  EXPECT_EQ(seq_idxes.size(0), 2);
+
+  // spec tokens are counted only after being accepted
+  const std::vector<int32_t> token_ids_lens = {
+    /*seq1*/ 6, 7, 8,
+    /*seq2*/ 3};
+  EXPECT_TRUE(equal(input_params.token_ids_lens, token_ids_lens));
+  // clang-format on
+}
+
+TEST(UtilsTest, ValidateTreeInputs) {
+  const int32_t block_size = 4;
+
+  SamplingParameter sampling_param;
+  StoppingCriteria stopping_criteria;
+
+  // token tree: 6 -> 7 and 6 -> 8 -> 9
+  Sequence seq(sampling_param,
+               stopping_criteria,
+               /*token_ids=*/{1, 2, 3, 4, 5},
+               /*echo=*/false,
+               /*on_stream=*/nullptr);
+  seq.append_blocks({1, 2, 3});
+  seq.append_new_token_id(6);
+  seq.append_spec_token_tree({7, 8, 9}, {-1, -1, 1});
+
+  std::vector<Sequence*> batch = {&seq};
+
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  torch::Tensor seq_idxes;
+  InputParameters input_params;
+  SamplingParameters sampling_params;
+
+  Utils::prepare_validate_inputs(batch,
+                                 block_size,
+                                 &flatten_token_ids,
+                                 &flatten_positions,
+                                 &seq_idxes,
+                                 &input_params,
+                                 &sampling_params);
+
+  // clang-format off
+  const std::vector<int32_t> expcted_tokens = {6, 7, 8, 9};
+  EXPECT_TRUE(equal(flatten_token_ids, expcted_tokens));
+
+  // spec tokens are positioned by their depth
+  const std::vector<int32_t> expected_pos = {5, 6, 6, 7};
+  EXPECT_TRUE(equal(flatten_positions, expected_pos));
+
+  // kv cache are stored in order regardless of the tree structure
+  const std::vector<int32_t> new_cache_slots = {9, 10, 11, 12};
+  EXPECT_TRUE(equal(input_params.new_cache_slots, new_cache_slots));
+
+  const std::vector<int32_t> tree_mask = {
+    /*6*/ 1, 0, 0, 0,
+    /*7*/ 1, 1, 0, 0,
+    /*8*/ 1, 0, 1, 0,
+    /*9*/ 1, 0, 1, 1};
+  ASSERT_TRUE(input_params.tree_mask.defined());
+  EXPECT_TRUE(equal(input_params.tree_mask.to(torch::kInt), tree_mask));
+
+  const std::vector<int64_t> expected_seq_idxes = {0, 1, 2, 3};
+  EXPECT_TRUE(equal(seq_idxes, expected_seq_idxes));
+
+  // only tokens on the path are counted for each row
+  const std::vector<int32_t> token_ids_lens = {6, 7, 7, 8};
+  EXPECT_TRUE(equal(input_params.token_ids_lens, token_ids_lens));
+  // clang-format on
+}
+
+TEST(UtilsTest, MultiStepCacheSlots) {
+  const int32_t block_size = 4;
+
+  SamplingParameter sampling_param;
+  StoppingCriteria stopping_criteria;
+
+  Sequence seq1(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{1, 2, 3, 4, 5},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq1.append_blocks({1, 2});
+  seq1.append_new_token_id(6);
+
+  Sequence seq2(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{1, 2, 3},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq2.append_blocks({3, 4});
+  seq2.append_new_token_id(4);
+
+  std::vector<Sequence*> batch = {&seq1, &seq2};
+  torch::Tensor cache_slots;
+  Utils::prepare_multi_step_cache_slots(
+      batch, block_size, /*num_steps=*/3, &cache_slots);
+
+  // slots for the tokens sampled by step 1 and step 2
+  EXPECT_EQ(cache_slots.sizes(), torch::IntArrayRef({2, 2}));
+  const std::vector<int32_t> expected = {10, 16, 11, 17};
+  EXPECT_TRUE(equal(cache_slots, expected));
+}
+
+TEST(UtilsTest, ScoreInputs) {
+  SamplingParameter sampling_param;
+  StoppingCriteria stopping_criteria;
+  stopping_criteria.prefill_only = true;
+
+  Sequence seq1(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{1, 3, 5, 7},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  Sequence seq2(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{2, 4, 6},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+
+  std::vector<Sequence*> batch = {&seq1, &seq2};
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  torch::Tensor target_token_ids;
+  InputParameters input_params;
+  Utils::prepare_score_inputs(batch,
+                              &flatten_token_ids,
+                              &flatten_positions,
+                              &target_token_ids,
+                              &input_params);
+
+  const std::vector<int32_t> expected_tokens = {1, 3, 5, 7, 2, 4, 6};
+  EXPECT_TRUE(equal(flatten_token_ids, expected_tokens));
+  const std::vector<int32_t> expected_pos = {0, 1, 2, 3, 0, 1, 2};
+  EXPECT_TRUE(equal(flatten_positions, expected_pos));
+
+  // every token but the last one scores the token following it
+  const std::vector<int32_t> last_token_idxes = {0, 1, 2, 4, 5};
+  EXPECT_TRUE(equal(input_params.last_token_idxes, last_token_idxes));
+  const std::vector<int64_t> expected_targets = {3, 5, 7, 4, 6};
+  EXPECT_TRUE(equal(target_token_ids, expected_targets));
+
+  EXPECT_TRUE(input_params.all_prefill_sequences);
+  EXPECT_EQ(input_params.q_max_seq_len, 4);
+  const std::vector<int32_t> cu_seq_lens = {0, 4, 7};
+  EXPECT_TRUE(equal(input_params.q_cu_seq_lens, cu_seq_lens));
+  EXPECT_TRUE(equal(input_params.kv_cu_seq_lens, cu_seq_lens));
+  // no kv cache is written
+  EXPECT_FALSE(input_params.new_cache_slots.defined());
+  EXPECT_FALSE(input_params.block_tables.defined());
+}
+
+TEST(UtilsTest, LoRAIds) {
+  const int32_t block_size = 4;
+
+  SamplingParameter base_param;
+  SamplingParameter lora_param;
+  lora_param.lora_id = 2;
+  StoppingCriteria stopping_criteria;
+
+  // prefill sequence with the adapter
+  Sequence seq1(lora_param,
+                stopping_criteria,
+                /*token_ids=*/{1, 3, 5},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq1.append_blocks({1});
+
+  // decode sequence with the base model
+  Sequence seq2(base_param,
+                stopping_criteria,
+                /*token_ids=*/{2, 4},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq2.append_blocks({2});
+  seq2.append_new_token_id(6);
+
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  InputParameters input_params;
+  SamplingParameters sampling_params;
+  std::vector<Sequence*> batch = {&seq1, &seq2};
+  Utils::prepare_inputs(batch,
+                        block_size,
+                        &flatten_token_ids,
+                        &flatten_positions,
+                        &input_params,
+                        &sampling_params);
+  const std::vector<int32_t> expected_lora_ids = {2, 2, 2, -1};
+  EXPECT_TRUE(equal(input_params.lora_ids, expected_lora_ids));
+
+  // no lora ids without adapters
+  InputParameters base_params;
+  SamplingParameters base_sampling_params;
+  std::vector<Sequence*> base_batch = {&seq2};
+  Utils::prepare_inputs(base_batch,
+                        block_size,
+                        &flatten_token_ids,
+                        &flatten_positions,
+                        &base_params,
+                        &base_sampling_params);
+  EXPECT_FALSE(base_params.lora_ids.defined());
+}
+
 }  // namespace llm
@@ -1,25 +1,93 @@
 #include "worker.h"
 
+#include <ATen/cuda/CUDAEvent.h>
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
 #include <c10/core/Device.h>
 #include <c10/cuda/CUDAGuard.h>
+#include <c10/cuda/CUDAStream.h>
 #include <folly/Unit.h>
 #include <folly/futures/Future.h>
 #include <glog/logging.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <optional>
 #include <utility>
+#include <vector>
 
+#include "common/metrics.h"
+#include "common/tracer.h"
 #include "common/threadpool.h"
+#include "layers/lora.h"
+#include "layers/pooler.h"
 #include "memory/kv_cache.h"
 #include "memory/memory.h"
 #include "model_loader/state_dict.h"
 #include "models/input_parameters.h"
 #include "sampling/logits_processor.h"
 #include "sampling/sampler.h"
+#include "sampling/sampling_state.h"
+#include "staging_arena.h"
 
 namespace llm {
 
+DEFINE_HISTOGRAM(engine_forward_seconds,
+                 "Latency of the model forward pass per step in seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(engine_sampling_seconds,
+                 "Latency of logits processing and sampling per step in "
+                 "seconds",
+                 latency_buckets());
+
+namespace {
+
+// PhaseTimer measures consecutive phases of a step on the device. cuda events
+// are used for cuda devices so that timing doesn't add any sync to the step.
+class PhaseTimer final {
+ public:
+  explicit PhaseTimer(const torch::Device& device)
+      : use_events_(device.is_cuda()) {
+    mark();
+  }
+
+  // mark the end of the current phase and the start of the next one
+  void mark() {
+    if (use_events_) {
+      events_.emplace_back(cudaEventDefault);
+      events_.back().record();
+    } else {
+      times_.push_back(absl::Now());
+    }
+  }
+
+  // duration of each phase, waits for the device to reach the last mark
+  std::vector<absl::Duration> durations() {
+    std::vector<absl::Duration> durations;
+    if (use_events_) {
+      events_.back().synchronize();
+      for (size_t i = 1; i < events_.size(); ++i) {
+        durations.push_back(
+            absl::Milliseconds(events_[i - 1].elapsed_time(events_[i])));
+      }
+    } else {
+      for (size_t i = 1; i < times_.size(); ++i) {
+        durations.push_back(times_[i] - times_[i - 1]);
+      }
+    }
+    return durations;
+  }
+
+ private:
+  bool use_events_ = false;
+  std::vector<at::cuda::CUDAEvent> events_;
+  std::vector<absl::Time> times_;
+};
+
+}  // namespace
+
 Worker::Worker(const ParallelArgs& parallel_args, const torch::Device& device)
     : parallel_args_(parallel_args), device_(device) {}
 
@@ -28,16 +96,21 @@ bool Worker::init_model(torch::ScalarType dtype,
                         const QuantArgs& quant_args) {
   // initialize model
   args_ = args;
+  quant_args_ = quant_args;
   dtype_ = dtype;
   model_ = CausalLM::create(args, quant_args, parallel_args_, dtype_, device_);
   CHECK(model_ != nullptr) << "Failed to create model.";
+  sampling_states_.clear();
+  sampling_states_.push_back(std::make_unique<SamplingState>(dtype_, device_));
   return true;
 }
 
 bool Worker::init_kv_cache(const std::vector<int64_t>& kv_cache_shape) {
   CHECK(model_ != nullptr) << "Model is not initialized.";
-  // create a KVCache for each layer
-  const int64_t num_layers = args_.n_layers();
+  // create a KVCache for each layer owned by this pipeline stage
+  const auto [start_layer, end_layer] =
+      parallel_args_.layer_range(args_.n_layers());
+  const int64_t num_layers = end_layer - start_layer;
   kv_caches_.reserve(num_layers);
   for (int64_t i = 0; i < num_layers; ++i) {
     auto key_cache =
@@ -54,11 +127,103 @@ void Worker::load_state_dict(const StateDict& state_dict) {
   model_->load_state_dict(state_dict);
 }
 
+void Worker::set_lora_registry(const LoRARegistry* lora_registry) {
+  CHECK_GT(FLAGS_max_loras, 0) << "lora is disabled by --max_loras";
+  CHECK(model_ != nullptr) << "Model is not initialized.";
+  lora_registry_ = lora_registry;
+  lora_pool_ = std::make_unique<LoRAPool>(FLAGS_max_loras);
+  // slots are still empty in the pool, so the dry runs are overwritten later
+  for (size_t id = 0; id < lora_registry->size(); ++id) {
+    const auto& adapter = lora_registry->get(static_cast<int32_t>(id));
+    LOG(INFO) << "Checking lora adapter " << adapter.name;
+    LoRALoadGuard load_guard(/*slot=*/0, adapter.scaling);
+    model_->load_state_dict(*adapter.state_dict);
+  }
+}
+
+LoRABatch Worker::prepare_lora_batch(const torch::Tensor& lora_ids) {
+  LoRABatch batch;
+  if (!lora_ids.defined()) {
+    return batch;
+  }
+  CHECK(lora_registry_ != nullptr) << "lora adapters are not registered";
+
+  // tokens of each adapter, ordered by adapter id
+  std::map<int32_t, std::vector<int64_t>> adapter_tokens;
+  const int32_t* ids = lora_ids.data_ptr<int32_t>();
+  for (int64_t i = 0; i < lora_ids.numel(); ++i) {
+    if (ids[i] >= 0) {
+      adapter_tokens[ids[i]].push_back(i);
+    }
+  }
+
+  lora_pool_->begin_batch();
+  for (const auto& [lora_id, token_idxes] : adapter_tokens) {
+    const auto [slot, needs_load] = lora_pool_->acquire(lora_id);
+    if (needs_load) {
+      TraceSpan span("load_lora", "rank", parallel_args_.rank());
+      const auto& adapter = lora_registry_->get(lora_id);
+      // linear layers pick up lora weights into the slot under the guard
+      LoRALoadGuard load_guard(slot, adapter.scaling);
+      model_->load_state_dict(*adapter.state_dict);
+    }
+    batch.slots.push_back(slot);
+    batch.token_idxes.push_back(
+        torch::tensor(token_idxes, torch::kLong).to(device_));
+  }
+  return batch;
+}
+
 void Worker::verify_loaded_weights() const {
   CHECK(model_ != nullptr) << "Model is not initialized.";
   model_->verify_loaded_weights();
 }
 
+void Worker::stage_state_dict(const StateDict& state_dict) {
+  CHECK(model_ != nullptr) << "Model is not initialized.";
+  if (staged_model_ == nullptr) {
+    // the same model on cpu shards, fuses and converts weights just like the
+    // one on device, so that the swap is a plain copy of each tensor
+    staged_model_ = CausalLM::create(
+        args_, quant_args_, parallel_args_, dtype_, torch::kCPU);
+    CHECK(staged_model_ != nullptr) << "Failed to create model.";
+  }
+  staged_model_->load_state_dict(state_dict);
+}
+
+bool Worker::verify_staged_weights() const {
+  if (staged_model_ == nullptr) {
+    LOG(ERROR) << "No weights are staged.";
+    return false;
+  }
+  MissingWeightsGuard guard;
+  staged_model_->verify_loaded_weights();
+  for (const auto& name : guard.missing_weights()) {
+    LOG(ERROR) << "Staged weight is not loaded: " << name;
+  }
+  return guard.missing_weights().empty();
+}
+
+void Worker::swap_staged_weights() {
+  CHECK(model_ != nullptr) << "Model is not initialized.";
+  CHECK(staged_model_ != nullptr) << "No weights are staged.";
+
+  torch::NoGradGuard no_grad;
+  const auto staged_weights = staged_model_->named_weights();
+  for (const auto& item : model_->named_weights()) {
+    const auto* staged = staged_weights.find(item.key());
+    CHECK(staged != nullptr) << "Staged weight not found: " << item.key();
+    CHECK_EQ(item.value().sizes(), staged->sizes())
+        << "weight size mismatch for " << item.key();
+    // copy in place to keep the addresses of weights on device unchanged
+    item.value().copy_(*staged);
+  }
+  if (device_.is_cuda()) {
+    torch::cuda::synchronize(device_.index());
+  }
+  staged_model_.reset();
+}
+
 std::tuple<int64_t, int64_t> Worker::profile_device_memory(
     torch::Tensor flatten_tokens,     // [num_tokens]
     torch::Tensor flatten_positions,  // [num_tokens]
@@ -69,7 +234,15 @@ std::tuple<int64_t, int64_t> Worker::profile_device_memory(
   torch::DeviceGuard device_guard(device_);
 
   // initialize dummy kv caches for profiling
-  std::vector<KVCache> dummy_kv_caches(args_.n_layers());
+  const auto [start_layer, end_layer] =
+      parallel_args_.layer_range(args_.n_layers());
+  std::vector<KVCache> dummy_kv_caches(end_layer - start_layer);
+
+  // later pipeline stages take hidden states from the previous stage
+  if (!parallel_args_.is_first_stage()) {
+    flatten_tokens = torch::zeros({flatten_tokens.size(0), args_.hidden_size()},
+                                  torch::dtype(dtype_));
+  }
 
   // release all unocupied cached memory
   // torch::cuda::empty_cache();
@@ -94,39 +267,178 @@ OutputParameters Worker::execute_model(
     torch::Tensor flatten_tokens,     // [num_tokens]
     torch::Tensor flatten_positions,  // [num_tokens]
     const InputParameters& params,
-    const SamplingParameters& sampling_params) {
+    const SamplingParameters& sampling_params,
+    size_t micro_batch) {
+  TraceSpan span("worker_execute", "rank", parallel_args_.rank());
   torch::DeviceGuard device_guard(device_);
 
-  torch::Device input_device = flatten_tokens.device();
+  // tokens are hidden states from the previous device for the last pipeline
+  // stage, use positions to decide where to return the outputs.
+  torch::Device input_device = flatten_positions.device();
 
   // all tensors should be on the same device as model
-  flatten_tokens = flatten_tokens.to(device_);
-  flatten_positions = flatten_positions.to(device_);
-  InputParameters d_params = params.to(device_);
+  InputParameters d_params =
+      to_device(&flatten_tokens, &flatten_positions, params);
+
+  // group tokens by lora adapter for the linear layers
+  const LoRABatch lora_batch = prepare_lora_batch(params.lora_ids);
+  LoRABatchGuard lora_guard(&lora_batch);
+
+  // all ranks run the same step, only the first one records timings
+  std::optional<PhaseTimer> timer;
+  if (parallel_args_.rank() == 0) {
+    timer.emplace(device_);
+  }
 
   // call model forward and return the result
   auto logits =
       model_->forward(flatten_tokens, flatten_positions, kv_caches_, d_params);
+  if (timer) {
+    timer->mark();
+  }
 
-  // waits for all kernels in all streams to complete.
-  torch::cuda::synchronize();
-
-  // create and call logits processors
-  auto logits_processor =
-      LogitsProcessor::create(sampling_params, dtype_, device_);
+  // the span ends once the outputs are on host
+  std::optional<TraceSpan> sampling_span;
+  sampling_span.emplace("sampling", "rank", parallel_args_.rank());
+  // reuse logits processors and sampler if the batch is not changed
+  while (sampling_states_.size() <= micro_batch) {
+    sampling_states_.push_back(
+        std::make_unique<SamplingState>(dtype_, device_));
+  }
+  SamplingState* sampling_state = sampling_states_[micro_batch].get();
+  sampling_state->update(sampling_params);
   // apply logits processors to logits in-place
-  logits_processor->forward(logits,
-                            d_params.token_ids,
-                            d_params.token_counts,
-                            d_params.token_ids_lens);
-
-  // create and call sampler
-  auto sampler = std::make_unique<Sampler>(sampling_params, dtype_, device_);
-  auto next_tokens = sampler->forward(logits);
+  sampling_state->logits_processor().forward(logits,
+                                             d_params.token_ids,
+                                             d_params.token_counts,
+                                             d_params.token_ids_lens);
+  const auto& sampler = sampling_state->sampler();
 
   // prepare output parameters
   OutputParameters output_params;
-  output_params.next_tokens = next_tokens.to(input_device);
+  if (sampling_params.logprobs) {
+    // logprobs share the distribution computed for sampling
+    auto output =
+        sampler.forward_with_logprobs(logits, sampling_params.num_top_logprobs);
+    output_params.next_tokens = output.next_tokens;
+    output_params.next_logprobs = output.next_logprobs;
+    output_params.top_tokens = output.top_tokens;
+    output_params.top_logprobs = output.top_logprobs;
+  } else {
+    output_params.next_tokens = sampler.forward(logits);
+    if (sampling_params.num_top_logprobs > 0) {
+      auto [top_tokens, top_logprobs] =
+          Sampler::top_logprobs(logits, sampling_params.num_top_logprobs);
+      output_params.top_tokens = top_tokens;
+      output_params.top_logprobs = top_logprobs;
+    }
+  }
+  if (timer) {
+    timer->mark();
+  }
+  move_outputs(&output_params, input_device);
+  sampling_span.reset();
+
+  if (timer) {
+    // the outputs are ready on host, no extra wait for the device
+    const auto durations = timer->durations();
+    engine_forward_seconds.Observe(absl::ToDoubleSeconds(durations[0]));
+    engine_sampling_seconds.Observe(absl::ToDoubleSeconds(durations[1]));
+  }
+  return output_params;
+}
+
+torch::Tensor Worker::execute_stage(torch::Tensor inputs,
+                                    torch::Tensor flatten_positions,
+                                    const InputParameters& params) {
+  CHECK(!parallel_args_.is_last_stage())
+      << "The last pipeline stage should call execute_model";
+  torch::DeviceGuard device_guard(device_);
+
+  InputParameters d_params = to_device(&inputs, &flatten_positions, params);
+  const LoRABatch lora_batch = prepare_lora_batch(params.lora_ids);
+  LoRABatchGuard lora_guard(&lora_batch);
+  return model_->forward(inputs, flatten_positions, kv_caches_, d_params);
+}
+
+OutputParameters Worker::execute_model_multi_steps(
+    torch::Tensor flatten_tokens,     // [num_seqs]
+    torch::Tensor flatten_positions,  // [num_seqs]
+    const InputParameters& params,
+    const SamplingParameters& sampling_params,
+    torch::Tensor cache_slots,
+    int32_t num_steps) {
+  CHECK(!params.all_prefill_sequences) << "only decode batch is supported";
+  torch::DeviceGuard device_guard(device_);
+
+  torch::Device input_device = flatten_tokens.device();
+
+  // all tensors should be on the same device as model
+  InputParameters d_params =
+      to_device(&flatten_tokens, &flatten_positions, params);
+  cache_slots = cache_slots.to(device_);
+
+  // group tokens by lora adapter for the linear layers
+  const LoRABatch lora_batch = prepare_lora_batch(params.lora_ids);
+  LoRABatchGuard lora_guard(&lora_batch);
+
+  // sampling parameters don't change between steps
+  SamplingState* sampling_state = sampling_states_.front().get();
+  sampling_state->update(sampling_params);
+  const auto& logits_processor = sampling_state->logits_processor();
+  const auto& sampler = sampling_state->sampler();
+
+  // each sequence grows by one token per step: [0, 1, ..., num_seqs]
+  const auto kv_cu_seq_lens_step = torch::arange(
+      d_params.kv_cu_seq_lens.numel(), d_params.kv_cu_seq_lens.options());
+
+  std::vector<torch::Tensor> next_tokens_vec;
+  std::vector<torch::Tensor> next_logprobs_vec;
+  std::vector<torch::Tensor> top_tokens_vec;
+  std::vector<torch::Tensor> top_logprobs_vec;
+  next_tokens_vec.reserve(num_steps);
+  for (int32_t step = 0; step < num_steps; ++step) {
+    if (step > 0) {
+      // feed back the tokens sampled by previous step
+      flatten_tokens = next_tokens_vec.back().view({-1}).to(torch::kInt);
+      flatten_positions = flatten_positions + 1;
+      d_params.kv_cu_seq_lens = d_params.kv_cu_seq_lens + kv_cu_seq_lens_step;
+      d_params.kv_max_seq_len += 1;
+      d_params.new_cache_slots = cache_slots[step - 1];
+    }
+
+    auto logits = model_->forward(
+        flatten_tokens, flatten_positions, kv_caches_, d_params);
+    logits_processor.forward(logits,
+                             d_params.token_ids,
+                             d_params.token_counts,
+                             d_params.token_ids_lens);
+    if (!sampling_params.logprobs) {
+      next_tokens_vec.push_back(sampler.forward(logits));
+      continue;
+    }
+    auto output =
+        sampler.forward_with_logprobs(logits, sampling_params.num_top_logprobs);
+    next_tokens_vec.push_back(output.next_tokens);
+    next_logprobs_vec.push_back(output.next_logprobs);
+    if (output.top_tokens.defined()) {
+      top_tokens_vec.push_back(output.top_tokens);
+      top_logprobs_vec.push_back(output.top_logprobs);
+    }
+  }
+
+  // [num_seqs, num_steps]
+  OutputParameters output_params;
+  output_params.next_tokens = torch::cat(next_tokens_vec, /*dim=*/1);
+  if (!next_logprobs_vec.empty()) {
+    output_params.next_logprobs = torch::stack(next_logprobs_vec, /*dim=*/1);
+  }
+  // [num_seqs, num_steps, num_top_logprobs]
+  if (!top_tokens_vec.empty()) {
+    output_params.top_tokens = torch::stack(top_tokens_vec, /*dim=*/1);
+    output_params.top_logprobs = torch::stack(top_logprobs_vec, /*dim=*/1);
+  }
+  move_outputs(&output_params, input_device);
   return output_params;
 }
 
@@ -138,9 +450,10 @@ OutputParameters Worker::validate(torch::Tensor flatten_tokens,
 
   torch::Device input_device = flatten_tokens.device();
 
-  flatten_tokens = flatten_tokens.to(device_);
-  flatten_positions = flatten_positions.to(device_);
-  InputParameters d_params = params.to(device_);
+  InputParameters d_params =
+      to_device(&flatten_tokens, &flatten_positions, params);
+  const LoRABatch lora_batch = prepare_lora_batch(params.lora_ids);
+  LoRABatchGuard lora_guard(&lora_batch);
 
   auto logits =
       model_->forward(flatten_tokens, flatten_positions, kv_caches_, d_params);
@@ -148,20 +461,195 @@ OutputParameters Worker::validate(torch::Tensor flatten_tokens,
   auto logits_processor =
       LogitsProcessor::create(sampling_params, dtype_, device_);
 
-  // TODO: need to support validate multiple speculative steps
+  // each row has its own token ids and counts
   logits_processor->forward(logits,
                             d_params.token_ids,
                             d_params.token_counts,
                             d_params.token_ids_lens);
 
   auto sampler = std::make_unique<Sampler>(sampling_params, dtype_, device_);
-  auto next_tokens = sampler->forward(logits);
 
   OutputParameters output_params;
-  output_params.next_tokens = next_tokens.to(input_device);
+  if (sampling_params.logprobs) {
+    auto output = sampler->forward_with_logprobs(
+        logits, sampling_params.num_top_logprobs);
+    output_params.next_tokens = output.next_tokens;
+    output_params.next_logprobs = output.next_logprobs;
+    output_params.top_tokens = output.top_tokens;
+    output_params.top_logprobs = output.top_logprobs;
+  } else {
+    output_params.next_tokens = sampler->forward(logits);
+  }
+  move_outputs(&output_params, input_device);
+  return output_params;
+}
+
+OutputParameters Worker::score(torch::Tensor flatten_tokens,
+                               torch::Tensor flatten_positions,
+                               const InputParameters& params,
+                               torch::Tensor target_tokens,
+                               int64_t num_top_logprobs) {
+  TraceSpan span("worker_score", "rank", parallel_args_.rank());
+  torch::DeviceGuard device_guard(device_);
+
+  torch::Device input_device = flatten_tokens.device();
+
+  InputParameters d_params =
+      to_device(&flatten_tokens, &flatten_positions, params);
+  const LoRABatch lora_batch = prepare_lora_batch(params.lora_ids);
+  LoRABatchGuard lora_guard(&lora_batch);
+
+  auto logits =
+      model_->forward(flatten_tokens, flatten_positions, kv_caches_, d_params);
+
+  // only the logprobs of targets and top tokens are copied back
+  target_tokens = target_tokens.to(device_);
+  auto output = Sampler::score(logits, target_tokens, num_top_logprobs);
+  OutputParameters output_params;
+  output_params.next_tokens = output.next_tokens;
+  output_params.next_logprobs = output.next_logprobs;
+  output_params.top_tokens = output.top_tokens;
+  output_params.top_logprobs = output.top_logprobs;
+  move_outputs(&output_params, input_device);
+  return output_params;
+}
+
+OutputParameters Worker::embed(torch::Tensor flatten_tokens,
+                               torch::Tensor flatten_positions,
+                               const InputParameters& params,
+                               torch::Tensor use_mean,
+                               torch::Tensor normalize) {
+  TraceSpan span("worker_embed", "rank", parallel_args_.rank());
+  torch::DeviceGuard device_guard(device_);
+
+  torch::Device input_device = flatten_tokens.device();
+
+  InputParameters d_params =
+      to_device(&flatten_tokens, &flatten_positions, params);
+  const LoRABatch lora_batch = prepare_lora_batch(params.lora_ids);
+  LoRABatchGuard lora_guard(&lora_batch);
+
+  auto hidden_states = model_->hidden_states(
+      flatten_tokens, flatten_positions, kv_caches_, d_params);
+
+  // pool on the device so that only [num_seqs, hidden_size] is copied back
+  OutputParameters output_params;
+  output_params.embeddings = Pooler::forward(hidden_states,
+                                             d_params.q_cu_seq_lens,
+                                             use_mean.to(device_),
+                                             normalize.to(device_));
+  move_outputs(&output_params, input_device);
   return output_params;
 }
 
+void Worker::move_outputs(OutputParameters* output_params,
+                          const torch::Device& device) {
+  bool has_async_copy = false;
+  const auto move = [&](torch::Tensor& tensor) {
+    if (!tensor.defined() || tensor.device() == device) {
+      return;
+    }
+    if (device.is_cpu() && tensor.is_cuda()) {
+      // queue the copy into pinned memory after the sampling kernels
+      auto host = torch::empty(
+          tensor.sizes(),
+          tensor.options().device(torch::kCPU).pinned_memory(true));
+      host.copy_(tensor, /*non_blocking=*/true);
+      tensor = host;
+      has_async_copy = true;
+      return;
+    }
+    tensor = tensor.to(device);
+  };
+  move(output_params->next_tokens);
+  move(output_params->top_tokens);
+  move(output_params->top_logprobs);
+  move(output_params->next_logprobs);
+  move(output_params->embeddings);
+
+  if (has_async_copy) {
+    // the only sync of a step: kernels on the current stream are ordered, so
+    // waiting for the copies is enough to read the outputs on host.
+    c10::cuda::getCurrentCUDAStream(device_.index()).synchronize();
+  }
+}
+
+InputParameters Worker::to_device(torch::Tensor* flatten_tokens,
+                                  torch::Tensor* flatten_positions,
+                                  const InputParameters& params) {
+  const auto& host_buffer = params.staging_buffer;
+  if (!host_buffer.defined() || host_buffer.device() == device_) {
+    *flatten_tokens = flatten_tokens->to(device_);
+    *flatten_positions = flatten_positions->to(device_);
+    return params.to(device_);
+  }
+
+  const int64_t num_bytes = host_buffer.numel();
+  const int64_t capacity =
+      staging_buffer_.defined() ? staging_buffer_.numel() : 0;
+  if (num_bytes > capacity) {
+    staging_buffer_ =
+        torch::empty({std::max(num_bytes, capacity * 2)},
+                     torch::dtype(torch::kUInt8).device(device_));
+  }
+  // one async copy for all inputs, the pinned host buffer is reused after
+  // the step is done.
+  auto device_buffer = staging_buffer_.slice(/*dim=*/0, 0, num_bytes);
+  device_buffer.copy_(host_buffer, /*non_blocking=*/true);
+
+  const auto rebase = [&](const torch::Tensor& t) {
+    return StagingArena::rebase(t, host_buffer, device_buffer);
+  };
+  *flatten_tokens = rebase(*flatten_tokens);
+  *flatten_positions = rebase(*flatten_positions);
+  return params.map(rebase);
+}
+
+void Worker::copy_kv_cache(const torch::Tensor& src_slot_ids,
+                           const torch::Tensor& dst_slot_ids) {
+  torch::DeviceGuard device_guard(device_);
+  const auto d_src_slot_ids = src_slot_ids.to(device_);
+  const auto d_dst_slot_ids = dst_slot_ids.to(device_);
+  for (auto& kv_cache : kv_caches_) {
+    kv_cache.copy_kv_cache(d_src_slot_ids, d_dst_slot_ids);
+  }
+}
+
+torch::Tensor Worker::get_kv_blocks(const torch::Tensor& block_ids) {
+  torch::DeviceGuard device_guard(device_);
+  const auto d_block_ids = block_ids.to(device_);
+  std::vector<torch::Tensor> kv_blocks;
+  kv_blocks.reserve(kv_caches_.size());
+  for (const auto& kv_cache : kv_caches_) {
+    auto [keys, values] = kv_cache.get_kv_blocks(d_block_ids);
+    kv_blocks.push_back(torch::stack({keys, values}));
+  }
+  return torch::stack(kv_blocks).cpu();
+}
+
+bool Worker::can_set_kv_blocks(const torch::Tensor& kv_blocks) const {
+  // [num_layers, 2, num_blocks, block_size, num_kv_heads, head_dim]
+  if (kv_caches_.empty() || !kv_blocks.defined() || kv_blocks.dim() != 6 ||
+      kv_blocks.size(0) != static_cast<int64_t>(kv_caches_.size())) {
+    return false;
+  }
+  // [num_blocks, block_size, num_kv_heads, head_dim]
+  const auto key_cache = std::get<0>(kv_caches_.front().get_kv_cache());
+  return kv_blocks.sizes().slice(3) == key_cache.sizes().slice(1);
+}
+
+void Worker::set_kv_blocks(const torch::Tensor& block_ids,
+                           const torch::Tensor& kv_blocks) {
+  CHECK_EQ(kv_blocks.size(0), kv_caches_.size()) << "num_layers mismatch";
+  torch::DeviceGuard device_guard(device_);
+  const auto d_block_ids = block_ids.to(device_);
+  const auto d_kv_blocks = kv_blocks.to(device_);
+  for (size_t i = 0; i < kv_caches_.size(); ++i) {
+    const auto layer_blocks = d_kv_blocks[static_cast<int64_t>(i)];
+    kv_caches_[i].set_kv_blocks(d_block_ids, layer_blocks[0], layer_blocks[1]);
+  }
+}
+
 folly::SemiFuture<std::tuple<int64_t, int64_t>>
 Worker::profile_device_memory_async(
     torch::Tensor flatten_tokens,     // [num_tokens]
@@ -181,47 +669,6 @@ Worker::profile_device_memory_async(
   return future;
 }
 
-folly::SemiFuture<OutputParameters> Worker::execute_model_async(
-    torch::Tensor flatten_tokens,     // [num_tokens]
-    torch::Tensor flatten_positions,  // [num_tokens]
-    const InputParameters& params,
-    const SamplingParameters& sampling_params) {
-  folly::Promise<OutputParameters> promise;
-  auto future = promise.getSemiFuture();
-  threadpool_.schedule([this,
-                        tokens = flatten_tokens,
-                        positions = flatten_positions,
-                        parameters = params,
-                        sampling_params = sampling_params,
-                        promise = std::move(promise)]() mutable {
-    // run the model on the given input in working thread
-    const auto output =
-        this->execute_model(tokens, positions, parameters, sampling_params);
-    promise.setValue(output);
-  });
-  return future;
-}
-
-folly::SemiFuture<OutputParameters> Worker::validate_async(
-    torch::Tensor flatten_tokens,
-    torch::Tensor flatten_positions,
-    const InputParameters& params,
-    const SamplingParameters& sampling_params) {
-  folly::Promise<OutputParameters> promise;
-  auto future = promise.getSemiFuture();
-  threadpool_.schedule([this,
-                        tokens = flatten_tokens,
-                        positions = flatten_positions,
-                        parameters = params,
-                        sampling_params = sampling_params,
-                        promise = std::move(promise)]() mutable {
-    const auto output =
-        this->validate(tokens, positions, parameters, sampling_params);
-    promise.setValue(output);
-  });
-  return future;
-}
-
 // initialize model, cache manager. async call
 folly::SemiFuture<bool> Worker::init_model_async(torch::ScalarType dtype,
                                                  const ModelArgs& args,
@@ -264,4 +711,16 @@ folly::SemiFuture<folly::Unit> Worker::load_state_dict_async(
   return future;
 }
 
+folly::SemiFuture<folly::Unit> Worker::stage_state_dict_async(
+    const StateDict& state_dict) {
+  folly::Promise<folly::Unit> promise;
+  auto future = promise.getSemiFuture();
+  threadpool_.schedule(
+      [this, &state_dict, promise = std::move(promise)]() mutable {
+        this->stage_state_dict(state_dict);
+        promise.setValue();
+      });
+  return future;
+}
+
 }  // namespace llm
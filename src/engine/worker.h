@@ -4,12 +4,16 @@
 #include <torch/torch.h>
 
 #include "common/threadpool.h"
+#include "layers/lora.h"
+#include "lora_pool.h"
+#include "model_loader/lora_registry.h"
 #include "model_loader/state_dict.h"
 #include "model_parallel/parallel_args.h"
 #include "models/causal_lm.h"
 #include "models/input_parameters.h"
 #include "models/model_args.h"
 #include "quantization/quant_args.h"
+#include "sampling/sampling_state.h"
 
 namespace llm {
 
@@ -18,15 +22,42 @@ namespace llm {
 // to avoid transferring large tensors between host and device.
 struct OutputParameters {
   // rerang the next tokens and next logprob according to the seq_idx
+  // the output has the same shape as seq_idx
   void index_select(const torch::Tensor& seq_idx) {
-    next_tokens = next_tokens.index_select(/*dim=*/0, seq_idx);
-    // next_logprob = next_logprob.index_select(/*dim=*/0, seq_idx);
+    next_tokens = next_tokens.flatten()
+                      .index_select(/*dim=*/0, seq_idx.flatten())
+                      .view(seq_idx.sizes());
+    if (next_logprobs.defined()) {
+      next_logprobs = next_logprobs.flatten()
+                          .index_select(/*dim=*/0, seq_idx.flatten())
+                          .view(seq_idx.sizes());
+    }
+    if (top_tokens.defined()) {
+      // [num_rows, k] => [seq_idx.sizes(), k]
+      auto sizes = seq_idx.sizes().vec();
+      sizes.push_back(top_tokens.size(-1));
+      top_tokens =
+          top_tokens.index_select(/*dim=*/0, seq_idx.flatten()).view(sizes);
+      top_logprobs =
+          top_logprobs.index_select(/*dim=*/0, seq_idx.flatten()).view(sizes);
+    }
   }
   // [num_seq] LongTensor
   torch::Tensor next_tokens;
 
-  // [num_seq]
-  // torch::Tensor next_logprob;
+  // tokens with highest logprobs and their logprobs, only set when
+  // num_top_logprobs > 0 in sampling parameters.
+  // [num_seq, num_top_logprobs] LongTensor, FloatTensor
+  torch::Tensor top_tokens;
+  torch::Tensor top_logprobs;
+
+  // logprobs of the next tokens, only set when logprobs is true in sampling
+  // parameters. [num_seq] FloatTensor
+  torch::Tensor next_logprobs;
+
+  // pooled hidden states, only set for embedding.
+  // [num_seq, hidden_size] FloatTensor
+  torch::Tensor embeddings;
 };
 
 class Worker final {
@@ -47,6 +78,27 @@ class Worker final {
   // verify if the model is loaded correctly
   void verify_loaded_weights() const;
 
+  // load the model weights from state_dict into a copy of the model in host
+  // memory, the model on device keeps serving. blocking call
+  void stage_state_dict(const StateDict& state_dict);
+
+  // verify that all weights are staged, logs the missing ones instead of
+  // aborting. returns false if any weight is missing.
+  bool verify_staged_weights() const;
+
+  // copy the weights staged by stage_state_dict into the model in place and
+  // release the host copy. the staged weights should have been verified by
+  // verify_staged_weights. blocking call, should not run with other steps.
+  void swap_staged_weights();
+
+  // release the weights staged by stage_state_dict, if any
+  void clear_staged_weights() { staged_model_.reset(); }
+
+  // serve the lora adapters of the registry, which should outlive the
+  // worker. every adapter is loaded into a slot once to check its shapes and
+  // allocate the slots, then adapters are loaded into slots on demand.
+  void set_lora_registry(const LoRARegistry* lora_registry);
+
   // returns available memory and total memory
   std::tuple<int64_t, int64_t> profile_device_memory(
       torch::Tensor flatten_tokens,     // [num_tokens]
@@ -57,18 +109,82 @@ class Worker final {
   bool init_kv_cache(const std::vector<int64_t>& kv_cache_shape);
 
   // Run the model on the given input. blocking call
+  // micro_batch: index of the micro-batch for the last pipeline stage, each
+  // micro-batch reuses its own sampling state across steps
   OutputParameters execute_model(
       torch::Tensor flatten_tokens,     // [num_tokens]
       torch::Tensor flatten_positions,  // [num_tokens]
       const InputParameters& params,
-      const SamplingParameters& sampling_params);
+      const SamplingParameters& sampling_params,
+      size_t micro_batch = 0);
 
-  // TODO
+  // Run the layers of a pipeline stage other than the last one. blocking call
+  // inputs: [num_tokens] token ids for the first stage, otherwise hidden
+  // states from the previous stage with shape [num_tokens, hidden_size]
+  // returns hidden states on the device of the worker for the next stage
+  torch::Tensor execute_stage(torch::Tensor inputs,
+                              torch::Tensor flatten_positions,  // [num_tokens]
+                              const InputParameters& params);
+
+  // Run num_steps decode steps on a decode-only batch. tokens sampled by each
+  // step are fed back as the input of the next step without leaving the
+  // device. blocking call
+  // cache_slots: [num_steps - 1, num_seqs], slots for steps after the first
+  // returns next tokens with shape [num_seqs, num_steps]
+  OutputParameters execute_model_multi_steps(
+      torch::Tensor flatten_tokens,     // [num_seqs]
+      torch::Tensor flatten_positions,  // [num_seqs]
+      const InputParameters& params,
+      const SamplingParameters& sampling_params,
+      torch::Tensor cache_slots,
+      int32_t num_steps);
+
+  // Run the model on the given input and sample one token for each row in
+  // last_token_idxes. blocking call
   OutputParameters validate(torch::Tensor flatten_tokens,
                             torch::Tensor flatten_positions,
                             const InputParameters& params,
                             const SamplingParameters& sampling_params);
 
+  // Run the model on prompts without kv cache and return the logprobs of
+  // target tokens for each row in last_token_idxes. blocking call
+  // target_tokens: [num_rows] LongTensor
+  // returns next_logprobs with shape [num_rows], and top tokens with their
+  // logprobs if num_top_logprobs > 0
+  OutputParameters score(torch::Tensor flatten_tokens,
+                         torch::Tensor flatten_positions,
+                         const InputParameters& params,
+                         torch::Tensor target_tokens,
+                         int64_t num_top_logprobs);
+
+  // Run the model on prompts without kv cache and pool the final hidden states
+  // of each sequence into an embedding. blocking call
+  // use_mean, normalize: [num_seqs] BoolTensor, see Pooler
+  // returns embeddings with shape [num_seqs, hidden_size]
+  OutputParameters embed(torch::Tensor flatten_tokens,
+                         torch::Tensor flatten_positions,
+                         const InputParameters& params,
+                         torch::Tensor use_mean,
+                         torch::Tensor normalize);
+
+  // move kv cache from src slots to dst slots for all layers. blocking call
+  void copy_kv_cache(const torch::Tensor& src_slot_ids,
+                     const torch::Tensor& dst_slot_ids);
+
+  // gather kv cache blocks of all layers into host memory. blocking call
+  // block_ids: [num_blocks] LongTensor
+  // returns [num_layers, 2, num_blocks, block_size, num_kv_heads, head_dim]
+  torch::Tensor get_kv_blocks(const torch::Tensor& block_ids);
+
+  // whether kv cache blocks gathered by get_kv_blocks of another worker have
+  // the layers and the block shape of the kv cache of this worker
+  bool can_set_kv_blocks(const torch::Tensor& kv_blocks) const;
+
+  // overwrite kv cache blocks of all layers with blocks gathered by
+  // get_kv_blocks. blocking call
+  void set_kv_blocks(const torch::Tensor& block_ids,
+                     const torch::Tensor& kv_blocks);
+
   // initialize model, cache manager. async call
   folly::SemiFuture<bool> init_model_async(torch::ScalarType dtype,
                                            const ModelArgs& args,
@@ -79,6 +195,10 @@ class Worker final {
   folly::SemiFuture<folly::Unit> load_state_dict_async(
       const StateDict& state_dict);
 
+  // Load the model weights from state_dict into host memory. async call
+  folly::SemiFuture<folly::Unit> stage_state_dict_async(
+      const StateDict& state_dict);
+
   folly::SemiFuture<std::tuple<int64_t, int64_t>> profile_device_memory_async(
       torch::Tensor flatten_tokens,     // [num_tokens]
       torch::Tensor flatten_positions,  // [num_tokens]
@@ -88,23 +208,25 @@ class Worker final {
   folly::SemiFuture<bool> init_kv_cache_async(
       const std::vector<int64_t>& kv_cache_shape);
 
-  // Run the model on the given input. async call
-  // the future returns a successfull status with no meaningful value
-  folly::SemiFuture<OutputParameters> execute_model_async(
-      torch::Tensor flatten_tokens,     // [num_tokens]
-      torch::Tensor flatten_positions,  // [num_tokens]
-      const InputParameters& params,
-      const SamplingParameters& sampling_params);
-
-  folly::SemiFuture<OutputParameters> validate_async(
-      torch::Tensor flatten_tokens,
-      torch::Tensor flatten_positions,
-      const InputParameters& params,
-      const SamplingParameters& sampling_params);
-
   const torch::Device& device() const { return device_; }
 
  private:
+  // move inputs to the device of the worker. inputs staged in one host buffer
+  // are uploaded with a single copy into staging_buffer_.
+  InputParameters to_device(torch::Tensor* flatten_tokens,
+                            torch::Tensor* flatten_positions,
+                            const InputParameters& params);
+
+  // group tokens by the device slots of their lora adapters, loading the
+  // adapters missing from device. empty if no token uses lora.
+  // lora_ids: [num_tokens] IntTensor on host
+  LoRABatch prepare_lora_batch(const torch::Tensor& lora_ids);
+
+  // move outputs to the device of inputs. outputs for host are copied into
+  // pinned memory asynchronously and only the copies are waited for.
+  void move_outputs(OutputParameters* output_params,
+                    const torch::Device& device);
+
   // working thread
   ThreadPool threadpool_;
 
@@ -120,11 +242,31 @@ class Worker final {
   // model args
   ModelArgs args_;
 
+  // quantization args
+  QuantArgs quant_args_;
+
   // kv caches
   std::vector<llm::KVCache> kv_caches_;
 
+  // device buffer to receive staged inputs, grows as needed
+  // UInt8Tensor: [capacity]
+  torch::Tensor staging_buffer_;
+
   // model
   std::unique_ptr<CausalLM> model_;
+
+  // a copy of the model in host memory holding staged weights, if any
+  std::unique_ptr<CausalLM> staged_model_;
+
+  // logits processors and sampler reused across steps, one for each
+  // micro-batch of pipelined steps
+  std::vector<std::unique_ptr<SamplingState>> sampling_states_;
+
+  // lora adapters in host memory, nullptr if lora is not used
+  const LoRARegistry* lora_registry_ = nullptr;
+
+  // device slots of lora adapters
+  std::unique_ptr<LoRAPool> lora_pool_;
 };
 
 }  // namespace llm
@@ -2,10 +2,237 @@
 
 #include <gtest/gtest.h>
 
+#include "model_loader/state_dict.h"
+#include "request/sampling_parameter.h"
+#include "request/sequence.h"
+#include "request/stopping_criteria.h"
+#include "utils.h"
+
 namespace llm {
 
+namespace {
+
+constexpr int64_t kVocabSize = 64;
+constexpr int64_t kHiddenSize = 32;
+constexpr int64_t kIntermediateSize = 64;
+constexpr int64_t kNumLayers = 3;
+constexpr int64_t kNumHeads = 4;
+
+// args of a tiny llama model
+ModelArgs tiny_llama_args() {
+  ModelArgs args;
+  args.model_type("llama")
+      .vocab_size(kVocabSize)
+      .hidden_size(kHiddenSize)
+      .intermediate_size(kIntermediateSize)
+      .n_layers(kNumLayers)
+      .n_heads(kNumHeads)
+      .hidden_act("silu")
+      .rms_norm_eps(1e-5)
+      .rope_theta(10000.0f)
+      .rope_scaling(1.0f)
+      .max_position_embeddings(128);
+  return args;
+}
+
+// random weights of the tiny llama model with huggingface names
+std::unordered_map<std::string, torch::Tensor> tiny_llama_weights(
+    uint64_t seed) {
+  const int64_t vocab_size = kVocabSize;
+  const int64_t hidden_size = kHiddenSize;
+  const int64_t intermediate_size = kIntermediateSize;
+  const int64_t n_layers = kNumLayers;
+
+  torch::manual_seed(seed);
+  std::unordered_map<std::string, torch::Tensor> weights;
+  const auto add_weight = [&](const std::string& name,
+                              std::vector<int64_t> sizes) {
+    weights[name] = torch::randn(sizes) * 0.1;
+  };
+  add_weight("model.embed_tokens.weight", {vocab_size, hidden_size});
+  for (int64_t i = 0; i < n_layers; ++i) {
+    const std::string prefix = "model.layers." + std::to_string(i) + ".";
+    for (const auto* proj : {"q_proj", "k_proj", "v_proj", "o_proj"}) {
+      add_weight(prefix + "self_attn." + proj + ".weight",
+                 {hidden_size, hidden_size});
+    }
+    add_weight(prefix + "mlp.gate_proj.weight",
+               {intermediate_size, hidden_size});
+    add_weight(prefix + "mlp.up_proj.weight", {intermediate_size, hidden_size});
+    add_weight(prefix + "mlp.down_proj.weight",
+               {hidden_size, intermediate_size});
+    weights[prefix + "input_layernorm.weight"] = torch::ones({hidden_size});
+    weights[prefix + "post_attention_layernorm.weight"] =
+        torch::ones({hidden_size});
+  }
+  weights["model.norm.weight"] = torch::ones({hidden_size});
+  add_weight("lm_head.weight", {vocab_size, hidden_size});
+  return weights;
+}
+
+}  // namespace
+
 TEST(WorkerTest, Basic) {
   // TODO: add tests
 }
 
+TEST(WorkerTest, LayerRange) {
+  using Range = std::pair<int64_t, int64_t>;
+  ParallelArgs parallel_args(0, 1, nullptr);
+  EXPECT_EQ(parallel_args.layer_range(5), Range(0, 5));
+
+  // 5 layers into 3 stages: [0, 2), [2, 4), [4, 5)
+  parallel_args.pipeline_size(3);
+  parallel_args.pipeline_rank(0);
+  EXPECT_TRUE(parallel_args.is_first_stage());
+  EXPECT_FALSE(parallel_args.is_last_stage());
+  EXPECT_EQ(parallel_args.layer_range(5), Range(0, 2));
+  parallel_args.pipeline_rank(1);
+  EXPECT_EQ(parallel_args.layer_range(5), Range(2, 4));
+  parallel_args.pipeline_rank(2);
+  EXPECT_TRUE(parallel_args.is_last_stage());
+  EXPECT_EQ(parallel_args.layer_range(5), Range(4, 5));
+}
+
+TEST(WorkerTest, PipelineStages) {
+  const int64_t hidden_size = kHiddenSize;
+  const int64_t n_heads = kNumHeads;
+  const int64_t head_dim = hidden_size / n_heads;
+  const int32_t block_size = 4;
+  const int64_t n_blocks = 8;
+
+  const ModelArgs args = tiny_llama_args();
+  const auto weights = tiny_llama_weights(/*seed=*/0);
+  const StateDict state_dict(weights, /*shard_id=*/0, /*num_shards=*/1);
+
+  const std::vector<int64_t> kv_cache_shape = {
+      n_blocks, block_size, n_heads, head_dim};
+  const auto create_worker = [&](int32_t pipeline_rank,
+                                 int32_t pipeline_size) {
+    ParallelArgs parallel_args(0, 1, nullptr);
+    parallel_args.pipeline_rank(pipeline_rank).pipeline_size(pipeline_size);
+    auto worker = std::make_unique<Worker>(parallel_args, torch::kCPU);
+    EXPECT_TRUE(worker->init_model(torch::kFloat, args, QuantArgs()));
+    worker->load_state_dict(state_dict);
+    worker->verify_loaded_weights();
+    EXPECT_TRUE(worker->init_kv_cache(kv_cache_shape));
+    return worker;
+  };
+  auto full = create_worker(0, 1);
+  auto stage0 = create_worker(0, 2);
+  auto stage1 = create_worker(1, 2);
+
+  // greedy sampling
+  SamplingParameter sampling_param;
+  sampling_param.temperature = 0;
+  StoppingCriteria stopping_criteria;
+  Sequence seq1(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{1, 3, 5, 7, 5, 4, 3, 2, 1},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq1.append_blocks({1, 2, 3});
+  Sequence seq2(sampling_param,
+                stopping_criteria,
+                /*token_ids=*/{2, 4, 6, 8},
+                /*echo=*/false,
+                /*on_stream=*/nullptr);
+  seq2.append_blocks({4});
+  std::vector<Sequence*> batch = {&seq1, &seq2};
+
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  InputParameters input_params;
+  SamplingParameters sampling_params;
+  Utils::prepare_inputs(batch,
+                        block_size,
+                        &flatten_token_ids,
+                        &flatten_positions,
+                        &input_params,
+                        &sampling_params);
+
+  const auto expected = full->execute_model(
+      flatten_token_ids, flatten_positions, input_params, sampling_params);
+
+  // the first stage returns hidden states for all tokens
+  auto hidden_states =
+      stage0->execute_stage(flatten_token_ids, flatten_positions, input_params);
+  EXPECT_EQ(hidden_states.sizes().vec(),
+            std::vector<int64_t>({flatten_token_ids.size(0), hidden_size}));
+  const auto output = stage1->execute_model(
+      hidden_states, flatten_positions, input_params, sampling_params);
+  EXPECT_TRUE(torch::equal(output.next_tokens, expected.next_tokens));
+}
+
+TEST(WorkerTest, SwapStagedWeights) {
+  const int64_t head_dim = kHiddenSize / kNumHeads;
+  const int32_t block_size = 4;
+  const std::vector<int64_t> kv_cache_shape = {
+      /*n_blocks=*/4, block_size, kNumHeads, head_dim};
+
+  const ModelArgs args = tiny_llama_args();
+  const StateDict old_state_dict(
+      tiny_llama_weights(/*seed=*/0), /*shard_id=*/0, /*num_shards=*/1);
+  const StateDict new_state_dict(
+      tiny_llama_weights(/*seed=*/1), /*shard_id=*/0, /*num_shards=*/1);
+  const auto create_worker = [&](const StateDict& state_dict) {
+    auto worker =
+        std::make_unique<Worker>(ParallelArgs(0, 1, nullptr), torch::kCPU);
+    EXPECT_TRUE(worker->init_model(torch::kFloat, args, QuantArgs()));
+    worker->load_state_dict(state_dict);
+    worker->verify_loaded_weights();
+    EXPECT_TRUE(worker->init_kv_cache(kv_cache_shape));
+    return worker;
+  };
+  auto worker = create_worker(old_state_dict);
+  auto expected_worker = create_worker(new_state_dict);
+
+  // greedy sampling with logprobs
+  SamplingParameter sampling_param;
+  sampling_param.temperature = 0;
+  sampling_param.logprobs = true;
+  StoppingCriteria stopping_criteria;
+  Sequence seq(sampling_param,
+               stopping_criteria,
+               /*token_ids=*/{1, 3, 5, 7, 5, 4},
+               /*echo=*/false,
+               /*on_stream=*/nullptr);
+  seq.append_blocks({1, 2});
+  std::vector<Sequence*> batch = {&seq};
+
+  torch::Tensor flatten_token_ids;
+  torch::Tensor flatten_positions;
+  InputParameters input_params;
+  SamplingParameters sampling_params;
+  Utils::prepare_inputs(batch,
+                        block_size,
+                        &flatten_token_ids,
+                        &flatten_positions,
+                        &input_params,
+                        &sampling_params);
+  const auto run = [&](Worker* worker) {
+    return worker->execute_model(
+        flatten_token_ids, flatten_positions, input_params, sampling_params);
+  };
+  const auto expected = run(expected_worker.get());
+  EXPECT_FALSE(
+      torch::allclose(run(worker.get()).next_logprobs, expected.next_logprobs));
+
+  // the staged weights don't change the model until they are swapped in
+  worker->stage_state_dict(new_state_dict);
+  EXPECT_FALSE(
+      torch::allclose(run(worker.get()).next_logprobs, expected.next_logprobs));
+  worker->swap_staged_weights();
+  EXPECT_TRUE(
+      torch::allclose(run(worker.get()).next_logprobs, expected.next_logprobs));
+
+  // weights can be swapped again, including the fused ones
+  worker->stage_state_dict(old_state_dict);
+  worker->swap_staged_weights();
+  worker->stage_state_dict(new_state_dict);
+  worker->swap_staged_weights();
+  EXPECT_TRUE(
+      torch::allclose(run(worker.get()).next_logprobs, expected.next_logprobs));
+}
+
 }  // namespace llm
@@ -1,5 +1,7 @@
 #include "chat_handler.h"
 
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
 #include <glog/logging.h>
 #include <grpcpp/grpcpp.h>
 #include <torch/torch.h>
@@ -91,6 +93,15 @@ bool verify_request_arguments(ChatCallData* call_data) {
       return false;
     }
   }
+  // prompt_lookup_num_tokens <= 10
+  if (request.has_prompt_lookup_num_tokens()) {
+    if (request.prompt_lookup_num_tokens() > 10) {
+      call_data->finish_with_error(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "prompt_lookup_num_tokens must be between 0 and 10");
+      return false;
+    }
+  }
   return true;
 }
 
@@ -151,6 +162,12 @@ bool send_result_to_client(ChatCallData* call_data,
   usage->set_completion_tokens(
       static_cast<int32_t>(stats.num_generated_tokens));
   usage->set_total_tokens(static_cast<int32_t>(stats.num_total_tokens));
+  usage->set_queue_time_ms(static_cast<float>(stats.queue_time_ms));
+  usage->set_time_to_first_token_ms(
+      static_cast<float>(stats.time_to_first_token_ms));
+  usage->set_time_per_output_token_ms(
+      static_cast<float>(stats.time_per_output_token_ms));
+  usage->set_num_preemptions(static_cast<int32_t>(stats.num_preemptions));
 
   // TODO: combine write and finish
   call_data->write(response);
@@ -159,10 +176,12 @@ bool send_result_to_client(ChatCallData* call_data,
 }
 
 // NOLINTNEXTLINE(readability-function-cognitive-complexity)
-std::unique_ptr<Request> grpc_request_to_request(ChatCallData* call_data,
-                                                 ChatTemplate* chat_template,
-                                                 const Tokenizer& tokenizer,
-                                                 const ModelArgs& model_args) {
+std::unique_ptr<Request> grpc_request_to_request(
+    ChatCallData* call_data,
+    ChatTemplate* chat_template,
+    const Tokenizer& tokenizer,
+    const ModelArgs& model_args,
+    const LoRARegistry* lora_registry) {
   const ChatRequest& grpc_request = call_data->request();
   const int64_t max_context_len = model_args.max_position_embeddings();
 
@@ -215,6 +234,14 @@ std::unique_ptr<Request> grpc_request_to_request(ChatCallData* call_data,
   if (grpc_request.has_top_p()) {
     sampling_param.top_p = grpc_request.top_p();
   }
+  if (grpc_request.has_prompt_lookup_num_tokens()) {
+    sampling_param.prompt_lookup_num_tokens =
+        grpc_request.prompt_lookup_num_tokens();
+  }
+  // the model selects a lora adapter by its name, the base model otherwise
+  if (lora_registry != nullptr) {
+    sampling_param.lora_id = lora_registry->find(grpc_request.model());
+  }
   // TODO: add support for following extended parameters
   // sampling_param.repetition_penalty = grpc_request.repetition_penalty();
   // sampling_param.top_k = grpc_request.top_k();
@@ -311,6 +338,7 @@ ChatHandler::ChatHandler(Scheduler* scheduler, const Engine* engine)
   CHECK(scheduler_ != nullptr);
   tokenizer_ = engine->tokenizer();
   model_args_ = engine->model_args();
+  lora_registry_ = engine->lora_registry();
 
   // construct chat template
   auto factory = ModelRegistry::get_default_chat_template_factory(
@@ -331,17 +359,23 @@ ChatHandler::ChatHandler(Scheduler* scheduler, const Engine* engine)
 }
 
 void ChatHandler::chat_async(ChatCallData* call_data) {
-  converter_threadpool_.schedule([this, call_data = call_data]() {
+  // the request may wait for the converter thread, count it as queue time
+  const absl::Time arrival = absl::Now();
+  converter_threadpool_.schedule([this, call_data = call_data, arrival]() {
     if (!verify_request_arguments(call_data)) {
       // request is not valid, finish with error
       return;
     }
 
-    auto request = grpc_request_to_request(
-        call_data, chat_template_.get(), *tokenizer_, model_args_);
+    auto request = grpc_request_to_request(call_data,
+                                           chat_template_.get(),
+                                           *tokenizer_,
+                                           model_args_,
+                                           lora_registry_);
     if (request == nullptr) {
       return;
     }
+    request->timeline.arrival = arrival;
 
     // schedule the request
     if (!scheduler_->schedule(request)) {
@@ -36,6 +36,9 @@ class ChatHandler final {
   // model args
   ModelArgs model_args_;
 
+  // lora adapters selected by the model of requests, nullptr if none
+  const LoRARegistry* lora_registry_ = nullptr;
+
   // converter threadpool
   ThreadPool converter_threadpool_;
 };
@@ -1,5 +1,7 @@
 #include "completion_handler.h"
 
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
 #include <glog/logging.h>
 #include <grpcpp/grpcpp.h>
 #include <torch/torch.h>
@@ -16,12 +18,15 @@ namespace llm {
 
 namespace {
 
+// maximum number of beams for beam search
+constexpr uint32_t kMaxBeamWidth = 16;
+
 std::string generate_request_id() {
   return "cmpl-" + uuids::to_string(uuids::uuid_system_generator{}());
 }
 
 // NOLINTNEXTLINE(readability-function-cognitive-complexity)
-bool verify_request_arguments(CompletionCallData* call_data) {
+bool verify_request_arguments(CompletionCallData* call_data, bool pipelined) {
   const auto& request = call_data->request();
   // n is not implemented yet for stream request
   const bool stream = request.has_stream() ? request.stream() : false;
@@ -32,12 +37,42 @@ bool verify_request_arguments(CompletionCallData* call_data) {
     return false;
   }
 
-  if (request.has_best_of() && request.best_of() != n) {
+  const bool use_beam_search =
+      request.has_use_beam_search() ? request.use_beam_search() : false;
+  if (use_beam_search) {
+    if (stream) {
+      call_data->finish_with_error(grpc::StatusCode::INVALID_ARGUMENT,
+                                   "stream is not supported by beam search");
+      return false;
+    }
+    const uint32_t beam_width = request.has_best_of() ? request.best_of() : n;
+    if (beam_width == 0 || beam_width > kMaxBeamWidth) {
+      call_data->finish_with_error(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "best_of must be between 1 and 16 for beam search");
+      return false;
+    }
+  } else if (request.has_best_of() && request.best_of() != n) {
     call_data->finish_with_error(grpc::StatusCode::UNIMPLEMENTED,
                                  "best_of != n is not supported yet");
     return false;
   }
 
+  // scoring the prompt returns one result
+  const bool score_only = request.has_max_tokens() && request.max_tokens() == 0;
+  if (score_only && (n > 1 || use_beam_search)) {
+    call_data->finish_with_error(
+        grpc::StatusCode::INVALID_ARGUMENT,
+        "n > 1 and beam search are not supported with max_tokens = 0");
+    return false;
+  }
+  if (score_only && pipelined) {
+    call_data->finish_with_error(
+        grpc::StatusCode::UNIMPLEMENTED,
+        "max_tokens = 0 is not supported with pipeline parallelism");
+    return false;
+  }
+
   // prompt is required
   if (request.prompt().empty()) {
     call_data->finish_with_error(grpc::StatusCode::INVALID_ARGUMENT,
@@ -102,6 +137,15 @@ bool verify_request_arguments(CompletionCallData* call_data) {
       return false;
     }
   }
+  // prompt_lookup_num_tokens <= 10
+  if (request.has_prompt_lookup_num_tokens()) {
+    if (request.prompt_lookup_num_tokens() > 10) {
+      call_data->finish_with_error(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "prompt_lookup_num_tokens must be between 0 and 10");
+      return false;
+    }
+  }
   return true;
 }
 
@@ -126,6 +170,7 @@ bool send_delta_to_client(CompletionCallData* call_data,
 
 bool send_result_to_client(CompletionCallData* call_data,
                            Request* request,
+                           const Tokenizer& tokenizer,
                            const std::vector<SequenceResult>& seq_results,
                            const Status& /*status*/,
                            const Statistics& stats) {
@@ -141,7 +186,19 @@ bool send_result_to_client(CompletionCallData* call_data,
     auto* choice = response.add_choices();
     choice->set_index(i);
     choice->set_text(seq_result.output_text);
-    // choice->set_logprobs(0);
+    if (request->sampling_param.logprobs) {
+      auto* logprobs = choice->mutable_logprobs();
+      for (const auto& logprob : seq_result.logprobs) {
+        logprobs->add_tokens(tokenizer.decode({logprob.token_id}));
+        logprobs->add_token_logprobs(logprob.logprob);
+        if (request->sampling_param.top_logprobs > 0) {
+          auto* top = logprobs->add_top_logprobs()->mutable_logprobs();
+          for (const auto& [token_id, value] : logprob.top_logprobs) {
+            (*top)[tokenizer.decode({token_id})] = value;
+          }
+        }
+      }
+    }
     if (seq_result.finish_reason != FinishReason::NONE) {
       choice->set_finish_reason(
           finish_reason_to_string(seq_result.finish_reason));
@@ -154,15 +211,23 @@ bool send_result_to_client(CompletionCallData* call_data,
   usage->set_completion_tokens(
       static_cast<int32_t>(stats.num_generated_tokens));
   usage->set_total_tokens(static_cast<int32_t>(stats.num_total_tokens));
+  usage->set_queue_time_ms(static_cast<float>(stats.queue_time_ms));
+  usage->set_time_to_first_token_ms(
+      static_cast<float>(stats.time_to_first_token_ms));
+  usage->set_time_per_output_token_ms(
+      static_cast<float>(stats.time_per_output_token_ms));
+  usage->set_num_preemptions(static_cast<int32_t>(stats.num_preemptions));
   // TODO: combine write and finish
   call_data->write(response);
   // TODO: mapping status to grpc status
   return call_data->finish();
 }
 
-std::unique_ptr<Request> grpc_request_to_request(CompletionCallData* call_data,
-                                                 const Tokenizer& tokenizer,
-                                                 const ModelArgs& model_args) {
+std::unique_ptr<Request> grpc_request_to_request(
+    CompletionCallData* call_data,
+    const Tokenizer& tokenizer,
+    const ModelArgs& model_args,
+    const LoRARegistry* lora_registry) {
   const CompletionRequest& grpc_request = call_data->request();
   CHECK(!grpc_request.prompt().empty()) << "Prompt is empty";
 
@@ -199,6 +264,19 @@ std::unique_ptr<Request> grpc_request_to_request(CompletionCallData* call_data,
   if (grpc_request.has_top_p()) {
     sampling_param.top_p = grpc_request.top_p();
   }
+  if (grpc_request.has_prompt_lookup_num_tokens()) {
+    sampling_param.prompt_lookup_num_tokens =
+        grpc_request.prompt_lookup_num_tokens();
+  }
+  if (grpc_request.has_logprobs()) {
+    // logprobs are computed together with sampling on device
+    sampling_param.logprobs = true;
+    sampling_param.top_logprobs = grpc_request.logprobs();
+  }
+  // the model selects a lora adapter by its name, the base model otherwise
+  if (lora_registry != nullptr) {
+    sampling_param.lora_id = lora_registry->find(grpc_request.model());
+  }
   // TODO: add support for following extended parameters
   // sampling_param.repetition_penalty = grpc_request.repetition_penalty();
   // sampling_param.top_k = grpc_request.top_k();
@@ -216,6 +294,9 @@ std::unique_ptr<Request> grpc_request_to_request(CompletionCallData* call_data,
     max_tokens = std::min(max_tokens, kDefaultMaxTokens);
   }
   stopping_criteria.max_tokens = max_tokens;
+  // only score the prompt without generating any tokens
+  stopping_criteria.prefill_only =
+      grpc_request.has_max_tokens() && grpc_request.max_tokens() == 0;
   // stopping_criteria.ignore_eos_token = false;
   stopping_criteria.eos_token_id = model_args.eos_token_id();
 
@@ -249,7 +330,14 @@ std::unique_ptr<Request> grpc_request_to_request(CompletionCallData* call_data,
   }
 
   // add on_stream and on_finish callbacks
-  const uint32_t num_seqs = grpc_request.has_n() ? grpc_request.n() : 1;
+  uint32_t num_seqs = grpc_request.has_n() ? grpc_request.n() : 1;
+  if (grpc_request.has_use_beam_search() && grpc_request.use_beam_search()) {
+    // beams are forked from one sequence and the best n ones are returned
+    sampling_param.beam_width =
+        grpc_request.has_best_of() ? grpc_request.best_of() : num_seqs;
+    request->num_return_sequences = num_seqs;
+    num_seqs = 1;
+  }
   if (request->stream) {
     // add sequences with on_stream callback
     for (uint32_t i = 0; i < num_seqs; ++i) {
@@ -271,12 +359,13 @@ std::unique_ptr<Request> grpc_request_to_request(CompletionCallData* call_data,
     }
 
     // add on_finish callback
-    request->on_finish = [call_data, request = request.get()](
+    // the tokenizer is owned by the handler and outlives the request
+    request->on_finish = [call_data, request = request.get(), &tokenizer](
                              const std::vector<SequenceResult>& seq_results,
                              const Status& status,
                              const Statistics& stats) -> bool {
       return send_result_to_client(
-          call_data, request, seq_results, status, stats);
+          call_data, request, tokenizer, seq_results, status, stats);
     };
   }
   return request;
@@ -289,19 +378,25 @@ CompletionHandler::CompletionHandler(Scheduler* scheduler, const Engine* engine)
   CHECK(scheduler_ != nullptr);
   tokenizer_ = engine->tokenizer();
   model_args_ = engine->model_args();
+  lora_registry_ = engine->lora_registry();
+  pipelined_ = engine->pipeline_size() > 1;
 }
 
 void CompletionHandler::complete_async(CompletionCallData* call_data) {
-  converter_threadpool_.schedule([this, call_data = call_data]() {
-    if (!verify_request_arguments(call_data)) {
+  // the request may wait for the converter thread, count it as queue time
+  const absl::Time arrival = absl::Now();
+  converter_threadpool_.schedule([this, call_data = call_data, arrival]() {
+    if (!verify_request_arguments(call_data, pipelined_)) {
       // request is not valid, finish with error
       return;
     }
 
-    auto request = grpc_request_to_request(call_data, *tokenizer_, model_args_);
+    auto request = grpc_request_to_request(
+        call_data, *tokenizer_, model_args_, lora_registry_);
     if (request == nullptr) {
       return;
     }
+    request->timeline.arrival = arrival;
 
     // schedule the request
     if (!scheduler_->schedule(request)) {
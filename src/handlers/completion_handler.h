@@ -29,6 +29,12 @@ class CompletionHandler final {
   // model args
   ModelArgs model_args_;
 
+  // lora adapters selected by the model of requests, nullptr if none
+  const LoRARegistry* lora_registry_ = nullptr;
+
+  // whether the engine runs the model in pipeline stages
+  bool pipelined_ = false;
+
   // converter threadpool
   ThreadPool converter_threadpool_;
 };
@@ -0,0 +1,257 @@
+#include "embedding_handler.h"
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <glog/logging.h>
+#include <grpcpp/grpcpp.h>
+#include <uuid.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "models/model_args.h"
+#include "request/request.h"
+#include "utils.h"
+
+namespace llm {
+
+namespace {
+
+// maximum number of inputs in one embedding request
+constexpr int kMaxInputs = 2048;
+
+std::string generate_request_id() {
+  return "embd-" + uuids::to_string(uuids::uuid_system_generator{}());
+}
+
+bool verify_request_arguments(EmbeddingCallData* call_data, bool pipelined) {
+  if (pipelined) {
+    call_data->finish_with_error(
+        grpc::StatusCode::UNIMPLEMENTED,
+        "embeddings are not supported with pipeline parallelism");
+    return false;
+  }
+  const auto& request = call_data->request();
+  // input is required
+  if (request.input().empty()) {
+    call_data->finish_with_error(grpc::StatusCode::INVALID_ARGUMENT,
+                                 "missing input");
+    return false;
+  }
+  if (request.input_size() > kMaxInputs) {
+    call_data->finish_with_error(grpc::StatusCode::INVALID_ARGUMENT,
+                                 "too many inputs");
+    return false;
+  }
+  for (const auto& input : request.input()) {
+    if (input.empty()) {
+      call_data->finish_with_error(grpc::StatusCode::INVALID_ARGUMENT,
+                                   "input must not be empty");
+      return false;
+    }
+  }
+  // pooling is either "mean" or "last"
+  if (request.has_pooling() && request.pooling() != "mean" &&
+      request.pooling() != "last") {
+    call_data->finish_with_error(grpc::StatusCode::INVALID_ARGUMENT,
+                                 "pooling must be either mean or last");
+    return false;
+  }
+  return true;
+}
+
+// collects the embeddings of all inputs of a call, each input is scheduled as
+// a separate request and the response is sent once all of them are finished.
+class EmbeddingBatch final {
+ public:
+  EmbeddingBatch(EmbeddingCallData* call_data, size_t num_inputs)
+      : call_data_(call_data), num_pending_(num_inputs + 1) {
+    // the extra pending count is released by the scheduling thread once all
+    // inputs are scheduled, which keeps the batch from finishing too early
+    response_.set_object("list");
+    response_.set_model(call_data->request().model());
+    for (size_t i = 0; i < num_inputs; ++i) {
+      auto* data = response_.add_data();
+      data->set_index(static_cast<uint32_t>(i));
+      data->set_object("embedding");
+    }
+  }
+
+  // set the embedding for the input at index
+  void set_embedding(size_t index,
+                     const std::vector<float>& embedding,
+                     size_t num_prompt_tokens) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* values = response_.mutable_data(static_cast<int>(index))
+                       ->mutable_embedding();
+    values->Add(embedding.begin(), embedding.end());
+    num_prompt_tokens_ += num_prompt_tokens;
+  }
+
+  // mark the batch as failed, the error is sent once all inputs are done
+  void set_failed(grpc::StatusCode code, const std::string& msg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!failed_) {
+      failed_ = true;
+      error_code_ = code;
+      error_msg_ = msg;
+    }
+  }
+
+  // called once for each finished input plus once by the scheduling thread
+  bool done(size_t count = 1) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CHECK_GE(num_pending_, count);
+    num_pending_ -= count;
+    if (num_pending_ > 0) {
+      return true;
+    }
+    if (failed_) {
+      call_data_->finish_with_error(error_code_, error_msg_);
+      return false;
+    }
+    auto* usage = response_.mutable_usage();
+    usage->set_prompt_tokens(static_cast<int32_t>(num_prompt_tokens_));
+    usage->set_total_tokens(static_cast<int32_t>(num_prompt_tokens_));
+    call_data_->write(response_);
+    return call_data_->finish();
+  }
+
+ private:
+  EmbeddingCallData* call_data_;
+
+  std::mutex mutex_;
+
+  EmbeddingResponse response_;
+
+  // number of inputs that are not finished yet
+  size_t num_pending_ = 0;
+
+  size_t num_prompt_tokens_ = 0;
+
+  bool failed_ = false;
+  grpc::StatusCode error_code_ = grpc::StatusCode::OK;
+  std::string error_msg_;
+};
+
+std::unique_ptr<Request> input_to_request(
+    EmbeddingCallData* call_data,
+    const std::string& input,
+    size_t index,
+    const std::shared_ptr<EmbeddingBatch>& batch,
+    const Tokenizer& tokenizer,
+    const ModelArgs& model_args,
+    const LoRARegistry* lora_registry) {
+  const EmbeddingRequest& grpc_request = call_data->request();
+
+  std::vector<int> prompt_tokens;
+  if (!tokenizer.encode(input, &prompt_tokens)) {
+    LOG(ERROR) << "Failed to encode input: " << input;
+    batch->set_failed(grpc::StatusCode::INVALID_ARGUMENT,
+                      "Failed to encode input");
+    return nullptr;
+  }
+  const int64_t max_context_len = model_args.max_position_embeddings();
+  if (prompt_tokens.empty() || prompt_tokens.size() > max_context_len) {
+    LOG(ERROR) << "Invalid input length: " << prompt_tokens.size();
+    batch->set_failed(grpc::StatusCode::INVALID_ARGUMENT,
+                      "Input is empty or too long");
+    return nullptr;
+  }
+
+  auto request =
+      std::make_unique<Request>(generate_request_id(), prompt_tokens);
+
+  // pool the final hidden states instead of sampling
+  auto& sampling_param = request->sampling_param;
+  sampling_param.pooling = PoolingType::MEAN;
+  if (grpc_request.has_pooling() && grpc_request.pooling() == "last") {
+    sampling_param.pooling = PoolingType::LAST;
+  }
+  if (grpc_request.has_normalize()) {
+    sampling_param.normalize = grpc_request.normalize();
+  }
+  // the model selects a lora adapter by its name, the base model otherwise
+  if (lora_registry != nullptr) {
+    sampling_param.lora_id = lora_registry->find(grpc_request.model());
+  }
+
+  // embed the prompt in one step without generating any tokens
+  auto& stopping_criteria = request->stopping_criteria;
+  stopping_criteria.max_tokens = 0;
+  stopping_criteria.prefill_only = true;
+  stopping_criteria.eos_token_id = model_args.eos_token_id();
+
+  if (grpc_request.has_priority()) {
+    request->priority = grpc_priority_to_priority(grpc_request.priority());
+  }
+
+  request->add_sequence();
+  request->on_finish = [batch, index, num_prompt_tokens = prompt_tokens.size()](
+                           const std::vector<SequenceResult>& seq_results,
+                           const Status& status,
+                           const Statistics& /*stats*/) -> bool {
+    if (!status.ok() || seq_results.empty()) {
+      batch->set_failed(grpc::StatusCode::INTERNAL, status.error_msg());
+    } else {
+      batch->set_embedding(
+          index, seq_results.front().embedding, num_prompt_tokens);
+    }
+    return batch->done();
+  };
+  return request;
+}
+
+}  // namespace
+
+EmbeddingHandler::EmbeddingHandler(Scheduler* scheduler, const Engine* engine)
+    : scheduler_(scheduler) {
+  CHECK(scheduler_ != nullptr);
+  tokenizer_ = engine->tokenizer();
+  model_args_ = engine->model_args();
+  lora_registry_ = engine->lora_registry();
+  pipelined_ = engine->pipeline_size() > 1;
+}
+
+void EmbeddingHandler::embed_async(EmbeddingCallData* call_data) {
+  // the request may wait for the converter thread, count it as queue time
+  const absl::Time arrival = absl::Now();
+  converter_threadpool_.schedule([this, call_data = call_data, arrival]() {
+    if (!verify_request_arguments(call_data, pipelined_)) {
+      // request is not valid, finish with error
+      return;
+    }
+
+    const auto& inputs = call_data->request().input();
+    const size_t num_inputs = inputs.size();
+    auto batch = std::make_shared<EmbeddingBatch>(call_data, num_inputs);
+    for (size_t i = 0; i < num_inputs; ++i) {
+      auto request = input_to_request(call_data,
+                                      inputs[static_cast<int>(i)],
+                                      i,
+                                      batch,
+                                      *tokenizer_,
+                                      model_args_,
+                                      lora_registry_);
+      if (request == nullptr) {
+        // skip the remaining inputs, scheduled ones still finish
+        batch->done(num_inputs - i);
+        break;
+      }
+      request->timeline.arrival = arrival;
+
+      // schedule the request
+      if (!scheduler_->schedule(request)) {
+        batch->set_failed(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                          "Out of capacity");
+        batch->done(num_inputs - i);
+        break;
+      }
+    }
+    // release the extra pending count held by this thread
+    batch->done();
+  });
+}
+
+}  // namespace llm
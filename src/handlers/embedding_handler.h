@@ -0,0 +1,42 @@
+#pragma once
+
+#include "call_data.h"
+#include "common/threadpool.h"
+#include "embedding.grpc.pb.h"  // IWYU pragma: keep
+#include "engine/engine.h"
+#include "models/model_args.h"
+#include "scheduler/scheduler.h"
+
+namespace llm {
+
+using EmbeddingCallData = CallData<EmbeddingRequest, EmbeddingResponse>;
+
+// a class to handle embedding requests
+class EmbeddingHandler final {
+ public:
+  EmbeddingHandler(Scheduler* scheduler, const Engine* engine);
+
+  // caller needs to guarantee the lifetime of call_data.
+  void embed_async(EmbeddingCallData* call_data);
+
+ private:
+  // request scheduler
+  Scheduler* scheduler_;
+
+  // tokenizer instance
+  std::unique_ptr<Tokenizer> tokenizer_;
+
+  // model args
+  ModelArgs model_args_;
+
+  // lora adapters selected by the model of requests, nullptr if none
+  const LoRARegistry* lora_registry_ = nullptr;
+
+  // whether the engine runs the model in pipeline stages
+  bool pipelined_ = false;
+
+  // converter threadpool
+  ThreadPool converter_threadpool_;
+};
+
+}  // namespace llm
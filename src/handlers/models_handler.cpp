@@ -6,8 +6,11 @@
 
 namespace llm {
 
-ModelsHandler::ModelsHandler(const std::string& model_id)
-    : model_id_(model_id), created_(absl::ToUnixSeconds(absl::Now())) {}
+ModelsHandler::ModelsHandler(const std::string& model_id,
+                             const std::vector<std::string>& lora_ids)
+    : model_id_(model_id),
+      lora_ids_(lora_ids),
+      created_(absl::ToUnixSeconds(absl::Now())) {}
 
 grpc::Status ModelsHandler::List(grpc::ServerContext* /*context*/,
                                  const ListRequest* /*request*/,
@@ -17,6 +20,14 @@ grpc::Status ModelsHandler::List(grpc::ServerContext* /*context*/,
   model_card->set_created(created_);
   model_card->set_object("model");
   model_card->set_owned_by("scalellm");
+  // lora adapters are selected as models by their names
+  for (const auto& lora_id : lora_ids_) {
+    auto* lora_card = response->add_data();
+    lora_card->set_id(lora_id);
+    lora_card->set_created(created_);
+    lora_card->set_object("model");
+    lora_card->set_owned_by("scalellm");
+  }
   return grpc::Status::OK;
 }
 
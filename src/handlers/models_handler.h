@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "models.grpc.pb.h"
 
@@ -8,7 +9,9 @@ namespace llm {
 
 class ModelsHandler : public Models::Service {
  public:
-  ModelsHandler(const std::string& model_id);
+  // lora_ids: names of lora adapters served along with the model
+  ModelsHandler(const std::string& model_id,
+                const std::vector<std::string>& lora_ids = {});
 
   grpc::Status List(grpc::ServerContext* context,
                     const ListRequest* request,
@@ -16,6 +19,7 @@ class ModelsHandler : public Models::Service {
 
  private:
   std::string model_id_;
+  std::vector<std::string> lora_ids_;
   // model created time
   // TODO: read from model config
   uint32_t created_;
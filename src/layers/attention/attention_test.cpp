@@ -70,6 +70,60 @@ std::tuple<torch::Tensor, torch::Tensor> get_kv_cache(
   return std::make_tuple(torch::stack(keys), torch::stack(values));
 }
 
+TEST(AttentionTreeMaskTest, Ref) {
+  const int64_t n_heads = 4;
+  const int64_t head_dim = 16;
+  const float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+  // 5 cached tokens followed by a token tree: root -> a, root -> b
+  const int64_t n_cached = 5;
+  torch::Tensor query = torch::rand({3, n_heads, head_dim});
+  torch::Tensor key = torch::rand({n_cached + 3, n_heads, head_dim});
+  torch::Tensor value = torch::rand({n_cached + 3, n_heads, head_dim});
+
+  InputParameters input_params;
+  input_params.q_cu_seq_lens = torch::tensor({0, 3}, torch::kInt);
+  input_params.kv_cu_seq_lens = torch::tensor({0, 8}, torch::kInt);
+  input_params.q_max_seq_len = 3;
+  input_params.kv_max_seq_len = 8;
+  input_params.tree_mask =
+      torch::tensor({1, 0, 0, 1, 1, 0, 1, 0, 1}, torch::kInt)
+          .view({3, 3})
+          .to(torch::kBool);
+
+  for (const bool alibi : {false, true}) {
+    torch::optional<torch::Tensor> alibi_slopes;
+    if (alibi) {
+      alibi_slopes = torch::rand({n_heads});
+    }
+    RefHandler ref_handler(scale, alibi_slopes);
+    torch::Tensor output = torch::empty_like(query);
+    ref_handler.batch_prefill(query, key, value, input_params, output);
+
+    // each branch should be the same as a causal chain without the other one
+    for (const int64_t node : {1, 2}) {
+      auto kv_idxes = torch::cat(
+          {torch::arange(n_cached + 1), torch::tensor({n_cached + node})});
+      auto q_idxes = torch::tensor({int64_t(0), node});
+      auto chain_query = query.index_select(/*dim=*/0, q_idxes);
+      auto chain_key = key.index_select(/*dim=*/0, kv_idxes);
+      auto chain_value = value.index_select(/*dim=*/0, kv_idxes);
+
+      InputParameters chain_params;
+      chain_params.q_cu_seq_lens = torch::tensor({0, 2}, torch::kInt);
+      chain_params.kv_cu_seq_lens =
+          torch::tensor({0, static_cast<int32_t>(n_cached + 2)}, torch::kInt);
+      chain_params.q_max_seq_len = 2;
+      chain_params.kv_max_seq_len = n_cached + 2;
+      torch::Tensor chain_output = torch::empty_like(chain_query);
+      ref_handler.batch_prefill(
+          chain_query, chain_key, chain_value, chain_params, chain_output);
+
+      EXPECT_TRUE(torch::allclose(output[0], chain_output[0]));
+      EXPECT_TRUE(torch::allclose(output[node], chain_output[1]));
+    }
+  }
+}
+
 // Tests self-attention for prefill stage
 class AttentionPrefillTest
     : public ::testing::TestWithParam<std::tuple<torch::Device,
@@ -13,7 +13,9 @@ namespace llm {
 
 FlashAttnHandler::FlashAttnHandler(float scale,
                                    torch::optional<torch::Tensor> alibi_slopes)
-    : scale_(scale), alibi_slopes_(alibi_slopes) {
+    : scale_(scale),
+      alibi_slopes_(alibi_slopes),
+      ref_handler_(scale, alibi_slopes) {
   if (FLAGS_use_kv_cache_stream) {
     cudaStreamCreate(&stream_);
   }
@@ -32,6 +34,11 @@ void FlashAttnHandler::batch_prefill(
     const torch::Tensor& value,           // [n_tokens, n_kv_heads, head_dim]
     const InputParameters& input_params,  // input paras used for attention
     torch::Tensor& output) {
+  if (input_params.tree_mask.defined()) {
+    ref_handler_.batch_prefill(query, key, value, input_params, output);
+    return;
+  }
+
   // don't use kv cache in prefill stage
   mha_varlen_fwd(output,
                  query,
@@ -62,6 +69,12 @@ void FlashAttnHandler::batch_decode(
     cudaStreamSynchronize(stream_);
   }
 
+  if (input_params.tree_mask.defined()) {
+    // the tree is small, gather the kv cache and verify it with explicit mask
+    ref_handler_.batch_decode(query, kv_cache, input_params, output);
+    return;
+  }
+
   auto [key_cache, value_cache] = kv_cache.get_kv_cache();
   mha_varlen_fwd(output,
                  query,
@@ -86,8 +99,9 @@ void FlashAttnHandler::append_kv_cache(
     const torch::Tensor& key,    // [n_tokens, n_kv_heads, head_dim]
     const torch::Tensor& value,  // [n_tokens, n_kv_heads, head_dim]
     const InputParameters& input_params) {
-  // append key and value to kv_cache
-  if (!kv_cache.empty()) {
+  // append key and value to kv_cache, no slots are assigned when the kv
+  // cache is not kept, e.g. for scoring prompts
+  if (!kv_cache.empty() && input_params.new_cache_slots.defined()) {
     kv_cache.set_kv_cache(input_params.new_cache_slots, key, value, stream_);
   }
 }
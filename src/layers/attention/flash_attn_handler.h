@@ -6,6 +6,7 @@
 #include "handler.h"
 #include "memory/kv_cache.h"
 #include "models/input_parameters.h"
+#include "ref_handler.h"
 
 namespace llm {
 
@@ -51,6 +52,9 @@ class FlashAttnHandler : public AttentionHandler {
 
   // stream for kv cache
   cudaStream_t stream_ = nullptr;
+
+  // fallback for tree mask, which is not supported by flash attn kernels
+  RefHandler ref_handler_;
 };
 
 }  // namespace llm
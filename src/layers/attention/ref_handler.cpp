@@ -48,6 +48,7 @@ void varlen_masked_self_attention(
     const torch::Tensor& q_cu_seq_lens,   // [n_seqs + 1]
     const torch::Tensor& kv_cu_seq_lens,  // [n_seqs + 1]
     const torch::optional<torch::Tensor> alibi_slopes,  // [n_heads]
+    const torch::Tensor& tree_mask,  // [n_tokens, max_q_len], optional
     float scale,
     torch::Tensor& output) {
   // same length for key and value
@@ -90,11 +91,32 @@ void varlen_masked_self_attention(
       _value = _value.repeat_interleave(/*repeats=*/num_goups, /*dim=*/-2);
     }
 
-    // causal mask
-    // [1, q_len, kv_len]
-    torch::Tensor mask = torch::ones({1, q_len, kv_len}, torch::kBool);
-    // returns the lower triangular part of a matrix
-    mask = torch::tril(mask, /*diagonal=*/kv_len - q_len).to(query);
+    torch::Tensor mask;
+    // positions of keys for alibi bias, [0, 1, ..., kv_len) if not set
+    torch::Tensor key_positions;
+    if (tree_mask.defined()) {
+      // tokens in kv cache are visible to all queries
+      // [1, q_len, kv_len]
+      auto q_mask = tree_mask.slice(/*dim=*/0, q_start, q_end)
+                        .slice(/*dim=*/1, 0, q_len)
+                        .to(torch::kBool);
+      auto kv_mask = torch::ones({q_len, kv_len - q_len}, q_mask.options());
+      mask = torch::cat({kv_mask, q_mask}, /*dim=*/1).unsqueeze(0).to(query);
+      if (alibi_slopes) {
+        // a token sees itself and its ancestors, so the number of visible
+        // new tokens gives its position along its branch of the tree
+        const int64_t n_cached = kv_len - q_len;
+        auto q_positions = q_mask.sum(/*dim=*/1).to(query) + (n_cached - 1);
+        key_positions = torch::cat(
+            {torch::arange(0, n_cached, query.options()), q_positions});
+      }
+    } else {
+      // causal mask
+      // [1, q_len, kv_len]
+      mask = torch::ones({1, q_len, kv_len}, torch::kBool);
+      // returns the lower triangular part of a matrix
+      mask = torch::tril(mask, /*diagonal=*/kv_len - q_len).to(query);
+    }
 
     torch::Tensor bias;
     if (alibi_slopes) {
@@ -102,8 +124,10 @@ void varlen_masked_self_attention(
       CHECK(slopes.size(0) == n_heads);
 
       // calculate alibi attention bias
-      // since it's causal mask, we can just use [0, 1, ...,, kv_len)
-      auto distance = torch::arange(0, kv_len, query.options());
+      // since it's causal mask, we can just use the key positions
+      auto distance = key_positions.defined()
+                          ? key_positions
+                          : torch::arange(0, kv_len, query.options());
       // [n_heads, 1, kv_len]
       bias = distance.view({1, 1, kv_len}) * slopes.view({n_heads, 1, 1});
     }
@@ -133,6 +157,7 @@ void RefHandler::batch_prefill(
                                input_params.q_cu_seq_lens,
                                input_params.kv_cu_seq_lens,
                                alibi_slopes_,
+                               input_params.tree_mask,
                                scale_,
                                output);
 }
@@ -154,6 +179,7 @@ void RefHandler::batch_decode(
                                input_params.q_cu_seq_lens,
                                input_params.kv_cu_seq_lens,
                                alibi_slopes_,
+                               input_params.tree_mask,
                                scale_,
                                output);
 }
@@ -164,8 +190,9 @@ void RefHandler::append_kv_cache(
     const torch::Tensor& key,    // [n_tokens, n_kv_heads, head_dim]
     const torch::Tensor& value,  // [n_tokens, n_kv_heads, head_dim]
     const InputParameters& input_params) {
-  // append key and value to kv_cache
-  if (!kv_cache.empty()) {
+  // append key and value to kv_cache, no slots are assigned when the kv
+  // cache is not kept, e.g. for scoring prompts
+  if (!kv_cache.empty() && input_params.new_cache_slots.defined()) {
     kv_cache.set_kv_cache(input_params.new_cache_slots, key, value);
   }
 }
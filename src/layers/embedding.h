@@ -42,14 +42,14 @@ class EmbeddingImpl : public torch::nn::Module {
     if (weight.defined()) {
       CHECK_EQ(weight_.sizes(), weight.sizes())
           << "weight size mismatch for " << name();
-      weight_.copy_(weight);
+      load_weight(weight_, weight);
       is_loaded_ = true;
     }
   }
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix) const {
-    CHECK(is_loaded_) << "weight is not loaded for " << prefix + "weight";
+    MissingWeightsGuard::check(is_loaded_, prefix + "weight");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -112,14 +112,14 @@ class ParallelEmbeddingImpl : public torch::nn::Module {
     if (weight.defined()) {
       CHECK_EQ(weight_.sizes(), weight.sizes())
           << "weight size mismatch for " << name();
-      weight_.copy_(weight);
+      load_weight(weight_, weight);
       is_loaded_ = true;
     }
   }
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix) const {
-    CHECK(is_loaded_) << "weight is not loaded for " << prefix + "weight";
+    MissingWeightsGuard::check(is_loaded_, prefix + "weight");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -193,14 +193,14 @@ class VocabParallelEmbeddingImpl : public torch::nn::Module {
     if (weight.defined()) {
       CHECK_EQ(weight_.sizes(), weight.sizes())
           << "weight size mismatch for " << name();
-      weight_.copy_(weight);
+      load_weight(weight_, weight);
       is_loaded_ = true;
     }
   }
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix = "") const {
-    CHECK(is_loaded_) << "weight is not loaded for " << prefix + "weight";
+    MissingWeightsGuard::check(is_loaded_, prefix + "weight");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -6,6 +6,7 @@
 
 #include <algorithm>
 
+#include "lora.h"
 #include "model_loader/state_dict.h"
 #include "model_parallel/model_parallel.h"
 
@@ -96,6 +97,10 @@ ColumnParallelLinearImpl::ColumnParallelLinearImpl(
 torch::Tensor ColumnParallelLinearImpl::forward(torch::Tensor input) const {
   namespace F = torch::nn::functional;
   auto output = F::linear(input, weight_, bias_);
+  if (const auto* lora_batch = LoRABatchGuard::current();
+      lora_a_.defined() && lora_batch != nullptr) {
+    detail::apply_lora(input, lora_a_, lora_b_, *lora_batch, output);
+  }
   if (parallel_args_.world_size() > 1 && gather_output_) {
     output = gather_from_model_parallel_region(output, parallel_args_);
   }
@@ -112,6 +117,11 @@ void ColumnParallelLinearImpl::load_state_dict(const StateDict& state_dict) {
 void ColumnParallelLinearImpl::load_state_dict(const StateDict& state_dict,
                                                TensorTransform transform_func) {
   CHECK(transform_func != nullptr) << "transform_func must be provided";
+  if (LoRALoadGuard::slot() >= 0) {
+    // the transform is for base weights only
+    load_state_dict(state_dict, std::vector<std::string_view>{""});
+    return;
+  }
   auto weight =
       state_dict.get_sharded_tensor("weight",
                                     /*dim=*/0,
@@ -121,7 +131,7 @@ void ColumnParallelLinearImpl::load_state_dict(const StateDict& state_dict,
     weight = transform_func(weight);
     CHECK_EQ(weight_.sizes(), weight.sizes())
         << "weight size mismatch for " << name();
-    weight_.copy_(weight);
+    load_weight(weight_, weight);
     weight_is_loaded_ = true;
   }
 
@@ -135,7 +145,7 @@ void ColumnParallelLinearImpl::load_state_dict(const StateDict& state_dict,
       bias = transform_func(bias);
       CHECK_EQ(bias_.sizes(), bias.sizes())
           << "bias size mismatch for " << name();
-      bias_.copy_(bias);
+      load_weight(bias_, bias);
       bias_is_loaded_ = true;
     }
   }
@@ -145,6 +155,30 @@ void ColumnParallelLinearImpl::load_state_dict(const StateDict& state_dict,
 void ColumnParallelLinearImpl::load_state_dict(
     const StateDict& state_dict,
     const std::vector<std::string_view>& prefixes) {
+  if (LoRALoadGuard::slot() >= 0) {
+    // fused weights without known sizes are treated as one weight
+    std::vector<int64_t> out_offsets = {0};
+    if (fused_out_features_.size() == prefixes.size()) {
+      for (const auto out_features : fused_out_features_) {
+        out_offsets.push_back(out_offsets.back() + out_features);
+      }
+    } else {
+      CHECK_EQ(prefixes.size(), 1) << "weights are not loaded for " << name();
+      out_offsets.push_back(weight_.size(0));
+    }
+    detail::load_lora_weights(state_dict,
+                              prefixes,
+                              out_offsets,
+                              /*in_features=*/weight_.size(1),
+                              /*shard_dim=*/0,
+                              parallel_args_,
+                              weight_.options(),
+                              lora_a_,
+                              lora_b_);
+    return;
+  }
+
+  fused_out_features_.resize(prefixes.size(), 0);
   std::vector<torch::Tensor> weight_list(prefixes.size());
   std::vector<torch::Tensor> bias_list(prefixes.size());
   for (size_t i = 0; i < prefixes.size(); ++i) {
@@ -157,6 +191,7 @@ void ColumnParallelLinearImpl::load_state_dict(
     if (weight.defined()) {
       CHECK(!weight_list[i].defined()) << "weight already loaded";
       weight_list[i] = weight;
+      fused_out_features_[i] = weight.size(0);
     }
 
     if (bias_.defined()) {
@@ -226,6 +261,11 @@ torch::Tensor RowParallelLinearImpl::forward(torch::Tensor input) const {
     input = scatter_to_model_parallel_region(input, parallel_args_);
   }
   auto output = F::linear(input, weight_);
+  // partial deltas of lora adapters are reduced along with the output
+  if (const auto* lora_batch = LoRABatchGuard::current();
+      lora_a_.defined() && lora_batch != nullptr) {
+    detail::apply_lora(input, lora_a_, lora_b_, *lora_batch, output);
+  }
   if (parallel_args_.world_size() > 1) {
     output = reduce_from_model_parallel_region(output, parallel_args_);
   }
@@ -238,6 +278,19 @@ torch::Tensor RowParallelLinearImpl::forward(torch::Tensor input) const {
 
 // load the weight from the checkpoint
 void RowParallelLinearImpl::load_state_dict(const StateDict& state_dict) {
+  if (LoRALoadGuard::slot() >= 0) {
+    detail::load_lora_weights(state_dict,
+                              /*prefixes=*/{""},
+                              /*out_offsets=*/{0, weight_.size(0)},
+                              /*in_features=*/weight_.size(1),
+                              /*shard_dim=*/1,
+                              parallel_args_,
+                              weight_.options(),
+                              lora_a_,
+                              lora_b_);
+    return;
+  }
+
   const auto weight =
       state_dict.get_sharded_tensor("weight",
                                     /*dim=*/1,
@@ -246,7 +299,7 @@ void RowParallelLinearImpl::load_state_dict(const StateDict& state_dict) {
   if (weight.defined()) {
     CHECK_EQ(weight_.sizes(), weight.sizes())
         << "weight size mismatch for " << name();
-    weight_.copy_(weight);
+    load_weight(weight_, weight);
     weight_is_loaded_ = true;
   }
 
@@ -255,7 +308,7 @@ void RowParallelLinearImpl::load_state_dict(const StateDict& state_dict) {
     if (bias.defined()) {
       CHECK_EQ(bias_.sizes(), bias.sizes())
           << "bias size mismatch for " << name();
-      bias_.copy_(bias);
+      load_weight(bias_, bias);
       bias_is_loaded_ = true;
     }
   }
@@ -48,10 +48,9 @@ class ColumnParallelLinearImpl : public ParallelLinearImpl {
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix) const override {
-    CHECK(weight_is_loaded_)
-        << "weight is not loaded for " << prefix + "weight";
-    CHECK(!bias_.defined() || bias_is_loaded_)
-        << "bias is not loaded for " << prefix + "bias";
+    MissingWeightsGuard::check(weight_is_loaded_, prefix + "weight");
+    MissingWeightsGuard::check(!bias_.defined() || bias_is_loaded_,
+                               prefix + "bias");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -73,6 +72,14 @@ class ColumnParallelLinearImpl : public ParallelLinearImpl {
   std::vector<torch::Tensor> weight_list_;
   std::vector<torch::Tensor> bias_list_;
 
+  // output rows of each fused weight, used to place lora adapters
+  std::vector<int64_t> fused_out_features_;
+
+  // lora adapters in device slots, undefined until an adapter is loaded.
+  // not registered as parameters. see detail::load_lora_weights
+  torch::Tensor lora_a_;
+  torch::Tensor lora_b_;
+
   // whether to gather the output
   bool gather_output_;
 
@@ -107,10 +114,9 @@ class RowParallelLinearImpl : public ParallelLinearImpl {
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix = "") const override {
-    CHECK(weight_is_loaded_)
-        << "weight is not loaded for " << prefix + "weight";
-    CHECK(!bias_.defined() || bias_is_loaded_)
-        << "bias is not loaded for " << prefix + "bias";
+    MissingWeightsGuard::check(weight_is_loaded_, prefix + "weight");
+    MissingWeightsGuard::check(!bias_.defined() || bias_is_loaded_,
+                               prefix + "bias");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -131,6 +137,11 @@ class RowParallelLinearImpl : public ParallelLinearImpl {
   bool weight_is_loaded_ = false;
   bool bias_is_loaded_ = false;
 
+  // lora adapters in device slots, undefined until an adapter is loaded.
+  // not registered as parameters. see detail::load_lora_weights
+  torch::Tensor lora_a_;
+  torch::Tensor lora_b_;
+
   // whether the input is already parallelized
   bool input_is_parallelized_;
 
@@ -0,0 +1,156 @@
+#include "lora.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <string>
+#include <vector>
+
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+
+DEFINE_int32(max_loras,
+             0,
+             "max number of lora adapters held on device at the same time, "
+             "which also bounds the number of adapters in a batch. 0 to "
+             "disable lora.");
+DEFINE_int32(max_lora_rank, 16, "max rank of lora adapters");
+
+namespace llm {
+namespace {
+
+// lora batch of the forward pass running in the current thread
+thread_local const LoRABatch* tl_lora_batch = nullptr;
+
+// slot and scaling of the adapter being loaded in the current thread
+thread_local int64_t tl_load_slot = -1;
+thread_local float tl_load_scaling = 1.0f;
+
+}  // namespace
+
+LoRABatchGuard::LoRABatchGuard(const LoRABatch* batch)
+    : prev_batch_(tl_lora_batch) {
+  tl_lora_batch = batch;
+}
+
+LoRABatchGuard::~LoRABatchGuard() { tl_lora_batch = prev_batch_; }
+
+const LoRABatch* LoRABatchGuard::current() { return tl_lora_batch; }
+
+LoRALoadGuard::LoRALoadGuard(int64_t slot, float scaling) {
+  CHECK_GE(slot, 0) << "invalid lora slot " << slot;
+  CHECK_LT(tl_load_slot, 0) << "another lora adapter is being loaded";
+  tl_load_slot = slot;
+  tl_load_scaling = scaling;
+}
+
+LoRALoadGuard::~LoRALoadGuard() {
+  tl_load_slot = -1;
+  tl_load_scaling = 1.0f;
+}
+
+int64_t LoRALoadGuard::slot() { return tl_load_slot; }
+
+float LoRALoadGuard::scaling() { return tl_load_scaling; }
+
+namespace detail {
+
+void load_lora_weights(const StateDict& state_dict,
+                       const std::vector<std::string_view>& prefixes,
+                       const std::vector<int64_t>& out_offsets,
+                       int64_t in_features,
+                       int64_t shard_dim,
+                       const ParallelArgs& parallel_args,
+                       const torch::TensorOptions& options,
+                       torch::Tensor& a,
+                       torch::Tensor& b) {
+  const int64_t slot = LoRALoadGuard::slot();
+  CHECK_GE(slot, 0) << "no lora adapter is being loaded";
+  CHECK_EQ(out_offsets.size(), prefixes.size() + 1);
+
+  const int rank = parallel_args.rank();
+  const int world_size = parallel_args.world_size();
+  const auto n_prefixes = static_cast<int64_t>(prefixes.size());
+  std::vector<torch::Tensor> a_list(n_prefixes);
+  std::vector<torch::Tensor> b_list(n_prefixes);
+  bool found = false;
+  for (int64_t i = 0; i < n_prefixes; ++i) {
+    const std::string prefix(prefixes[i]);
+    // the sharded dim of the linear weight is the input of lora_A or the
+    // output of lora_B, the other one is replicated on all ranks.
+    if (shard_dim == 0) {
+      a_list[i] = state_dict.get_tensor(prefix + "lora_A.weight");
+      b_list[i] = state_dict.get_sharded_tensor(
+          prefix + "lora_B.weight", /*dim=*/0, rank, world_size);
+    } else {
+      a_list[i] = state_dict.get_sharded_tensor(
+          prefix + "lora_A.weight", /*dim=*/1, rank, world_size);
+      b_list[i] = state_dict.get_tensor(prefix + "lora_B.weight");
+    }
+    CHECK_EQ(a_list[i].defined(), b_list[i].defined())
+        << "lora_A and lora_B should be provided together for " << prefix;
+    found |= a_list[i].defined();
+  }
+
+  if (!found) {
+    // the adapter doesn't touch this layer, clear what the slot held before
+    if (a.defined()) {
+      a[slot].zero_();
+      b[slot].zero_();
+    }
+    return;
+  }
+
+  const int64_t max_rank = FLAGS_max_lora_rank;
+  if (!a.defined()) {
+    CHECK_GT(FLAGS_max_loras, 0) << "lora is disabled by --max_loras";
+    a = torch::zeros({FLAGS_max_loras, n_prefixes * max_rank, in_features},
+                     options);
+    b = torch::zeros(
+        {FLAGS_max_loras, out_offsets.back(), n_prefixes * max_rank}, options);
+  }
+  CHECK_EQ(a.size(1), n_prefixes * max_rank) << "lora layout mismatch";
+
+  auto slot_a = a[slot];
+  auto slot_b = b[slot];
+  slot_a.zero_();
+  slot_b.zero_();
+  const float scaling = LoRALoadGuard::scaling();
+  for (int64_t i = 0; i < n_prefixes; ++i) {
+    if (!a_list[i].defined()) {
+      continue;
+    }
+    const int64_t r = a_list[i].size(0);
+    const int64_t out_features = out_offsets[i + 1] - out_offsets[i];
+    CHECK_LE(r, max_rank) << "lora rank " << r << " exceeds --max_lora_rank";
+    CHECK_EQ(a_list[i].size(1), in_features)
+        << "lora_A size mismatch for " << prefixes[i];
+    CHECK(b_list[i].size(0) == out_features && b_list[i].size(1) == r)
+        << "lora_B size mismatch for " << prefixes[i];
+    slot_a.narrow(/*dim=*/0, i * max_rank, r).copy_(a_list[i]);
+    // fold the scaling into lora_B so that apply_lora has nothing to scale
+    slot_b.narrow(/*dim=*/0, out_offsets[i], out_features)
+        .narrow(/*dim=*/1, i * max_rank, r)
+        .copy_(b_list[i].to(torch::kFloat32) * scaling);
+  }
+}
+
+void apply_lora(const torch::Tensor& input,
+                const torch::Tensor& a,
+                const torch::Tensor& b,
+                const LoRABatch& batch,
+                torch::Tensor& output) {
+  for (size_t i = 0; i < batch.slots.size(); ++i) {
+    const auto& token_idxes = batch.token_idxes[i];
+    const auto slot = batch.slots[i];
+    // [n_tokens, in_features] => [n_tokens, rank] => [n_tokens, out_features]
+    const auto x = input.index_select(/*dim=*/0, token_idxes);
+    const auto delta =
+        torch::matmul(torch::matmul(x, a[slot].t()), b[slot].t());
+    output.index_add_(/*dim=*/0, token_idxes, delta);
+  }
+}
+
+}  // namespace detail
+}  // namespace llm
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <gflags/gflags_declare.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "model_loader/state_dict.h"
+#include "model_parallel/parallel_args.h"
+
+DECLARE_int32(max_loras);
+DECLARE_int32(max_lora_rank);
+
+namespace llm {
+
+// tokens of a batch grouped by the device slots of their lora adapters,
+// shared by all linear layers in a forward pass.
+struct LoRABatch {
+  bool empty() const { return slots.empty(); }
+
+  // slots of the adapters used by the batch
+  std::vector<int64_t> slots;
+
+  // indexes of the tokens using each slot, on the device of the model
+  // LongTensor: [n_tokens_of_slot]
+  std::vector<torch::Tensor> token_idxes;
+};
+
+// linear layers only see hidden states, so the worker sets the lora batch of
+// the current thread for the duration of a forward pass.
+class LoRABatchGuard final {
+ public:
+  explicit LoRABatchGuard(const LoRABatch* batch);
+
+  ~LoRABatchGuard();
+
+  // returns the lora batch of the current thread, nullptr if not set
+  static const LoRABatch* current();
+
+ private:
+  const LoRABatch* prev_batch_ = nullptr;
+};
+
+// within the scope of the guard, load_state_dict of linear layers loads lora
+// adapter weights into the slot instead of the base weights. this reuses the
+// weight name mapping of each model for adapters.
+class LoRALoadGuard final {
+ public:
+  // scaling: lora_alpha / r of the adapter, folded into lora_B
+  LoRALoadGuard(int64_t slot, float scaling);
+
+  ~LoRALoadGuard();
+
+  // returns the slot being loaded in the current thread, -1 if not loading
+  static int64_t slot();
+
+  static float scaling();
+};
+
+namespace detail {
+
+// load lora_A and lora_B of each prefix into the slot of a and b, which are
+// allocated with FLAGS_max_loras slots on first use. the adapter of the i-th
+// prefix takes ranks [i * max_rank, i * max_rank + r) and rows of its output
+// [out_offsets[i], out_offsets[i + 1]). missing adapters are left as zeros.
+// a: [n_slots, n_prefixes * max_rank, in_features]
+// b: [n_slots, out_features, n_prefixes * max_rank]
+// shard_dim: 0 to shard lora_B by rows, 1 to shard lora_A by columns
+void load_lora_weights(const StateDict& state_dict,
+                       const std::vector<std::string_view>& prefixes,
+                       const std::vector<int64_t>& out_offsets,
+                       int64_t in_features,
+                       int64_t shard_dim,
+                       const ParallelArgs& parallel_args,
+                       const torch::TensorOptions& options,
+                       torch::Tensor& a,
+                       torch::Tensor& b);
+
+// add x * A^T * B^T of the slot of each token group to output in place
+void apply_lora(const torch::Tensor& input,
+                const torch::Tensor& a,
+                const torch::Tensor& b,
+                const LoRABatch& batch,
+                torch::Tensor& output);
+
+}  // namespace detail
+
+}  // namespace llm
@@ -0,0 +1,132 @@
+#include "lora.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include "linear_impl.h"
+#include "model_loader/state_dict.h"
+
+namespace llm {
+
+TEST(LoRATest, FusedColumnParallelLinear) {
+  gflags::FlagSaver flag_saver;
+  FLAGS_max_loras = 2;
+  FLAGS_max_lora_rank = 4;
+
+  const int64_t in_features = 16;
+  // q, k and v with different sizes
+  const std::vector<int64_t> out_features = {8, 4, 4};
+  ParallelArgs parallel_args(0, 1, nullptr);
+  ColumnParallelLinearImpl linear(in_features,
+                                  /*out_features=*/16,
+                                  /*bias=*/false,
+                                  /*gather_output=*/false,
+                                  parallel_args,
+                                  torch::kFloat,
+                                  torch::kCPU);
+  const std::vector<std::string_view> prefixes = {"q.", "k.", "v."};
+  std::unordered_map<std::string, torch::Tensor> base_dict;
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    base_dict[std::string(prefixes[i]) + "weight"] =
+        torch::randn({out_features[i], in_features});
+  }
+  linear.load_state_dict(StateDict(base_dict, 0, 1), prefixes);
+
+  // the adapter has rank 3 and only targets q and v
+  const float scaling = 2.0f;
+  const auto q_a = torch::randn({3, in_features});
+  const auto q_b = torch::randn({out_features[0], 3});
+  const auto v_a = torch::randn({3, in_features});
+  const auto v_b = torch::randn({out_features[2], 3});
+  std::unordered_map<std::string, torch::Tensor> lora_dict = {
+      {"q.lora_A.weight", q_a},
+      {"q.lora_B.weight", q_b},
+      {"v.lora_A.weight", v_a},
+      {"v.lora_B.weight", v_b},
+  };
+  {
+    LoRALoadGuard guard(/*slot=*/1, scaling);
+    linear.load_state_dict(StateDict(lora_dict, 0, 1), prefixes);
+  }
+
+  const auto input = torch::randn({5, in_features});
+  const auto base_output = linear.forward(input);
+
+  // tokens 1 and 3 use the adapter
+  LoRABatch batch;
+  batch.slots = {1};
+  batch.token_idxes = {torch::tensor({1, 3}, torch::kLong)};
+  LoRABatchGuard batch_guard(&batch);
+  const auto output = linear.forward(input);
+
+  auto expected = base_output.clone();
+  for (const int64_t idx : {1, 3}) {
+    const auto x = input[idx];
+    expected[idx].narrow(0, 0, 8).add_(torch::mv(q_b, torch::mv(q_a, x)),
+                                       scaling);
+    expected[idx].narrow(0, 12, 4).add_(torch::mv(v_b, torch::mv(v_a, x)),
+                                        scaling);
+  }
+  EXPECT_TRUE(torch::allclose(output, expected, /*rtol=*/1e-4, /*atol=*/1e-4));
+}
+
+TEST(LoRATest, RowParallelLinear) {
+  gflags::FlagSaver flag_saver;
+  FLAGS_max_loras = 1;
+  FLAGS_max_lora_rank = 4;
+
+  const int64_t in_features = 16;
+  const int64_t out_features = 8;
+  ParallelArgs parallel_args(0, 1, nullptr);
+  RowParallelLinearImpl linear(in_features,
+                               out_features,
+                               /*bias=*/true,
+                               /*input_is_parallelized=*/true,
+                               parallel_args,
+                               torch::kFloat,
+                               torch::kCPU);
+  std::unordered_map<std::string, torch::Tensor> base_dict = {
+      {"weight", torch::randn({out_features, in_features})},
+      {"bias", torch::randn({out_features})},
+  };
+  linear.load_state_dict(StateDict(base_dict, 0, 1));
+
+  const auto lora_a = torch::randn({4, in_features});
+  const auto lora_b = torch::randn({out_features, 4});
+  std::unordered_map<std::string, torch::Tensor> lora_dict = {
+      {"lora_A.weight", lora_a},
+      {"lora_B.weight", lora_b},
+  };
+  {
+    LoRALoadGuard guard(/*slot=*/0, /*scaling=*/0.5f);
+    linear.load_state_dict(StateDict(lora_dict, 0, 1));
+  }
+
+  const auto input = torch::randn({3, in_features});
+  const auto base_output = linear.forward(input);
+
+  LoRABatch batch;
+  batch.slots = {0};
+  batch.token_idxes = {torch::arange(3, torch::kLong)};
+  {
+    LoRABatchGuard batch_guard(&batch);
+    const auto output = linear.forward(input);
+    const auto expected =
+        base_output + torch::matmul(torch::matmul(input, lora_a.t()),
+                                    lora_b.t()) *
+                          0.5f;
+    EXPECT_TRUE(
+        torch::allclose(output, expected, /*rtol=*/1e-4, /*atol=*/1e-4));
+  }
+
+  // an adapter not targeting the layer clears the slot
+  {
+    LoRALoadGuard guard(/*slot=*/0, /*scaling=*/1.0f);
+    linear.load_state_dict(StateDict({}, 0, 1));
+  }
+  LoRABatchGuard batch_guard(&batch);
+  EXPECT_TRUE(torch::allclose(linear.forward(input), base_output));
+}
+
+}  // namespace llm
@@ -91,10 +91,9 @@ class LayerNormImpl : public torch::nn::Module {
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix = "") const {
-    CHECK(weight_is_loaded_)
-        << "weight is not loaded for " << prefix + "weight";
-    CHECK(!bias_.defined() || bias_is_loaded_)
-        << "bias is not loaded for " << prefix + "bias";
+    MissingWeightsGuard::check(weight_is_loaded_, prefix + "weight");
+    MissingWeightsGuard::check(!bias_.defined() || bias_is_loaded_,
+                               prefix + "bias");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -153,7 +152,7 @@ class RMSNormImpl : public torch::nn::Module {
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix = "") const {
-    CHECK(is_loaded_) << "weight is not loaded for " << prefix + "weight";
+    MissingWeightsGuard::check(is_loaded_, prefix + "weight");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -216,7 +215,7 @@ class RMSNormResidualImpl : public torch::nn::Module {
 
   // whether the weight is loaded
   void verify_loaded_weights(const std::string& prefix = "") const {
-    CHECK(is_loaded_) << "weight is not loaded for " << prefix + "weight";
+    MissingWeightsGuard::check(is_loaded_, prefix + "weight");
   }
 
   void pretty_print(std::ostream& stream) const override {
@@ -0,0 +1,38 @@
+#include "pooler.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+torch::Tensor Pooler::forward(const torch::Tensor& hidden_states,
+                              const torch::Tensor& cu_seq_lens,
+                              const torch::Tensor& use_mean,
+                              const torch::Tensor& normalize) {
+  const int64_t num_seqs = cu_seq_lens.numel() - 1;
+  CHECK_EQ(use_mean.numel(), num_seqs);
+  CHECK_EQ(normalize.numel(), num_seqs);
+  // accumulate in float32
+  const auto h = hidden_states.to(torch::kFloat32);
+  const auto cu_lens = cu_seq_lens.to(torch::kLong);
+  const auto seq_lens = cu_lens.slice(/*dim=*/0, /*start=*/1) -
+                        cu_lens.slice(/*dim=*/0, /*start=*/0, /*end=*/-1);
+
+  // sum of each sequence by scattering tokens to their sequences
+  const auto seq_idxes = torch::repeat_interleave(
+      torch::arange(num_seqs, cu_lens.options()), seq_lens);
+  auto mean = torch::zeros({num_seqs, h.size(-1)}, h.options())
+                  .index_add_(/*dim=*/0, seq_idxes, h);
+  mean.div_(seq_lens.clamp_min(1).unsqueeze(-1).to(h.scalar_type()));
+
+  const auto last_idxes =
+      (cu_lens.slice(/*dim=*/0, /*start=*/1) - 1).clamp_min(0);
+  const auto last = h.index_select(/*dim=*/0, last_idxes);
+
+  auto embeddings = torch::where(use_mean.unsqueeze(-1), mean, last);
+  const auto norm = embeddings.norm(/*p=*/2, /*dim=*/-1, /*keepdim=*/true)
+                        .clamp_min(1e-12);
+  return torch::where(normalize.unsqueeze(-1), embeddings / norm, embeddings);
+}
+
+}  // namespace llm
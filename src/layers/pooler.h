@@ -0,0 +1,22 @@
+#pragma once
+
+#include <torch/torch.h>
+
+namespace llm {
+
+// pool the hidden states of each sequence into one embedding on the device.
+class Pooler {
+ public:
+  // hidden_states: [num_tokens, hidden_size]
+  // cu_seq_lens: [num_seqs + 1] IntTensor, token range of each sequence
+  // use_mean: [num_seqs] BoolTensor, mean of all tokens if true, otherwise
+  // the last token of the sequence
+  // normalize: [num_seqs] BoolTensor, scale embeddings to unit length
+  // returns embeddings in float32: [num_seqs, hidden_size]
+  static torch::Tensor forward(const torch::Tensor& hidden_states,
+                               const torch::Tensor& cu_seq_lens,
+                               const torch::Tensor& use_mean,
+                               const torch::Tensor& normalize);
+};
+
+}  // namespace llm
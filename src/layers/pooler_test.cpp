@@ -0,0 +1,31 @@
+#include "pooler.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+TEST(PoolerTest, MeanAndLast) {
+  const int64_t hidden_size = 8;
+  // 3 sequences with length 2, 3, 1
+  const auto hidden_states = torch::randn({6, hidden_size});
+  const auto cu_seq_lens = torch::tensor({0, 2, 5, 6}, torch::kInt);
+  const auto use_mean = torch::tensor({true, false, true});
+  const auto normalize = torch::tensor({false, false, true});
+
+  const auto embeddings =
+      Pooler::forward(hidden_states, cu_seq_lens, use_mean, normalize);
+  EXPECT_EQ(embeddings.sizes(), torch::IntArrayRef({3, hidden_size}));
+
+  // mean of the first sequence
+  EXPECT_TRUE(torch::allclose(embeddings[0],
+                              hidden_states.slice(0, 0, 2).mean(/*dim=*/0)));
+  // last token of the second sequence
+  EXPECT_TRUE(torch::allclose(embeddings[1], hidden_states[4]));
+  // normalized mean of the single token sequence
+  const auto expected = hidden_states[5] / hidden_states[5].norm();
+  EXPECT_TRUE(torch::allclose(embeddings[2], expected));
+  EXPECT_NEAR(embeddings[2].norm().item<float>(), 1.0f, 1e-5);
+}
+
+}  // namespace llm
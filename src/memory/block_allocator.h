@@ -10,11 +10,15 @@ namespace llm {
 // BlockAllocator is used to track memory blocks. It is not thread safe.
 // Please note: The actual memory has been allocated outside of this class. This
 // class only manages the allocation and deallocation of block ids.
+// A block can be shared by multiple sequences, it is returned to the free list
+// when the last reference is freed.
 class BlockAllocator final {
  public:
   // block_size: number of slots per block
   BlockAllocator(uint32_t num_blocks, uint32_t slots_per_block)
-      : free_block_count_(num_blocks), slots_per_block_(slots_per_block) {
+      : free_block_count_(num_blocks),
+        slots_per_block_(slots_per_block),
+        ref_counts_(num_blocks, 0) {
     free_blocks_.reserve(free_block_count_);
     for (int32_t i = 0; i < free_block_count_; ++i) {
       // push smaller block ids to the back of the vector
@@ -42,21 +46,39 @@ class BlockAllocator final {
   // allocate a block id
   int32_t allocate() {
     CHECK(free_block_count_ > 0) << "No more CPU memory blocks available";
-    return free_blocks_[--free_block_count_];
+    const int32_t block_id = free_blocks_[--free_block_count_];
+    ref_counts_[block_id] = 1;
+    return block_id;
   }
 
   // caller should make sure the block_id is valid
   void free(int32_t block_id) {
+    CHECK_GT(ref_counts_[block_id], 0) << "block is already freed";
+    if (--ref_counts_[block_id] > 0) {
+      // still referenced by other sequences
+      return;
+    }
     CHECK(free_block_count_ < free_blocks_.size());
     free_blocks_[free_block_count_++] = block_id;
   }
 
+  // add a reference to an allocated block
+  void share(int32_t block_id) {
+    CHECK_GT(ref_counts_[block_id], 0) << "can't share a free block";
+    ++ref_counts_[block_id];
+  }
+
+  // get number of references to the block
+  uint32_t ref_count(int32_t block_id) const { return ref_counts_[block_id]; }
+
   // get number of slots per block
   int32_t slots_per_block() const { return slots_per_block_; }
 
   // get number of free blocks
   int32_t free_block_count() const { return free_block_count_; }
 
+  size_t total_block_count() const { return ref_counts_.size(); }
+
  private:
   // free block count
   int32_t free_block_count_ = 0;
@@ -66,6 +88,9 @@ class BlockAllocator final {
 
   // free block list
   std::vector<int32_t> free_blocks_;
+
+  // number of references to each block
+  std::vector<uint32_t> ref_counts_;
 };
 
 }  // namespace llm
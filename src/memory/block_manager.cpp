@@ -2,8 +2,10 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "block_allocator.h"
@@ -11,13 +13,14 @@
 
 namespace llm {
 namespace {
-// get the number of cache blocks to allocate for the sequence
-size_t num_blocks_to_allocate(const Sequence& sequence, int32_t block_size) {
+// get the number of cache blocks to allocate for num_tokens of the sequence
+size_t num_blocks_to_allocate(const Sequence& sequence,
+                              size_t num_tokens,
+                              int32_t block_size) {
   if (sequence.is_finished()) {
     // no need to allocate more blocks for a finished sequence
     return 0;
   }
-  const size_t num_tokens = sequence.num_tokens();
   const size_t num_blocks = sequence.num_blocks();
   // round up to the nearest block number
   const size_t num_blocks_needed = (num_tokens + block_size - 1) / block_size;
@@ -27,6 +30,11 @@ size_t num_blocks_to_allocate(const Sequence& sequence, int32_t block_size) {
   }
   return num_blocks_needed - num_blocks;
 }
+
+// get the number of cache blocks to allocate for the sequence
+size_t num_blocks_to_allocate(const Sequence& sequence, int32_t block_size) {
+  return num_blocks_to_allocate(sequence, sequence.num_tokens(), block_size);
+}
 }  // namespace
 BlockManager::BlockManager(uint32_t num_blocks, int32_t block_size)
     : block_size_(block_size), block_allocator_(num_blocks, block_size) {}
@@ -69,8 +77,17 @@ void BlockManager::release_slots_for_request(Request* request) {
 
 bool BlockManager::allocate_slots_for_sequence(Sequence* sequence) {
   DCHECK(sequence != nullptr);
+  return allocate_slots_for_sequence(sequence, sequence->num_tokens());
+}
+
+bool BlockManager::allocate_slots_for_sequence(Sequence* sequence,
+                                               size_t num_tokens) {
+  DCHECK(sequence != nullptr);
+  if (!copy_on_write(sequence, num_tokens)) {
+    return false;
+  }
   const uint32_t num_additional_blocks =
-      num_blocks_to_allocate(*sequence, block_size_);
+      num_blocks_to_allocate(*sequence, num_tokens, block_size_);
   if (num_additional_blocks == 0) {
     // no need to allocate more blocks
     return true;
@@ -92,6 +109,13 @@ void BlockManager::release_slots_for_sequence(Sequence* sequence) {
   block_allocator_.free(block_ids);
 }
 
+void BlockManager::release_slots_for_sequence(Sequence* sequence,
+                                              size_t num_tokens) {
+  DCHECK(sequence != nullptr);
+  const size_t num_blocks = (num_tokens + block_size_ - 1) / block_size_;
+  block_allocator_.free(sequence->release_blocks(num_blocks));
+}
+
 bool BlockManager::allocate_slots_for_sequences(std::vector<Sequence*>& sequences) {
   for (auto sequence : sequences) {
     DCHECK(sequence != nullptr);
@@ -121,4 +145,43 @@ void BlockManager::release_slots_for_sequences(std::vector<Sequence*>& sequences
   }
 }
 
+void BlockManager::fork_slots_for_sequence(const Sequence& src,
+                                           Sequence* dst) {
+  DCHECK(dst != nullptr);
+  release_slots_for_sequence(dst);
+  for (const int32_t block_id : src.blocks()) {
+    block_allocator_.share(block_id);
+  }
+  dst->append_blocks(src.blocks());
+}
+
+std::vector<std::pair<int32_t, int32_t>> BlockManager::pop_block_copies() {
+  return std::exchange(block_copies_, {});
+}
+
+bool BlockManager::copy_on_write(Sequence* sequence, size_t num_tokens) {
+  if (sequence->is_finished()) {
+    return true;
+  }
+  // blocks holding the tokens to be written: [cache_pos, num_tokens)
+  const size_t start = sequence->num_tokens_in_cache() / block_size_;
+  const size_t end = std::min(sequence->num_blocks(),
+                              (num_tokens + block_size_ - 1) / block_size_);
+  for (size_t i = start; i < end; ++i) {
+    const int32_t block_id = sequence->blocks()[i];
+    if (block_allocator_.ref_count(block_id) <= 1) {
+      continue;
+    }
+    if (block_allocator_.free_block_count() == 0) {
+      return false;
+    }
+    const int32_t new_block_id = block_allocator_.allocate();
+    block_copies_.emplace_back(block_id, new_block_id);
+    sequence->replace_block(i, new_block_id);
+    // drop the reference to the shared block
+    block_allocator_.free(block_id);
+  }
+  return true;
+}
+
 }  // namespace llm
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "block_allocator.h"
@@ -22,18 +23,55 @@ class BlockManager final {
 
   bool allocate_slots_for_sequence(Sequence* sequence);
 
+  // try to allocate slots for the first num_tokens tokens of the sequence,
+  // used to reserve slots for tokens to be generated.
+  bool allocate_slots_for_sequence(Sequence* sequence, size_t num_tokens);
+
   void release_slots_for_sequence(Sequence* sequence);
 
+  // release the blocks not needed by the first num_tokens tokens of the
+  // sequence, used to give back slots reserved for tokens to be generated.
+  void release_slots_for_sequence(Sequence* sequence, size_t num_tokens);
+
   bool allocate_slots_for_sequences(std::vector<Sequence*>& sequences);
 
   void release_slots_for_sequences(std::vector<Sequence*>& sequences);
 
+  // share the cache blocks of src with dst, the blocks of dst are released
+  // first. shared blocks are copied on write when allocating slots.
+  void fork_slots_for_sequence(const Sequence& src, Sequence* dst);
+
+  // returns block copies (src_block_id, dst_block_id) recorded by
+  // copy-on-write since last call. the copies should be done before running
+  // the model.
+  std::vector<std::pair<int32_t, int32_t>> pop_block_copies();
+
+  // get number of free blocks
+  uint32_t num_free_blocks() const {
+    return block_allocator_.free_block_count();
+  }
+
+  // get number of blocks managed, free or not
+  uint32_t num_total_blocks() const {
+    return static_cast<uint32_t>(block_allocator_.total_block_count());
+  }
+
+  // get number of slots per block
+  int32_t block_size() const { return block_size_; }
+
  private:
+  // give the sequence its own copy of shared blocks that are going to be
+  // written by the tokens before num_tokens.
+  bool copy_on_write(Sequence* sequence, size_t num_tokens);
+
   // number of slots per block
   int32_t block_size_ = 0;
 
   // the block allocator that manages the memory blocks
   BlockAllocator block_allocator_;
+
+  // pending block copies recorded by copy-on-write
+  std::vector<std::pair<int32_t, int32_t>> block_copies_;
 };
 
 }  // namespace llm
@@ -65,6 +65,33 @@ void KVCache::set_kv_cache_cuda(const torch::Tensor& slot_ids,
       slot_ids, keys, values, key_cache_, value_cache_, stream);
 }
 
+void KVCache::copy_kv_cache(const torch::Tensor& src_slot_ids,
+                            const torch::Tensor& dst_slot_ids) {
+  DCHECK_EQ(src_slot_ids.numel(), dst_slot_ids.numel());
+  // gather before scatter so that overlapped slots are handled correctly
+  auto [keys, values] = get_kv_cache(src_slot_ids);
+  set_kv_cache(dst_slot_ids.to(keys.device()), keys, values);
+}
+
+std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_blocks(
+    const torch::Tensor& block_ids) const {
+  DCHECK_EQ(block_ids.dtype(), torch::kLong);
+  const auto ids = block_ids.to(key_cache_.device());
+  return {key_cache_.index_select(/*dim=*/0, ids),
+          value_cache_.index_select(/*dim=*/0, ids)};
+}
+
+void KVCache::set_kv_blocks(const torch::Tensor& block_ids,
+                            const torch::Tensor& keys,
+                            const torch::Tensor& values) {
+  DCHECK_EQ(block_ids.dtype(), torch::kLong);
+  DCHECK_EQ(block_ids.numel(), keys.size(0));
+  DCHECK_EQ(block_ids.numel(), values.size(0));
+  const auto ids = block_ids.to(key_cache_.device());
+  key_cache_.index_copy_(/*dim=*/0, ids, keys.to(key_cache_.device()));
+  value_cache_.index_copy_(/*dim=*/0, ids, values.to(value_cache_.device()));
+}
+
 std::tuple<torch::Tensor, torch::Tensor> KVCache::get_kv_cache(
     const torch::Tensor& slot_ids) const {
   DCHECK_EQ(slot_ids.dtype(), torch::kInt);
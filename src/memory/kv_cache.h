@@ -33,6 +33,26 @@ class KVCache final {
                     const torch::Tensor& values,
                     cudaStream_t stream = nullptr);
 
+  // copy key and value cache from src_slot_ids to dst_slot_ids, used to
+  // compact the kv cache of accepted speculative tokens.
+  // src_slot_ids/dst_slot_ids: [num_slots] IntTensor
+  void copy_kv_cache(const torch::Tensor& src_slot_ids,
+                     const torch::Tensor& dst_slot_ids);
+
+  // get whole key and value cache blocks, used to migrate the kv cache of a
+  // sequence to another engine.
+  // block_ids: [num_blocks] LongTensor
+  // returns keys/values: [num_blocks, block_size, num_heads, head_dim]
+  std::tuple<torch::Tensor, torch::Tensor> get_kv_blocks(
+      const torch::Tensor& block_ids) const;
+
+  // overwrite whole key and value cache blocks with migrated keys/values.
+  // block_ids: [num_blocks] LongTensor
+  // keys/values: [num_blocks, block_size, num_heads, head_dim]
+  void set_kv_blocks(const torch::Tensor& block_ids,
+                     const torch::Tensor& keys,
+                     const torch::Tensor& values);
+
   // get key and value cache for a sequence based on physical memory blocks
   // block_table: [num_blocks] IntTensor
   // context_len: the length of the sequence
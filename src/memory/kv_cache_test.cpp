@@ -102,4 +102,67 @@ TEST(KVCacheTest, Random) {
   }
 }
 
+TEST(KVCacheTest, Copy) {
+  const int num_kv_heads = 2;
+  const int head_dim = 4;
+  const int block_size = 4;
+  const int num_blocks = 3;
+
+  torch::Tensor key_cache = torch::zeros(
+      {num_blocks, block_size, num_kv_heads, head_dim}, torch::kFloat);
+  torch::Tensor value_cache = torch::zeros(
+      {num_blocks, block_size, num_kv_heads, head_dim}, torch::kFloat);
+  KVCache kv_cache(key_cache, value_cache);
+
+  // slot i holds value i
+  const int num_slots = num_blocks * block_size;
+  torch::Tensor slot_ids = torch::arange(num_slots, torch::kInt);
+  torch::Tensor keys =
+      torch::arange(num_slots, torch::kFloat)
+          .view({num_slots, 1, 1})
+          .expand({num_slots, num_kv_heads, head_dim})
+          .contiguous();
+  kv_cache.set_kv_cache(slot_ids, keys, keys * 2);
+
+  // move slots {5, 7, 9} to {4, 5, 6}, dst 5 overlaps with src 5
+  kv_cache.copy_kv_cache(torch::tensor({5, 7, 9}, torch::kInt),
+                         torch::tensor({4, 5, 6}, torch::kInt));
+
+  auto [keys_out, values_out] =
+      kv_cache.get_kv_cache(torch::tensor({4, 5, 6, 7}, torch::kInt));
+  auto desired = keys.index_select(/*dim=*/0,
+                                   torch::tensor({5, 7, 9, 7}, torch::kLong));
+  EXPECT_TRUE(torch::equal(keys_out, desired));
+  EXPECT_TRUE(torch::equal(values_out, desired * 2));
+}
+
+TEST(KVCacheTest, Blocks) {
+  const int num_kv_heads = 2;
+  const int head_dim = 4;
+  const int block_size = 4;
+  const int num_blocks = 3;
+
+  torch::Tensor key_cache = torch::rand(
+      {num_blocks, block_size, num_kv_heads, head_dim}, torch::kFloat);
+  torch::Tensor value_cache = torch::rand(
+      {num_blocks, block_size, num_kv_heads, head_dim}, torch::kFloat);
+  KVCache src_cache(key_cache, value_cache);
+  KVCache dst_cache(torch::zeros_like(key_cache),
+                    torch::zeros_like(value_cache));
+
+  // migrate blocks {2, 0} to {0, 1}
+  auto [keys, values] =
+      src_cache.get_kv_blocks(torch::tensor({2, 0}, torch::kLong));
+  dst_cache.set_kv_blocks(torch::tensor({0, 1}, torch::kLong), keys, values);
+
+  auto [keys_out, values_out] =
+      dst_cache.get_kv_blocks(torch::tensor({0, 1, 2}, torch::kLong));
+  EXPECT_TRUE(torch::equal(keys_out[0], key_cache[2]));
+  EXPECT_TRUE(torch::equal(keys_out[1], key_cache[0]));
+  EXPECT_TRUE(torch::equal(values_out[0], value_cache[2]));
+  EXPECT_TRUE(torch::equal(values_out[1], value_cache[0]));
+  // untouched block
+  EXPECT_TRUE(torch::equal(keys_out[2], torch::zeros_like(key_cache[2])));
+}
+
 }  // namespace llm
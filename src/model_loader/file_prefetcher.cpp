@@ -0,0 +1,106 @@
+#include "file_prefetcher.h"
+
+#include <fcntl.h>
+#include <folly/futures/Future.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llm {
+namespace {
+
+// bytes of a file read by one task
+constexpr int64_t kChunkSize = int64_t(64) * 1024 * 1024;
+// bytes read by each pread call
+constexpr int64_t kReadSize = int64_t(4) * 1024 * 1024;
+
+// shared by the chunk reads of a file, the last one closes the file
+struct PrefetchState {
+  ~PrefetchState() { ::close(fd); }
+
+  int fd = -1;
+  std::atomic<int64_t> num_pending_chunks{0};
+  folly::Promise<folly::Unit> promise;
+};
+
+// read [offset, offset + length) of the file into the page cache
+void read_chunk(int fd, int64_t offset, int64_t length) {
+  std::vector<char> buffer(std::min(length, kReadSize));
+  while (length > 0) {
+    const auto n = ::pread(fd,
+                           buffer.data(),
+                           std::min<int64_t>(length, buffer.size()),
+                           offset);
+    if (n <= 0) {
+      // interrupted or failed, the rest is faulted in when mapped
+      return;
+    }
+    offset += n;
+    length -= n;
+  }
+}
+
+}  // namespace
+
+FilePrefetcher::FilePrefetcher(size_t num_threads)
+    : threadpool_(num_threads) {}
+
+FilePrefetcher::~FilePrefetcher() {
+  stopped_.store(true, std::memory_order_relaxed);
+}
+
+void FilePrefetcher::prefetch(const std::string& path) {
+  if (pending_.count(path) > 0) {
+    return;
+  }
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to open " << path << " for prefetching";
+    return;
+  }
+  auto state = std::make_shared<PrefetchState>();
+  state->fd = fd;
+  struct stat file_stat = {};
+  if (::fstat(fd, &file_stat) != 0) {
+    PLOG(WARNING) << "Failed to stat " << path << " for prefetching";
+    return;
+  }
+  const int64_t file_size = file_stat.st_size;
+  const int64_t num_chunks = (file_size + kChunkSize - 1) / kChunkSize;
+  pending_.emplace(path, state->promise.getSemiFuture());
+  if (num_chunks == 0) {
+    state->promise.setValue();
+    return;
+  }
+
+  state->num_pending_chunks.store(num_chunks, std::memory_order_relaxed);
+  for (int64_t i = 0; i < num_chunks; ++i) {
+    const int64_t offset = i * kChunkSize;
+    const int64_t length = std::min(kChunkSize, file_size - offset);
+    threadpool_.schedule([this, state, offset, length]() {
+      if (!stopped_.load(std::memory_order_relaxed)) {
+        read_chunk(state->fd, offset, length);
+      }
+      if (state->num_pending_chunks.fetch_sub(1) == 1) {
+        state->promise.setValue();
+      }
+    });
+  }
+}
+
+void FilePrefetcher::wait(const std::string& path) {
+  auto it = pending_.find(path);
+  if (it == pending_.end()) {
+    return;
+  }
+  std::move(it->second).get();
+  pending_.erase(it);
+}
+
+}  // namespace llm
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <folly/futures/Future.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include "common/threadpool.h"
+
+namespace llm {
+
+// FilePrefetcher reads weights files into the page cache in the background.
+// each file is split into chunks that are read in parallel, so that mapping
+// the file afterwards only takes page table updates instead of disk reads.
+class FilePrefetcher final {
+ public:
+  explicit FilePrefetcher(size_t num_threads);
+
+  // chunks not read yet are skipped, running reads are waited for
+  ~FilePrefetcher();
+
+  // start reading the file in the background, no-op if already started.
+  // failures are logged and ignored since prefetching is only a hint.
+  void prefetch(const std::string& path);
+
+  // wait for the prefetch of the file, no-op if not prefetched
+  void wait(const std::string& path);
+
+ private:
+  // set when destroyed to skip pending chunks
+  std::atomic<bool> stopped_{false};
+
+  // prefetches not waited for yet
+  std::unordered_map<std::string, folly::SemiFuture<folly::Unit>> pending_;
+
+  // threads reading chunks, destroyed first to join them
+  ThreadPool threadpool_;
+};
+
+}  // namespace llm
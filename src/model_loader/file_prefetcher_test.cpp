@@ -0,0 +1,79 @@
+#include "file_prefetcher.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+namespace llm {
+namespace {
+
+// create a file of the given size in the temp directory, sparse beyond data
+std::string create_file(const std::string& name,
+                        const std::string& data,
+                        uintmax_t size) {
+  const auto path = std::filesystem::temp_directory_path() / name;
+  {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  }
+  std::filesystem::resize_file(path, size);
+  return path.string();
+}
+
+}  // namespace
+
+TEST(FilePrefetcherTest, PrefetchThenWait) {
+  const auto path = create_file("file_prefetcher_test_small", "weights", 1024);
+  FilePrefetcher prefetcher(/*num_threads=*/2);
+  prefetcher.prefetch(path);
+  prefetcher.wait(path);
+  // waited prefetches and unknown files are no-ops
+  prefetcher.wait(path);
+  prefetcher.wait("file_prefetcher_test_unknown");
+  // missing files are ignored
+  prefetcher.prefetch("file_prefetcher_test_missing");
+  prefetcher.wait("file_prefetcher_test_missing");
+  std::filesystem::remove(path);
+}
+
+TEST(FilePrefetcherTest, DuplicatePrefetch) {
+  const auto path = create_file("file_prefetcher_test_dup", "weights", 1024);
+  FilePrefetcher prefetcher(/*num_threads=*/2);
+  prefetcher.prefetch(path);
+  prefetcher.prefetch(path);
+  prefetcher.wait(path);
+  // the file can be prefetched again once waited for
+  prefetcher.prefetch(path);
+  prefetcher.wait(path);
+  std::filesystem::remove(path);
+}
+
+TEST(FilePrefetcherTest, ZeroSizeFile) {
+  const auto path = create_file("file_prefetcher_test_empty", "", 0);
+  FilePrefetcher prefetcher(/*num_threads=*/1);
+  prefetcher.prefetch(path);
+  prefetcher.wait(path);
+  std::filesystem::remove(path);
+}
+
+TEST(FilePrefetcherTest, DestroyWithPendingChunks) {
+  // a sparse file of several chunks, read by one thread
+  const uintmax_t size = uintmax_t(256) * 1024 * 1024;
+  const auto path = create_file("file_prefetcher_test_large", "", size);
+  {
+    FilePrefetcher prefetcher(/*num_threads=*/1);
+    prefetcher.prefetch(path);
+    // destroyed without waiting, pending chunks are skipped
+  }
+  {
+    FilePrefetcher prefetcher(/*num_threads=*/1);
+    prefetcher.prefetch(path);
+    prefetcher.wait(path);
+  }
+  std::filesystem::remove(path);
+}
+
+}  // namespace llm
@@ -0,0 +1,124 @@
+#include "lora_registry.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_split.h>
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "common/json_reader.h"
+#include "state_dict.h"
+
+namespace llm {
+namespace {
+
+// prefix added by peft to the names of the base model weights
+constexpr std::string_view kPeftPrefix = "base_model.model.";
+
+}  // namespace
+
+bool LoRARegistry::add(const std::string& name,
+                       const std::string& adapter_path) {
+  if (name.empty() || name_to_id_.count(name) > 0) {
+    LOG(ERROR) << "Invalid or duplicate lora adapter name: " << name;
+    return false;
+  }
+
+  JsonReader reader;
+  if (!reader.parse(adapter_path + "/adapter_config.json")) {
+    LOG(ERROR) << "Failed to parse adapter_config.json in " << adapter_path;
+    return false;
+  }
+  const auto r = reader.value_or<int64_t>("r", 0);
+  if (r <= 0) {
+    LOG(ERROR) << "Invalid lora rank " << r << " in " << adapter_path;
+    return false;
+  }
+  const auto lora_alpha = reader.value_or<float>("lora_alpha", r);
+  const bool use_rslora = reader.value_or<bool>("use_rslora", false);
+
+  std::unique_ptr<StateDict> weights;
+  const std::string safetensors_path =
+      adapter_path + "/adapter_model.safetensors";
+  const std::string pickle_path = adapter_path + "/adapter_model.bin";
+  if (std::filesystem::exists(safetensors_path)) {
+    weights = StateDict::load_safetensors(safetensors_path, 0, 1);
+  } else if (std::filesystem::exists(pickle_path)) {
+    weights = StateDict::load_pickle_file(pickle_path, 0, 1);
+  } else {
+    LOG(ERROR) << "Failed to find adapter weights in " << adapter_path;
+    return false;
+  }
+
+  // keep lora weights only, named after the base model. tensors are copied
+  // out of the file mapping so that the file can be released.
+  std::unordered_map<std::string, torch::Tensor> dict;
+  int64_t rank = 0;
+  for (const auto& [tensor_name, tensor] : *weights) {
+    const bool is_lora_a = absl::StrContains(tensor_name, ".lora_A.");
+    if (!is_lora_a && !absl::StrContains(tensor_name, ".lora_B.")) {
+      continue;
+    }
+    std::string_view base_name = tensor_name;
+    if (absl::StartsWith(base_name, kPeftPrefix)) {
+      base_name.remove_prefix(kPeftPrefix.size());
+    }
+    if (is_lora_a) {
+      rank = std::max(rank, tensor.size(0));
+    }
+    dict[std::string(base_name)] = tensor.clone();
+  }
+  if (dict.empty()) {
+    LOG(ERROR) << "No lora weights found in " << adapter_path;
+    return false;
+  }
+
+  LoRAAdapter adapter;
+  adapter.name = name;
+  adapter.rank = rank;
+  adapter.scaling = use_rslora ? lora_alpha / std::sqrt(static_cast<float>(r))
+                               : lora_alpha / static_cast<float>(r);
+  adapter.state_dict = std::make_unique<StateDict>(std::move(dict), 0, 1);
+
+  const auto id = static_cast<int32_t>(adapters_.size());
+  LOG(INFO) << "Loaded lora adapter " << name << " (id " << id << ") from "
+            << adapter_path << " with rank " << rank << ", scaling "
+            << adapter.scaling << " and " << adapter.state_dict->size()
+            << " tensors";
+  adapters_.push_back(std::move(adapter));
+  name_to_id_[name] = id;
+  return true;
+}
+
+bool LoRARegistry::add_all(const std::string& adapters) {
+  for (const auto& item : absl::StrSplit(adapters, ',', absl::SkipEmpty())) {
+    const std::vector<std::string> name_path =
+        absl::StrSplit(item, absl::MaxSplits('=', 1));
+    if (name_path.size() != 2) {
+      LOG(ERROR) << "Invalid lora adapter " << item << ", expected name=path";
+      return false;
+    }
+    if (!add(name_path[0], name_path[1])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int32_t LoRARegistry::find(const std::string& name) const {
+  const auto it = name_to_id_.find(name);
+  return it == name_to_id_.end() ? -1 : it->second;
+}
+
+const LoRAAdapter& LoRARegistry::get(int32_t id) const {
+  CHECK(id >= 0 && id < static_cast<int32_t>(adapters_.size()))
+      << "Invalid lora adapter id " << id;
+  return adapters_[id];
+}
+
+}  // namespace llm
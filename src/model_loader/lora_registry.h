@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "state_dict.h"
+
+namespace llm {
+
+// a lora adapter held in host memory
+struct LoRAAdapter {
+  // name used by requests to select the adapter
+  std::string name;
+
+  // rank of the adapter, the max one if it varies across layers
+  int64_t rank = 0;
+
+  // lora_alpha / r, or lora_alpha / sqrt(r) for rank stabilized lora
+  float scaling = 1.0f;
+
+  // lora_A and lora_B weights named after the base model, for example
+  // model.layers.0.self_attn.q_proj.lora_A.weight
+  std::unique_ptr<StateDict> state_dict;
+};
+
+// lora adapters that requests can select by name. adapters are loaded into
+// host memory once at startup, and workers page them into device slots on
+// demand. adapters can only be added before serving, lookups are thread safe
+// afterwards.
+class LoRARegistry final {
+ public:
+  // load the peft adapter in adapter_path, which holds adapter_config.json
+  // and adapter_model.safetensors (or adapter_model.bin).
+  // returns false if the adapter can't be loaded.
+  bool add(const std::string& name, const std::string& adapter_path);
+
+  // load adapters from comma separated name=path pairs
+  bool add_all(const std::string& adapters);
+
+  // returns the id of the adapter with the name, -1 if not found
+  int32_t find(const std::string& name) const;
+
+  const LoRAAdapter& get(int32_t id) const;
+
+  size_t size() const { return adapters_.size(); }
+
+  bool empty() const { return adapters_.empty(); }
+
+ private:
+  // adapters indexed by id
+  std::vector<LoRAAdapter> adapters_;
+
+  std::unordered_map<std::string, int32_t> name_to_id_;
+};
+
+}  // namespace llm
@@ -19,6 +19,11 @@
 #include "tokenizer/sentencepiece_tokenizer.h"
 #include "tokenizer/tiktoken_tokenizer.h"
 
+DEFINE_int32(weights_prefetch_threads,
+             8,
+             "number of threads reading weights files into the page cache "
+             "ahead of loading, 0 to disable prefetching");
+
 namespace llm {
 StateDictIterator::StateDictIterator(
     const std::vector<std::string>& model_weights_files,
@@ -28,13 +33,28 @@ StateDictIterator::StateDictIterator(
     : model_weights_files_(model_weights_files),
       index_(index),
       is_pickle_(is_pickle),
-      is_sharded_(is_sharded) {}
+      is_sharded_(is_sharded) {
+  if (FLAGS_weights_prefetch_threads > 0 &&
+      index_ < model_weights_files_.size()) {
+    prefetcher_ =
+        std::make_shared<FilePrefetcher>(FLAGS_weights_prefetch_threads);
+  }
+}
 
 const StateDict* StateDictIterator::get_state_dict() const {
   const size_t num_weight_files = model_weights_files_.size();
   CHECK(index_ < num_weight_files);
   // lazy loading
   if (!state_dict_) {
+    if (prefetcher_ != nullptr) {
+      // read the file with all threads unless it has been prefetched, then
+      // read the next one while this one is being loaded
+      prefetcher_->prefetch(model_weights_files_[index_]);
+      prefetcher_->wait(model_weights_files_[index_]);
+      if (index_ + 1 < num_weight_files) {
+        prefetcher_->prefetch(model_weights_files_[index_ + 1]);
+      }
+    }
     LOG(INFO) << "Loading model weights from " << model_weights_files_[index_];
 
     const int shard_id = is_sharded_ ? static_cast<int>(index_) : 0;
@@ -52,19 +72,53 @@ const StateDict* StateDictIterator::get_state_dict() const {
 
 std::unique_ptr<ModelLoader> ModelLoader::create(
     const std::string& model_weights_path) {
+  auto model_loader = try_create(model_weights_path);
+  CHECK(model_loader != nullptr)
+      << "Failed to load model from " << model_weights_path;
+  return model_loader;
+}
+
+std::unique_ptr<ModelLoader> ModelLoader::try_create(
+    const std::string& model_weights_path) {
+  std::error_code ec;
+  if (!std::filesystem::is_directory(model_weights_path, ec)) {
+    LOG(ERROR) << "Model weights path is not a directory: "
+               << model_weights_path;
+    return nullptr;
+  }
   bool has_hf_weight_files = false;
   for (const auto& entry :
-       std::filesystem::directory_iterator(model_weights_path)) {
+       std::filesystem::directory_iterator(model_weights_path, ec)) {
     if (entry.path().extension() == ".safetensors" ||
         entry.path().extension() == ".bin") {
       has_hf_weight_files = true;
       break;
     }
   }
-  if (has_hf_weight_files) {
-    return std::make_unique<HFModelLoader>(model_weights_path);
+  if (ec) {
+    LOG(ERROR) << "Failed to list " << model_weights_path << ": "
+               << ec.message();
+    return nullptr;
+  }
+
+  try {
+    if (has_hf_weight_files) {
+      auto model_loader = std::make_unique<HFModelLoader>(model_weights_path);
+      if (model_loader->init()) {
+        return model_loader;
+      }
+    } else {
+      auto model_loader = std::make_unique<PTModelLoader>(model_weights_path);
+      if (model_loader->init()) {
+        return model_loader;
+      }
+    }
+  } catch (const std::exception& e) {
+    // malformed json files
+    LOG(ERROR) << "Failed to load model args from " << model_weights_path
+               << ": " << e.what();
   }
-  return std::make_unique<PTModelLoader>(model_weights_path);
+  return nullptr;
 }
 
 std::unique_ptr<Tokenizer> PTModelLoader::tokenizer() const {
@@ -73,20 +127,28 @@ std::unique_ptr<Tokenizer> PTModelLoader::tokenizer() const {
 }
 
 PTModelLoader::PTModelLoader(const std::string& model_weights_path)
-    : model_weights_path_(model_weights_path) {
-  const std::string args_file_path = model_weights_path + "/params.json";
-  CHECK(load_model_args(args_file_path))
-      << "Failed to load model args from " << args_file_path;
+    : model_weights_path_(model_weights_path) {}
+
+bool PTModelLoader::init() {
+  const std::string args_file_path = model_weights_path_ + "/params.json";
+  if (!load_model_args(args_file_path)) {
+    LOG(ERROR) << "Failed to load model args from " << args_file_path;
+    return false;
+  }
   for (const auto& entry :
-       std::filesystem::directory_iterator(model_weights_path)) {
+       std::filesystem::directory_iterator(model_weights_path_)) {
     if (entry.path().extension() == ".pth") {
       model_weights_files_.push_back(entry.path().string());
     }
   }
-  CHECK(!model_weights_files_.empty())
-      << "Failed to find model weights files in " << model_weights_path;
+  if (model_weights_files_.empty()) {
+    LOG(ERROR) << "Failed to find model weights files in "
+               << model_weights_path_;
+    return false;
+  }
   // sort the model weights files by name
   std::sort(model_weights_files_.begin(), model_weights_files_.end());
+  return true;
 }
 
 bool PTModelLoader::load_model_args(const std::string& args_file_path) {
@@ -139,11 +201,15 @@ bool PTModelLoader::load_model_args(const std::string& args_file_path) {
 }
 
 HFModelLoader::HFModelLoader(const std::string& model_weights_path)
-    : model_weights_path_(model_weights_path) {
-  CHECK(load_model_args(model_weights_path));
+    : model_weights_path_(model_weights_path) {}
+
+bool HFModelLoader::init() {
+  if (!load_model_args(model_weights_path_)) {
+    return false;
+  }
   // try to load safetensors first
   for (const auto& entry :
-       std::filesystem::directory_iterator(model_weights_path)) {
+       std::filesystem::directory_iterator(model_weights_path_)) {
     // load bin or safe tensors
     if (entry.path().extension() == ".safetensors") {
       model_weights_files_.push_back(entry.path().string());
@@ -153,17 +219,21 @@ HFModelLoader::HFModelLoader(const std::string& model_weights_path)
   if (model_weights_files_.empty()) {
     // load pickle files
     for (const auto& entry :
-         std::filesystem::directory_iterator(model_weights_path)) {
+         std::filesystem::directory_iterator(model_weights_path_)) {
       if (entry.path().extension() == ".bin") {
         model_weights_files_.push_back(entry.path().string());
       }
     }
     is_pickle_ = true;
   }
-  CHECK(!model_weights_files_.empty())
-      << "Failed to find model weights files in " << model_weights_path;
+  if (model_weights_files_.empty()) {
+    LOG(ERROR) << "Failed to find model weights files in "
+               << model_weights_path_;
+    return false;
+  }
   // sort the model weights files by name
   std::sort(model_weights_files_.begin(), model_weights_files_.end());
+  return true;
 }
 
 std::unique_ptr<Tokenizer> HFModelLoader::tokenizer() const {
@@ -3,8 +3,10 @@
 #include <gflags/gflags.h>
 #include <torch/torch.h>
 
+#include <memory>
 #include <vector>
 
+#include "model_loader/file_prefetcher.h"
 #include "model_loader/state_dict.h"
 #include "models/model_args.h"
 #include "quantization/quant_args.h"
@@ -14,7 +16,8 @@
 namespace llm {
 
 // Iterator for StateDict, load the model weights file one by one to save
-// memory
+// memory. the next file is read into the page cache in the background while
+// the current one is being consumed.
 class StateDictIterator {
  public:
   StateDictIterator(const std::vector<std::string>& model_weights_files,
@@ -61,6 +64,9 @@ class StateDictIterator {
 
   // pointer to the current state dict, lazy loaded
   mutable std::unique_ptr<StateDict> state_dict_;
+
+  // reads weights files ahead, nullptr if prefetching is disabled
+  std::shared_ptr<FilePrefetcher> prefetcher_;
 };
 
 class ModelLoader {
@@ -80,6 +86,11 @@ class ModelLoader {
   // create a model loader from the given path
   static std::unique_ptr<ModelLoader> create(
       const std::string& model_weights_path);
+
+  // create a model loader from the given path, returns nullptr if the path
+  // is not a model directory or its args can't be loaded.
+  static std::unique_ptr<ModelLoader> try_create(
+      const std::string& model_weights_path);
 };
 
 // A model loader for shared pytorch model files.
@@ -87,6 +98,9 @@ class PTModelLoader : public ModelLoader {
  public:
   PTModelLoader(const std::string& model_weights_path);
 
+  // load model args and find weights files, returns false on failure
+  bool init();
+
   const ModelArgs& model_args() const override { return args_; }
 
   const QuantArgs& quant_args() const override { return quant_args_; }
@@ -132,6 +146,9 @@ class HFModelLoader : public ModelLoader {
  public:
   HFModelLoader(const std::string& model_weights_path);
 
+  // load model args and find weights files, returns false on failure
+  bool init();
+
   const ModelArgs& model_args() const override { return args_; }
 
   const QuantArgs& quant_args() const override { return quant_args_; }
@@ -2,15 +2,25 @@
 
 #include <ATen/core/TensorBody.h>
 #include <caffe2/serialize/inline_container.h>
+#include <fcntl.h>
+#include <folly/FileUtil.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <torch/csrc/jit/serialization/import_read.h>
 #include <torch/csrc/jit/serialization/storage_context.h>
 #include <torch/torch.h>
 
+#include <cstdint>
 #include <memory>
 
 #include "huggingface/safetensors.h"
 
+DEFINE_bool(mmap_weights,
+            false,
+            "let weights on cpu alias the memory mapped safetensors files "
+            "instead of copying them, so that the page cache is shared "
+            "across processes serving the same model");
+
 namespace llm {
 
 namespace {
@@ -75,6 +85,9 @@ std::vector<int64_t> get_sizes(const View* view) {
   return sizes;
 }
 
+// missing weights guard of the current thread
+thread_local MissingWeightsGuard* tl_missing_weights_guard = nullptr;
+
 }  // namespace
 
 std::unique_ptr<StateDict> StateDict::load_pickle_file(
@@ -103,9 +116,18 @@ std::unique_ptr<StateDict> StateDict::load_safetensors(
     int num_shards) {
   CHECK(shard_id >= 0 && shard_id < num_shards)
       << "Invalid shard id " << shard_id << " for " << num_shards << " shards";
+  // opened read only even if the mapping is writable, so that weights can
+  // be loaded from read only directories.
+  auto file = std::make_shared<folly::File>(weights_file, O_RDONLY);
   folly::MemoryMapping::Options options;
-  options.setPrefault(true).setReadable(true);
-  auto mem_map = std::make_unique<folly::MemoryMapping>(weights_file.c_str(),
+  // pages are faulted in on access, sharded tensors are read from the file
+  // directly so that each rank only reads its own shards.
+  options.setReadable(true);
+  if (FLAGS_mmap_weights) {
+    // parameters may alias the mapping, writes go to private copies of pages
+    options.setWritable(true).setShared(false);
+  }
+  auto mem_map = std::make_shared<folly::MemoryMapping>(file->dup(),
                                                         0,   // offset
                                                         -1,  // length
                                                         options);
@@ -139,9 +161,11 @@ std::unique_ptr<StateDict> StateDict::load_safetensors(
     const auto scalar_type = get_dtype(tensor_view->dtype);
     const void* tensor_data = data + tensor_view->start;
     const std::vector<int64_t> tensor_sizes = get_sizes(tensor_view);
+    // the tensor keeps the mapping alive in case it is aliased
     // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
     const auto tensor = at::from_blob(const_cast<void*>(tensor_data),
                                       tensor_sizes,
+                                      [mem_map](void* /*data*/) {},
                                       torch::dtype(scalar_type));
     CHECK(safetensors_free_tensor(tensor_view) == Status::Ok)
         << "Failed to free tensor view";
@@ -152,8 +176,11 @@ std::unique_ptr<StateDict> StateDict::load_safetensors(
   CHECK(safetensors_destroy(handle) == Status::Ok)
       << "Failed to destroy safetensors handle";
 
-  return std::make_unique<StateDict>(
-      std::move(mem_map), std::move(dict), shard_id, num_shards);
+  return std::make_unique<StateDict>(std::move(mem_map),
+                                     std::move(file),
+                                     std::move(dict),
+                                     shard_id,
+                                     num_shards);
 }
 
 StateDict::StateDict(std::unordered_map<std::string, torch::Tensor> dict,
@@ -165,11 +192,14 @@ StateDict::StateDict(std::unordered_map<std::string, torch::Tensor> dict,
       << " shards";
 }
 
-StateDict::StateDict(std::unique_ptr<folly::MemoryMapping> mem_map,
+StateDict::StateDict(std::shared_ptr<folly::MemoryMapping> mem_map,
+                     std::shared_ptr<folly::File> file,
                      std::unordered_map<std::string, torch::Tensor> dict,
                      int shard_id,
                      int num_shards)
     : mem_map_(std::move(mem_map)),
+      file_(std::move(file)),
+      file_range_(mem_map_->range()),
       dict_(std::move(dict)),
       shard_id_(shard_id),
       num_shards_(num_shards) {
@@ -215,7 +245,7 @@ torch::Tensor StateDict::get_sharded_tensor(const std::string_view& tensor_name,
   }
   // chunk tensor along the dim
   const int64_t dim_size = tensor.size(dim);
-  if (dim_size <= num_ranks_per_shard) {
+  if (num_ranks_per_shard == 1 || dim_size <= num_ranks_per_shard) {
     // too small to shard, return the whole tensor instead
     return tensor;
   }
@@ -223,10 +253,63 @@ torch::Tensor StateDict::get_sharded_tensor(const std::string_view& tensor_name,
   CHECK(dim_size % num_ranks_per_shard == 0)
       << "can't devide tensor evenly on " << dim << " with dim: " << dim_size
       << " ranks_per_shard: " << num_ranks_per_shard;
+  if (!transform_func_) {
+    // read the shard from the file without touching the rest of the tensor
+    auto shard = read_shard(tensor, dim, local_rank, num_ranks_per_shard);
+    if (shard.defined()) {
+      return shard;
+    }
+  }
   const auto chunks = tensor.chunk(num_ranks_per_shard, dim);
   return chunks[local_rank];
 }
 
+torch::Tensor StateDict::read_shard(const torch::Tensor& tensor,
+                                    int64_t dim,
+                                    int64_t local_rank,
+                                    int64_t num_ranks) const {
+  // only shards along dim 0 or 1 are read row by row, chunk the rest
+  if (file_ == nullptr || !tensor.is_contiguous() || dim > 1) {
+    return torch::Tensor{nullptr};
+  }
+  const auto* data = static_cast<const uint8_t*>(tensor.data_ptr());
+  if (data < file_range_.begin() ||
+      data + tensor.nbytes() > file_range_.end()) {
+    return torch::Tensor{nullptr};
+  }
+  const int64_t file_offset = data - file_range_.begin();
+
+  auto sizes = tensor.sizes().vec();
+  const int64_t dim_size = sizes[dim];
+  sizes[dim] = dim_size / num_ranks;
+  auto shard = torch::empty(sizes, tensor.options());
+
+  // bytes of one index along the dim
+  const int64_t slice_bytes = tensor.stride(dim) * tensor.element_size();
+  // contiguous bytes of the shard: the whole shard for dim 0, one row of
+  // the shard for dim 1.
+  const int64_t shard_bytes = sizes[dim] * slice_bytes;
+  const int64_t num_rows = dim == 0 ? 1 : sizes[0];
+  auto* dst = static_cast<uint8_t*>(shard.data_ptr());
+  for (int64_t i = 0; i < num_rows; ++i) {
+    const int64_t offset =
+        file_offset + (i * dim_size * slice_bytes) + (local_rank * shard_bytes);
+    const auto n = folly::preadFull(
+        file_->fd(), dst + (i * shard_bytes), shard_bytes, offset);
+    PCHECK(n == shard_bytes) << "Failed to read " << shard_bytes
+                             << " bytes at offset " << offset;
+  }
+  return shard;
+}
+
+int64_t StateDict::num_bytes() const {
+  int64_t num_bytes = 0;
+  for (const auto& [name, tensor] : dict_) {
+    num_bytes += static_cast<int64_t>(tensor.nbytes());
+  }
+  return num_bytes;
+}
+
 // select all the tensors whose name starts with prefix.
 StateDict StateDict::select(const std::string_view& prefix) const {
   std::unordered_map<std::string, torch::Tensor> selected;
@@ -236,7 +319,11 @@ StateDict StateDict::select(const std::string_view& prefix) const {
       selected[name.substr(prefix.length())] = tensor;
     }
   }
-  return {std::move(selected), shard_id_, num_shards_};
+  StateDict selected_dict(std::move(selected), shard_id_, num_shards_);
+  // the selected tensors are still mapped from the same file
+  selected_dict.file_ = file_;
+  selected_dict.file_range_ = file_range_;
+  return selected_dict;
 }
 
 StateDict StateDict::select_with_transform(
@@ -247,4 +334,40 @@ StateDict StateDict::select_with_transform(
   return selected;
 }
 
+void load_weight(torch::Tensor& param, const torch::Tensor& weight) {
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  const auto address = reinterpret_cast<uintptr_t>(weight.data_ptr());
+  const bool aliasable = FLAGS_mmap_weights && param.device().is_cpu() &&
+                         weight.device().is_cpu() &&
+                         param.dtype() == weight.dtype() &&
+                         param.sizes() == weight.sizes() &&
+                         weight.is_contiguous() &&
+                         address % weight.element_size() == 0;
+  if (aliasable) {
+    // share the storage of the weight, mapped weights stay in the page cache
+    param.set_(weight);
+  } else {
+    param.copy_(weight);
+  }
+}
+
+MissingWeightsGuard::MissingWeightsGuard()
+    : prev_guard_(tl_missing_weights_guard) {
+  tl_missing_weights_guard = this;
+}
+
+MissingWeightsGuard::~MissingWeightsGuard() {
+  tl_missing_weights_guard = prev_guard_;
+}
+
+void MissingWeightsGuard::check(bool is_loaded, const std::string& name) {
+  if (is_loaded) {
+    return;
+  }
+  if (tl_missing_weights_guard == nullptr) {
+    LOG(FATAL) << name << " is not loaded";
+  }
+  tl_missing_weights_guard->missing_weights_.push_back(name);
+}
+
 }  // namespace llm
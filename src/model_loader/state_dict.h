@@ -1,10 +1,14 @@
 #pragma once
 #include <c10/core/DeviceType.h>
+#include <folly/File.h>
+#include <folly/Range.h>
 #include <folly/system/MemoryMapping.h>
 #include <torch/torch.h>
 
 #include <memory>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace llm {
 
@@ -24,7 +28,8 @@ class StateDict final {
             int shard_id,
             int num_shards);
 
-  StateDict(std::unique_ptr<folly::MemoryMapping> mem_map,
+  StateDict(std::shared_ptr<folly::MemoryMapping> mem_map,
+            std::shared_ptr<folly::File> file,
             std::unordered_map<std::string, torch::Tensor> dict,
             int shard_id,
             int num_shards);
@@ -33,6 +38,7 @@ class StateDict final {
   torch::Tensor get_tensor(const std::string_view& tensor_name) const;
 
   // get the sharded tensor with the given name for the given rank.
+  // for safetensors, only the bytes of the shard are read from the file.
   torch::Tensor get_sharded_tensor(const std::string_view& tensor_name,
                                    int64_t dim,
                                    int rank,
@@ -50,6 +56,9 @@ class StateDict final {
 
   size_t size() const { return dict_.size(); }
 
+  // total bytes of all tensors
+  int64_t num_bytes() const;
+
   int shard_id() const { return shard_id_; }
 
   int num_shards() const { return num_shards_; }
@@ -59,8 +68,22 @@ class StateDict final {
   auto end() const { return dict_.end(); }
 
  private:
-  // memory mapping for safetensors
-  std::unique_ptr<folly::MemoryMapping> mem_map_;
+  // read the shard of a tensor mapped from the file into a new tensor.
+  // return undefined tensor if the tensor is not mapped from the file or dim
+  // is not 0 or 1.
+  torch::Tensor read_shard(const torch::Tensor& tensor,
+                           int64_t dim,
+                           int64_t local_rank,
+                           int64_t num_ranks) const;
+
+  // memory mapping for safetensors, also held by the mapped tensors
+  std::shared_ptr<folly::MemoryMapping> mem_map_;
+
+  // safetensors file for reading shards, shared with the selected dicts
+  std::shared_ptr<folly::File> file_;
+
+  // mapped content of the file, used to locate tensors in the file
+  folly::ByteRange file_range_;
 
   std::unordered_map<std::string, torch::Tensor> dict_;
 
@@ -72,4 +95,32 @@ class StateDict final {
   // total number of data shards
   int num_shards_ = 1;
 };
+
+// copy the loaded weight into the parameter. with --mmap_weights, a cpu
+// parameter aliases the weight instead if their dtypes and layouts match.
+void load_weight(torch::Tensor& param, const torch::Tensor& weight);
+
+// verify_loaded_weights aborts on the first missing weight. within the scope
+// of the guard, missing weights are collected instead, so that a reloaded
+// checkpoint can be rejected without taking down the server.
+class MissingWeightsGuard final {
+ public:
+  MissingWeightsGuard();
+
+  ~MissingWeightsGuard();
+
+  // names of the missing weights collected so far
+  const std::vector<std::string>& missing_weights() const {
+    return missing_weights_;
+  }
+
+  // called by layers for each of their weights
+  static void check(bool is_loaded, const std::string& name);
+
+ private:
+  MissingWeightsGuard* prev_guard_ = nullptr;
+
+  std::vector<std::string> missing_weights_;
+};
+
 }  // namespace llm
@@ -1,8 +1,14 @@
 #include "state_dict.h"
 
 #include <c10/core/Device.h>
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 
+#include <filesystem>
+#include <fstream>
+
+DECLARE_bool(mmap_weights);
+
 namespace llm {
 
 // test data was generated with the following python code:
@@ -74,4 +80,86 @@ TEST(StateDictTest, SharedTensor) {
   EXPECT_TRUE(rank1_tensor.equal(chunks[1]));
 }
 
+TEST(StateDictTest, ShardedSafeTensors) {
+  // write a safetensors file with a 4x6x4 float tensor
+  const auto tensor = torch::arange(96, torch::kFloat32).reshape({4, 6, 4});
+  std::string header =
+      R"({"tensor":{"dtype":"F32","shape":[4,6,4],"data_offsets":[0,384]}})";
+  // pad the header to 8 bytes alignment
+  header.resize((header.size() + 7) / 8 * 8, ' ');
+  const uint64_t header_size = header.size();
+  const auto path = std::filesystem::temp_directory_path() /
+                    "state_dict_test_sharded.safetensors";
+  {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header_size),
+               sizeof(header_size));
+    file.write(header.data(), static_cast<std::streamsize>(header.size()));
+    file.write(static_cast<const char*>(tensor.data_ptr()),
+               static_cast<std::streamsize>(tensor.nbytes()));
+  }
+
+  auto state_dict = StateDict::load_safetensors(path.string(), 0, 1);
+  EXPECT_TRUE(state_dict->get_tensor("tensor").equal(tensor));
+  // shards are read from the file for selected state dicts as well
+  const auto selected = state_dict->select("ten");
+  // shards along the last dim are chunked from the mapped tensor instead
+  for (int64_t dim = 0; dim < 3; ++dim) {
+    const auto chunks = tensor.chunk(2, dim);
+    for (int rank = 0; rank < 2; ++rank) {
+      const auto shard = selected.get_sharded_tensor("sor",
+                                                     dim,
+                                                     rank,
+                                                     /*world_size=*/2);
+      EXPECT_EQ(shard.is_contiguous(), dim < 2);
+      EXPECT_TRUE(shard.equal(chunks[rank]));
+    }
+  }
+  std::filesystem::remove(path);
+}
+
+TEST(StateDictTest, MmapWeights) {
+  gflags::FlagSaver flag_saver;
+  FLAGS_mmap_weights = true;
+  auto state_dict = StateDict::load_safetensors("data/test.safetensors", 0, 1);
+  const auto weight = state_dict->get_tensor("key_1");
+  ASSERT_TRUE(weight.defined());
+
+  // the parameter aliases the mapped weight
+  auto param = torch::empty({10, 10}, torch::kFloat32);
+  load_weight(param, weight);
+  EXPECT_EQ(param.data_ptr(), weight.data_ptr());
+  // the mapping outlives the state dict
+  state_dict.reset();
+  EXPECT_TRUE(param.equal(torch::ones({10, 10})));
+
+  // transformed weights are copied
+  auto transposed_param = torch::empty({10, 10}, torch::kFloat32);
+  load_weight(transposed_param, param.t());
+  EXPECT_NE(transposed_param.data_ptr(), param.data_ptr());
+  EXPECT_TRUE(transposed_param.equal(param.t()));
+
+  // writes to the aliased parameter go to private copies of the pages
+  param.add_(1);
+  EXPECT_TRUE(param.equal(torch::ones({10, 10}) * 2));
+  state_dict = StateDict::load_safetensors("data/test.safetensors", 0, 1);
+  EXPECT_TRUE(state_dict->get_tensor("key_1").equal(torch::ones({10, 10})));
+}
+
+TEST(StateDictTest, MissingWeightsGuard) {
+  MissingWeightsGuard guard;
+  MissingWeightsGuard::check(/*is_loaded=*/true, "a.weight");
+  MissingWeightsGuard::check(/*is_loaded=*/false, "b.weight");
+  {
+    // nested guards collect their own missing weights
+    MissingWeightsGuard nested_guard;
+    MissingWeightsGuard::check(/*is_loaded=*/false, "c.weight");
+    EXPECT_EQ(nested_guard.missing_weights(),
+              std::vector<std::string>{"c.weight"});
+  }
+  MissingWeightsGuard::check(/*is_loaded=*/false, "d.bias");
+  EXPECT_EQ(guard.missing_weights(),
+            (std::vector<std::string>{"b.weight", "d.bias"}));
+}
+
 }  // namespace llm
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <ostream>
+#include <utility>
 
 #include "common/macros.h"
 #include "process_group.h"
@@ -19,12 +22,36 @@ struct ParallelArgs {
 
   // pointer to process group, nullptr if world size is 1
   DEFINE_PTR_ARG(ProcessGroup, process_group) = nullptr;
+
+  // pipeline stage of current process
+  DEFINE_ARG(int32_t, pipeline_rank) = 0;
+
+  // number of pipeline stages, each stage owns a contiguous range of layers
+  DEFINE_ARG(int32_t, pipeline_size) = 1;
+
+  bool is_first_stage() const { return pipeline_rank_ == 0; }
+
+  bool is_last_stage() const { return pipeline_rank_ == pipeline_size_ - 1; }
+
+  // returns the range of layers [start, end) owned by current pipeline stage.
+  // layers are split evenly, the first stages get one more layer if the
+  // number of layers is not divisible by the number of stages.
+  std::pair<int64_t, int64_t> layer_range(int64_t n_layers) const {
+    const int64_t base = n_layers / pipeline_size_;
+    const int64_t remainder = n_layers % pipeline_size_;
+    const int64_t rank = pipeline_rank_;
+    const int64_t start = rank * base + std::min(rank, remainder);
+    const int64_t end = start + base + (rank < remainder ? 1 : 0);
+    return {start, end};
+  }
 };
 
 inline std::ostream& operator<<(std::ostream& os, const ParallelArgs& args) {
   os << "ParallelArgs: [";
   os << "rank: " << args.rank();
   os << ", world_size: " << args.world_size();
+  os << ", pipeline_rank: " << args.pipeline_rank();
+  os << ", pipeline_size: " << args.pipeline_size();
   os << "]";
   return os;
 }
@@ -16,7 +16,14 @@ std::unique_ptr<CausalLM> CausalLM::create(const ModelArgs& args,
   // get the factory function for the model type from model registry
   auto factory = ModelRegistry::get_causallm_factory(args.model_type());
   if (factory) {
-    return factory(args, quant_args, parallel_args, dtype, device);
+    auto model = factory(args, quant_args, parallel_args, dtype, device);
+    if (parallel_args.pipeline_size() > 1 &&
+        !model->supports_pipeline_parallel()) {
+      LOG(ERROR) << "Pipeline parallelism is not supported for model type: "
+                 << args.model_type();
+      return nullptr;
+    }
+    return model;
   }
 
   LOG(ERROR) << "Unsupported model type: " << args.model_type();
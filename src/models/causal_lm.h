@@ -2,8 +2,10 @@
 
 #include <torch/torch.h>
 
+#include <type_traits>
 #include <vector>
 
+#include "common/tracer.h"
 #include "model_args.h"
 #include "quantization/quant_args.h"
 #include "input_parameters.h"
@@ -24,12 +26,30 @@ class CausalLM : public torch::nn::Module {
                                 std::vector<KVCache>& kv_caches,
                                 const InputParameters& parameters) = 0;
 
+  // returns the final hidden states of all tokens before the lm head, used to
+  // compute embeddings. shape [num_tokens, hidden_size]
+  virtual torch::Tensor hidden_states(
+      const torch::Tensor& tokens,     // [num_tokens]
+      const torch::Tensor& positions,  // [num_tokens]
+      std::vector<KVCache>& kv_caches,
+      const InputParameters& parameters) = 0;
+
   // load the model from the given state_dict
   virtual void load_state_dict(const StateDict& state_dict) = 0;
 
   // verify if the model is loaded correctly
   virtual void verify_loaded_weights() const = 0;
 
+  // returns all parameters and buffers of the model keyed by their names,
+  // used to copy weights between two models created with the same args.
+  virtual torch::OrderedDict<std::string, torch::Tensor> named_weights()
+      const = 0;
+
+  // whether the model can be split into pipeline stages. such a model takes
+  // hidden states instead of tokens and returns hidden states instead of
+  // logits for stages other than the first and the last one.
+  virtual bool supports_pipeline_parallel() const = 0;
+
   // factory method to create a causal language model
   static std::unique_ptr<CausalLM> create(const ModelArgs& args,
                                           const QuantArgs& quant_args,
@@ -38,6 +58,17 @@ class CausalLM : public torch::nn::Module {
                                           const torch::Device& device);
 };
 
+// a model supports pipeline parallelism if its implementation declares
+// static constexpr bool kSupportsPipelineParallel = true;
+template <typename T, typename = void>
+struct supports_pipeline_parallel : std::false_type {};
+
+template <typename T>
+struct supports_pipeline_parallel<
+    T,
+    std::void_t<decltype(T::kSupportsPipelineParallel)>>
+    : std::bool_constant<T::kSupportsPipelineParallel> {};
+
 // an template class to hold different models without using virtual functions.
 template <typename Model>
 class CausalLMImpl : public CausalLM {
@@ -48,9 +79,18 @@ class CausalLMImpl : public CausalLM {
                         const torch::Tensor& positions,  // [num_tokens]
                         std::vector<KVCache>& kv_caches,
                         const InputParameters& parameters) override {
+    TraceSpan span("forward", "num_tokens", tokens.size(0));
     return model_->forward(tokens, positions, kv_caches, parameters);
   }
 
+  torch::Tensor hidden_states(const torch::Tensor& tokens,
+                              const torch::Tensor& positions,
+                              std::vector<KVCache>& kv_caches,
+                              const InputParameters& parameters) override {
+    TraceSpan span("hidden_states", "num_tokens", tokens.size(0));
+    return model_->hidden_states(tokens, positions, kv_caches, parameters);
+  }
+
   void load_state_dict(const StateDict& state_dict) override {
     model_->load_state_dict(state_dict);
   }
@@ -59,6 +99,20 @@ class CausalLMImpl : public CausalLM {
     return model_->verify_loaded_weights();
   }
 
+  torch::OrderedDict<std::string, torch::Tensor> named_weights()
+      const override {
+    auto weights = model_->named_parameters(/*recurse=*/true);
+    for (const auto& item : model_->named_buffers(/*recurse=*/true)) {
+      weights.insert(item.key(), item.value());
+    }
+    return weights;
+  }
+
+  bool supports_pipeline_parallel() const override {
+    return llm::supports_pipeline_parallel<
+        typename Model::ContainedType>::value;
+  }
+
  private:
   Model model_;
 };
@@ -401,13 +401,20 @@ class ChatGLMForCausalLMImpl : public torch::nn::Module {
                         torch::Tensor positions,
                         std::vector<KVCache>& kv_caches,
                         const InputParameters& input_params) {
-    auto h =
-        model_(word_embeddings_(tokens), positions, kv_caches, input_params);
+    auto h = hidden_states(tokens, positions, kv_caches, input_params);
     // select last token for each sequence
     h = h.index_select(/*dim=*/0, input_params.last_token_idxes);
     return output_layer_(h);
   }
 
+  // returns the final hidden states of all tokens: [num_tokens, hidden_size]
+  torch::Tensor hidden_states(torch::Tensor tokens,
+                              torch::Tensor positions,
+                              std::vector<KVCache>& kv_caches,
+                              const InputParameters& input_params) {
+    return model_(word_embeddings_(tokens), positions, kv_caches, input_params);
+  }
+
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
     word_embeddings_->load_state_dict(
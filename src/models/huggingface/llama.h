@@ -4,6 +4,7 @@
 #include <torch/torch.h>
 
 #include "chat_template/common_chat_template.h"
+#include "common/tracer.h"
 #include "layers/activation.h"
 #include "layers/attention/attention_rope.h"
 #include "layers/attention/handler.h"
@@ -247,67 +248,96 @@ class LlamaModelImpl : public torch::nn::Module {
                  const QuantArgs& quant_args,
                  const ParallelArgs& parallel_args,
                  torch::ScalarType dtype,
-                 const torch::Device& device) {
+                 const torch::Device& device)
+      : is_first_stage_(parallel_args.is_first_stage()),
+        is_last_stage_(parallel_args.is_last_stage()) {
     // register submodules
-    embed_tokens_ = register_module("embed_tokens",
-                                    ParallelEmbedding(args.vocab_size(),
-                                                      args.hidden_size(),
-                                                      parallel_args,
-                                                      dtype,
-                                                      device));
+    // with pipeline parallelism, only the first stage owns the embedding and
+    // only the last stage owns the final norm.
+    if (is_first_stage_) {
+      embed_tokens_ = register_module("embed_tokens",
+                                      ParallelEmbedding(args.vocab_size(),
+                                                        args.hidden_size(),
+                                                        parallel_args,
+                                                        dtype,
+                                                        device));
+    }
 
     handler_ = AttentionHandler::create(args, device);
 
+    const auto [start_layer, end_layer] =
+        parallel_args.layer_range(args.n_layers());
+    start_layer_ = start_layer;
     blocks_ = register_module("layers", torch::nn::ModuleList());
-    layers_.reserve(args.n_layers());
-    for (int32_t i = 0; i < args.n_layers(); i++) {
+    layers_.reserve(end_layer - start_layer);
+    for (int64_t i = start_layer; i < end_layer; i++) {
       auto block = LlamaDecoderLayer(
           args, quant_args, parallel_args, dtype, device, handler_.get());
       layers_.push_back(block);
       blocks_->push_back(block);
     }
-    norm_ = register_module(
-        "norm",
-        RMSNorm(args.hidden_size(), args.rms_norm_eps(), dtype, device));
+    if (is_last_stage_) {
+      norm_ = register_module(
+          "norm",
+          RMSNorm(args.hidden_size(), args.rms_norm_eps(), dtype, device));
+    }
   }
 
-  // tokens: [num_tokens]
+  // tokens: [num_tokens] for the first pipeline stage, otherwise hidden
+  // states from the previous stage with shape [num_tokens, hidden_size]
   // positions: [num_tokens] token pos in the sequence
+  // kv_caches: kv caches for the layers owned by this stage
   torch::Tensor forward(torch::Tensor tokens,
                         torch::Tensor positions,
                         std::vector<KVCache>& kv_caches,
                         const InputParameters& input_params) {
-    auto h = embed_tokens_(tokens);
+    auto h = is_first_stage_ ? embed_tokens_(tokens) : tokens;
 
     // TODO: set working space for attention handler
     for (size_t i = 0; i < layers_.size(); i++) {
+      TraceSpan span("layer", "index", start_layer_ + i);
       auto& layer = layers_[i];
       h = layer(h, positions, kv_caches[i], input_params);
     }
-    return norm_(h);
+    return is_last_stage_ ? norm_(h) : h;
   }
 
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
-    embed_tokens_->load_state_dict(state_dict.select("embed_tokens."));
+    if (is_first_stage_) {
+      embed_tokens_->load_state_dict(state_dict.select("embed_tokens."));
+    }
     // call each layer's load_state_dict function
     for (int i = 0; i < layers_.size(); i++) {
-      layers_[i]->load_state_dict(
-          state_dict.select("layers." + std::to_string(i) + "."));
+      layers_[i]->load_state_dict(state_dict.select(
+          "layers." + std::to_string(start_layer_ + i) + "."));
+    }
+    if (is_last_stage_) {
+      norm_->load_state_dict(state_dict.select("norm."));
     }
-    norm_->load_state_dict(state_dict.select("norm."));
   }
 
   void verify_loaded_weights(const std::string& prefix) const {
-    embed_tokens_->verify_loaded_weights(prefix + "embed_tokens.");
+    if (is_first_stage_) {
+      embed_tokens_->verify_loaded_weights(prefix + "embed_tokens.");
+    }
     for (int i = 0; i < layers_.size(); i++) {
-      layers_[i]->verify_loaded_weights(prefix + "layers." + std::to_string(i) +
-                                        ".");
+      layers_[i]->verify_loaded_weights(
+          prefix + "layers." + std::to_string(start_layer_ + i) + ".");
+    }
+    if (is_last_stage_) {
+      norm_->verify_loaded_weights(prefix + "norm.");
     }
-    norm_->verify_loaded_weights(prefix + "norm.");
   }
 
  private:
+  // pipeline stage of the model
+  bool is_first_stage_ = true;
+  bool is_last_stage_ = true;
+
+  // index of the first layer owned by this stage
+  int64_t start_layer_ = 0;
+
   // parameter members, must be registered
   ParallelEmbedding embed_tokens_{nullptr};
 
@@ -328,45 +358,71 @@ class LlamaForCausalLMImpl : public torch::nn::Module {
                        const QuantArgs& quant_args,
                        const ParallelArgs& parallel_args,
                        torch::ScalarType dtype,
-                       const torch::Device& device) {
+                       const torch::Device& device)
+      : is_last_stage_(parallel_args.is_last_stage()) {
     // register submodules
     model_ = register_module(
         "model", LlamaModel(args, quant_args, parallel_args, dtype, device));
 
-    lm_head_ = register_module("lm_head",
-                               ColumnParallelLinear(args.hidden_size(),
-                                                    args.vocab_size(),
-                                                    /*bias=*/false,
-                                                    /*gather_output=*/true,
-                                                    parallel_args,
-                                                    dtype,
-                                                    device));
+    if (is_last_stage_) {
+      lm_head_ = register_module("lm_head",
+                                 ColumnParallelLinear(args.hidden_size(),
+                                                      args.vocab_size(),
+                                                      /*bias=*/false,
+                                                      /*gather_output=*/true,
+                                                      parallel_args,
+                                                      dtype,
+                                                      device));
+    }
   }
 
   // tokens: [num_tokens]
   // positions: [num_tokens] token pos in the sequence
+  // returns logits for the last pipeline stage, otherwise hidden states of
+  // all tokens with shape [num_tokens, hidden_size] for the next stage.
   torch::Tensor forward(torch::Tensor tokens,
                         torch::Tensor positions,
                         std::vector<KVCache>& kv_caches,
                         const InputParameters& input_params) {
-    auto h = model_(tokens, positions, kv_caches, input_params);
+    auto h = hidden_states(tokens, positions, kv_caches, input_params);
+    if (!is_last_stage_) {
+      return h;
+    }
     // select last token for each sequence
     h = h.index_select(/*dim=*/0, input_params.last_token_idxes);
     return lm_head_(h);
   }
 
+  // returns the final hidden states of all tokens for the last pipeline
+  // stage: [num_tokens, hidden_size]
+  torch::Tensor hidden_states(torch::Tensor tokens,
+                              torch::Tensor positions,
+                              std::vector<KVCache>& kv_caches,
+                              const InputParameters& input_params) {
+    return model_(tokens, positions, kv_caches, input_params);
+  }
+
   // load the weight from the checkpoint
   void load_state_dict(const StateDict& state_dict) {
     model_->load_state_dict(state_dict.select("model."));
-    lm_head_->load_state_dict(state_dict.select("lm_head."));
+    if (is_last_stage_) {
+      lm_head_->load_state_dict(state_dict.select("lm_head."));
+    }
   }
 
   void verify_loaded_weights() const {
     model_->verify_loaded_weights("model.");
-    lm_head_->verify_loaded_weights("lm_head.");
+    if (is_last_stage_) {
+      lm_head_->verify_loaded_weights("lm_head.");
+    }
   }
 
+  // the model can be split into pipeline stages
+  static constexpr bool kSupportsPipelineParallel = true;
+
  private:
+  bool is_last_stage_ = true;
+
   // parameter members, must be registered
   LlamaModel model_{nullptr};
 
@@ -9,6 +9,15 @@ namespace llm {
 // self-attention and kv-cache.
 struct InputParameters {
   InputParameters to(const torch::Device& device) const {
+    // all tensors should be on the same device
+    return map([&device](const torch::Tensor& t) {
+      return t.defined() ? t.to(device) : t;
+    });
+  }
+
+  // create a copy with scalar values and tensors transformed by fn
+  template <typename Fn>
+  InputParameters map(Fn&& fn) const {
     InputParameters params;
     // copy scalar values
     params.all_prefill_sequences = all_prefill_sequences;
@@ -16,19 +25,17 @@ struct InputParameters {
     params.kv_max_seq_len = kv_max_seq_len;
     params.q_max_seq_len = q_max_seq_len;
 
-    // all tensors should be on the same device
-    auto safe_to = [](const torch::Tensor& t, const torch::Device& device) {
-      return t.defined() ? t.to(device) : t;
-    };
-    params.kv_cu_seq_lens = safe_to(kv_cu_seq_lens, device);
-    params.q_cu_seq_lens = safe_to(q_cu_seq_lens, device);
-
-    params.new_cache_slots = safe_to(new_cache_slots, device);
-    params.block_tables = safe_to(block_tables, device);
-    params.last_token_idxes = safe_to(last_token_idxes, device);
-    params.token_ids = safe_to(token_ids, device);
-    params.token_counts = safe_to(token_counts, device);
-    params.token_ids_lens = safe_to(token_ids_lens, device);
+    params.kv_cu_seq_lens = fn(kv_cu_seq_lens);
+    params.q_cu_seq_lens = fn(q_cu_seq_lens);
+
+    params.new_cache_slots = fn(new_cache_slots);
+    params.block_tables = fn(block_tables);
+    params.tree_mask = fn(tree_mask);
+    params.last_token_idxes = fn(last_token_idxes);
+    params.token_ids = fn(token_ids);
+    params.token_counts = fn(token_counts);
+    params.token_ids_lens = fn(token_ids_lens);
+    params.lora_ids = lora_ids;
     return params;
   }
 
@@ -65,6 +72,13 @@ struct InputParameters {
   // IntTensor: [n_seq, max_n_blocks]
   torch::Tensor block_tables;
 
+  // attention mask among the new tokens of each sequence, used to verify a
+  // token tree in one pass. row i is for the i-th new token, column j is for
+  // the j-th new token of the same sequence. tokens in kv cache are always
+  // visible. undefined means causal mask.
+  // BoolTensor: [n_tokens, q_max_seq_len]
+  torch::Tensor tree_mask;
+
   // *******************************************************
   // *****  parameters for all sequence in the batch  ******
   // *******************************************************
@@ -81,6 +95,18 @@ struct InputParameters {
   // the number of unique tokens in each sequence.
   // IntTensor: [n_seqs]
   torch::Tensor token_ids_lens;
+
+  // id of the lora adapter of each new token, -1 for the base model.
+  // undefined if no sequence in the batch uses lora. only read on host to
+  // group tokens by adapter, not moved by to(device).
+  // IntTensor: [n_tokens]
+  torch::Tensor lora_ids;
+
+  // host buffer backing the input tensors when they are allocated from a
+  // staging arena, used to upload all of them with one copy. undefined if the
+  // tensors are allocated separately. not moved by to(device).
+  // UInt8Tensor: [n_bytes]
+  torch::Tensor staging_buffer;
 };
 
 }  // namespace llm
@@ -326,12 +326,11 @@ void ColumnParallelQLinearImpl::load_state_dict(
 
 void ColumnParallelQLinearImpl::verify_loaded_weights(
     const std::string& prefix) const {
-  CHECK(qweight_is_loaded_)
-      << "qweight is not loaded for " << prefix + "qweight";
-  CHECK(qzeros_is_loaded_) << "qzeros is not loaded for " << prefix + "qzeros";
-  CHECK(scales_is_loaded_) << "scales is not loaded for " << prefix + "scales";
-  CHECK(!bias_.defined() || bias_is_loaded_)
-      << "bias is not loaded for " << prefix + "bias";
+  MissingWeightsGuard::check(qweight_is_loaded_, prefix + "qweight");
+  MissingWeightsGuard::check(qzeros_is_loaded_, prefix + "qzeros");
+  MissingWeightsGuard::check(scales_is_loaded_, prefix + "scales");
+  MissingWeightsGuard::check(!bias_.defined() || bias_is_loaded_,
+                             prefix + "bias");
 }
 
 RowParallelQLinearImpl::RowParallelQLinearImpl(
@@ -456,12 +455,11 @@ void RowParallelQLinearImpl::load_state_dict(const StateDict& state_dict) {
 
 void RowParallelQLinearImpl::verify_loaded_weights(
     const std::string& prefix) const {
-  CHECK(qweight_is_loaded_)
-      << "qweight is not loaded for " << prefix + "qweight";
-  CHECK(qzeros_is_loaded_) << "qzeros is not loaded for " << prefix + "qzeros";
-  CHECK(scales_is_loaded_) << "scales is not loaded for " << prefix + "scales";
-  CHECK(!bias_.defined() || bias_is_loaded_)
-      << "bias is not loaded for " << prefix + "bias";
+  MissingWeightsGuard::check(qweight_is_loaded_, prefix + "qweight");
+  MissingWeightsGuard::check(qzeros_is_loaded_, prefix + "qzeros");
+  MissingWeightsGuard::check(scales_is_loaded_, prefix + "scales");
+  MissingWeightsGuard::check(!bias_.defined() || bias_is_loaded_,
+                             prefix + "bias");
 }
 
 }  // namespace llm
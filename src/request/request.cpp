@@ -4,6 +4,7 @@
 #include <absl/time/time.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -16,7 +17,9 @@ Request::Request(const std::string& id,
                  const std::vector<int32_t>& prompt_tokens)
     : id(id),
       created_time(absl::ToUnixSeconds(absl::Now())),
-      prompt_tokens(prompt_tokens) {}
+      prompt_tokens(prompt_tokens) {
+  timeline.arrival = timeline.tokenized = absl::Now();
+}
 
 void Request::add_sequence(OnStream on_stream) {
   if (stream) {
@@ -37,4 +40,29 @@ bool Request::is_finished() const {
   }
   return true;
 }
+
+void Request::fill_latency_stats(Statistics* stats) const {
+  const absl::Time unset = absl::InfinitePast();
+  if (timeline.first_scheduled != unset) {
+    stats->queue_time_ms =
+        absl::ToDoubleMilliseconds(timeline.first_scheduled - timeline.arrival);
+  }
+  if (timeline.first_token != unset) {
+    stats->time_to_first_token_ms =
+        absl::ToDoubleMilliseconds(timeline.first_token - timeline.arrival);
+    // sequences are generated in parallel, use the longest one
+    size_t num_generated_tokens = 0;
+    for (const auto& seq : sequences) {
+      num_generated_tokens =
+          std::max(num_generated_tokens, seq.num_generated_tokens());
+    }
+    if (timeline.finish != unset && num_generated_tokens > 1) {
+      stats->time_per_output_token_ms =
+          absl::ToDoubleMilliseconds(timeline.finish - timeline.first_token) /
+          static_cast<double>(num_generated_tokens - 1);
+    }
+  }
+  stats->num_preemptions = timeline.preemptions.size();
+}
+
 }  // namespace llm
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <absl/time/time.h>
+
 #include <cstdint>
 #include <deque>
 #include <string>
@@ -43,6 +45,39 @@ struct Statistics {
   size_t num_generated_tokens = 0;
   // the total number of tokens used in the request (prompt + completion).
   size_t num_total_tokens = 0;
+
+  // latency breakdown in milliseconds, 0 if not available.
+  // time from arrival to the first time the request is scheduled.
+  double queue_time_ms = 0;
+  // time from arrival to the first generated token.
+  double time_to_first_token_ms = 0;
+  // mean time between generated tokens after the first one.
+  double time_per_output_token_ms = 0;
+
+  // the number of times the request was preempted.
+  size_t num_preemptions = 0;
+};
+
+// Timestamps of the lifecycle of a request, absl::InfinitePast() for events
+// that have not happened yet.
+struct RequestTimeline {
+  // the request is received by the server.
+  absl::Time arrival = absl::InfinitePast();
+
+  // the prompt is tokenized and the request is created.
+  absl::Time tokenized = absl::InfinitePast();
+
+  // the request is scheduled into a batch for the first time.
+  absl::Time first_scheduled = absl::InfinitePast();
+
+  // the first token is generated.
+  absl::Time first_token = absl::InfinitePast();
+
+  // each time the request is preempted to release cache blocks.
+  std::vector<absl::Time> preemptions;
+
+  // the request is finished.
+  absl::Time finish = absl::InfinitePast();
 };
 
 // Priority of the request.
@@ -53,6 +88,12 @@ struct SequenceResult {
   std::string output_text;
 
   FinishReason finish_reason;
+
+  // logprobs of generated tokens, empty if not asked by the request
+  std::vector<LogProb> logprobs;
+
+  // embedding of the prompt, empty if not asked by the request
+  std::vector<float> embedding;
 };
 
 // Function to call when a request is finished.
@@ -79,6 +120,9 @@ struct Request final {
 
   size_t num_prompt_tokens() const { return prompt_tokens.size(); }
 
+  // derive the latency breakdown from the timeline of the request
+  void fill_latency_stats(Statistics* stats) const;
+
   // The unique id of the request.
   // NOLINTNEXTLINE
   const std::string id;
@@ -106,6 +150,9 @@ struct Request final {
   // the priority of the request.
   RequestPriority priority = RequestPriority::MEDIUM;
 
+  // number of best sequences to return when beam search is enabled.
+  size_t num_return_sequences = 1;
+
   // list of sequences to generate completions for the prompt
   // use deque instead of vector to avoid no-copy move for Sequence
   std::deque<Sequence> sequences;
@@ -115,6 +162,9 @@ struct Request final {
 
   // function to call when a stream request is finished.
   OnStreamFinish on_stream_finish;
+
+  // timestamps of the request, arrival and tokenized are set on creation.
+  RequestTimeline timeline;
 };
 
 // Compare two request contexts based on priority then scheduled time.
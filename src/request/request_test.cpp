@@ -0,0 +1,44 @@
+#include "request.h"
+
+#include <absl/time/clock.h>
+#include <gtest/gtest.h>
+
+namespace llm {
+
+TEST(RequestTest, LatencyStats) {
+  Request request("1", /*prompt_tokens=*/{1, 2, 3});
+  request.stopping_criteria.max_tokens = 10;
+  request.stopping_criteria.ignore_eos_token = true;
+  request.add_sequence();
+  request.add_sequence();
+
+  // nothing happened yet
+  Statistics stats;
+  request.fill_latency_stats(&stats);
+  EXPECT_EQ(stats.queue_time_ms, 0);
+  EXPECT_EQ(stats.time_to_first_token_ms, 0);
+  EXPECT_EQ(stats.time_per_output_token_ms, 0);
+  EXPECT_EQ(stats.num_preemptions, 0);
+
+  const absl::Time arrival = absl::FromUnixSeconds(100);
+  auto& timeline = request.timeline;
+  timeline.arrival = arrival;
+  timeline.first_scheduled = arrival + absl::Milliseconds(10);
+  timeline.first_token = arrival + absl::Milliseconds(50);
+  timeline.preemptions.push_back(arrival + absl::Milliseconds(60));
+  timeline.finish = arrival + absl::Milliseconds(90);
+  // the longest sequence generates 5 tokens
+  for (int32_t token_id = 1; token_id <= 5; ++token_id) {
+    request.sequences[0].append_new_token_id(token_id);
+  }
+  request.sequences[1].append_new_token_id(1);
+
+  request.fill_latency_stats(&stats);
+  EXPECT_DOUBLE_EQ(stats.queue_time_ms, 10);
+  EXPECT_DOUBLE_EQ(stats.time_to_first_token_ms, 50);
+  // 40ms for the 4 tokens after the first one
+  EXPECT_DOUBLE_EQ(stats.time_per_output_token_ms, 10);
+  EXPECT_EQ(stats.num_preemptions, 1);
+}
+
+}  // namespace llm
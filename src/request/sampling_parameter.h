@@ -1,10 +1,21 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <vector>
 
 namespace llm {
 
+// how to pool the final hidden states of a prompt into an embedding
+enum class PoolingType : int8_t {
+  // no embedding is returned
+  NONE = 0,
+  // mean of the hidden states of all tokens
+  MEAN = 1,
+  // hidden state of the last token
+  LAST = 2,
+};
+
 // SamplingParameter is used to specify sampling parameters for a
 // request/sequence.
 struct SamplingParameter {
@@ -16,6 +27,22 @@ struct SamplingParameter {
   int64_t top_k = 0;
   bool do_sample = false;
   uint64_t seed = 0;
+  // number of draft tokens to propose by prompt lookup for each step.
+  // 0 means speculative decoding is disabled.
+  uint32_t prompt_lookup_num_tokens = 0;
+  // number of beams kept by beam search. 1 means beam search is disabled.
+  uint32_t beam_width = 1;
+  // whether to return the logprob of each generated token.
+  bool logprobs = false;
+  // number of most likely alternatives to return with each token logprob.
+  int64_t top_logprobs = 0;
+  // pooling of the prompt hidden states returned as an embedding by prefill
+  // only sequences, NONE to score the prompt instead.
+  PoolingType pooling = PoolingType::NONE;
+  // whether to scale the embedding to unit length.
+  bool normalize = true;
+  // id of the lora adapter applied to the model, -1 for the base model.
+  int32_t lora_id = -1;
 };
 
 // SamplingParameters is used to specify sampling parameters for a batch of
@@ -38,6 +65,16 @@ struct SamplingParameters {
     const bool sample =
         p.do_sample || p.temperature != 0.0 || p.top_p != 1.0 || p.top_k != 0;
     do_sample.push_back(sample);
+
+    // beam search picks beams from top 2 * beam_width tokens of each beam
+    if (p.beam_width > 1) {
+      num_top_logprobs = std::max<int64_t>(
+          num_top_logprobs, 2 * static_cast<int64_t>(p.beam_width));
+    }
+    if (p.logprobs) {
+      logprobs = true;
+      num_top_logprobs = std::max(num_top_logprobs, p.top_logprobs);
+    }
   }
 
   // following are used for sampling, with shape [num_request]
@@ -68,6 +105,19 @@ struct SamplingParameters {
 
   // default = 0, use global generator
   std::vector<uint64_t> seeds;
+
+  // number of tokens with highest logprobs to return for each sequence.
+  // default = 0, no logprobs are returned
+  int64_t num_top_logprobs = 0;
+
+  // whether to return logprobs of the sampled tokens, true if any sequence
+  // in the batch asks for them.
+  bool logprobs = false;
+
+  // ids of the sequences in the batch, one for each row. used to reuse the
+  // sampling state across steps since the parameters of a sequence never
+  // change. empty if rows are not mapped to sequences one by one.
+  std::vector<int64_t> seq_ids;
 };
 
 }  // namespace llm
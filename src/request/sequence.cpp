@@ -1,8 +1,11 @@
 #include "sequence.h"
 
 #include <absl/strings/match.h>
+#include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -53,10 +56,11 @@ Sequence::Sequence(const SamplingParameter& sampling_param,
   }
 }
 
-bool Sequence::append_new_token_id(int32_t next_token_id) {
+bool Sequence::append_new_token_id(int32_t next_token_id, float logprob) {
   if (is_finished_) {
     return false;
   }
+  cumulative_logprob_ += logprob;
 
   // check eos and stop tokens ids first
   if (!stopping_criteria_.ignore_eos_token &&
@@ -99,34 +103,197 @@ bool Sequence::append_new_token_id(int32_t next_token_id) {
   return true;
 }
 
+bool Sequence::is_finished_by(int32_t next_token_id) const {
+  if (!stopping_criteria_.ignore_eos_token &&
+      next_token_id == stopping_criteria_.eos_token_id) {
+    return true;
+  }
+  if (stopping_criteria_.stop_token_ids.count(next_token_id) > 0) {
+    return true;
+  }
+
+  // the stop sequence should end with the token and the rest of it should
+  // match the end of current token ids
+  for (const auto& stop_sequence : stopping_criteria_.stop_sequences) {
+    if (stop_sequence.back() != next_token_id) {
+      continue;
+    }
+    const size_t prefix_len = stop_sequence.size() - 1;
+    if (token_ids_.size() >= prefix_len &&
+        std::equal(stop_sequence.begin(),
+                   stop_sequence.end() - 1,
+                   token_ids_.end() - static_cast<long>(prefix_len))) {
+      return true;
+    }
+  }
+
+  const size_t max_new_tokens = stopping_criteria_.max_tokens;
+  return max_new_tokens > 0 && num_generated_tokens() + 1 >= max_new_tokens;
+}
+
+void Sequence::set_num_tokens_in_cache(size_t num_tokens) {
+  CHECK_LE(num_tokens, token_ids_.size());
+  cache_pos_ = num_tokens;
+}
+
+void Sequence::finish_prefill_only(std::vector<LogProb> prompt_logprobs) {
+  CHECK(is_prefill_only());
+  logprobs_ = std::move(prompt_logprobs);
+  finish_reason_ = FinishReason::LENGTH;
+  is_finished_ = true;
+}
+
+void Sequence::finish_with_embedding(std::vector<float> embedding) {
+  CHECK(is_prefill_only());
+  embedding_ = std::move(embedding);
+  finish_reason_ = FinishReason::LENGTH;
+  is_finished_ = true;
+}
+
+void Sequence::fork_from(const Sequence& other) {
+  CHECK_EQ(&sampling_param_, &other.sampling_param_)
+      << "can only fork from a sequence of the same request";
+  CHECK(spec_token_ids_.empty() && other.spec_token_ids_.empty());
+  token_ids_ = other.token_ids_;
+  token_to_count_map_ = other.token_to_count_map_;
+  num_prompt_tokens_ = other.num_prompt_tokens_;
+  cache_pos_ = other.cache_pos_;
+  is_finished_ = other.is_finished_;
+  is_cancelled_.store(other.is_cancelled(), std::memory_order_relaxed);
+  finish_reason_ = other.finish_reason_;
+  cumulative_logprob_ = other.cumulative_logprob_;
+  logprobs_ = other.logprobs_;
+  prefix_offset_ = other.prefix_offset_;
+  output_offset_ = other.output_offset_;
+}
+
 void Sequence::append_spec_token_id(int32_t spec_token_id) {
+  spec_token_parents_.push_back(
+      static_cast<int32_t>(spec_token_ids_.size()) - 1);
   spec_token_ids_.push_back(spec_token_id);
 }
 
-void Sequence::update_valid_token_ids(const int64_t* valid_ids) {
-  // reset finished flags
-  finish_reason_ = FinishReason::NONE;
-  is_finished_ = false;
+void Sequence::append_spec_token_ids(
+    const std::vector<int32_t>& spec_token_ids) {
+  for (const int32_t token_id : spec_token_ids) {
+    token_ids_.push_back(token_id);
+    token_to_count_map_[token_id]++;
+    append_spec_token_id(token_id);
+  }
+}
+
+void Sequence::append_spec_token_tree(
+    const std::vector<int32_t>& spec_token_ids,
+    const std::vector<int32_t>& parents) {
+  CHECK_EQ(spec_token_ids.size(), parents.size());
+  for (size_t i = 0; i < spec_token_ids.size(); ++i) {
+    const int32_t parent = parents[i];
+    CHECK(parent >= -1 && parent < static_cast<int32_t>(spec_token_ids_.size()))
+        << "parent should be appended before its children";
+    token_ids_.push_back(spec_token_ids[i]);
+    token_to_count_map_[spec_token_ids[i]]++;
+    spec_token_ids_.push_back(spec_token_ids[i]);
+    spec_token_parents_.push_back(parent);
+  }
+}
+
+bool Sequence::is_spec_token_chain() const {
+  for (size_t i = 0; i < spec_token_parents_.size(); ++i) {
+    if (spec_token_parents_[i] != static_cast<int32_t>(i) - 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Sequence::discard_spec_token_ids(size_t start) {
+  const size_t num_spec_tokens = spec_token_ids_.size();
+  CHECK_LE(start, num_spec_tokens);
+  CHECK_GE(token_ids_.size(), num_spec_tokens);
+  for (size_t i = start; i < num_spec_tokens; ++i) {
+    auto it = token_to_count_map_.find(spec_token_ids_[i]);
+    if (--it->second == 0) {
+      // avoid penalizing the discarded tokens
+      token_to_count_map_.erase(it);
+    }
+  }
+  token_ids_.resize(token_ids_.size() - (num_spec_tokens - start));
+  spec_token_ids_.resize(start);
+  spec_token_parents_.resize(start);
+  // kv cache for the discarded tokens is not valid anymore
+  cache_pos_ = std::min(cache_pos_, token_ids_.size() - 1);
+}
+
+size_t Sequence::max_num_spec_tokens() const {
+  const size_t max_new_tokens = stopping_criteria_.max_tokens;
+  if (max_new_tokens == 0) {
+    return std::numeric_limits<size_t>::max();
+  }
+  // keep the room for the token sampled by the target model
+  const size_t num_generated = num_generated_tokens() + 1;
+  return num_generated < max_new_tokens ? max_new_tokens - num_generated : 0;
+}
 
-  size_t idx = 0;
-  for (; idx < spec_token_ids_.size(); ++idx) {
-    if (valid_ids[idx] != spec_token_ids_[idx]) {
-      // find first invalid token id (idx)
-      // 1. clear invalid token counts
-      for (int64_t i = idx; i < spec_token_ids_.size(); ++i) {
-        token_to_count_map_[spec_token_ids_[i]]--;
+size_t Sequence::update_valid_token_ids(const int64_t* valid_ids) {
+  // walk down the token tree along the tokens sampled by the target model
+  const int32_t num_spec_tokens = static_cast<int32_t>(spec_token_ids_.size());
+  std::vector<int32_t> accepted;
+  int32_t node = -1;
+  while (true) {
+    // ids[node + 1] is sampled after the node
+    const int64_t valid_id = valid_ids[node + 1];
+    int32_t child = node + 1;
+    for (; child < num_spec_tokens; ++child) {
+      if (spec_token_parents_[child] == node &&
+          spec_token_ids_[child] == valid_id) {
+        break;
       }
-      // 2. erase invalid tokens
-      token_ids_.erase(token_ids_.end() - spec_token_ids_.size() + idx,
-                       token_ids_.end());
+    }
+    if (child == num_spec_tokens) {
       break;
     }
+    accepted.push_back(child);
+    node = child;
+  }
+
+  // the kv cache of the i-th speculative token was stored at root_pos + i + 1,
+  // move the accepted ones to their final positions.
+  kv_cache_moves_.clear();
+  const int32_t root_pos =
+      static_cast<int32_t>(token_ids_.size()) - num_spec_tokens - 1;
+  for (size_t i = 0; i < accepted.size(); ++i) {
+    const int32_t src_pos = root_pos + accepted[i] + 1;
+    const int32_t dst_pos = root_pos + static_cast<int32_t>(i) + 1;
+    if (src_pos != dst_pos) {
+      kv_cache_moves_.emplace_back(src_pos, dst_pos);
+    }
+  }
+
+  // roll back all speculative tokens then replay the accepted ones together
+  // with the token sampled by the target model, so that the stopping criterias
+  // are checked for each of them.
+  std::vector<int32_t> accepted_token_ids;
+  accepted_token_ids.reserve(accepted.size() + 1);
+  for (const int32_t idx : accepted) {
+    accepted_token_ids.push_back(spec_token_ids_[idx]);
   }
-  // clear spec token ids
-  spec_token_ids_.clear();
+  accepted_token_ids.push_back(static_cast<int32_t>(valid_ids[node + 1]));
 
-  // append new valid id
-  append_new_token_id(valid_ids[idx]);
+  discard_spec_token_ids();
+  finish_reason_ = FinishReason::NONE;
+  is_finished_ = false;
+  // draft tokens after the sequence finished are dropped, not accepted
+  size_t num_accepted = 0;
+  for (size_t i = 0; i < accepted_token_ids.size(); ++i) {
+    // the last token is sampled by the target model instead of drafted
+    if (i < accepted.size()) {
+      ++num_accepted;
+    }
+    if (!append_new_token_id(accepted_token_ids[i])) {
+      break;
+    }
+  }
+  return num_accepted;
 }
 
 // decode the sequence to get delta text using the tokenizer
@@ -4,6 +4,8 @@
 #include <cstdint>
 #include <functional>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "sampling_parameter.h"
@@ -25,6 +27,17 @@ enum class FinishReason {
 using OnStream =
     std::function<bool(const std::string& delta, FinishReason reason)>;
 
+// logprob of a generated token and the most likely alternatives at its
+// position, sorted by logprob in descending order.
+struct LogProb {
+  int32_t token_id = 0;
+
+  float logprob = 0.0f;
+
+  // (token_id, logprob) pairs
+  std::vector<std::pair<int32_t, float>> top_logprobs;
+};
+
 // The sequence encapsulates all the necessary
 // information for a sequence, including the prompt, the token ids, and the
 // current position in generating tokens, etc.
@@ -64,24 +77,110 @@ class Sequence final {
   // get the sampling parameters
   const SamplingParameter& sampling_param() const;
 
+  // mark the first num_tokens tokens as cached, used when the kv cache is
+  // migrated from another engine.
+  void set_num_tokens_in_cache(size_t num_tokens);
+
   // whether the sequence is in prefill stage, no kv cache has been generated
   bool is_prefill() const { return cache_pos_ == 0; }
 
+  // whether the sequence only scores the prompt without generating tokens
+  bool is_prefill_only() const { return stopping_criteria_.prefill_only; }
+
+  // finish a prefill only sequence with the logprobs of its prompt tokens
+  // after the first one.
+  void finish_prefill_only(std::vector<LogProb> prompt_logprobs);
+
+  // finish a prefill only sequence with the embedding of its prompt
+  void finish_with_embedding(std::vector<float> embedding);
+
+  // get the embedding of the prompt, empty if not asked by the request
+  const std::vector<float>& embedding() const { return embedding_; }
+
   // add a new token id to the sequence and check if the sequence is finished.
+  // logprob is accumulated into the cumulative logprob of the sequence.
   // returns false if the sequence is finished.
-  bool append_new_token_id(int32_t next_token_id);
+  bool append_new_token_id(int32_t next_token_id, float logprob = 0.0f);
+
+  // check if appending the token would finish the sequence, without changing
+  // the sequence.
+  bool is_finished_by(int32_t next_token_id) const;
+
+  // get the sum of logprobs of generated tokens
+  float cumulative_logprob() const { return cumulative_logprob_; }
+
+  // record the logprobs of the last generated token
+  void append_logprob(LogProb logprob) {
+    logprobs_.push_back(std::move(logprob));
+  }
+
+  // get logprobs of generated tokens, only recorded if asked by the request.
+  // for prefill only sequences, logprobs of the prompt tokens instead.
+  const std::vector<LogProb>& logprobs() const { return logprobs_; }
+
+  // copy the generation state from another sequence of the same request, used
+  // to fork beams. cache blocks are managed by the block manager separately.
+  void fork_from(const Sequence& other);
 
   // append speculate token id
   void append_spec_token_id(int32_t spec_token_id);
 
-  // update valid token ids
-  void update_valid_token_ids(const int64_t* ids);
+  // append speculative token ids proposed without a draft model, e.g. by
+  // prompt lookup. the tokens are not processed by any model yet, so the
+  // cache position is left untouched.
+  void append_spec_token_ids(const std::vector<int32_t>& spec_token_ids);
+
+  // append a tree of speculative tokens. parents[i] is the index of the parent
+  // of the i-th token among all speculative tokens, -1 for the last accepted
+  // token. the parent should be appended before its children.
+  void append_spec_token_tree(const std::vector<int32_t>& spec_token_ids,
+                              const std::vector<int32_t>& parents);
+
+  // get the parent index of each speculative token, -1 for the root.
+  const std::vector<int32_t>& spec_token_parents() const {
+    return spec_token_parents_;
+  }
+
+  // whether the speculative tokens form a single chain
+  bool is_spec_token_chain() const;
+
+  // remove speculative tokens starting from the start-th one
+  void discard_spec_token_ids(size_t start = 0);
+
+  // get the number of speculative tokens appended to the sequence
+  size_t num_spec_tokens() const { return spec_token_ids_.size(); }
+
+  // get the speculative tokens appended to the sequence
+  const std::vector<int32_t>& spec_token_ids() const { return spec_token_ids_; }
+
+  // get the maximum number of speculative tokens that can be appended without
+  // exceeding max_tokens, leaving room for the token from the target model.
+  size_t max_num_spec_tokens() const;
+
+  // update valid token ids with the tokens sampled by the target model.
+  // ids: [num_spec_tokens + 1], ids[0] is sampled after the last accepted
+  // token and ids[i + 1] is sampled after the i-th speculative token.
+  // the longest path in the token tree matching the samples is accepted.
+  // returns the number of accepted speculative tokens, excluding the ones
+  // after the sequence finished.
+  size_t update_valid_token_ids(const int64_t* ids);
+
+  // kv cache moves (src_pos, dst_pos) needed to compact the accepted
+  // speculative tokens from a token tree, set by update_valid_token_ids.
+  const std::vector<std::pair<int32_t, int32_t>>& kv_cache_moves() const {
+    return kv_cache_moves_;
+  }
 
   // add new cache blocks
   void append_blocks(const std::vector<int32_t>& new_blocks) {
     blocks_.insert(blocks_.end(), new_blocks.begin(), new_blocks.end());
   }
 
+  // replace the cache block at index, used for copy-on-write
+  void replace_block(size_t index, int32_t block_id) {
+    blocks_[index] = block_id;
+  }
+
   // release all cache blocks
   std::vector<int32_t> release_blocks() {
     // reset the current pos to 0 so that the cache can be recomputed next time
@@ -89,6 +188,16 @@ class Sequence final {
     return std::move(blocks_);
   }
 
+  // release the cache blocks after the first num_blocks ones
+  std::vector<int32_t> release_blocks(size_t num_blocks) {
+    if (num_blocks >= blocks_.size()) {
+      return {};
+    }
+    std::vector<int32_t> released(blocks_.begin() + num_blocks, blocks_.end());
+    blocks_.resize(num_blocks);
+    return released;
+  }
+
   // returns allocated cache blocks
   const std::vector<int32_t>& blocks() const { return blocks_; }
 
@@ -170,6 +279,15 @@ class Sequence final {
   // the reason why the sequence is finished
   FinishReason finish_reason_ = FinishReason::NONE;
 
+  // sum of logprobs of generated tokens
+  float cumulative_logprob_ = 0.0f;
+
+  // logprobs of generated tokens
+  std::vector<LogProb> logprobs_;
+
+  // pooled hidden states of the prompt
+  std::vector<float> embedding_;
+
   // variables to keep track of output text, should be accessed by single thread
   // prefix offset is used to defeat cleanup algorithms in the decode which
   // decide to add a space or not based on surrounding tokens.
@@ -188,6 +306,12 @@ class Sequence final {
 
   // speculative decoding tokens
   std::vector<int32_t> spec_token_ids_;
+
+  // parent index of each speculative token, -1 for the last accepted token
+  std::vector<int32_t> spec_token_parents_;
+
+  // kv cache moves for accepted speculative tokens
+  std::vector<std::pair<int32_t, int32_t>> kv_cache_moves_;
 };
 
 }  // namespace llm
@@ -124,6 +124,9 @@ TEST(SequenceTest, StopSequences) {
   EXPECT_TRUE(sequence.append_new_token_id(3));
   EXPECT_TRUE(sequence.append_new_token_id(5));
   EXPECT_TRUE(sequence.append_new_token_id(6));
+  // check without appending the token
+  EXPECT_FALSE(sequence.is_finished_by(8));
+  EXPECT_TRUE(sequence.is_finished_by(7));
   EXPECT_FALSE(sequence.append_new_token_id(7));
 
   EXPECT_TRUE(sequence.is_finished());
@@ -134,4 +137,125 @@ TEST(SequenceTest, StopSequences) {
   EXPECT_EQ(sequence.num_tokens(), 9);
 }
 
+TEST(SequenceTest, PrefillOnly) {
+  StoppingCriteria stopping_criteria;
+  stopping_criteria.prefill_only = true;
+  SamplingParameter sampling_param;
+  Sequence sequence(sampling_param,
+                    stopping_criteria,
+                    /*token_ids=*/{1, 2, 3},
+                    /*echo=*/false,
+                    /*on_stream=*/nullptr);
+  EXPECT_TRUE(sequence.is_prefill_only());
+  EXPECT_FALSE(sequence.is_finished());
+
+  // logprobs of the tokens after the first one
+  sequence.finish_prefill_only({{2, -1.0f, {}}, {3, -2.0f, {}}});
+  EXPECT_TRUE(sequence.is_finished());
+  EXPECT_EQ(sequence.finish_reason(), FinishReason::LENGTH);
+  EXPECT_EQ(sequence.num_generated_tokens(), 0);
+  ASSERT_EQ(sequence.logprobs().size(), 2);
+  EXPECT_EQ(sequence.logprobs()[1].token_id, 3);
+  EXPECT_FLOAT_EQ(sequence.logprobs()[1].logprob, -2.0f);
+}
+
+TEST(SequenceTest, SpecTokenIds) {
+  std::vector<int32_t> prompt_tokens = {1, 2, 4};
+
+  StoppingCriteria stopping_criteria;
+  stopping_criteria.max_tokens = 10;
+  stopping_criteria.eos_token_id = 30;
+  SamplingParameter sampling_param;
+
+  Sequence sequence(sampling_param,
+                    stopping_criteria,
+                    prompt_tokens,
+                    /*echo=*/false,
+                    /*on_stream=*/nullptr);
+  EXPECT_TRUE(sequence.append_new_token_id(5));
+  EXPECT_EQ(sequence.max_num_spec_tokens(), 8);
+
+  // propose 3 tokens, the second one is rejected by the target model
+  sequence.append_spec_token_ids({6, 7, 8});
+  EXPECT_EQ(sequence.num_spec_tokens(), 3);
+  EXPECT_EQ(sequence.num_tokens(), 7);
+  EXPECT_EQ(sequence.num_tokens_in_cache(), 3);
+
+  const std::vector<int64_t> valid_ids = {6, 9, 10, 11};
+  EXPECT_EQ(sequence.update_valid_token_ids(valid_ids.data()), 1);
+  EXPECT_EQ(sequence.num_spec_tokens(), 0);
+  EXPECT_EQ(sequence.token_ids(), std::vector<int32_t>({1, 2, 4, 5, 6, 9}));
+  EXPECT_EQ(sequence.num_tokens_in_cache(), 5);
+  EXPECT_EQ(sequence.token_to_count_map().count(7), 0);
+  EXPECT_FALSE(sequence.is_finished());
+
+  // all proposed tokens match but the first one hits eos, so the second one
+  // is not accepted
+  sequence.append_spec_token_ids({30, 12});
+  const std::vector<int64_t> eos_ids = {30, 12, 13};
+  EXPECT_EQ(sequence.update_valid_token_ids(eos_ids.data()), 1);
+  EXPECT_TRUE(sequence.is_finished());
+  EXPECT_EQ(sequence.finish_reason(), FinishReason::STOP);
+  EXPECT_EQ(sequence.token_ids(), std::vector<int32_t>({1, 2, 4, 5, 6, 9}));
+}
+
+TEST(SequenceTest, SpecTokenTree) {
+  std::vector<int32_t> prompt_tokens = {1, 2, 4};
+
+  StoppingCriteria stopping_criteria;
+  stopping_criteria.max_tokens = 10;
+  SamplingParameter sampling_param;
+
+  Sequence sequence(sampling_param,
+                    stopping_criteria,
+                    prompt_tokens,
+                    /*echo=*/false,
+                    /*on_stream=*/nullptr);
+  EXPECT_TRUE(sequence.append_new_token_id(5));
+
+  // two branches: 5 -> 6 -> 7 and 5 -> 8 -> 9
+  sequence.append_spec_token_tree({6, 7, 8, 9}, {-1, 0, -1, 2});
+  EXPECT_FALSE(sequence.is_spec_token_chain());
+  EXPECT_EQ(sequence.num_spec_tokens(), 4);
+  EXPECT_EQ(sequence.num_tokens(), 8);
+
+  // the target model samples 8 after 5, 9 after 8, then 10 after 9
+  const std::vector<int64_t> valid_ids = {8, 0, 0, 9, 10};
+  EXPECT_EQ(sequence.update_valid_token_ids(valid_ids.data()), 2);
+  EXPECT_EQ(sequence.token_ids(),
+            std::vector<int32_t>({1, 2, 4, 5, 8, 9, 10}));
+  EXPECT_EQ(sequence.num_tokens_in_cache(), 6);
+  EXPECT_EQ(sequence.token_to_count_map().count(6), 0);
+  EXPECT_EQ(sequence.token_to_count_map().count(7), 0);
+
+  // kv cache of 8 and 9 are moved to follow 5
+  const std::vector<std::pair<int32_t, int32_t>> moves = {{6, 4}, {7, 5}};
+  EXPECT_EQ(sequence.kv_cache_moves(), moves);
+
+  // accepting the first branch needs no move
+  sequence.append_spec_token_tree({11, 12}, {-1, -1});
+  const std::vector<int64_t> first_ids = {11, 13, 0};
+  EXPECT_EQ(sequence.update_valid_token_ids(first_ids.data()), 1);
+  EXPECT_TRUE(sequence.kv_cache_moves().empty());
+  EXPECT_EQ(sequence.token_ids(),
+            std::vector<int32_t>({1, 2, 4, 5, 8, 9, 10, 11, 13}));
+}
+
+TEST(SequenceTest, ReleaseBlocks) {
+  StoppingCriteria stopping_criteria;
+  SamplingParameter sampling_param;
+  Sequence sequence(sampling_param,
+                    stopping_criteria,
+                    /*token_ids=*/{1, 2, 4},
+                    /*echo=*/false,
+                    /*on_stream=*/nullptr);
+  sequence.append_blocks({3, 5, 7});
+
+  // blocks after the first two are released
+  EXPECT_EQ(sequence.release_blocks(2), std::vector<int32_t>({7}));
+  EXPECT_EQ(sequence.blocks(), std::vector<int32_t>({3, 5}));
+  EXPECT_TRUE(sequence.release_blocks(2).empty());
+  EXPECT_EQ(sequence.num_blocks(), 2);
+}
+
 }  // namespace llm
@@ -24,6 +24,10 @@ struct StoppingCriteria {
 
   // stop sequences
   std::vector<std::vector<int32_t>> stop_sequences;
+
+  // stop once the prompt is processed without generating any tokens, used to
+  // score prompts. no kv cache is kept for such sequences.
+  bool prefill_only = false;
 };
 
 }  // namespace llm
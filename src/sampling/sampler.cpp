@@ -63,10 +63,32 @@ torch::Tensor Sampler::sample(const torch::Tensor& probs) const {
 }
 
 torch::Tensor Sampler::forward(const torch::Tensor& logits) const {
-  const auto num_seqs = logits.size(0);
+  return sample_from_probs(torch::softmax(logits, /*dim=*/-1));
+}
+
+SampleOutput Sampler::forward_with_logprobs(const torch::Tensor& logits,
+                                            int64_t num_top_logprobs) const {
+  // compute logprobs in float32 to avoid precision loss when accumulating
+  const auto logprobs =
+      torch::log_softmax(logits, /*dim=*/-1, /*dtype=*/torch::kFloat32);
+
+  SampleOutput output;
+  output.next_tokens = sample_from_probs(logprobs.exp());
+  output.next_logprobs =
+      logprobs.gather(/*dim=*/-1, output.next_tokens).view({-1});
+  if (num_top_logprobs > 0) {
+    auto [values, indices] =
+        logprobs.topk(std::min(num_top_logprobs, logits.size(-1)));
+    output.top_tokens = indices;
+    output.top_logprobs = values;
+  }
+  return output;
+}
+
+torch::Tensor Sampler::sample_from_probs(const torch::Tensor& probs) const {
+  const auto num_seqs = probs.size(0);
   CHECK_EQ(num_seqs, static_cast<int64_t>(sample_funcs_.size()));
 
-  const auto probs = torch::softmax(logits, /*dim=*/-1);
   if (!top_p_.defined() && !top_k_.defined()) {
     // No top_p or top_k, just sample from the distribution
     return sample(probs);
@@ -85,7 +107,7 @@ torch::Tensor Sampler::forward(const torch::Tensor& logits) const {
 
   // ####################  apply top k   ####################
   if (top_k_.defined()) {
-    const auto vocab_size = logits.size(-1);
+    const auto vocab_size = probs.size(-1);
     auto top_k_mask = torch::arange(vocab_size, probs_sort.device())
                           .expand(probs_sort.sizes());
     top_k_mask = top_k_mask >= top_k_;
@@ -102,4 +124,55 @@ torch::Tensor Sampler::forward(const torch::Tensor& logits) const {
   return torch::gather(probs_idx, /*dim=*/-1, selected);
 }
 
+SampleOutput Sampler::score(const torch::Tensor& logits,
+                           const torch::Tensor& target_tokens,
+                           int64_t num_top_logprobs) {
+  const int64_t num_rows = logits.size(0);
+  CHECK_EQ(target_tokens.numel(), num_rows);
+  const int64_t k = std::min(num_top_logprobs, logits.size(-1));
+  std::vector<torch::Tensor> next_logprobs_vec;
+  std::vector<torch::Tensor> top_tokens_vec;
+  std::vector<torch::Tensor> top_logprobs_vec;
+  for (int64_t start = 0; start < num_rows; start += kScoreChunkSize) {
+    const int64_t len = std::min(kScoreChunkSize, num_rows - start);
+    const auto logprobs =
+        torch::log_softmax(logits.narrow(/*dim=*/0, start, len),
+                           /*dim=*/-1,
+                           /*dtype=*/torch::kFloat32);
+    const auto targets =
+        target_tokens.narrow(/*dim=*/0, start, len).view({-1, 1});
+    next_logprobs_vec.push_back(
+        logprobs.gather(/*dim=*/-1, targets).view({-1}));
+    if (k > 0) {
+      auto [values, indices] = logprobs.topk(k);
+      top_tokens_vec.push_back(indices);
+      top_logprobs_vec.push_back(values);
+    }
+  }
+
+  SampleOutput output;
+  output.next_tokens = target_tokens.view({-1, 1});
+  if (next_logprobs_vec.empty()) {
+    output.next_logprobs =
+        torch::empty({0}, logits.options().dtype(torch::kFloat32));
+  } else {
+    output.next_logprobs = torch::cat(next_logprobs_vec);
+  }
+  if (!top_tokens_vec.empty()) {
+    output.top_tokens = torch::cat(top_tokens_vec);
+    output.top_logprobs = torch::cat(top_logprobs_vec);
+  }
+  return output;
+}
+
+std::tuple<torch::Tensor, torch::Tensor> Sampler::top_logprobs(
+    const torch::Tensor& logits,
+    int64_t k) {
+  // compute logprobs in float32 to avoid precision loss when accumulating
+  const auto logprobs =
+      torch::log_softmax(logits, /*dim=*/-1, /*dtype=*/torch::kFloat32);
+  auto [values, indices] = logprobs.topk(std::min(k, logits.size(-1)));
+  return {indices, values};
+}
+
 }  // namespace llm
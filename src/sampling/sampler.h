@@ -3,10 +3,25 @@
 #include <torch/types.h>
 
 #include <functional>
+#include <tuple>
 
 #include "request/sampling_parameter.h"
 namespace llm {
 
+// output of sampling with logprobs, all tensors stay on the device of logits
+struct SampleOutput {
+  // [num_seqs, 1] LongTensor
+  torch::Tensor next_tokens;
+
+  // logprobs of the sampled tokens: [num_seqs] FloatTensor
+  torch::Tensor next_logprobs;
+
+  // tokens with highest logprobs and their logprobs, only set when
+  // num_top_logprobs > 0: [num_seqs, num_top_logprobs] LongTensor, FloatTensor
+  torch::Tensor top_tokens;
+  torch::Tensor top_logprobs;
+};
+
 class Sampler final {
  public:
   Sampler(const SamplingParameters& params,
@@ -15,6 +30,31 @@ class Sampler final {
 
   torch::Tensor forward(const torch::Tensor& logits) const;
 
+  // sample next tokens and gather their logprobs with the top alternatives.
+  // the distribution is computed once and shared by sampling and logprobs.
+  // logits: [num_seqs, vocab_size]
+  SampleOutput forward_with_logprobs(const torch::Tensor& logits,
+                                     int64_t num_top_logprobs) const;
+
+  // number of rows converted to float32 logprobs at a time by score
+  static constexpr int64_t kScoreChunkSize = 1024;
+
+  // returns logprobs of the given target tokens with the top alternatives,
+  // used to score prompts. rows are processed in chunks to bound the memory
+  // of float32 logprobs.
+  // logits: [num_rows, vocab_size], target_tokens: [num_rows] LongTensor
+  // returns next_tokens set to target_tokens with shape [num_rows, 1]
+  static SampleOutput score(const torch::Tensor& logits,
+                            const torch::Tensor& target_tokens,
+                            int64_t num_top_logprobs);
+
+  // returns the k tokens with highest logprobs and their logprobs
+  // logits: [num_seqs, vocab_size]
+  // returns (top_tokens, top_logprobs): [num_seqs, k] LongTensor, FloatTensor
+  static std::tuple<torch::Tensor, torch::Tensor> top_logprobs(
+      const torch::Tensor& logits,
+      int64_t k);
+
   // operator() allows us to use the module as a function.
   template <typename... Args>
   torch::Tensor operator()(Args&&... args) const {
@@ -24,6 +64,10 @@ class Sampler final {
  private:
   torch::Tensor sample(const torch::Tensor& probs) const;
 
+  // apply top_p and top_k to probs then sample from them
+  // probs: [num_seqs, vocab_size], returns [num_seqs, 1]
+  torch::Tensor sample_from_probs(const torch::Tensor& probs) const;
+
   using SampleFunc = std::function<torch::Tensor(const torch::Tensor&)>;
   std::vector<int64_t> seeds_;
   std::vector<SampleFunc> sample_funcs_;
@@ -30,6 +30,55 @@ TEST(SamplerTest, Greedy) {
       torch::allclose(output, logits.argmax(/*dim=*/-1, /*keepdim=*/true)));
 }
 
+TEST(SamplerTest, GreedyWithLogprobs) {
+  torch::ScalarType dtype(torch::kFloat32);
+  torch::Device device(torch::kCPU);
+  SamplingParameters params;
+  params.top_k = {0, 0};
+  params.top_p = {1.0, 1.0};
+  params.do_sample = {false, false};
+  Sampler sampler(params, dtype, device);
+
+  int64_t batch_size = 2;
+  int64_t vocab_size = 100;
+  const auto logits = torch::randn({batch_size, vocab_size},
+                                   torch::dtype(dtype).device(device));
+  const auto output = sampler.forward_with_logprobs(logits,
+                                                    /*num_top_logprobs=*/3);
+  const auto expected = torch::log_softmax(logits, /*dim=*/-1);
+  EXPECT_TRUE(torch::equal(output.next_tokens,
+                           logits.argmax(/*dim=*/-1, /*keepdim=*/true)));
+  // the chosen token has the highest logprob for greedy sampling
+  EXPECT_TRUE(torch::allclose(output.next_logprobs,
+                              std::get<0>(expected.max(/*dim=*/-1))));
+  EXPECT_EQ(output.top_tokens.sizes(), torch::IntArrayRef({batch_size, 3}));
+  EXPECT_EQ(output.top_logprobs.sizes(), torch::IntArrayRef({batch_size, 3}));
+  EXPECT_TRUE(torch::equal(output.top_tokens.select(/*dim=*/1, /*index=*/0),
+                           output.next_tokens.squeeze(/*dim=*/-1)));
+}
+
+TEST(SamplerTest, Score) {
+  torch::ScalarType dtype(torch::kFloat32);
+  torch::Device device(torch::kCPU);
+
+  int64_t num_rows = 3000;
+  int64_t vocab_size = 50;
+  const auto logits =
+      torch::randn({num_rows, vocab_size}, torch::dtype(dtype).device(device));
+  const auto targets = torch::randint(vocab_size, {num_rows}, torch::kInt64);
+  const auto output = Sampler::score(logits, targets, /*num_top_logprobs=*/2);
+
+  // rows span multiple chunks
+  const auto expected = torch::log_softmax(logits, /*dim=*/-1)
+                            .gather(/*dim=*/-1, targets.view({-1, 1}))
+                            .view({-1});
+  EXPECT_TRUE(torch::allclose(output.next_logprobs, expected));
+  EXPECT_TRUE(torch::equal(output.next_tokens.view({-1}), targets));
+  EXPECT_EQ(output.top_tokens.sizes(), torch::IntArrayRef({num_rows, 2}));
+  EXPECT_TRUE(torch::equal(output.top_tokens.select(/*dim=*/1, /*index=*/0),
+                           logits.argmax(/*dim=*/-1)));
+}
+
 TEST(SamplerTest, ToppTopk) {
   // Test GreedySampler
   torch::ScalarType dtype(torch::kFloat32);
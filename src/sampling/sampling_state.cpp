@@ -0,0 +1,28 @@
+#include "sampling_state.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <memory>
+
+namespace llm {
+
+SamplingState::SamplingState(torch::ScalarType dtype,
+                             const torch::Device& device)
+    : dtype_(dtype), device_(device) {}
+
+bool SamplingState::update(const SamplingParameters& params) {
+  // rows without sequence ids can't be matched with the last batch
+  if (!params.seq_ids.empty() && params.seq_ids == seq_ids_) {
+    return false;
+  }
+  DCHECK(params.seq_ids.empty() ||
+         params.seq_ids.size() == params.temperatures.size());
+
+  logits_processor_ = LogitsProcessor::create(params, dtype_, device_);
+  sampler_ = std::make_unique<Sampler>(params, dtype_, device_);
+  seq_ids_ = params.seq_ids;
+  return true;
+}
+
+}  // namespace llm
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "logits_processor.h"
+#include "request/sampling_parameter.h"
+#include "sampler.h"
+
+namespace llm {
+
+// SamplingState keeps the logits processor and sampler of the last batch on
+// the device. Since sampling parameters of a sequence never change, they are
+// reused as long as the batch has the same sequences in the same order, so
+// steady-state decode steps don't upload any sampling parameters.
+class SamplingState final {
+ public:
+  SamplingState(torch::ScalarType dtype, const torch::Device& device);
+
+  // rebuild the state if the sequences in the batch have changed.
+  // returns true if the state is rebuilt.
+  bool update(const SamplingParameters& params);
+
+  const LogitsProcessor& logits_processor() const {
+    return *logits_processor_;
+  }
+
+  const Sampler& sampler() const { return *sampler_; }
+
+ private:
+  torch::ScalarType dtype_;
+
+  torch::Device device_;
+
+  // ids of sequences in the last batch, empty if the state can't be reused
+  std::vector<int64_t> seq_ids_;
+
+  std::unique_ptr<LogitsProcessor> logits_processor_;
+
+  std::unique_ptr<Sampler> sampler_;
+};
+
+}  // namespace llm
@@ -0,0 +1,63 @@
+#include "sampling_state.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+namespace llm {
+
+TEST(SamplingStateTest, Update) {
+  SamplingState state(torch::kFloat32, torch::kCPU);
+
+  SamplingParameter param;
+  param.temperature = 0.5;
+  SamplingParameters params;
+  params.add(param);
+  params.add(param);
+  params.seq_ids = {1, 2};
+  EXPECT_TRUE(state.update(params));
+  const auto* logits_processor = &state.logits_processor();
+  const auto* sampler = &state.sampler();
+
+  // same sequences, reuse the state
+  EXPECT_FALSE(state.update(params));
+  EXPECT_EQ(&state.logits_processor(), logits_processor);
+  EXPECT_EQ(&state.sampler(), sampler);
+
+  // a sequence joined the batch
+  params.add(param);
+  params.seq_ids.push_back(3);
+  EXPECT_TRUE(state.update(params));
+  EXPECT_FALSE(state.update(params));
+
+  // a sequence left the batch
+  SamplingParameters new_params;
+  new_params.add(param);
+  new_params.add(param);
+  new_params.seq_ids = {1, 3};
+  EXPECT_TRUE(state.update(new_params));
+
+  // the state is rebuilt for rows without sequence ids
+  new_params.seq_ids.clear();
+  EXPECT_TRUE(state.update(new_params));
+  EXPECT_TRUE(state.update(new_params));
+}
+
+TEST(SamplingStateTest, Forward) {
+  SamplingState state(torch::kFloat32, torch::kCPU);
+  SamplingParameter param;
+  param.temperature = 0.0;
+  SamplingParameters params;
+  params.add(param);
+  params.add(param);
+  params.seq_ids = {1, 2};
+  state.update(params);
+
+  auto logits = torch::tensor({{0.1, 0.9, 0.0}, {0.8, 0.1, 0.1}});
+  state.logits_processor().forward(
+      logits, torch::Tensor(), torch::Tensor(), torch::Tensor());
+  const auto next_tokens = state.sampler().forward(logits);
+  EXPECT_TRUE(torch::equal(next_tokens.flatten(),
+                           torch::tensor({1, 0}, torch::kInt64)));
+}
+
+}  // namespace llm
@@ -0,0 +1,207 @@
+#include "beam_search.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "memory/block_manager.h"
+#include "request/request.h"
+#include "request/sequence.h"
+
+namespace llm {
+namespace {
+
+// drop the beam and release its cache blocks. the sequence is cancelled so
+// that it is neither scheduled nor returned, and can be recycled later.
+void drop_beam(Sequence* beam, BlockManager* block_manager) {
+  block_manager->release_slots_for_sequence(beam);
+  beam->set_cancelled();
+}
+
+// finished sequences that are not dropped
+std::vector<Sequence*> get_hypotheses(Request* request) {
+  std::vector<Sequence*> hypotheses;
+  for (Sequence& seq : request->sequences) {
+    if (seq.is_finished() && !seq.is_cancelled()) {
+      hypotheses.push_back(&seq);
+    }
+  }
+  return hypotheses;
+}
+
+}  // namespace
+
+float BeamSearch::score(const Sequence& sequence) {
+  const size_t num_generated_tokens =
+      std::max<size_t>(sequence.num_generated_tokens(), 1);
+  return sequence.cumulative_logprob() /
+         static_cast<float>(num_generated_tokens);
+}
+
+void BeamSearch::step(Request* request,
+                      std::vector<BeamCandidate> candidates,
+                      BlockManager* block_manager) {
+  DCHECK(request != nullptr);
+  DCHECK(block_manager != nullptr);
+  const size_t beam_width = request->sampling_param.beam_width;
+  CHECK_GT(beam_width, 1) << "beam search is not enabled";
+
+  // rank candidates by the cumulative logprob after appending the token
+  std::stable_sort(
+      candidates.begin(),
+      candidates.end(),
+      [](const BeamCandidate& a, const BeamCandidate& b) {
+        return a.beam->cumulative_logprob() + a.logprob >
+               b.beam->cumulative_logprob() + b.logprob;
+      });
+
+  std::vector<const BeamCandidate*> running;
+  std::vector<const BeamCandidate*> finished;
+  for (size_t rank = 0;
+       rank < candidates.size() && running.size() < beam_width;
+       ++rank) {
+    const BeamCandidate& candidate = candidates[rank];
+    if (candidate.beam->is_finished_by(candidate.token_id)) {
+      // only keep finished candidates ranked within the beam width
+      if (rank < beam_width) {
+        finished.push_back(&candidate);
+      }
+    } else {
+      running.push_back(&candidate);
+    }
+  }
+
+  // beams without any child are dropped and recycled
+  std::unordered_set<Sequence*> parents;
+  for (const auto* candidate : running) {
+    parents.insert(candidate->beam);
+  }
+  for (const auto* candidate : finished) {
+    parents.insert(candidate->beam);
+  }
+  std::unordered_set<Sequence*> beams;
+  for (const auto& candidate : candidates) {
+    beams.insert(candidate.beam);
+  }
+  std::vector<Sequence*> free_sequences;
+  for (Sequence& seq : request->sequences) {
+    if (beams.count(&seq) > 0 && parents.count(&seq) == 0) {
+      drop_beam(&seq, block_manager);
+    }
+    if (seq.is_cancelled()) {
+      free_sequences.push_back(&seq);
+    }
+  }
+  // reuse sequences in order
+  std::reverse(free_sequences.begin(), free_sequences.end());
+
+  // get a sequence to hold a new beam or hypothesis
+  auto acquire_sequence = [&]() -> Sequence* {
+    if (!free_sequences.empty()) {
+      Sequence* seq = free_sequences.back();
+      free_sequences.pop_back();
+      return seq;
+    }
+    request->add_sequence();
+    return &request->sequences.back();
+  };
+
+  // keep the best beam_width hypotheses, they don't need cache blocks
+  for (const auto* candidate : finished) {
+    const Sequence& parent = *candidate->beam;
+    auto hypotheses = get_hypotheses(request);
+    Sequence* hypothesis = nullptr;
+    if (hypotheses.size() < beam_width) {
+      hypothesis = acquire_sequence();
+    } else {
+      auto worst = std::min_element(
+          hypotheses.begin(),
+          hypotheses.end(),
+          [](const Sequence* a, const Sequence* b) {
+            return score(*a) < score(*b);
+          });
+      const float candidate_score =
+          (parent.cumulative_logprob() + candidate->logprob) /
+          static_cast<float>(parent.num_generated_tokens() + 1);
+      if (candidate_score <= score(**worst)) {
+        continue;
+      }
+      hypothesis = *worst;
+    }
+    hypothesis->fork_from(parent);
+    hypothesis->append_new_token_id(candidate->token_id, candidate->logprob);
+    CHECK(hypothesis->is_finished());
+  }
+
+  // fork beams with multiple children, the first child reuses the parent
+  // which is extended after all its children are forked.
+  std::unordered_map<Sequence*, const BeamCandidate*> first_children;
+  for (const auto* candidate : running) {
+    Sequence* parent = candidate->beam;
+    if (first_children.emplace(parent, candidate).second) {
+      continue;
+    }
+    Sequence* child = acquire_sequence();
+    block_manager->fork_slots_for_sequence(*parent, child);
+    child->fork_from(*parent);
+    child->append_new_token_id(candidate->token_id, candidate->logprob);
+  }
+  for (Sequence& seq : request->sequences) {
+    auto it = first_children.find(&seq);
+    if (it != first_children.end()) {
+      seq.append_new_token_id(it->second->token_id, it->second->logprob);
+    } else if (parents.count(&seq) > 0) {
+      // parents that only have finished children are not needed anymore
+      drop_beam(&seq, block_manager);
+    }
+  }
+
+  // stop early if no running beam can beat the worst hypothesis
+  const auto hypotheses = get_hypotheses(request);
+  if (hypotheses.size() < beam_width) {
+    return;
+  }
+  float worst_score = std::numeric_limits<float>::max();
+  for (const Sequence* hypothesis : hypotheses) {
+    worst_score = std::min(worst_score, score(*hypothesis));
+  }
+  std::vector<Sequence*> running_beams;
+  float best_running_score = std::numeric_limits<float>::lowest();
+  for (Sequence& seq : request->sequences) {
+    if (!seq.is_finished()) {
+      running_beams.push_back(&seq);
+      best_running_score = std::max(best_running_score, score(seq));
+    }
+  }
+  if (best_running_score <= worst_score) {
+    for (Sequence* beam : running_beams) {
+      drop_beam(beam, block_manager);
+    }
+  }
+}
+
+std::vector<Sequence*> BeamSearch::best_sequences(Request* request) {
+  DCHECK(request != nullptr);
+  std::vector<Sequence*> sequences;
+  for (Sequence& seq : request->sequences) {
+    if (!seq.is_cancelled()) {
+      sequences.push_back(&seq);
+    }
+  }
+  std::stable_sort(sequences.begin(),
+                   sequences.end(),
+                   [](const Sequence* a, const Sequence* b) {
+                     return score(*a) > score(*b);
+                   });
+  if (sequences.size() > request->num_return_sequences) {
+    sequences.resize(request->num_return_sequences);
+  }
+  return sequences;
+}
+
+}  // namespace llm
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "memory/block_manager.h"
+#include "request/request.h"
+#include "request/sequence.h"
+
+namespace llm {
+
+// a candidate to extend a running beam with one token
+struct BeamCandidate {
+  // the beam to extend
+  Sequence* beam = nullptr;
+
+  // the token to append
+  int32_t token_id = 0;
+
+  // logprob of the token
+  float logprob = 0.0f;
+};
+
+// Beam search keeps beam_width running beams for a request. In each step, the
+// candidates from all running beams are ranked by cumulative logprob, the top
+// ones are kept as new beams and the rest are dropped. A beam with multiple
+// children is forked, the children share the cache blocks of the parent which
+// are copied on write. Beams that finish are kept as hypotheses, and the best
+// num_return_sequences hypotheses are returned when the request is finished.
+// The sequences of dropped beams are recycled to avoid growing the request.
+class BeamSearch final {
+ public:
+  // select beams for the next step from the candidates of all running beams
+  // of the request.
+  static void step(Request* request,
+                   std::vector<BeamCandidate> candidates,
+                   BlockManager* block_manager);
+
+  // returns the best sequences of the request sorted by score, at most
+  // num_return_sequences of them.
+  static std::vector<Sequence*> best_sequences(Request* request);
+
+  // length normalized logprob of the sequence
+  static float score(const Sequence& sequence);
+};
+
+}  // namespace llm
@@ -0,0 +1,115 @@
+#include "beam_search.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+
+#include "memory/block_manager.h"
+#include "request/request.h"
+
+namespace llm {
+
+TEST(BeamSearchTest, ForkAndPrune) {
+  const int32_t eos_token_id = 100;
+  BlockManager block_manager(/*num_blocks=*/10, /*block_size=*/4);
+
+  Request request("beam", /*prompt_tokens=*/{1, 2, 3});
+  request.sampling_param.beam_width = 2;
+  request.stopping_criteria.max_tokens = 10;
+  request.stopping_criteria.eos_token_id = eos_token_id;
+  request.add_sequence();
+  Sequence* seq0 = &request.sequences[0];
+  EXPECT_TRUE(block_manager.allocate_slots_for_sequence(seq0));
+
+  // the first beam is forked into two beams sharing the prompt blocks
+  BeamSearch::step(&request,
+                   {{seq0, 5, std::log(0.6f)},
+                    {seq0, 6, std::log(0.3f)},
+                    {seq0, eos_token_id, std::log(0.05f)},
+                    {seq0, 7, std::log(0.05f)}},
+                   &block_manager);
+  ASSERT_EQ(request.sequences.size(), 2);
+  Sequence* seq1 = &request.sequences[1];
+  EXPECT_EQ(seq0->token_ids(), std::vector<int32_t>({1, 2, 3, 5}));
+  EXPECT_EQ(seq1->token_ids(), std::vector<int32_t>({1, 2, 3, 6}));
+  EXPECT_EQ(seq0->blocks(), seq1->blocks());
+  EXPECT_FLOAT_EQ(seq1->cumulative_logprob(), std::log(0.3f));
+
+  // the shared block is copied on write for the first beam only
+  EXPECT_TRUE(block_manager.allocate_slots_for_sequence(seq0));
+  EXPECT_TRUE(block_manager.allocate_slots_for_sequence(seq1));
+  const auto block_copies = block_manager.pop_block_copies();
+  ASSERT_EQ(block_copies.size(), 1);
+  EXPECT_EQ(block_copies[0].first, seq1->blocks()[0]);
+  EXPECT_EQ(block_copies[0].second, seq0->blocks()[0]);
+  EXPECT_TRUE(block_manager.pop_block_copies().empty());
+
+  // the best candidate hits eos and is kept as a hypothesis
+  BeamSearch::step(&request,
+                   {{seq0, eos_token_id, std::log(0.9f)},
+                    {seq0, 8, std::log(0.1f)},
+                    {seq1, 9, std::log(0.5f)},
+                    {seq1, eos_token_id, std::log(0.4f)}},
+                   &block_manager);
+  ASSERT_EQ(request.sequences.size(), 3);
+  Sequence* seq2 = &request.sequences[2];
+  EXPECT_TRUE(seq2->is_finished());
+  EXPECT_EQ(seq2->finish_reason(), FinishReason::STOP);
+  EXPECT_EQ(seq2->token_ids(), std::vector<int32_t>({1, 2, 3, 5}));
+  EXPECT_EQ(seq0->token_ids(), std::vector<int32_t>({1, 2, 3, 5, 8}));
+  EXPECT_EQ(seq1->token_ids(), std::vector<int32_t>({1, 2, 3, 6, 9}));
+
+  // the first beam is dropped and recycled for the second child of seq1
+  EXPECT_TRUE(block_manager.allocate_slots_for_sequence(seq0));
+  EXPECT_TRUE(block_manager.allocate_slots_for_sequence(seq1));
+  BeamSearch::step(&request,
+                   {{seq0, 14, std::log(0.01f)},
+                    {seq0, 15, std::log(0.01f)},
+                    {seq1, 12, std::log(0.9f)},
+                    {seq1, 13, std::log(0.05f)}},
+                   &block_manager);
+  ASSERT_EQ(request.sequences.size(), 3);
+  EXPECT_FALSE(seq0->is_finished());
+  EXPECT_EQ(seq0->token_ids(), std::vector<int32_t>({1, 2, 3, 6, 9, 13}));
+  EXPECT_EQ(seq1->token_ids(), std::vector<int32_t>({1, 2, 3, 6, 9, 12}));
+  EXPECT_EQ(seq0->blocks(), seq1->blocks());
+
+  // the hypothesis has the best score
+  request.num_return_sequences = 2;
+  const auto best = BeamSearch::best_sequences(&request);
+  ASSERT_EQ(best.size(), 2);
+  EXPECT_EQ(best[0], seq2);
+  EXPECT_EQ(best[1], seq1);
+}
+
+TEST(BeamSearchTest, MaxTokens) {
+  BlockManager block_manager(/*num_blocks=*/10, /*block_size=*/4);
+
+  Request request("beam", /*prompt_tokens=*/{1, 2, 3});
+  request.sampling_param.beam_width = 2;
+  request.stopping_criteria.max_tokens = 1;
+  request.num_return_sequences = 2;
+  request.add_sequence();
+  Sequence* seq0 = &request.sequences[0];
+  EXPECT_TRUE(block_manager.allocate_slots_for_sequence(seq0));
+  const uint32_t num_free_blocks = block_manager.num_free_blocks();
+
+  // all candidates reach max tokens, the top two become hypotheses
+  BeamSearch::step(&request,
+                   {{seq0, 5, std::log(0.2f)},
+                    {seq0, 6, std::log(0.7f)},
+                    {seq0, 7, std::log(0.1f)}},
+                   &block_manager);
+  EXPECT_TRUE(request.is_finished());
+  // the parent is dropped and its blocks are released
+  EXPECT_TRUE(seq0->is_cancelled());
+  EXPECT_EQ(block_manager.num_free_blocks(), num_free_blocks + 1);
+
+  const auto best = BeamSearch::best_sequences(&request);
+  ASSERT_EQ(best.size(), 2);
+  EXPECT_EQ(best[0]->token_ids(), std::vector<int32_t>({1, 2, 3, 6}));
+  EXPECT_EQ(best[0]->finish_reason(), FinishReason::LENGTH);
+  EXPECT_EQ(best[1]->token_ids(), std::vector<int32_t>({1, 2, 3, 5}));
+}
+
+}  // namespace llm
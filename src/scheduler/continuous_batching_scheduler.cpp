@@ -5,14 +5,119 @@
 #include <folly/MPMCQueue.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "beam_search.h"
+#include "common/metrics.h"
+#include "common/tracer.h"
 #include "request/request.h"
 #include "request/sequence.h"
 
+DEFINE_int32(prompt_lookup_min_ngram,
+             1,
+             "minimum n-gram size to match for prompt lookup decoding");
+DEFINE_int32(prompt_lookup_max_ngram,
+             3,
+             "maximum n-gram size to match for prompt lookup decoding");
+
 namespace llm {
 
+DEFINE_COUNTER(prompt_lookup_proposed_tokens_total,
+               "Total number of draft tokens proposed by prompt lookup");
+DEFINE_COUNTER(prompt_lookup_accepted_tokens_total,
+               "Total number of draft tokens accepted by the target model");
+
+// per step metrics
+DEFINE_HISTOGRAM(scheduler_step_seconds,
+                 "Latency of one scheduler step with a batch in seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(scheduler_build_batch_seconds,
+                 "Latency of building the batch for one step in seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(scheduler_process_outputs_seconds,
+                 "Latency of appending sampled tokens and scheduling stream "
+                 "responses per step in seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(detokenize_stream_seconds,
+                 "Latency of detokenizing and sending one response in seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(step_num_sequences,
+                 "Number of sequences in the batch of one step",
+                 size_buckets());
+DEFINE_HISTOGRAM(step_num_tokens,
+                 "Number of tokens processed by one step",
+                 size_buckets());
+DEFINE_COUNTER(prefill_tokens_total, "Total number of prompt tokens processed");
+DEFINE_COUNTER(decode_tokens_total,
+               "Total number of generated tokens processed");
+DEFINE_COUNTER(preemptions_total,
+               "Total number of requests preempted to free cache blocks");
+DEFINE_GAUGE(kv_cache_used_blocks, "Number of kv cache blocks in use");
+DEFINE_GAUGE(kv_cache_free_blocks, "Number of free kv cache blocks");
+
+// per request metrics
+DEFINE_HISTOGRAM(request_queue_time_seconds,
+                 "Time from arrival to the first schedule of a request in "
+                 "seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(request_time_to_first_token_seconds,
+                 "Time from arrival to the first token of a request in seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(request_time_per_output_token_seconds,
+                 "Mean time between output tokens of a request in seconds",
+                 latency_buckets());
+DEFINE_HISTOGRAM(request_preemptions,
+                 "Number of times a request was preempted",
+                 exponential_buckets(1.0, 2.0, 6));
+
+namespace {
+
+// read the logprob of token_id at flat index idx of the outputs with at most
+// num_top_logprobs alternatives
+LogProb make_logprob(const OutputParameters& output,
+                     int64_t idx,
+                     int32_t token_id,
+                     int64_t num_top_logprobs) {
+  LogProb logprob;
+  logprob.token_id = token_id;
+  logprob.logprob = output.next_logprobs.data_ptr<float>()[idx];
+  if (num_top_logprobs > 0 && output.top_tokens.defined()) {
+    const int64_t k = output.top_tokens.size(-1);
+    const int64_t n = std::min(num_top_logprobs, k);
+    const int64_t* top_tokens = output.top_tokens.data_ptr<int64_t>();
+    const float* top_logprobs = output.top_logprobs.data_ptr<float>();
+    logprob.top_logprobs.reserve(n);
+    for (int64_t j = 0; j < n; ++j) {
+      logprob.top_logprobs.emplace_back(
+          static_cast<int32_t>(top_tokens[idx * k + j]),
+          top_logprobs[idx * k + j]);
+    }
+  }
+  return logprob;
+}
+
+// record logprobs at flat index idx of the outputs for the token just appended
+// to the sequence. tokens that are not appended, e.g. eos, are skipped.
+void append_logprob(Sequence* seq,
+                    const OutputParameters& output,
+                    int64_t idx,
+                    size_t num_tokens_before) {
+  const auto& sampling_param = seq->sampling_param();
+  if (!sampling_param.logprobs || !output.next_logprobs.defined() ||
+      seq->num_tokens() <= num_tokens_before) {
+    return;
+  }
+  seq->append_logprob(make_logprob(
+      output, idx, seq->token_ids().back(), sampling_param.top_logprobs));
+}
+
+}  // namespace
+
 constexpr size_t kRequestQueueSize = 100000;
 // TODO: reader from config
 constexpr size_t kMaxBatchSize = 100;
@@ -23,13 +128,50 @@ DEFINE_int32(streaming_token_buffer_size,
              1,
              "number of tokens to buffer before streaming to client");
 
+DEFINE_string(record_request_trace_path,
+              "",
+              "path to record served requests as jsonl for the simulator");
+
+DEFINE_string(record_step_trace_path,
+              "",
+              "path to record step latencies as jsonl to calibrate the "
+              "simulator");
+
+DEFINE_int32(num_decode_steps,
+             1,
+             "number of decode steps to run per scheduler step for decode-only "
+             "batches");
+
+DECLARE_int32(max_loras);
+DECLARE_int32(max_score_tokens_per_step);
+
 ContinuousBatchingScheduler::ContinuousBatchingScheduler(Engine* engine)
-    : engine_(engine), request_queue_(kRequestQueueSize) {
+    : ContinuousBatchingScheduler(engine,
+                                  DisaggRole::NONE,
+                                  /*kv_transport=*/nullptr) {}
+
+ContinuousBatchingScheduler::ContinuousBatchingScheduler(
+    Engine* engine,
+    DisaggRole role,
+    KVTransport* kv_transport)
+    : engine_(engine),
+      role_(role),
+      kv_transport_(kv_transport),
+      request_queue_(kRequestQueueSize) {
   CHECK(engine_ != nullptr);
+  CHECK(role_ == DisaggRole::NONE || kv_transport_ != nullptr)
+      << "kv transport is required for prefill/decode disaggregation";
   block_manager_ = engine_->block_manager();
   tokenizer_ = engine_->tokenizer();
   CHECK(block_manager_ != nullptr);
   CHECK(tokenizer_ != nullptr);
+  num_free_blocks_.store(block_manager_->num_free_blocks(),
+                         std::memory_order_relaxed);
+  if (!FLAGS_record_request_trace_path.empty() ||
+      !FLAGS_record_step_trace_path.empty()) {
+    trace_recorder_ = std::make_unique<TraceRecorder>(
+        FLAGS_record_request_trace_path, FLAGS_record_step_trace_path);
+  }
 }
 
 ContinuousBatchingScheduler::~ContinuousBatchingScheduler() {
@@ -56,8 +198,22 @@ ContinuousBatchingScheduler::~ContinuousBatchingScheduler() {
 }
 
 void ContinuousBatchingScheduler::on_request_finish(Request* request) {
+  if (trace_recorder_) {
+    trace_recorder_->on_request_finish(request);
+  }
+  if (request->timeline.first_scheduled == absl::InfinitePast()) {
+    // finished before being scheduled
+    num_pending_tokens_.fetch_sub(request->num_prompt_tokens(),
+                                  std::memory_order_relaxed);
+  }
+  request->timeline.finish = absl::Now();
+  observe_request(*request);
   // release all blocks for the finished request
   block_manager_->release_slots_for_request(request);
+  // drop prompt lookup indexes for all sequences
+  for (const Sequence& seq : request->sequences) {
+    ngram_indexes_.erase(seq.id());
+  }
   // take over the ownership of the request
   std::unique_ptr<Request> finished_request(request);
   response_threadpool_.schedule([tokenizer = tokenizer_.get(),
@@ -66,6 +222,11 @@ void ContinuousBatchingScheduler::on_request_finish(Request* request) {
       // just finish the request
       request->on_stream_finish(Status());
     } else {
+      TraceSpan span("finish");
+      for (const Sequence& seq : request->sequences) {
+        span.add_seq_id(seq.id());
+      }
+      const auto start = absl::Now();
       // summarize statistics for all sequences
       Statistics stats;
       stats.num_prompt_tokens = request->num_prompt_tokens();
@@ -75,14 +236,37 @@ void ContinuousBatchingScheduler::on_request_finish(Request* request) {
       stats.num_total_tokens =
           stats.num_prompt_tokens + stats.num_generated_tokens;
 
+      std::vector<Sequence*> sequences;
+      if (request->sampling_param.beam_width > 1) {
+        // only return the best beams
+        sequences = BeamSearch::best_sequences(request.get());
+        stats.num_generated_tokens = 0;
+        for (const Sequence* seq : sequences) {
+          stats.num_generated_tokens += seq->num_generated_tokens();
+        }
+        stats.num_total_tokens =
+            stats.num_prompt_tokens + stats.num_generated_tokens;
+      } else {
+        for (Sequence& seq : request->sequences) {
+          sequences.push_back(&seq);
+        }
+      }
+      request->fill_latency_stats(&stats);
+
       std::vector<SequenceResult> seq_results;
-      seq_results.reserve(request->sequences.size());
-      for (Sequence& seq : request->sequences) {
+      seq_results.reserve(sequences.size());
+      for (Sequence* seq : sequences) {
         // generate the final output
-        const auto output = seq.decode_delta_text(seq.num_tokens(), *tokenizer);
-        seq_results.push_back({output, seq.finish_reason()});
+        const auto output =
+            seq->decode_delta_text(seq->num_tokens(), *tokenizer);
+        seq_results.push_back({output,
+                               seq->finish_reason(),
+                               seq->logprobs(),
+                               seq->embedding()});
       }
       request->on_finish(seq_results, Status(), stats);
+      detokenize_stream_seconds.Observe(
+          absl::ToDoubleSeconds(absl::Now() - start));
     }
   });
 }
@@ -98,19 +282,27 @@ void ContinuousBatchingScheduler::on_sequence_stream(Sequence* seq) {
     // output the delta text til the end of the sequence to the client
     response_threadpool_.schedule(
         [seq, tokenizer = tokenizer_.get(), end = num_tokens, finish_reason]() {
+          TraceSpan span("stream");
+          span.add_seq_id(seq->id());
+          const auto start = absl::Now();
           const auto detla = seq->decode_delta_text(end, *tokenizer);
           if (!detla.empty() || finish_reason != FinishReason::NONE) {
             seq->stream_delta(detla, finish_reason);
           };
+          detokenize_stream_seconds.Observe(
+              absl::ToDoubleSeconds(absl::Now() - start));
         });
   }
 }
 
 bool ContinuousBatchingScheduler::schedule(std::unique_ptr<Request>& request) {
   CHECK(request != nullptr);
+  const int64_t num_prompt_tokens = request->num_prompt_tokens();
   if (request_queue_.write(request.get())) {
     // take over the ownership of the request
     request.release();
+    num_pending_tokens_.fetch_add(num_prompt_tokens,
+                                  std::memory_order_relaxed);
     return true;
   }
   // queue is full
@@ -124,9 +316,17 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
     // read from request queue then push to priority queue
     request_queue_.read(request);
     CHECK(request != nullptr);
+    // requests are only traced when prefill and decode share the engine
+    if (trace_recorder_ && role_ == DisaggRole::NONE) {
+      trace_recorder_->on_request_arrival(request);
+    }
     priority_queue_.push(request);
   }
 
+  if (role_ == DisaggRole::DECODE) {
+    receive_migrated_requests();
+  }
+
   // access in reverse order
   for (auto it = request_batch_.rbegin(); it != request_batch_.rend(); ++it) {
     Request* request = *it;
@@ -135,6 +335,12 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
       continue;
     }
 
+    if (role_ == DisaggRole::PREFILL && is_prefilled(request)) {
+      // the request is decoded by the decode scheduler from now on
+      migrate_request(request);
+      continue;
+    }
+
     // the request is still holding cache slots
     preemptable_candidates_.push_front(request);
     // push the request back to the priority queue
@@ -145,9 +351,37 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
   sequences_batch_.clear();
   request_batch_.clear();
 
+  // prompt tokens of scoring and embedding requests in the batch
+  int64_t num_score_tokens = 0;
+  // lora adapters in the batch, bounded by the device slots of workers
+  std::unordered_set<int32_t> lora_ids;
+  // requests skipped for lack of lora slots or prefill only budget, pushed
+  // back after scheduling
+  std::vector<Request*> skipped_candidates;
   // schedule sequence by sequence but preempt whole request if necessary
   while (!priority_queue_.empty()) {
     Request* candidate = priority_queue_.top();
+    const int32_t lora_id = candidate->sampling_param.lora_id;
+    if (lora_id >= 0 && lora_ids.count(lora_id) == 0 &&
+        static_cast<int32_t>(lora_ids.size()) >= FLAGS_max_loras) {
+      // keep scheduling the requests behind it, which may not need a slot
+      priority_queue_.pop();
+      skipped_candidates.push_back(candidate);
+      continue;
+    }
+    if (candidate->stopping_criteria.prefill_only) {
+      // pack prefill only requests up to the budget, at least one per step
+      const auto num_tokens =
+          static_cast<int64_t>(candidate->num_prompt_tokens());
+      if (num_score_tokens > 0 &&
+          num_score_tokens + num_tokens > FLAGS_max_score_tokens_per_step) {
+        // keep scheduling the requests behind it, which may not need budget
+        priority_queue_.pop();
+        skipped_candidates.push_back(candidate);
+        continue;
+      }
+      num_score_tokens += num_tokens;
+    }
     bool has_enough_slots = true;
     std::vector<Sequence*> sequence_candiadtes;
     sequence_candiadtes.reserve(candidate->sequences.size());
@@ -156,6 +390,11 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
         // skip finished sequence.
         continue;
       }
+      if (sequence.is_prefill_only()) {
+        // scored or embedded without kv cache
+        sequence_candiadtes.push_back(&sequence);
+        continue;
+      }
       if (block_manager_->allocate_slots_for_sequence(&sequence)) {
         sequence_candiadtes.push_back(&sequence);
       } else {
@@ -168,9 +407,13 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
       // add request to new batch
       priority_queue_.pop();
       request_batch_.push_back(candidate);
+      on_request_scheduled(candidate);
       sequences_batch_.insert(sequences_batch_.end(),
                               sequence_candiadtes.begin(),
                               sequence_candiadtes.end());
+      if (lora_id >= 0) {
+        lora_ids.insert(lora_id);
+      }
       if (!preemptable_candidates_.empty() &&
           candidate == preemptable_candidates_.front()) {
         // the request has been scheduled and can't be preempted
@@ -186,6 +429,8 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
       // avoid preempting the candidate request
       if (request_to_preempt != candidate) {
         block_manager_->release_slots_for_request(request_to_preempt);
+        request_to_preempt->timeline.preemptions.push_back(absl::Now());
+        preemptions_total.Increment();
       }
       continue;
     }
@@ -194,12 +439,16 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
     if (!sequence_candiadtes.empty()) {
       priority_queue_.pop();
       request_batch_.push_back(candidate);
+      on_request_scheduled(candidate);
       sequences_batch_.insert(sequences_batch_.end(),
                               sequence_candiadtes.begin(),
                               sequence_candiadtes.end());
     }
     break;
   }
+  for (Request* request : skipped_candidates) {
+    priority_queue_.push(request);
+  }
 
   if (sequences_batch_.empty() && !priority_queue_.empty()) {
     // don't have enough memory to schedule one sequence
@@ -210,6 +459,130 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
     // TODO: optimize the logic to only release blocks for sequences one by one
     on_request_finish(request);
   }
+  const uint32_t num_free_blocks = block_manager_->num_free_blocks();
+  num_free_blocks_.store(num_free_blocks, std::memory_order_relaxed);
+  kv_cache_free_blocks.Set(num_free_blocks);
+  kv_cache_used_blocks.Set(block_manager_->num_total_blocks() -
+                           num_free_blocks);
+}
+
+folly::SemiFuture<folly::Unit> ContinuousBatchingScheduler::swap_weights() {
+  std::lock_guard<std::mutex> lock(swap_mutex_);
+  CHECK(!swap_promise_.has_value()) << "Weights are already being swapped";
+  swap_promise_.emplace();
+  auto future = swap_promise_->getSemiFuture();
+  swap_requested_.store(true, std::memory_order_release);
+  return future;
+}
+
+void ContinuousBatchingScheduler::maybe_swap_weights() {
+  if (!swap_requested_.load(std::memory_order_acquire)) {
+    return;
+  }
+  folly::Promise<folly::Unit> promise;
+  {
+    std::lock_guard<std::mutex> lock(swap_mutex_);
+    promise = std::move(*swap_promise_);
+    swap_promise_.reset();
+    swap_requested_.store(false, std::memory_order_relaxed);
+  }
+
+  TraceSpan span("swap_weights");
+  engine_->swap_weights();
+
+  // the kv cache computed with the old weights is stale, release it as if
+  // the requests were preempted so that it's recomputed with the new weights.
+  for (Request* request : request_batch_) {
+    block_manager_->release_slots_for_request(request);
+  }
+  std::vector<Request*> queued_requests;
+  while (!priority_queue_.empty()) {
+    queued_requests.push_back(priority_queue_.top());
+    priority_queue_.pop();
+  }
+  for (Request* request : queued_requests) {
+    block_manager_->release_slots_for_request(request);
+    priority_queue_.push(request);
+  }
+  LOG(INFO) << "Swapped weights, recomputing kv cache for "
+            << request_batch_.size() + queued_requests.size() << " requests";
+  promise.setValue();
+}
+
+bool ContinuousBatchingScheduler::is_prefilled(const Request* request) const {
+  for (const Sequence& seq : request->sequences) {
+    if (!seq.is_finished() && seq.is_prefill()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ContinuousBatchingScheduler::migrate_request(Request* request) {
+  auto migrated = std::make_unique<MigratedRequest>();
+  migrated->sequences.resize(request->sequences.size());
+  for (size_t i = 0; i < request->sequences.size(); ++i) {
+    const Sequence& seq = request->sequences[i];
+    if (seq.is_finished() || seq.num_blocks() == 0) {
+      continue;
+    }
+    auto& migrated_seq = migrated->sequences[i];
+    migrated_seq.num_tokens_in_cache = seq.num_tokens_in_cache();
+    migrated_seq.kv_blocks = engine_->get_kv_blocks(seq.blocks());
+  }
+  // the kv cache has been copied out, release blocks for other requests
+  block_manager_->release_slots_for_request(request);
+  for (const Sequence& seq : request->sequences) {
+    ngram_indexes_.erase(seq.id());
+  }
+  auto it = std::find(
+      preemptable_candidates_.begin(), preemptable_candidates_.end(), request);
+  if (it != preemptable_candidates_.end()) {
+    preemptable_candidates_.erase(it);
+  }
+
+  migrated->request.reset(request);
+  // send from the response thread so that pending stream responses of the
+  // request are done before the decode scheduler takes it over
+  response_threadpool_.schedule([kv_transport = kv_transport_,
+                                 migrated = std::move(migrated)]() mutable {
+    while (!kv_transport->send(migrated)) {
+      // wait for the decode scheduler to drain the transport
+      absl::SleepFor(absl::Milliseconds(kStepSleepTimeMs));
+    }
+  });
+}
+
+void ContinuousBatchingScheduler::receive_migrated_requests() {
+  while (auto migrated = kv_transport_->recv()) {
+    Request* request = migrated->request.release();
+    // already scheduled by the prefill scheduler, the load of the request is
+    // counted by the blocks holding its kv cache
+    CHECK(request != nullptr);
+    CHECK_EQ(migrated->sequences.size(), request->sequences.size());
+    for (size_t i = 0; i < migrated->sequences.size(); ++i) {
+      const auto& migrated_seq = migrated->sequences[i];
+      if (migrated_seq.kv_blocks.empty()) {
+        continue;
+      }
+      Sequence* seq = &request->sequences[i];
+      // [num_layers, 2, num_blocks, block_size, num_kv_heads, head_dim]
+      const int64_t num_blocks = migrated_seq.kv_blocks.front().size(2);
+      // blocks sharded differently by the prefill engine are rejected too
+      if (!block_manager_->allocate_slots_for_sequence(
+              seq, migrated_seq.num_tokens_in_cache) ||
+          seq->num_blocks() != static_cast<size_t>(num_blocks) ||
+          !engine_->set_kv_blocks(seq->blocks(), migrated_seq.kv_blocks)) {
+        // recompute the kv cache like a preempted sequence
+        LOG(WARNING) << "Failed to restore kv cache for sequence "
+                     << seq->id() << ", recompute it";
+        block_manager_->release_slots_for_sequence(seq);
+        continue;
+      }
+      seq->set_num_tokens_in_cache(migrated_seq.num_tokens_in_cache);
+    }
+    priority_queue_.push(request);
+  }
 }
 
 // step the scheduler forward by one step
@@ -217,10 +590,15 @@ void ContinuousBatchingScheduler::build_sequence_batch() {
 void ContinuousBatchingScheduler::step(const absl::Duration& timeout) {
   // get a new batch of requests
   const auto deadline = absl::Now() + timeout;
+  absl::Time step_start;
   while (true) {
+    maybe_swap_weights();
+    step_start = absl::Now();
     build_sequence_batch();
     if (!sequences_batch_.empty()) {
       // find one batch of requests to process
+      scheduler_build_batch_seconds.Observe(
+          absl::ToDoubleSeconds(absl::Now() - step_start));
       break;
     }
     const auto now = absl::Now();
@@ -235,7 +613,51 @@ void ContinuousBatchingScheduler::step(const absl::Duration& timeout) {
   }
 
   CHECK(!sequences_batch_.empty());
+  observe_batch();
+  TraceSpan span("scheduler_step");
+  if (span.enabled()) {
+    for (const Sequence* seq : sequences_batch_) {
+      span.add_seq_id(seq->id());
+    }
+  }
+  const auto observe_step = [step_start]() {
+    scheduler_step_seconds.Observe(
+        absl::ToDoubleSeconds(absl::Now() - step_start));
+  };
+  // copy the blocks shared by beams before they are written
+  engine_->copy_kv_blocks(block_manager_->pop_block_copies());
+
+  if (run_prefill_only()) {
+    observe_step();
+    return;
+  }
+
+  // the prefill scheduler generates only the first token of each sequence
+  if (role_ != DisaggRole::PREFILL && propose_prompt_lookup_tokens()) {
+    // verify draft tokens and generate one more token in one forward pass
+    validate_spec_tokens();
+    on_tokens_generated();
+    observe_step();
+    return;
+  }
+
+  const int32_t num_steps = prepare_multi_step_decode();
+  if (num_steps > 1) {
+    execute_multi_step_decode(num_steps);
+    on_tokens_generated();
+    observe_step();
+    return;
+  }
+
+  // only single step batches are recorded for the simulator
+  const auto step_stats = StepStats::from_batch(sequences_batch_);
+  const auto execute_start = absl::Now();
   auto output_parameters = engine_->execute_model(sequences_batch_);
+  if (trace_recorder_) {
+    trace_recorder_->on_step(step_stats, absl::Now() - execute_start);
+  }
+  const auto process_start = absl::Now();
+  TraceSpan process_span("process_outputs");
 
   const auto& next_tokens = output_parameters.next_tokens;
   const int64_t num_seqs = next_tokens.numel();
@@ -243,17 +665,399 @@ void ContinuousBatchingScheduler::step(const absl::Duration& timeout) {
 
   const int64_t* new_token_ids = next_tokens.data_ptr<int64_t>();
   // process sequence in batch
+  bool has_beam_search = false;
   for (int64_t i = 0; i < num_seqs; ++i) {
     Sequence* seq = sequences_batch_[i];
+    if (seq->sampling_param().beam_width > 1) {
+      // beams are selected per request
+      has_beam_search = true;
+      continue;
+    }
     const int32_t next_token_id = static_cast<int32_t>(new_token_ids[i]);
     // add the next token to sequence and check if the sequence is finished
+    const size_t num_tokens = seq->num_tokens();
     seq->append_new_token_id(next_token_id);
+    append_logprob(seq, output_parameters, i, num_tokens);
+
+    // stream delta to client if streaming is enabled
+    if (seq->is_streaming()) {
+      on_sequence_stream(seq);
+    }
+  }
+
+  if (has_beam_search) {
+    step_beam_search(output_parameters);
+  }
+  scheduler_process_outputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - process_start));
+  on_tokens_generated();
+  observe_step();
+}
+
+bool ContinuousBatchingScheduler::run_prefill_only() {
+  std::vector<Sequence*> score_batch;
+  std::vector<Sequence*> embed_batch;
+  for (Sequence* seq : sequences_batch_) {
+    if (!seq->is_prefill_only()) {
+      continue;
+    }
+    if (seq->sampling_param().pooling != PoolingType::NONE) {
+      embed_batch.push_back(seq);
+    } else {
+      score_batch.push_back(seq);
+    }
+  }
+  if (score_batch.empty() && embed_batch.empty()) {
+    return false;
+  }
+  if (!score_batch.empty()) {
+    score_prompts(score_batch);
+  }
+  if (!embed_batch.empty()) {
+    embed_prompts(embed_batch);
+  }
+
+  // the remaining sequences generate tokens as usual
+  sequences_batch_.erase(std::remove_if(sequences_batch_.begin(),
+                                        sequences_batch_.end(),
+                                        [](const Sequence* seq) {
+                                          return seq->is_prefill_only();
+                                        }),
+                         sequences_batch_.end());
+  return sequences_batch_.empty();
+}
+
+void ContinuousBatchingScheduler::score_prompts(
+    const std::vector<Sequence*>& batch) {
+  const auto output = engine_->score(batch);
+  TraceSpan span("process_scores");
+  // each sequence has one row for each token after the first one
+  int64_t row = 0;
+  for (Sequence* seq : batch) {
+    const auto& sampling_param = seq->sampling_param();
+    const auto& token_ids = seq->token_ids();
+    const auto num_rows = static_cast<int64_t>(token_ids.size()) - 1;
+    std::vector<LogProb> logprobs;
+    if (sampling_param.logprobs) {
+      logprobs.reserve(num_rows);
+      for (int64_t j = 0; j < num_rows; ++j) {
+        logprobs.push_back(make_logprob(output,
+                                        row + j,
+                                        token_ids[j + 1],
+                                        sampling_param.top_logprobs));
+      }
+    }
+    row += num_rows;
+    seq->finish_prefill_only(std::move(logprobs));
+    if (seq->is_streaming()) {
+      on_sequence_stream(seq);
+    }
+  }
+  CHECK_EQ(row, output.next_logprobs.numel());
+}
+
+void ContinuousBatchingScheduler::embed_prompts(
+    const std::vector<Sequence*>& batch) {
+  const auto output = engine_->embed(batch);
+  TraceSpan span("process_embeddings");
+  // [num_seqs, hidden_size]
+  const auto& embeddings = output.embeddings;
+  CHECK_EQ(embeddings.size(0), static_cast<int64_t>(batch.size()));
+  const int64_t hidden_size = embeddings.size(1);
+  const float* data = embeddings.data_ptr<float>();
+  for (size_t i = 0; i < batch.size(); ++i) {
+    Sequence* seq = batch[i];
+    const float* begin = data + i * hidden_size;
+    seq->finish_with_embedding(std::vector<float>(begin, begin + hidden_size));
+    if (seq->is_streaming()) {
+      on_sequence_stream(seq);
+    }
+  }
+}
+
+void ContinuousBatchingScheduler::on_request_scheduled(Request* request) {
+  if (request->timeline.first_scheduled == absl::InfinitePast()) {
+    request->timeline.first_scheduled = absl::Now();
+    // from now on the request takes cache blocks instead
+    num_pending_tokens_.fetch_sub(request->num_prompt_tokens(),
+                                  std::memory_order_relaxed);
+  }
+}
+
+void ContinuousBatchingScheduler::on_tokens_generated() {
+  const absl::Time now = absl::Now();
+  for (Request* request : request_batch_) {
+    if (request->timeline.first_token != absl::InfinitePast()) {
+      continue;
+    }
+    for (const Sequence& seq : request->sequences) {
+      if (seq.num_generated_tokens() > 0) {
+        request->timeline.first_token = now;
+        break;
+      }
+    }
+  }
+}
+
+void ContinuousBatchingScheduler::observe_request(const Request& request) {
+  Statistics stats;
+  request.fill_latency_stats(&stats);
+  const auto& timeline = request.timeline;
+  if (timeline.first_scheduled != absl::InfinitePast()) {
+    request_queue_time_seconds.Observe(stats.queue_time_ms / 1000.0);
+  }
+  if (timeline.first_token != absl::InfinitePast()) {
+    request_time_to_first_token_seconds.Observe(
+        stats.time_to_first_token_ms / 1000.0);
+  }
+  if (stats.time_per_output_token_ms > 0) {
+    request_time_per_output_token_seconds.Observe(
+        stats.time_per_output_token_ms / 1000.0);
+  }
+  request_preemptions.Observe(static_cast<double>(stats.num_preemptions));
+}
+
+void ContinuousBatchingScheduler::observe_batch() const {
+  int64_t num_prefill_tokens = 0;
+  int64_t num_decode_tokens = 0;
+  for (const Sequence* seq : sequences_batch_) {
+    const auto num_tokens = static_cast<int64_t>(seq->num_tokens() -
+                                                 seq->num_tokens_in_cache());
+    if (seq->is_prefill()) {
+      num_prefill_tokens += num_tokens;
+    } else {
+      num_decode_tokens += num_tokens;
+    }
+  }
+  step_num_sequences.Observe(static_cast<double>(sequences_batch_.size()));
+  step_num_tokens.Observe(
+      static_cast<double>(num_prefill_tokens + num_decode_tokens));
+  prefill_tokens_total.Increment(static_cast<double>(num_prefill_tokens));
+  decode_tokens_total.Increment(static_cast<double>(num_decode_tokens));
+}
+
+void ContinuousBatchingScheduler::step_beam_search(
+    const OutputParameters& output_parameters) {
+  // [num_seqs, num_top_logprobs]
+  const auto& top_tokens = output_parameters.top_tokens;
+  const auto& top_logprobs = output_parameters.top_logprobs;
+  CHECK(top_tokens.defined() && top_logprobs.defined());
+  const int64_t num_seqs = top_tokens.size(0);
+  CHECK(num_seqs == sequences_batch_.size());
+  const int64_t k = top_tokens.size(1);
+  const int64_t* token_ids = top_tokens.data_ptr<int64_t>();
+  const float* logprobs = top_logprobs.data_ptr<float>();
+
+  std::unordered_map<const Sequence*, int64_t> seq_idxes;
+  for (int64_t i = 0; i < num_seqs; ++i) {
+    seq_idxes[sequences_batch_[i]] = i;
+  }
+
+  for (Request* request : request_batch_) {
+    if (request->sampling_param.beam_width <= 1) {
+      continue;
+    }
+    std::vector<BeamCandidate> candidates;
+    bool all_beams_scheduled = true;
+    for (Sequence& seq : request->sequences) {
+      if (seq.is_finished()) {
+        continue;
+      }
+      auto it = seq_idxes.find(&seq);
+      if (it == seq_idxes.end()) {
+        all_beams_scheduled = false;
+        break;
+      }
+      const int64_t i = it->second;
+      for (int64_t j = 0; j < k; ++j) {
+        candidates.push_back({&seq,
+                              static_cast<int32_t>(token_ids[i * k + j]),
+                              logprobs[i * k + j]});
+      }
+    }
+    // beams are compared with each other, wait until all of them are scheduled
+    if (!all_beams_scheduled) {
+      continue;
+    }
+    BeamSearch::step(request, std::move(candidates), block_manager_);
+  }
+}
+
+bool ContinuousBatchingScheduler::propose_prompt_lookup_tokens() {
+  if (engine_->pipeline_size() > 1) {
+    // draft tokens are not verified by pipelined engines
+    return false;
+  }
+  for (const Sequence* seq : sequences_batch_) {
+    if (seq->sampling_param().beam_width > 1) {
+      // beams are selected from the top tokens of a normal step, which
+      // validate doesn't return. don't speculate for the whole batch.
+      return false;
+    }
+  }
+  bool has_spec_tokens = false;
+  for (Sequence* seq : sequences_batch_) {
+    if (seq->sampling_param().logprobs) {
+      // logprobs are only recorded for the token sampled at each step
+      continue;
+    }
+    const size_t num_tokens_to_propose =
+        std::min<size_t>(seq->sampling_param().prompt_lookup_num_tokens,
+                         seq->max_num_spec_tokens());
+    if (num_tokens_to_propose == 0) {
+      continue;
+    }
+
+    auto it = ngram_indexes_.find(seq->id());
+    if (it == ngram_indexes_.end()) {
+      it = ngram_indexes_
+               .emplace(seq->id(),
+                        NGramIndex(FLAGS_prompt_lookup_min_ngram,
+                                   FLAGS_prompt_lookup_max_ngram))
+               .first;
+    }
+    NGramIndex& index = it->second;
+    index.update(seq->token_ids());
+    const auto spec_token_ids =
+        index.propose(seq->token_ids(), num_tokens_to_propose);
+    if (spec_token_ids.empty()) {
+      continue;
+    }
+
+    seq->append_spec_token_ids(spec_token_ids);
+    // allocate cache slots for draft tokens, skip speculation if no room
+    if (!block_manager_->allocate_slots_for_sequence(seq)) {
+      seq->discard_spec_token_ids();
+      continue;
+    }
+    has_spec_tokens = true;
+  }
+  return has_spec_tokens;
+}
+
+void ContinuousBatchingScheduler::validate_spec_tokens() {
+  auto output_parameters = engine_->validate(sequences_batch_);
+  const auto process_start = absl::Now();
+  TraceSpan process_span("process_outputs");
+
+  // [num_seqs, max_num_spec_tokens + 1]
+  const auto& next_tokens = output_parameters.next_tokens;
+  const int64_t num_seqs = next_tokens.size(0);
+  CHECK(num_seqs == sequences_batch_.size());
+  const int64_t stride = next_tokens.size(1);
+
+  const int64_t* new_token_ids = next_tokens.data_ptr<int64_t>();
+  for (int64_t i = 0; i < num_seqs; ++i) {
+    Sequence* seq = sequences_batch_[i];
+    const size_t num_spec_tokens = seq->num_spec_tokens();
+    const size_t num_tokens = seq->num_tokens();
+    // accept matched draft tokens and the token sampled by the target model
+    const size_t num_accepted =
+        seq->update_valid_token_ids(new_token_ids + i * stride);
+    if (num_spec_tokens == 0) {
+      append_logprob(seq, output_parameters, i * stride, num_tokens);
+    } else {
+      // sequences asking for logprobs don't speculate, drafted tokens have
+      // no logprobs to record
+      prompt_lookup_proposed_tokens_total.Increment(
+          static_cast<double>(num_spec_tokens));
+      prompt_lookup_accepted_tokens_total.Increment(
+          static_cast<double>(num_accepted));
+    }
+
+    // stream delta to client if streaming is enabled
+    if (seq->is_streaming()) {
+      on_sequence_stream(seq);
+    }
+  }
+  scheduler_process_outputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - process_start));
+}
+
+int32_t ContinuousBatchingScheduler::prepare_multi_step_decode() {
+  if (FLAGS_num_decode_steps <= 1 || role_ == DisaggRole::PREFILL ||
+      engine_->pipeline_size() > 1) {
+    return 1;
+  }
+
+  size_t num_steps = 1;
+  for (const Sequence* seq : sequences_batch_) {
+    // only sequences generating one token per step are supported
+    if (seq->is_prefill() ||
+        seq->num_tokens() - seq->num_tokens_in_cache() != 1) {
+      return 1;
+    }
+    // penalties are computed from tokens known before the first step
+    const auto& sampling_param = seq->sampling_param();
+    if (sampling_param.beam_width > 1) {
+      // beams are selected after each step
+      return 1;
+    }
+    if (sampling_param.frequency_penalty != 0.0 ||
+        sampling_param.presence_penalty != 0.0 ||
+        sampling_param.repetition_penalty != 1.0) {
+      return 1;
+    }
+    // no need to run more steps than any sequence can generate
+    const size_t max_steps =
+        std::min<size_t>(FLAGS_num_decode_steps - 1,
+                         seq->max_num_spec_tokens()) +
+        1;
+    num_steps = std::max(num_steps, max_steps);
+  }
+
+  if (num_steps > 1) {
+    // reserve cache slots for tokens generated by all but the last step
+    for (size_t i = 0; i < sequences_batch_.size(); ++i) {
+      Sequence* seq = sequences_batch_[i];
+      if (!block_manager_->allocate_slots_for_sequence(
+              seq, seq->num_tokens() + num_steps - 1)) {
+        // give back the slots reserved for the previous sequences
+        for (size_t j = 0; j < i; ++j) {
+          block_manager_->release_slots_for_sequence(
+              sequences_batch_[j], sequences_batch_[j]->num_tokens());
+        }
+        return 1;
+      }
+    }
+  }
+  return static_cast<int32_t>(num_steps);
+}
+
+void ContinuousBatchingScheduler::execute_multi_step_decode(int32_t num_steps) {
+  auto output_parameters =
+      engine_->execute_model_multi_steps(sequences_batch_, num_steps);
+  const auto process_start = absl::Now();
+  TraceSpan process_span("process_outputs");
+
+  // [num_seqs, num_steps]
+  const auto& next_tokens = output_parameters.next_tokens;
+  const int64_t num_seqs = next_tokens.size(0);
+  CHECK(num_seqs == sequences_batch_.size());
+  CHECK(next_tokens.size(1) == num_steps);
+
+  const int64_t* new_token_ids = next_tokens.data_ptr<int64_t>();
+  for (int64_t i = 0; i < num_seqs; ++i) {
+    Sequence* seq = sequences_batch_[i];
+    // drop tokens generated after the sequence is finished
+    for (int32_t step = 0; step < num_steps; ++step) {
+      const int32_t next_token_id =
+          static_cast<int32_t>(new_token_ids[i * num_steps + step]);
+      const size_t num_tokens = seq->num_tokens();
+      const bool appended = seq->append_new_token_id(next_token_id);
+      append_logprob(seq, output_parameters, i * num_steps + step, num_tokens);
+      if (!appended) {
+        break;
+      }
+    }
 
     // stream delta to client if streaming is enabled
     if (seq->is_streaming()) {
       on_sequence_stream(seq);
     }
   }
+  scheduler_process_outputs_seconds.Observe(
+      absl::ToDoubleSeconds(absl::Now() - process_start));
 }
 
 }  // namespace llm
@@ -2,24 +2,48 @@
 
 #include <absl/time/time.h>
 #include <folly/MPMCQueue.h>
+#include <folly/futures/Future.h>
 
+#include <atomic>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
+#include <unordered_map>
 
 #include "engine/engine.h"
+#include "kv_transport.h"
 #include "memory/block_manager.h"
+#include "ngram_index.h"
 #include "request/request.h"
 #include "scheduler.h"
+#include "trace_recorder.h"
 
 namespace llm {
 
+// role of the scheduler when prefill and decode run on separate engines
+enum class DisaggRole : int8_t {
+  // run both prefill and decode on the same engine
+  NONE = 0,
+  // only prefill requests, then send them to the decode scheduler
+  PREFILL = 1,
+  // decode requests received from the prefill scheduler
+  DECODE = 2,
+};
+
 // TODO: add schedule config to control the max number of tokens per batch, max
 // number of seqs per batch and the time out value.
 class ContinuousBatchingScheduler final : public Scheduler {
  public:
   ContinuousBatchingScheduler(Engine* engine);
 
+  // create a scheduler for one side of prefill/decode disaggregation, the
+  // prefill and decode schedulers should share the same kv transport.
+  ContinuousBatchingScheduler(Engine* engine,
+                              DisaggRole role,
+                              KVTransport* kv_transport);
+
   ~ContinuousBatchingScheduler();
 
   // schedule a request, thread safe and non-blocking
@@ -30,17 +54,96 @@ class ContinuousBatchingScheduler final : public Scheduler {
   // may get blocked if there are no requests to process
   void step(const absl::Duration& timeout) override;
 
+  // number of prompt tokens of requests that are not scheduled into a batch
+  // yet. the load of running requests shows in the cache blocks they take.
+  // thread safe, used to balance requests across replicas.
+  int64_t num_pending_tokens() const {
+    return num_pending_tokens_.load(std::memory_order_relaxed);
+  }
+
+  // number of free cache blocks as of the last step. thread safe
+  int64_t num_free_blocks() const {
+    return num_free_blocks_.load(std::memory_order_relaxed);
+  }
+
+  // number of slots per cache block
+  int32_t block_size() const { return block_manager_->block_size(); }
+
+  // swap in the weights staged by Engine::stage_weights between two steps,
+  // then recompute the kv cache of running requests with the new weights.
+  // thread safe, the future is fulfilled once the weights are swapped.
+  folly::SemiFuture<folly::Unit> swap_weights();
+
  private:
   // get a batch of requests from the priority queue
   void build_sequence_batch();
 
+  // swap the staged weights if requested, called between steps
+  void maybe_swap_weights();
+
   void on_request_finish(Request* request);
 
   void on_sequence_stream(Sequence* seq);
 
+  // whether all unfinished sequences of the request have been prefilled
+  bool is_prefilled(const Request* request) const;
+
+  // hand off a prefilled request with its kv cache to the decode scheduler
+  void migrate_request(Request* request);
+
+  // receive prefilled requests from the prefill scheduler and restore their
+  // kv cache
+  void receive_migrated_requests();
+
+  // score or embed prefill only sequences in current batch and remove them
+  // from the batch. returns true if no sequences are left to generate tokens.
+  bool run_prefill_only();
+
+  // finish sequences with the logprobs of their prompt tokens
+  void score_prompts(const std::vector<Sequence*>& batch);
+
+  // finish sequences with the pooled hidden states of their prompts
+  void embed_prompts(const std::vector<Sequence*>& batch);
+
+  // propose draft tokens by prompt lookup for sequences that enabled it,
+  // unless the batch has beam search. returns true if any draft tokens are
+  // proposed.
+  bool propose_prompt_lookup_tokens();
+
+  // verify draft tokens with the engine and accept the matched ones
+  void validate_spec_tokens();
+
+  // returns the number of decode steps to run for current batch and reserves
+  // cache slots for them. returns 1 if the batch can't run multiple steps.
+  int32_t prepare_multi_step_decode();
+
+  // run multiple decode steps and append generated tokens to sequences
+  void execute_multi_step_decode(int32_t num_steps);
+
+  // select beams for requests with beam search enabled
+  void step_beam_search(const OutputParameters& output_parameters);
+
+  // export the size and the prefill/decode split of current batch to metrics
+  void observe_batch() const;
+
+  // record the first time the request is scheduled
+  void on_request_scheduled(Request* request);
+
+  // record the first token time for requests in current batch
+  void on_tokens_generated();
+
+  // export the latency breakdown of a finished request to metrics
+  void observe_request(const Request& request);
+
   // the engine to run the batch
   Engine* engine_;
 
+  // role in prefill/decode disaggregation
+  DisaggRole role_ = DisaggRole::NONE;
+
+  // transport between prefill and decode schedulers, not owned
+  KVTransport* kv_transport_ = nullptr;
+
   // the block manager to manage the cache blocks
   BlockManager* block_manager_;
 
@@ -68,6 +171,21 @@ class ContinuousBatchingScheduler final : public Scheduler {
   // low.
   std::deque<Request*> preemptable_candidates_;
 
+  // suffix indexes for prompt lookup decoding, keyed by sequence id
+  std::unordered_map<int64_t, NGramIndex> ngram_indexes_;
+
+  // records request and step traces for the scheduler simulator, optional
+  std::unique_ptr<TraceRecorder> trace_recorder_;
+
+  // load of the scheduler that can be read from other threads
+  std::atomic<int64_t> num_pending_tokens_{0};
+  std::atomic<int64_t> num_free_blocks_{0};
+
+  // pending request to swap weights, guarded by swap_mutex_
+  std::mutex swap_mutex_;
+  std::optional<folly::Promise<folly::Unit>> swap_promise_;
+  std::atomic<bool> swap_requested_{false};
+
   // the threadpool to handle responses
   ThreadPool response_threadpool_;
 };
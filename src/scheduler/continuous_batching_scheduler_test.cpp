@@ -0,0 +1,214 @@
+#include "continuous_batching_scheduler.h"
+
+#include <absl/time/time.h>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+DECLARE_int32(max_score_tokens_per_step);
+
+namespace llm {
+namespace {
+
+constexpr int32_t kBlockSize = 4;
+constexpr uint32_t kNumBlocks = 32;
+constexpr int64_t kNextTokenId = 7;
+
+class FakeTokenizer : public Tokenizer {
+ public:
+  bool encode(const std::string_view& /*text*/,
+              std::vector<int32_t>* /*ids*/) const override {
+    return false;
+  }
+
+  std::string decode(const std::vector<int32_t>& tokens) const override {
+    return std::string(tokens.size(), 'x');
+  }
+
+  size_t vocab_size() const override { return 0; }
+
+  std::unique_ptr<Tokenizer> clone() const override {
+    return std::make_unique<FakeTokenizer>();
+  }
+};
+
+// an engine generating the same tokens for all sequences
+class FakeEngine : public Engine {
+ public:
+  FakeEngine()
+      : Engine({torch::kCPU}),
+        block_manager_(std::make_unique<BlockManager>(kNumBlocks, kBlockSize)) {
+  }
+
+  bool init(const std::string& /*model_weights_path*/) override {
+    return true;
+  }
+
+  std::unique_ptr<Tokenizer> tokenizer() const override {
+    return std::make_unique<FakeTokenizer>();
+  }
+
+  BlockManager* block_manager() const override { return block_manager_.get(); }
+
+  OutputParameters execute_model(const std::vector<Sequence*>& batch) override {
+    const auto num_seqs = static_cast<int64_t>(batch.size());
+    for (const Sequence* seq : batch) {
+      if (seq->is_prefill()) {
+        ++num_prefill_seqs;
+      } else {
+        ++num_decode_seqs;
+      }
+    }
+    OutputParameters output_params;
+    output_params.next_tokens =
+        torch::full({num_seqs}, kNextTokenId, torch::kInt64);
+    // top 4 tokens of each sequence for beam search
+    output_params.top_tokens =
+        torch::tensor({5, 6, 7, 8}, torch::kInt64).repeat({num_seqs, 1});
+    output_params.top_logprobs =
+        torch::tensor({0.4f, 0.3f, 0.2f, 0.1f}).log().repeat({num_seqs, 1});
+    return output_params;
+  }
+
+  OutputParameters validate(const std::vector<Sequence*>& batch) override {
+    ++num_validate_calls;
+    size_t max_num_spec_tokens = 0;
+    for (const Sequence* seq : batch) {
+      max_num_spec_tokens =
+          std::max(max_num_spec_tokens, seq->num_spec_tokens());
+    }
+    OutputParameters output_params;
+    output_params.next_tokens =
+        torch::full({static_cast<int64_t>(batch.size()),
+                     static_cast<int64_t>(max_num_spec_tokens) + 1},
+                    kNextTokenId,
+                    torch::kInt64);
+    return output_params;
+  }
+
+  OutputParameters score(const std::vector<Sequence*>& batch) override {
+    // one logprob for each prompt token after the first one
+    int64_t num_rows = 0;
+    for (const Sequence* seq : batch) {
+      num_rows += static_cast<int64_t>(seq->num_prompt_tokens()) - 1;
+    }
+    num_score_seqs += static_cast<int64_t>(batch.size());
+    OutputParameters output_params;
+    output_params.next_logprobs = torch::zeros({num_rows});
+    return output_params;
+  }
+
+  int64_t num_prefill_seqs = 0;
+  int64_t num_decode_seqs = 0;
+  int64_t num_score_seqs = 0;
+  int64_t num_validate_calls = 0;
+
+ private:
+  std::unique_ptr<BlockManager> block_manager_;
+};
+
+std::unique_ptr<Request> create_request(const std::string& id,
+                                        std::vector<int32_t> prompt_tokens) {
+  auto request = std::make_unique<Request>(id, std::move(prompt_tokens));
+  request->stopping_criteria.max_tokens = 10;
+  request->stopping_criteria.ignore_eos_token = true;
+  request->on_finish = [](const std::vector<SequenceResult>& /*results*/,
+                          const Status& /*status*/,
+                          const Statistics& /*stats*/) { return true; };
+  return request;
+}
+
+}  // namespace
+
+TEST(ContinuousBatchingSchedulerTest, BeamSearchWithPromptLookup) {
+  FakeEngine engine;
+  ContinuousBatchingScheduler scheduler(&engine);
+
+  // the prompt repeats the generated token, so prompt lookup has drafts to
+  // propose in each step
+  auto lookup_request = create_request("lookup", {1, 2, 7, 1, 2, 7, 1, 2});
+  lookup_request->sampling_param.prompt_lookup_num_tokens = 2;
+  lookup_request->add_sequence();
+  ASSERT_TRUE(scheduler.schedule(lookup_request));
+
+  auto beam_request = create_request("beam", {4, 5, 6});
+  beam_request->sampling_param.beam_width = 2;
+  beam_request->add_sequence();
+  const Request* beams = beam_request.get();
+  ASSERT_TRUE(scheduler.schedule(beam_request));
+
+  // the first beam is forked into the top two tokens
+  scheduler.step(absl::Seconds(1));
+  ASSERT_EQ(beams->sequences.size(), 2);
+  EXPECT_EQ(beams->sequences[0].token_ids(),
+            std::vector<int32_t>({4, 5, 6, 5}));
+  EXPECT_EQ(beams->sequences[1].token_ids(),
+            std::vector<int32_t>({4, 5, 6, 6}));
+
+  // both beams keep going through beam search
+  scheduler.step(absl::Seconds(1));
+  ASSERT_EQ(beams->sequences.size(), 2);
+  for (const Sequence& seq : beams->sequences) {
+    EXPECT_EQ(seq.num_generated_tokens(), 2);
+  }
+  // the batch is not speculated while it has beams
+  EXPECT_EQ(engine.num_validate_calls, 0);
+}
+
+TEST(ContinuousBatchingSchedulerTest, PendingTokens) {
+  FakeEngine engine;
+  ContinuousBatchingScheduler scheduler(&engine);
+
+  auto request = create_request("1", {1, 2, 3});
+  request->add_sequence();
+  ASSERT_TRUE(scheduler.schedule(request));
+  EXPECT_EQ(scheduler.num_pending_tokens(), 3);
+
+  // running requests take cache blocks instead
+  scheduler.step(absl::Seconds(1));
+  EXPECT_EQ(scheduler.num_pending_tokens(), 0);
+  EXPECT_EQ(scheduler.num_free_blocks(),
+            static_cast<int64_t>(kNumBlocks) - 1);
+  scheduler.step(absl::Seconds(1));
+  EXPECT_EQ(scheduler.num_pending_tokens(), 0);
+}
+
+TEST(ContinuousBatchingSchedulerTest, PrefillOnlyBudget) {
+  gflags::FlagSaver flag_saver;
+  FLAGS_max_score_tokens_per_step = 10;
+  FakeEngine engine;
+  ContinuousBatchingScheduler scheduler(&engine);
+
+  auto decode_request = create_request("decode", {1, 2, 3});
+  decode_request->add_sequence();
+  ASSERT_TRUE(scheduler.schedule(decode_request));
+  scheduler.step(absl::Seconds(1));
+  EXPECT_EQ(engine.num_prefill_seqs, 1);
+
+  // two scoring requests ahead of the running request, only one of them
+  // fits the budget of each step
+  for (const std::string id : {"score0", "score1"}) {
+    auto score_request = create_request(id, {1, 2, 3, 4, 5, 6, 7, 8});
+    score_request->priority = RequestPriority::HIGH;
+    score_request->stopping_criteria.max_tokens = 0;
+    score_request->stopping_criteria.prefill_only = true;
+    score_request->add_sequence();
+    ASSERT_TRUE(scheduler.schedule(score_request));
+  }
+
+  // the running request is decoded along with the first scoring request
+  scheduler.step(absl::Seconds(1));
+  EXPECT_EQ(engine.num_score_seqs, 1);
+  EXPECT_EQ(engine.num_decode_seqs, 1);
+
+  scheduler.step(absl::Seconds(1));
+  EXPECT_EQ(engine.num_score_seqs, 2);
+  EXPECT_EQ(engine.num_decode_seqs, 2);
+}
+
+}  // namespace llm
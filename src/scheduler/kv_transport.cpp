@@ -0,0 +1,38 @@
+#include "kv_transport.h"
+
+#include <glog/logging.h>
+
+#include <memory>
+
+namespace llm {
+
+LocalKVTransport::LocalKVTransport(size_t capacity) : queue_(capacity) {}
+
+LocalKVTransport::~LocalKVTransport() {
+  // release all requests that are not received
+  MigratedRequest* migrated = nullptr;
+  while (queue_.read(migrated)) {
+    std::unique_ptr<MigratedRequest> migrated_ptr(migrated);
+  }
+}
+
+bool LocalKVTransport::send(std::unique_ptr<MigratedRequest>& migrated) {
+  CHECK(migrated != nullptr);
+  if (queue_.write(migrated.get())) {
+    // the transport owns the request until it is received
+    migrated.release();
+    return true;
+  }
+  // queue is full
+  return false;
+}
+
+std::unique_ptr<MigratedRequest> LocalKVTransport::recv() {
+  MigratedRequest* migrated = nullptr;
+  if (!queue_.read(migrated)) {
+    return nullptr;
+  }
+  return std::unique_ptr<MigratedRequest>(migrated);
+}
+
+}  // namespace llm
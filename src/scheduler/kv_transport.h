@@ -0,0 +1,66 @@
+#pragma once
+
+#include <folly/MPMCQueue.h>
+#include <torch/torch.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "request/request.h"
+
+namespace llm {
+
+// kv cache of a sequence migrated from the prefill engine
+struct MigratedSequence {
+  // number of tokens in the kv cache, 0 if nothing is migrated
+  size_t num_tokens_in_cache = 0;
+
+  // kv cache blocks gathered by Engine::get_kv_blocks, one tensor per worker
+  // [num_layers, 2, num_blocks, block_size, num_kv_heads, head_dim]
+  std::vector<torch::Tensor> kv_blocks;
+};
+
+// a prefilled request handed off from the prefill engine to the decode engine
+struct MigratedRequest {
+  std::unique_ptr<Request> request;
+
+  // one for each sequence in the request, in the same order
+  std::vector<MigratedSequence> sequences;
+};
+
+// KVTransport moves prefilled requests and their kv cache from a prefill
+// scheduler to a decode scheduler, so that prefill and decode can run on
+// separate engines and be sized and batched independently.
+class KVTransport {
+ public:
+  virtual ~KVTransport() = default;
+
+  // send a prefilled request, thread safe and non-blocking.
+  // returns false if the transport is full and the ownership of the request is
+  // not transferred.
+  virtual bool send(std::unique_ptr<MigratedRequest>& migrated) = 0;
+
+  // receive a prefilled request, thread safe and non-blocking.
+  // returns nullptr if there is nothing to receive.
+  virtual std::unique_ptr<MigratedRequest> recv() = 0;
+};
+
+// a transport between two engines in the same process. the request is handed
+// over as is, together with its callbacks.
+class LocalKVTransport final : public KVTransport {
+ public:
+  explicit LocalKVTransport(size_t capacity);
+
+  ~LocalKVTransport() override;
+
+  bool send(std::unique_ptr<MigratedRequest>& migrated) override;
+
+  std::unique_ptr<MigratedRequest> recv() override;
+
+ private:
+  // a thread safe queue of migrated requests owned by the transport
+  folly::MPMCQueue<MigratedRequest*> queue_;
+};
+
+}  // namespace llm
@@ -0,0 +1,222 @@
+#include "kv_transport.h"
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+#include "continuous_batching_scheduler.h"
+
+namespace llm {
+namespace {
+
+constexpr int32_t kBlockSize = 4;
+constexpr uint32_t kNumBlocks = 32;
+constexpr int64_t kNextTokenId = 7;
+
+class FakeTokenizer : public Tokenizer {
+ public:
+  bool encode(const std::string_view& /*text*/,
+              std::vector<int32_t>* /*ids*/) const override {
+    return false;
+  }
+
+  std::string decode(const std::vector<int32_t>& tokens) const override {
+    return std::string(tokens.size(), 'x');
+  }
+
+  size_t vocab_size() const override { return 0; }
+
+  std::unique_ptr<Tokenizer> clone() const override {
+    return std::make_unique<FakeTokenizer>();
+  }
+};
+
+// an engine that keeps one value as the kv cache of each block
+class FakeEngine : public Engine {
+ public:
+  FakeEngine()
+      : Engine({torch::kCPU}),
+        block_manager_(std::make_unique<BlockManager>(kNumBlocks, kBlockSize)) {
+  }
+
+  bool init(const std::string& /*model_weights_path*/) override {
+    return true;
+  }
+
+  std::unique_ptr<Tokenizer> tokenizer() const override {
+    return std::make_unique<FakeTokenizer>();
+  }
+
+  BlockManager* block_manager() const override { return block_manager_.get(); }
+
+  OutputParameters execute_model(const std::vector<Sequence*>& batch) override {
+    for (const Sequence* seq : batch) {
+      if (seq->is_prefill()) {
+        ++num_prefill_seqs;
+        // fill the cache of prefilled blocks with the sequence id
+        for (int32_t block_id : seq->blocks()) {
+          kv_blocks[block_id] = static_cast<float>(seq->id());
+        }
+      } else {
+        ++num_decode_seqs;
+      }
+    }
+    OutputParameters output_params;
+    output_params.next_tokens = torch::full(
+        {static_cast<int64_t>(batch.size())}, kNextTokenId, torch::kInt64);
+    return output_params;
+  }
+
+  std::vector<torch::Tensor> get_kv_blocks(
+      const std::vector<int32_t>& block_ids) override {
+    // [num_layers, 2, num_blocks, block_size, num_kv_heads, head_dim]
+    auto blocks = torch::zeros(
+        {1, 2, static_cast<int64_t>(block_ids.size()), 1, 1, 1});
+    for (size_t i = 0; i < block_ids.size(); ++i) {
+      blocks.select(2, static_cast<int64_t>(i)).fill_(kv_blocks[block_ids[i]]);
+    }
+    return {blocks};
+  }
+
+  bool set_kv_blocks(const std::vector<int32_t>& block_ids,
+                     const std::vector<torch::Tensor>& blocks) override {
+    if (reject_kv_blocks || blocks.size() != 1) {
+      return false;
+    }
+    for (size_t i = 0; i < block_ids.size(); ++i) {
+      kv_blocks[block_ids[i]] =
+          blocks[0][0][0][static_cast<int64_t>(i)].flatten()[0].item<float>();
+    }
+    return true;
+  }
+
+  std::unordered_map<int32_t, float> kv_blocks;
+  // reject migrated blocks as if they were sharded differently
+  bool reject_kv_blocks = false;
+  int64_t num_prefill_seqs = 0;
+  int64_t num_decode_seqs = 0;
+
+ private:
+  std::unique_ptr<BlockManager> block_manager_;
+};
+
+}  // namespace
+
+TEST(KVTransportTest, Local) {
+  LocalKVTransport transport(/*capacity=*/1);
+  EXPECT_TRUE(transport.recv() == nullptr);
+
+  auto migrated = std::make_unique<MigratedRequest>();
+  migrated->request = std::make_unique<Request>("1", std::vector<int32_t>{1});
+  EXPECT_TRUE(transport.send(migrated));
+  EXPECT_TRUE(migrated == nullptr);
+
+  // full
+  auto another = std::make_unique<MigratedRequest>();
+  EXPECT_FALSE(transport.send(another));
+  EXPECT_TRUE(another != nullptr);
+
+  auto received = transport.recv();
+  ASSERT_TRUE(received != nullptr);
+  EXPECT_EQ(received->request->id, "1");
+  EXPECT_TRUE(transport.recv() == nullptr);
+}
+
+TEST(KVTransportTest, PrefillDecodeDisaggregation) {
+  LocalKVTransport transport(/*capacity=*/16);
+  FakeEngine prefill_engine;
+  FakeEngine decode_engine;
+  ContinuousBatchingScheduler prefill_scheduler(
+      &prefill_engine, DisaggRole::PREFILL, &transport);
+  ContinuousBatchingScheduler decode_scheduler(
+      &decode_engine, DisaggRole::DECODE, &transport);
+
+  std::atomic<bool> finished{false};
+  Statistics stats;
+  FinishReason finish_reason = FinishReason::NONE;
+  // 6 prompt tokens in 2 blocks
+  auto request =
+      std::make_unique<Request>("1", std::vector<int32_t>{1, 2, 3, 4, 5, 6});
+  request->stopping_criteria.max_tokens = 3;
+  request->stopping_criteria.ignore_eos_token = true;
+  request->on_finish = [&](const std::vector<SequenceResult>& seq_results,
+                           const Status& /*status*/,
+                           const Statistics& request_stats) -> bool {
+    stats = request_stats;
+    finish_reason = seq_results.front().finish_reason;
+    finished.store(true);
+    return true;
+  };
+  request->add_sequence();
+  const int64_t seq_id = request->sequences.front().id();
+  ASSERT_TRUE(prefill_scheduler.schedule(request));
+
+  // prefill and generate the first token
+  prefill_scheduler.step(absl::ZeroDuration());
+  EXPECT_EQ(prefill_engine.num_prefill_seqs, 1);
+  EXPECT_EQ(prefill_engine.kv_blocks.size(), 2);
+
+  // hand off the request and release its blocks
+  prefill_scheduler.step(absl::ZeroDuration());
+  EXPECT_EQ(prefill_engine.num_prefill_seqs, 1);
+  EXPECT_EQ(prefill_engine.num_decode_seqs, 0);
+  EXPECT_EQ(prefill_engine.block_manager()->num_free_blocks(), kNumBlocks);
+
+  // decode the rest tokens with the migrated kv cache
+  decode_scheduler.step(absl::Seconds(1));
+  decode_scheduler.step(absl::Seconds(1));
+  EXPECT_EQ(decode_engine.num_prefill_seqs, 0);
+  EXPECT_EQ(decode_engine.num_decode_seqs, 2);
+  ASSERT_EQ(decode_engine.kv_blocks.size(), 2);
+  for (const auto& [block_id, value] : decode_engine.kv_blocks) {
+    EXPECT_EQ(value, static_cast<float>(seq_id));
+  }
+
+  // finish the request
+  decode_scheduler.step(absl::ZeroDuration());
+  const auto deadline = absl::Now() + absl::Seconds(1);
+  while (!finished.load() && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  ASSERT_TRUE(finished.load());
+  EXPECT_EQ(stats.num_prompt_tokens, 6);
+  EXPECT_EQ(stats.num_generated_tokens, 3);
+  EXPECT_EQ(finish_reason, FinishReason::LENGTH);
+  EXPECT_EQ(decode_engine.block_manager()->num_free_blocks(), kNumBlocks);
+}
+
+TEST(KVTransportTest, RecomputeRejectedKVBlocks) {
+  LocalKVTransport transport(/*capacity=*/16);
+  FakeEngine prefill_engine;
+  FakeEngine decode_engine;
+  decode_engine.reject_kv_blocks = true;
+  ContinuousBatchingScheduler prefill_scheduler(
+      &prefill_engine, DisaggRole::PREFILL, &transport);
+  ContinuousBatchingScheduler decode_scheduler(
+      &decode_engine, DisaggRole::DECODE, &transport);
+
+  auto request =
+      std::make_unique<Request>("1", std::vector<int32_t>{1, 2, 3, 4, 5, 6});
+  request->stopping_criteria.max_tokens = 3;
+  request->stopping_criteria.ignore_eos_token = true;
+  request->on_finish = [](const std::vector<SequenceResult>& /*results*/,
+                          const Status& /*status*/,
+                          const Statistics& /*stats*/) { return true; };
+  request->add_sequence();
+  ASSERT_TRUE(prefill_scheduler.schedule(request));
+  prefill_scheduler.step(absl::ZeroDuration());
+  prefill_scheduler.step(absl::ZeroDuration());
+
+  // the decode engine recomputes the kv cache instead of crashing
+  decode_scheduler.step(absl::Seconds(1));
+  EXPECT_EQ(decode_engine.num_prefill_seqs, 1);
+  EXPECT_EQ(decode_engine.num_decode_seqs, 0);
+  EXPECT_TRUE(decode_engine.kv_blocks.empty());
+}
+
+}  // namespace llm
@@ -0,0 +1,107 @@
+#include "ngram_index.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace llm {
+namespace {
+
+// hash of token ids in [start, end)
+uint64_t hash_ngram(const std::vector<int32_t>& token_ids,
+                    size_t start,
+                    size_t end) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = start; i < end; ++i) {
+    hash ^= static_cast<uint32_t>(token_ids[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+}  // namespace
+
+NGramIndex::NGramIndex(size_t min_ngram, size_t max_ngram)
+    : min_ngram_(min_ngram), max_ngram_(max_ngram) {
+  CHECK_GT(min_ngram_, 0);
+  CHECK_LE(min_ngram_, max_ngram_);
+  tables_.resize(max_ngram_ - min_ngram_ + 1);
+}
+
+void NGramIndex::update(const std::vector<int32_t>& token_ids) {
+  // index n-grams ending at [next_end_pos_, num_tokens - 1)
+  // the n-gram ending at the last token has no follower to propose yet.
+  const size_t num_tokens = token_ids.size();
+  for (; next_end_pos_ < num_tokens; ++next_end_pos_) {
+    for (size_t n = min_ngram_; n <= max_ngram_ && n <= next_end_pos_; ++n) {
+      const uint64_t hash =
+          hash_ngram(token_ids, next_end_pos_ - n, next_end_pos_);
+      // overwrite to keep the latest occurrence
+      tables_[n - min_ngram_][hash] = next_end_pos_;
+    }
+  }
+}
+
+std::vector<int32_t> NGramIndex::propose(const std::vector<int32_t>& token_ids,
+                                         size_t max_num_tokens) const {
+  if (max_num_tokens == 0) {
+    return {};
+  }
+  // try longer n-grams first for more accurate matches
+  for (size_t n = std::min(max_ngram_, token_ids.size()); n >= min_ngram_;
+       --n) {
+    auto spec_token_ids = propose_ngram(token_ids, n, max_num_tokens);
+    if (!spec_token_ids.empty()) {
+      return spec_token_ids;
+    }
+  }
+  return {};
+}
+
+std::vector<std::vector<int32_t>> NGramIndex::propose_candidates(
+    const std::vector<int32_t>& token_ids,
+    size_t max_num_tokens) const {
+  std::vector<std::vector<int32_t>> candidates;
+  if (max_num_tokens == 0) {
+    return candidates;
+  }
+  for (size_t n = std::min(max_ngram_, token_ids.size()); n >= min_ngram_;
+       --n) {
+    auto spec_token_ids = propose_ngram(token_ids, n, max_num_tokens);
+    if (spec_token_ids.empty() ||
+        std::find(candidates.begin(), candidates.end(), spec_token_ids) !=
+            candidates.end()) {
+      continue;
+    }
+    candidates.push_back(std::move(spec_token_ids));
+  }
+  return candidates;
+}
+
+std::vector<int32_t> NGramIndex::propose_ngram(
+    const std::vector<int32_t>& token_ids,
+    size_t n,
+    size_t max_num_tokens) const {
+  const size_t num_tokens = token_ids.size();
+  const auto& table = tables_[n - min_ngram_];
+  const auto it = table.find(hash_ngram(token_ids, num_tokens - n, num_tokens));
+  if (it == table.end()) {
+    return {};
+  }
+  const size_t end_pos = it->second;
+  // verify the match to rule out hash collisions
+  if (end_pos >= num_tokens ||
+      !std::equal(token_ids.begin() + static_cast<long>(end_pos - n),
+                  token_ids.begin() + static_cast<long>(end_pos),
+                  token_ids.begin() + static_cast<long>(num_tokens - n))) {
+    return {};
+  }
+  const size_t num_proposed = std::min(max_num_tokens, num_tokens - end_pos);
+  return {token_ids.begin() + static_cast<long>(end_pos),
+          token_ids.begin() + static_cast<long>(end_pos + num_proposed)};
+}
+
+}  // namespace llm
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace llm {
+
+// A suffix index over the token ids of a sequence, used to propose draft tokens
+// for prompt lookup decoding. The last n tokens of the sequence are matched
+// against their latest earlier occurrence, and the tokens that followed that
+// occurrence are proposed as the continuation. No draft model is needed, which
+// works well for workloads copying long spans from the prompt, e.g. code edits
+// and RAG answers quoting the context.
+// The index is built incrementally and is not thread safe.
+class NGramIndex final {
+ public:
+  // n-grams with size in [min_ngram, max_ngram] are indexed, longer n-grams
+  // are tried first when proposing.
+  NGramIndex(size_t min_ngram, size_t max_ngram);
+
+  // index the tokens appended since last update.
+  // the token ids should only be appended between two calls.
+  void update(const std::vector<int32_t>& token_ids);
+
+  // propose up to max_num_tokens draft tokens following the suffix of token
+  // ids. returns an empty vector if no match is found.
+  std::vector<int32_t> propose(const std::vector<int32_t>& token_ids,
+                               size_t max_num_tokens) const;
+
+  // propose one candidate for each matched n-gram size, longest n-gram first.
+  // duplicated candidates are removed. used to build a draft token tree.
+  std::vector<std::vector<int32_t>> propose_candidates(
+      const std::vector<int32_t>& token_ids,
+      size_t max_num_tokens) const;
+
+ private:
+  // propose draft tokens following the suffix n-gram of size n
+  std::vector<int32_t> propose_ngram(const std::vector<int32_t>& token_ids,
+                                     size_t n,
+                                     size_t max_num_tokens) const;
+
+  size_t min_ngram_ = 1;
+  size_t max_ngram_ = 1;
+
+  // one table for each n-gram size: hash of n-gram => end position (exclusive)
+  // of its latest occurrence. only n-grams followed by at least one token are
+  // indexed.
+  std::vector<std::unordered_map<uint64_t, size_t>> tables_;
+
+  // the next end position to index
+  size_t next_end_pos_ = 1;
+};
+
+}  // namespace llm
@@ -0,0 +1,69 @@
+#include "ngram_index.h"
+
+#include <gtest/gtest.h>
+
+namespace llm {
+
+TEST(NGramIndexTest, ProposeLongestMatch) {
+  NGramIndex index(/*min_ngram=*/1, /*max_ngram=*/3);
+  // "1 2 3 4 5" appears in the prompt, the suffix "2 3" matches it
+  std::vector<int32_t> token_ids = {7, 1, 2, 3, 4, 5, 9, 2, 3};
+  index.update(token_ids);
+  EXPECT_EQ(index.propose(token_ids, /*max_num_tokens=*/2),
+            std::vector<int32_t>({4, 5}));
+  // the proposal is bounded by the end of the sequence
+  EXPECT_EQ(index.propose(token_ids, /*max_num_tokens=*/10),
+            std::vector<int32_t>({4, 5, 9, 2, 3}));
+  EXPECT_TRUE(index.propose(token_ids, /*max_num_tokens=*/0).empty());
+}
+
+TEST(NGramIndexTest, ProposeLatestOccurrence) {
+  NGramIndex index(/*min_ngram=*/1, /*max_ngram=*/2);
+  std::vector<int32_t> token_ids = {1, 2, 1, 3, 1};
+  index.update(token_ids);
+  // "1" is followed by "2" and then "3", the latest one wins
+  EXPECT_EQ(index.propose(token_ids, /*max_num_tokens=*/1),
+            std::vector<int32_t>({3}));
+
+  // incremental update with new tokens
+  token_ids.push_back(4);
+  token_ids.push_back(1);
+  token_ids.push_back(2);
+  index.update(token_ids);
+  // "1 2" matches the prompt at the beginning
+  EXPECT_EQ(index.propose(token_ids, /*max_num_tokens=*/2),
+            std::vector<int32_t>({1, 3}));
+}
+
+TEST(NGramIndexTest, NoMatch) {
+  NGramIndex index(/*min_ngram=*/2, /*max_ngram=*/3);
+  std::vector<int32_t> token_ids = {1, 2, 3, 4, 1};
+  index.update(token_ids);
+  // only unigram "1" matches, which is shorter than min_ngram
+  EXPECT_TRUE(index.propose(token_ids, /*max_num_tokens=*/3).empty());
+
+  std::vector<int32_t> short_token_ids = {1};
+  NGramIndex short_index(/*min_ngram=*/2, /*max_ngram=*/3);
+  short_index.update(short_token_ids);
+  EXPECT_TRUE(
+      short_index.propose(short_token_ids, /*max_num_tokens=*/3).empty());
+}
+
+TEST(NGramIndexTest, ProposeCandidates) {
+  NGramIndex index(/*min_ngram=*/1, /*max_ngram=*/2);
+  std::vector<int32_t> token_ids = {1, 3, 4, 2, 3, 5, 3, 6, 2, 3};
+  index.update(token_ids);
+  // "2 3" is followed by "5 3", while the latest "3" is followed by "6 2"
+  const std::vector<std::vector<int32_t>> expected = {{5, 3}, {6, 2}};
+  EXPECT_EQ(index.propose_candidates(token_ids, /*max_num_tokens=*/2),
+            expected);
+
+  // duplicated candidates are removed
+  token_ids = {1, 2, 3, 4, 2, 3};
+  NGramIndex dedup_index(/*min_ngram=*/1, /*max_ngram=*/2);
+  dedup_index.update(token_ids);
+  EXPECT_EQ(dedup_index.propose_candidates(token_ids, /*max_num_tokens=*/2),
+            std::vector<std::vector<int32_t>>({{4, 2}}));
+}
+
+}  // namespace llm
@@ -0,0 +1,94 @@
+#include "replica_router.h"
+
+#include <absl/time/clock.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <functional>
+#include <string_view>
+
+#include "common/metrics.h"
+
+DEFINE_int32(router_affinity_slack_tokens,
+             2048,
+             "max extra load in tokens a replica can have over the least "
+             "loaded one to still serve requests sharing its prompt prefix");
+
+namespace llm {
+
+DEFINE_COUNTER(router_affinity_hits_total,
+               "Total number of requests routed by prompt prefix affinity");
+
+ReplicaRouter::ReplicaRouter(std::vector<ContinuousBatchingScheduler*> replicas)
+    : replicas_(std::move(replicas)), affinity_(kAffinityTableSize) {
+  CHECK(!replicas_.empty()) << "At least one replica is required";
+  block_size_ = replicas_[0]->block_size();
+  for (const auto* replica : replicas_) {
+    CHECK(replica != nullptr);
+    CHECK_EQ(replica->block_size(), block_size_)
+        << "All replicas should use the same block size";
+  }
+  for (auto& replica : affinity_) {
+    replica.store(-1, std::memory_order_relaxed);
+  }
+}
+
+bool ReplicaRouter::schedule(std::unique_ptr<Request>& request) {
+  CHECK(request != nullptr);
+  const size_t replica = route(*request);
+  return replicas_[replica]->schedule(request);
+}
+
+void ReplicaRouter::step(const absl::Duration& timeout) {
+  absl::SleepFor(timeout);
+}
+
+size_t ReplicaRouter::route(const Request& request) {
+  // pick the least loaded replica
+  size_t best = 0;
+  int64_t best_load = load(0);
+  for (size_t i = 1; i < replicas_.size(); ++i) {
+    const int64_t replica_load = load(i);
+    if (replica_load < best_load) {
+      best = i;
+      best_load = replica_load;
+    }
+  }
+
+  const auto hash = prefix_hash(request);
+  if (!hash.has_value()) {
+    return best;
+  }
+  auto& slot = affinity_[hash.value() % kAffinityTableSize];
+  // stay with the replica holding the prefix if it is not overloaded
+  const int32_t last = slot.load(std::memory_order_relaxed);
+  if (last >= 0 && static_cast<size_t>(last) < replicas_.size() &&
+      load(last) <= best_load + FLAGS_router_affinity_slack_tokens) {
+    router_affinity_hits_total.Increment();
+    return last;
+  }
+  slot.store(static_cast<int32_t>(best), std::memory_order_relaxed);
+  return best;
+}
+
+int64_t ReplicaRouter::load(size_t replica) const {
+  const auto* scheduler = replicas_[replica];
+  return scheduler->num_pending_tokens() -
+         scheduler->num_free_blocks() * block_size_;
+}
+
+std::optional<size_t> ReplicaRouter::prefix_hash(
+    const Request& request) const {
+  const auto& tokens = request.prompt_tokens;
+  const size_t num_blocks =
+      std::min(tokens.size() / block_size_, kAffinityPrefixBlocks);
+  if (num_blocks == 0) {
+    return std::nullopt;
+  }
+  const std::string_view prefix(reinterpret_cast<const char*>(tokens.data()),
+                                num_blocks * block_size_ * sizeof(int32_t));
+  return std::hash<std::string_view>{}(prefix);
+}
+
+}  // namespace llm
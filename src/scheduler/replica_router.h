@@ -0,0 +1,68 @@
+#pragma once
+
+#include <absl/time/time.h>
+#include <gflags/gflags_declare.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "continuous_batching_scheduler.h"
+#include "request/request.h"
+#include "scheduler.h"
+
+DECLARE_int32(router_affinity_slack_tokens);
+
+namespace llm {
+
+// A router that serves requests with multiple data parallel replicas in one
+// process. Each replica has its own engine and scheduler, and the router
+// dispatches each request to one of them by:
+// * load: prompt tokens waiting to be scheduled on the replica minus the
+//   tokens its free cache blocks can hold.
+// * prefix affinity: requests sharing the first blocks of prompt are sent to
+//   the same replica to reuse its cache, unless it is much busier than the
+//   least loaded one.
+class ReplicaRouter final : public Scheduler {
+ public:
+  // replicas are not owned and should outlive the router
+  explicit ReplicaRouter(std::vector<ContinuousBatchingScheduler*> replicas);
+
+  // dispatch the request to one replica, thread safe and non-blocking
+  // may return false if the queue of the replica is full
+  bool schedule(std::unique_ptr<Request>& request) override;
+
+  // replicas are stepped on their own threads, just wait for the timeout
+  void step(const absl::Duration& timeout) override;
+
+  // returns the index of the replica to serve the request and remembers it
+  // for requests with the same prompt prefix. thread safe
+  size_t route(const Request& request);
+
+ private:
+  // load of the replica in tokens, the lower the better
+  int64_t load(size_t replica) const;
+
+  // hash of the first blocks of the prompt, nullopt if the prompt is shorter
+  // than one block
+  std::optional<size_t> prefix_hash(const Request& request) const;
+
+  // number of slots in the prefix affinity table
+  static constexpr size_t kAffinityTableSize = 4096;
+
+  // max number of prompt blocks used for prefix affinity
+  static constexpr size_t kAffinityPrefixBlocks = 4;
+
+  std::vector<ContinuousBatchingScheduler*> replicas_;
+
+  // number of slots per cache block, same for all replicas
+  int32_t block_size_ = 0;
+
+  // replica that served the prompt prefix last, -1 if none.
+  // indexed by prefix hash modulo table size.
+  std::vector<std::atomic<int32_t>> affinity_;
+};
+
+}  // namespace llm
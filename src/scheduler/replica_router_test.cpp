@@ -0,0 +1,115 @@
+#include "replica_router.h"
+
+#include <gtest/gtest.h>
+#include <torch/torch.h>
+
+#include <memory>
+
+namespace llm {
+namespace {
+
+constexpr int32_t kBlockSize = 4;
+constexpr uint32_t kNumBlocks = 32;
+
+class FakeTokenizer : public Tokenizer {
+ public:
+  bool encode(const std::string_view& /*text*/,
+              std::vector<int32_t>* /*ids*/) const override {
+    return false;
+  }
+
+  std::string decode(const std::vector<int32_t>& tokens) const override {
+    return std::string(tokens.size(), 'x');
+  }
+
+  size_t vocab_size() const override { return 0; }
+
+  std::unique_ptr<Tokenizer> clone() const override {
+    return std::make_unique<FakeTokenizer>();
+  }
+};
+
+class FakeEngine : public Engine {
+ public:
+  FakeEngine()
+      : Engine({torch::kCPU}),
+        block_manager_(std::make_unique<BlockManager>(kNumBlocks, kBlockSize)) {
+  }
+
+  bool init(const std::string& /*model_weights_path*/) override {
+    return true;
+  }
+
+  std::unique_ptr<Tokenizer> tokenizer() const override {
+    return std::make_unique<FakeTokenizer>();
+  }
+
+  BlockManager* block_manager() const override { return block_manager_.get(); }
+
+ private:
+  std::unique_ptr<BlockManager> block_manager_;
+};
+
+std::unique_ptr<Request> make_request(const std::vector<int32_t>& prompt) {
+  static int64_t next_id = 0;
+  return std::make_unique<Request>(std::to_string(next_id++), prompt);
+}
+
+}  // namespace
+
+TEST(ReplicaRouterTest, LeastLoaded) {
+  FakeEngine engine0;
+  FakeEngine engine1;
+  ContinuousBatchingScheduler replica0(&engine0);
+  ContinuousBatchingScheduler replica1(&engine1);
+  ReplicaRouter router({&replica0, &replica1});
+
+  // prompts shorter than one block are routed by load only
+  auto request = make_request({1, 2, 3});
+  EXPECT_TRUE(router.schedule(request));
+  EXPECT_TRUE(request == nullptr);
+  EXPECT_EQ(replica0.num_pending_tokens(), 3);
+  EXPECT_EQ(replica1.num_pending_tokens(), 0);
+
+  request = make_request({1, 2});
+  EXPECT_TRUE(router.schedule(request));
+  EXPECT_EQ(replica0.num_pending_tokens(), 3);
+  EXPECT_EQ(replica1.num_pending_tokens(), 2);
+
+  request = make_request({1});
+  EXPECT_TRUE(router.schedule(request));
+  EXPECT_EQ(replica0.num_pending_tokens(), 3);
+  EXPECT_EQ(replica1.num_pending_tokens(), 3);
+}
+
+TEST(ReplicaRouterTest, PrefixAffinity) {
+  FakeEngine engine0;
+  FakeEngine engine1;
+  ContinuousBatchingScheduler replica0(&engine0);
+  ContinuousBatchingScheduler replica1(&engine1);
+  ReplicaRouter router({&replica0, &replica1});
+
+  const std::vector<int32_t> prefix = {1, 2, 3, 4, 5, 6, 7, 8};
+  auto request = make_request(prefix);
+  EXPECT_EQ(router.route(*request), 0);
+  EXPECT_TRUE(router.schedule(request));
+
+  // the same prefix stays on replica 0 although replica 1 is idle
+  auto shared = make_request({1, 2, 3, 4, 5, 6, 7, 8, 9, 10});
+  EXPECT_EQ(router.route(*shared), 0);
+  // a different prefix goes to the least loaded replica
+  auto other = make_request({8, 7, 6, 5, 4, 3, 2, 1});
+  EXPECT_EQ(router.route(*other), 1);
+
+  // fall back to the least loaded replica once the gap exceeds the slack
+  const int32_t slack = FLAGS_router_affinity_slack_tokens;
+  FLAGS_router_affinity_slack_tokens = 4;
+  EXPECT_EQ(router.route(*shared), 1);
+  // and the prefix follows the new replica
+  EXPECT_TRUE(router.schedule(shared));
+  EXPECT_EQ(replica1.num_pending_tokens(), 10);
+  FLAGS_router_affinity_slack_tokens = slack;
+  EXPECT_EQ(router.route(*make_request(prefix)), 1);
+}
+
+}  // namespace llm
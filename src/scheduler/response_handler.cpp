@@ -1,5 +1,6 @@
 #include "response_handler.h"
 
+#include <absl/time/clock.h>
 #include <glog/logging.h>
 
 #include <cstdint>
@@ -20,6 +21,7 @@ ResponseHandler::ResponseHandler(BlockManager* block_manager,
     : block_manager_(block_manager), tokenizer_(tokenizer) {}
 
 void ResponseHandler::on_request_finish(Request* request) {
+  request->timeline.finish = absl::Now();
   // release all blocks for the finished request
   block_manager_->release_slots_for_request(request);
   // take over the ownership of the request
@@ -38,13 +40,15 @@ void ResponseHandler::on_request_finish(Request* request) {
       }
       stats.num_total_tokens =
           stats.num_prompt_tokens + stats.num_generated_tokens;
+      request->fill_latency_stats(&stats);
 
       std::vector<SequenceResult> seq_results;
       seq_results.reserve(request->sequences.size());
       for (Sequence& seq : request->sequences) {
         // generate the final output
         const auto output = seq.decode_delta_text(seq.num_tokens(), *tokenizer);
-        seq_results.push_back({output, seq.finish_reason()});
+        seq_results.push_back(
+            {output, seq.finish_reason(), seq.logprobs(), seq.embedding()});
       }
       request->on_finish(seq_results, Status(), stats);
     }
@@ -1,12 +1,26 @@
 #include "speculative_scheduler.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
 #include "engine/engine.h"
 #include "memory/block_manager.h"
 #include "request/request.h"
 #include "request/sequence.h"
 
+DEFINE_int32(speculative_ngram_branches,
+             2,
+             "max number of prompt lookup candidates merged into the draft "
+             "token tree, 0 to verify the draft chain only");
+
+DECLARE_int32(prompt_lookup_min_ngram);
+DECLARE_int32(prompt_lookup_max_ngram);
+
 namespace llm {
 
 constexpr uint64_t kStepSleepTimeMs = 10;
@@ -53,9 +67,17 @@ void SpeculativeScheduler::step(const absl::Duration& timeout) {
     absl::SleepFor(time_to_sleep);
   }
 
+  // look up candidates before the draft model appends tokens
+  const auto candidates = propose_ngram_candidates(spec_sequences_batch);
+
   // run multiple steps on ssm to generate multiple tokens.
   speculate_multiple_steps(spec_sequences_batch);
 
+  // grow the draft chain into a token tree with the candidates
+  for (size_t i = 0; i < spec_sequences_batch.size(); ++i) {
+    append_ngram_branches(spec_sequences_batch[i], candidates[i]);
+  }
+
   // run validation on llm.
   auto output_parameters = validate(spec_sequences_batch);
 
@@ -69,6 +91,12 @@ void SpeculativeScheduler::step(const absl::Duration& timeout) {
         next_tokens.index_select(/*dim=*/0, torch::tensor(i, torch::kInt64));
     const int64_t* ids = seq_next_tokens.data_ptr<int64_t>();
     seq->update_valid_token_ids(ids);
+  }
+
+  // move kv cache of the accepted branches next to the accepted tokens
+  llm_engine_->compact_kv_cache(spec_sequences_batch);
+
+  for (Sequence* seq : spec_sequences_batch) {
     // stream delta to client if streaming is enabled
     if (seq->is_streaming()) {
       response_handler_->on_sequence_stream(seq);
@@ -95,9 +123,12 @@ void SpeculativeScheduler::speculate_multiple_steps(
     for (int64_t i = 0; i < num_seqs; ++i) {
       auto seq = spec_batch[i];
       const auto next_token_id = static_cast<int32_t>(new_token_ids[i]);
+      const size_t num_tokens = seq->num_tokens();
       seq->append_new_token_id(next_token_id);
-      // record speculative token ids
-      seq->append_spec_token_id(next_token_id);
+      // record speculative token ids, stop tokens are not appended
+      if (seq->num_tokens() > num_tokens) {
+        seq->append_spec_token_id(next_token_id);
+      }
 
       if (!seq->is_finished()) {
         next_spec_batch.emplace_back(seq);
@@ -112,4 +143,90 @@ OutputParameters SpeculativeScheduler::validate(
   return llm_engine_->validate(sequences_batch);
 }
 
+std::vector<std::vector<std::vector<int32_t>>>
+SpeculativeScheduler::propose_ngram_candidates(
+    const std::vector<Sequence*>& sequences) {
+  std::vector<std::vector<std::vector<int32_t>>> candidates;
+  candidates.reserve(sequences.size());
+  // only keep indexes for sequences in the current batch
+  std::unordered_map<int64_t, NGramIndex> ngram_indexes;
+  for (const Sequence* seq : sequences) {
+    auto& seq_candidates = candidates.emplace_back();
+    if (FLAGS_speculative_ngram_branches <= 0) {
+      continue;
+    }
+    auto it = ngram_indexes_.find(seq->id());
+    NGramIndex index = it != ngram_indexes_.end()
+                           ? std::move(it->second)
+                           : NGramIndex(FLAGS_prompt_lookup_min_ngram,
+                                        FLAGS_prompt_lookup_max_ngram);
+    index.update(seq->token_ids());
+    seq_candidates =
+        index.propose_candidates(seq->token_ids(), config_.speculative_steps_);
+    if (seq_candidates.size() >
+        static_cast<size_t>(FLAGS_speculative_ngram_branches)) {
+      seq_candidates.resize(FLAGS_speculative_ngram_branches);
+    }
+    ngram_indexes.emplace(seq->id(), std::move(index));
+  }
+  ngram_indexes_.swap(ngram_indexes);
+  return candidates;
+}
+
+void SpeculativeScheduler::append_ngram_branches(
+    Sequence* sequence,
+    const std::vector<std::vector<int32_t>>& candidates) {
+  if (candidates.empty()) {
+    return;
+  }
+  // leave room for the token sampled by the target model
+  const size_t num_spec_tokens = sequence->num_spec_tokens();
+  const size_t max_num_spec_tokens = sequence->max_num_spec_tokens();
+  if (num_spec_tokens >= max_num_spec_tokens) {
+    return;
+  }
+  size_t budget = max_num_spec_tokens - num_spec_tokens;
+
+  // the chain drafted by the ssm is the first branch of the tree
+  std::vector<int32_t> tree_token_ids = sequence->spec_token_ids();
+  std::vector<int32_t> tree_parents = sequence->spec_token_parents();
+  std::vector<int32_t> new_token_ids;
+  std::vector<int32_t> new_parents;
+  for (const auto& candidate : candidates) {
+    int32_t node = -1;
+    for (const int32_t token_id : candidate) {
+      // reuse the node if the prefix is already in the tree
+      int32_t child = node + 1;
+      const int32_t num_nodes = static_cast<int32_t>(tree_token_ids.size());
+      for (; child < num_nodes; ++child) {
+        if (tree_parents[child] == node && tree_token_ids[child] == token_id) {
+          break;
+        }
+      }
+      if (child == num_nodes) {
+        if (budget == 0) {
+          break;
+        }
+        --budget;
+        tree_token_ids.push_back(token_id);
+        tree_parents.push_back(node);
+        new_token_ids.push_back(token_id);
+        new_parents.push_back(node);
+      }
+      node = child;
+    }
+  }
+  if (new_token_ids.empty()) {
+    return;
+  }
+
+  // the ssm has no kv cache for the new branches. if one of them is accepted,
+  // the ssm attends to stale kv cache, which only affects the draft quality.
+  sequence->append_spec_token_tree(new_token_ids, new_parents);
+  if (!llm_block_manager_->allocate_slots_for_sequence(sequence)) {
+    // verify the draft chain only if no room for the branches
+    sequence->discard_spec_token_ids(num_spec_tokens);
+  }
+}
+
 }  // namespace llm
@@ -2,9 +2,12 @@
 
 #include <cstdint>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "engine/engine.h"
 #include "request/request.h"
+#include "scheduler/ngram_index.h"
 #include "scheduler/response_handler.h"
 #include "scheduler/scheduler.h"
 #include "scheduler/scheduler_config.h"
@@ -28,7 +31,17 @@ class SpeculativeScheduler final : public Scheduler {
  private:
   void speculate_multiple_steps(std::vector<Sequence*>& sequences);
   OutputParameters validate(std::vector<Sequence*>& sequences);
- 
+
+  // propose candidates from prompt lookup for each sequence, which are merged
+  // into the draft token tree after the draft model finishes speculation.
+  std::vector<std::vector<std::vector<int32_t>>> propose_ngram_candidates(
+      const std::vector<Sequence*>& sequences);
+
+  // merge candidates into the draft token tree of the sequence
+  void append_ngram_branches(
+      Sequence* sequence,
+      const std::vector<std::vector<int32_t>>& candidates);
+
  private:
   SchedulerConfig config_;
 
@@ -42,6 +55,9 @@ class SpeculativeScheduler final : public Scheduler {
 
   std::unique_ptr<SchedulerPolicy> scheduler_policy_;
   std::unique_ptr<ResponseHandler> response_handler_;
+
+  // prompt lookup indexes for sequences in the last batch
+  std::unordered_map<int64_t, NGramIndex> ngram_indexes_;
 };
 
 }  // namespace llm
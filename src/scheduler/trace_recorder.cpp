@@ -0,0 +1,137 @@
+#include "trace_recorder.h"
+
+#include <absl/time/clock.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+#include "request/request.h"
+#include "request/sequence.h"
+
+namespace llm {
+namespace {
+
+// read json lines from a file, skipping empty lines
+template <typename Parser>
+bool read_json_lines(const std::string& path, Parser&& parser) {
+  std::ifstream ifs(path);
+  if (!ifs.is_open()) {
+    LOG(ERROR) << "Failed to open trace file: " << path;
+    return false;
+  }
+  std::string line;
+  int64_t line_no = 0;
+  while (std::getline(ifs, line)) {
+    ++line_no;
+    if (line.empty()) {
+      continue;
+    }
+    try {
+      parser(nlohmann::json::parse(line));
+    } catch (const nlohmann::json::exception& e) {
+      LOG(ERROR) << "Failed to parse " << path << ":" << line_no << ", "
+                 << e.what();
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+StepStats StepStats::from_batch(const std::vector<Sequence*>& batch) {
+  StepStats stats;
+  stats.num_seqs = static_cast<int64_t>(batch.size());
+  for (const Sequence* seq : batch) {
+    const auto num_tokens = static_cast<int64_t>(seq->num_tokens());
+    stats.num_tokens +=
+        num_tokens - static_cast<int64_t>(seq->num_tokens_in_cache());
+    stats.num_kv_tokens += num_tokens;
+  }
+  return stats;
+}
+
+TraceRecorder::TraceRecorder(const std::string& request_trace_path,
+                             const std::string& step_trace_path) {
+  if (!request_trace_path.empty()) {
+    request_trace_.open(request_trace_path);
+    CHECK(request_trace_.is_open())
+        << "Failed to open request trace file: " << request_trace_path;
+  }
+  if (!step_trace_path.empty()) {
+    step_trace_.open(step_trace_path);
+    CHECK(step_trace_.is_open())
+        << "Failed to open step trace file: " << step_trace_path;
+  }
+}
+
+void TraceRecorder::on_request_arrival(const Request* request) {
+  if (!request_trace_.is_open()) {
+    return;
+  }
+  const auto now = absl::Now();
+  if (start_time_ == absl::InfinitePast()) {
+    start_time_ = now;
+  }
+  arrival_times_.emplace(request, now);
+}
+
+void TraceRecorder::on_request_finish(const Request* request) {
+  auto it = arrival_times_.find(request);
+  if (it == arrival_times_.end()) {
+    return;
+  }
+  size_t output_len = 0;
+  for (const Sequence& seq : request->sequences) {
+    output_len = std::max(output_len, seq.num_generated_tokens());
+  }
+  nlohmann::json record;
+  record["arrival_time"] = absl::ToDoubleSeconds(it->second - start_time_);
+  record["prompt_len"] = request->num_prompt_tokens();
+  record["output_len"] = output_len;
+  request_trace_ << record.dump() << "\n";
+  arrival_times_.erase(it);
+}
+
+void TraceRecorder::on_step(const StepStats& stats, absl::Duration latency) {
+  if (!step_trace_.is_open()) {
+    return;
+  }
+  nlohmann::json record;
+  record["num_tokens"] = stats.num_tokens;
+  record["num_seqs"] = stats.num_seqs;
+  record["num_kv_tokens"] = stats.num_kv_tokens;
+  record["latency_ms"] = absl::ToDoubleMilliseconds(latency);
+  step_trace_ << record.dump() << "\n";
+}
+
+bool TraceRecorder::read_requests(const std::string& path,
+                                  std::vector<RequestRecord>* records) {
+  CHECK(records != nullptr);
+  return read_json_lines(path, [records](const nlohmann::json& json) {
+    RequestRecord record;
+    record.arrival_time = json.at("arrival_time").get<double>();
+    record.prompt_len = json.at("prompt_len").get<int64_t>();
+    record.output_len = json.at("output_len").get<int64_t>();
+    records->push_back(record);
+  });
+}
+
+bool TraceRecorder::read_steps(const std::string& path,
+                               std::vector<StepRecord>* records) {
+  CHECK(records != nullptr);
+  return read_json_lines(path, [records](const nlohmann::json& json) {
+    StepRecord record;
+    record.stats.num_tokens = json.at("num_tokens").get<int64_t>();
+    record.stats.num_seqs = json.at("num_seqs").get<int64_t>();
+    record.stats.num_kv_tokens = json.at("num_kv_tokens").get<int64_t>();
+    record.latency_ms = json.at("latency_ms").get<double>();
+    records->push_back(record);
+  });
+}
+
+}  // namespace llm
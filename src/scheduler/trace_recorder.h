@@ -0,0 +1,87 @@
+#pragma once
+
+#include <absl/time/time.h>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "request/request.h"
+#include "request/sequence.h"
+
+namespace llm {
+
+// shape of a batch that determines the cost of one step
+struct StepStats {
+  // number of tokens to process, prefill tokens included
+  int64_t num_tokens = 0;
+
+  // number of sequences in the batch
+  int64_t num_seqs = 0;
+
+  // number of tokens attended to, including tokens in kv cache
+  int64_t num_kv_tokens = 0;
+
+  // get the stats of a batch before running it
+  static StepStats from_batch(const std::vector<Sequence*>& batch);
+};
+
+// one request in a trace, serialized as a json line:
+// {"arrival_time": 0.5, "prompt_len": 128, "output_len": 64}
+struct RequestRecord {
+  // seconds since the first request
+  double arrival_time = 0.0;
+
+  int64_t prompt_len = 0;
+
+  int64_t output_len = 0;
+};
+
+// one step measured by the scheduler, serialized as a json line:
+// {"num_tokens": 130, "num_seqs": 3, "num_kv_tokens": 700, "latency_ms": 25.1}
+struct StepRecord {
+  StepStats stats;
+
+  double latency_ms = 0.0;
+};
+
+// TraceRecorder records the requests served and the steps executed by a
+// scheduler into jsonl files. The request trace can be replayed by the
+// scheduler simulator, and the step trace is used to calibrate its cost model.
+// Not thread safe, should be called from the scheduler thread.
+class TraceRecorder final {
+ public:
+  // an empty path disables the corresponding trace
+  TraceRecorder(const std::string& request_trace_path,
+                const std::string& step_trace_path);
+
+  // record the arrival time of a request
+  void on_request_arrival(const Request* request);
+
+  // record the request with its arrival time and output length
+  void on_request_finish(const Request* request);
+
+  // record the latency of a step
+  void on_step(const StepStats& stats, absl::Duration latency);
+
+  // read records from a jsonl file, returns false if failed.
+  static bool read_requests(const std::string& path,
+                            std::vector<RequestRecord>* records);
+  static bool read_steps(const std::string& path,
+                         std::vector<StepRecord>* records);
+
+ private:
+  // output files, not opened if the path is empty
+  std::ofstream request_trace_;
+  std::ofstream step_trace_;
+
+  // arrival time of the first request
+  absl::Time start_time_ = absl::InfinitePast();
+
+  // arrival time of requests in flight
+  std::unordered_map<const Request*, absl::Time> arrival_times_;
+};
+
+}  // namespace llm
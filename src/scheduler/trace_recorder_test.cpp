@@ -0,0 +1,65 @@
+#include "trace_recorder.h"
+
+#include <absl/time/time.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace llm {
+
+TEST(TraceRecorderTest, StepTrace) {
+  const auto path =
+      (std::filesystem::temp_directory_path() / "step_trace_test.jsonl")
+          .string();
+  {
+    TraceRecorder recorder(/*request_trace_path=*/"", path);
+    StepStats stats;
+    stats.num_tokens = 130;
+    stats.num_seqs = 3;
+    stats.num_kv_tokens = 700;
+    recorder.on_step(stats, absl::Milliseconds(25));
+    stats.num_tokens = 2;
+    stats.num_seqs = 2;
+    recorder.on_step(stats, absl::Milliseconds(10));
+  }
+
+  std::vector<StepRecord> records;
+  ASSERT_TRUE(TraceRecorder::read_steps(path, &records));
+  ASSERT_EQ(records.size(), 2);
+  EXPECT_EQ(records[0].stats.num_tokens, 130);
+  EXPECT_EQ(records[0].stats.num_seqs, 3);
+  EXPECT_EQ(records[0].stats.num_kv_tokens, 700);
+  EXPECT_DOUBLE_EQ(records[0].latency_ms, 25.0);
+  EXPECT_EQ(records[1].stats.num_tokens, 2);
+  EXPECT_DOUBLE_EQ(records[1].latency_ms, 10.0);
+  std::filesystem::remove(path);
+}
+
+TEST(TraceRecorderTest, RequestTrace) {
+  const auto path =
+      (std::filesystem::temp_directory_path() / "request_trace_test.jsonl")
+          .string();
+  {
+    TraceRecorder recorder(path, /*step_trace_path=*/"");
+    Request request("test", /*prompt_tokens=*/{1, 2, 3});
+    request.add_sequence();
+    recorder.on_request_arrival(&request);
+    request.sequences[0].append_new_token_id(4);
+    request.sequences[0].append_new_token_id(5);
+    recorder.on_request_finish(&request);
+  }
+
+  std::vector<RequestRecord> records;
+  ASSERT_TRUE(TraceRecorder::read_requests(path, &records));
+  ASSERT_EQ(records.size(), 1);
+  EXPECT_DOUBLE_EQ(records[0].arrival_time, 0.0);
+  EXPECT_EQ(records[0].prompt_len, 3);
+  EXPECT_EQ(records[0].output_len, 2);
+  std::filesystem::remove(path);
+
+  EXPECT_FALSE(TraceRecorder::read_requests(path, &records));
+}
+
+}  // namespace llm
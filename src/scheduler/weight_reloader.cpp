@@ -0,0 +1,94 @@
+#include "weight_reloader.h"
+
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+#include <glog/logging.h>
+
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace llm {
+
+namespace {
+
+// interval to check whether schedulers have swapped weights
+constexpr absl::Duration kSwapPollInterval = absl::Milliseconds(10);
+
+}  // namespace
+
+WeightReloader::~WeightReloader() { stop(); }
+
+void WeightReloader::add_all(std::vector<Target> targets) {
+  CHECK(!targets.empty());
+  for (const auto& [engine, scheduler] : targets) {
+    CHECK(engine != nullptr);
+    CHECK(scheduler != nullptr);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  CHECK(targets_.empty()) << "engines are already added";
+  targets_ = std::move(targets);
+}
+
+bool WeightReloader::reload_async(const std::string& model_weights_path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stopped_.load(std::memory_order_relaxed) || targets_.empty() ||
+      in_progress_.exchange(true)) {
+    return false;
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  thread_ = std::thread([this, model_weights_path, targets = targets_]() {
+    reload(model_weights_path, targets);
+    in_progress_.store(false);
+  });
+  return true;
+}
+
+void WeightReloader::stop() {
+  stopped_.store(true);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void WeightReloader::reload(const std::string& model_weights_path,
+                            const std::vector<Target>& targets) {
+  const auto start = absl::Now();
+  LOG(INFO) << "Reloading weights from: " << model_weights_path;
+
+  // stage all engines before swapping any of them, so that a bad checkpoint
+  // leaves the server with the old weights.
+  for (const auto& [engine, scheduler] : targets) {
+    if (stopped_.load() || !engine->stage_weights(model_weights_path)) {
+      LOG(ERROR) << "Failed to reload weights from: " << model_weights_path;
+      for (const auto& target : targets) {
+        target.first->clear_staged_weights();
+      }
+      return;
+    }
+  }
+
+  std::vector<folly::SemiFuture<folly::Unit>> futures;
+  futures.reserve(targets.size());
+  for (const auto& [engine, scheduler] : targets) {
+    futures.push_back(scheduler->swap_weights());
+  }
+  // schedulers may stop stepping on shutdown, don't wait for them forever
+  for (auto& future : futures) {
+    while (!future.isReady()) {
+      if (stopped_.load()) {
+        LOG(WARNING) << "Stopped reloading weights before they are swapped";
+        return;
+      }
+      absl::SleepFor(kSwapPollInterval);
+    }
+  }
+  LOG(INFO) << "Reloaded weights from " << model_weights_path << " in "
+            << absl::FormatDuration(absl::Now() - start);
+}
+
+}  // namespace llm
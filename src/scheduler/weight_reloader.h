@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "continuous_batching_scheduler.h"
+#include "engine/engine.h"
+
+namespace llm {
+
+// Reloads the weights of a live server from a checkpoint with the same
+// architecture. The weights are staged into host memory in the background
+// while serving, then each scheduler pauses between two steps to copy them
+// into its engine in place and recompute the kv cache of running requests.
+class WeightReloader final {
+ public:
+  WeightReloader() = default;
+
+  ~WeightReloader();
+
+  // an engine with the scheduler running its steps
+  using Target = std::pair<Engine*, ContinuousBatchingScheduler*>;
+
+  // add all engines of the server at once, so that a reload never misses
+  // any of them. can only be called once. engines and schedulers are not
+  // owned and should outlive the reloader or stop() should be called first.
+  // thread safe
+  void add_all(std::vector<Target> targets);
+
+  // start reloading weights from model_weights_path in the background.
+  // returns false if a reload is in progress or engines are not added yet.
+  // thread safe
+  bool reload_async(const std::string& model_weights_path);
+
+  // whether a reload is in progress. thread safe
+  bool in_progress() const {
+    return in_progress_.load(std::memory_order_relaxed);
+  }
+
+  // wait for the reload in progress, if any, and stop accepting new ones.
+  // a reload waiting for schedulers to swap weights is abandoned.
+  void stop();
+
+ private:
+  // stage the weights for all engines, then swap them in
+  void reload(const std::string& model_weights_path,
+              const std::vector<Target>& targets);
+
+  std::mutex mutex_;
+
+  // engines and their schedulers, guarded by mutex_
+  std::vector<Target> targets_;
+
+  // the thread running the last reload, guarded by mutex_
+  std::thread thread_;
+
+  std::atomic<bool> in_progress_{false};
+
+  std::atomic<bool> stopped_{false};
+};
+
+}  // namespace llm
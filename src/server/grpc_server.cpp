@@ -25,6 +25,7 @@ bool GrpcServer::start(const Options& options) {
   // clients. In this case it corresponds to an *asynchronous* service.
   builder.RegisterService(&completion_service_);
   builder.RegisterService(&chat_service_);
+  builder.RegisterService(&embedding_service_);
   builder.RegisterService(models_handler_.get());
   // Get hold of the completion queue used for the asynchronous communication
   // with the gRPC runtime.
@@ -69,6 +70,24 @@ bool GrpcServer::start(const Options& options) {
     new ChatCallData(cq_.get(), on_register, on_request);
   }
 
+  // Spawn a new CallData instance for embedding request
+  {
+    auto on_register =
+        [this](grpc::ServerContext* context,
+               EmbeddingRequest* request,
+               grpc::ServerAsyncWriter<EmbeddingResponse>* responder,
+               grpc::ServerCompletionQueue* new_call_cq,
+               grpc::ServerCompletionQueue* notification_cq,
+               void* tag) {
+          embedding_service_.RequestEmbed(
+              context, request, responder, new_call_cq, notification_cq, tag);
+        };
+    auto on_request = [this](EmbeddingCallData* call_data) {
+      embedding_handler_->embed_async(call_data);
+    };
+    new EmbeddingCallData(cq_.get(), on_register, on_request);
+  }
+
   // Proceed to the server's main loop.
   handler_thread_ = std::make_unique<std::thread>([this]() { handle_rpcs(); });
   return true;
@@ -7,6 +7,7 @@
 
 #include "handlers/chat_handler.h"
 #include "handlers/completion_handler.h"
+#include "handlers/embedding_handler.h"
 #include "handlers/models_handler.h"
 
 namespace llm {
@@ -20,9 +21,11 @@ class GrpcServer final {
 
   GrpcServer(std::unique_ptr<CompletionHandler> completion_handler,
              std::unique_ptr<ChatHandler> chat_handler,
+             std::unique_ptr<EmbeddingHandler> embedding_handler,
              std::unique_ptr<ModelsHandler> models_handler)
       : completion_handler_(std::move(completion_handler)),
         chat_handler_(std::move(chat_handler)),
+        embedding_handler_(std::move(embedding_handler)),
         models_handler_(std::move(models_handler)) {}
 
   ~GrpcServer();
@@ -40,12 +43,16 @@ class GrpcServer final {
   // handler for chat requests
   std::unique_ptr<ChatHandler> chat_handler_;
 
+  // handler for embedding requests
+  std::unique_ptr<EmbeddingHandler> embedding_handler_;
+
   // handler for models requests
   std::unique_ptr<ModelsHandler> models_handler_;
 
   // registed service
   Completion::AsyncService completion_service_;
   Chat::AsyncService chat_service_;
+  Embeddings::AsyncService embedding_service_;
 
   // grpc server
   std::unique_ptr<grpc::Server> grpc_server_;
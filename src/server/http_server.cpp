@@ -6,10 +6,76 @@
 #include <boost/beast.hpp>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 namespace llm {
+namespace {
+
+// returns the value of a hex digit, or -1 if c is not a hex digit
+int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// decode '+' and percent-encoded bytes of a query component, malformed
+// escapes are kept as is
+std::string url_decode(const std::string& value) {
+  std::string decoded;
+  decoded.reserve(value.size());
+  for (size_t i = 0; i < value.size(); ++i) {
+    const char c = value[i];
+    if (c == '+') {
+      decoded.push_back(' ');
+      continue;
+    }
+    if (c == '%' && i + 2 < value.size()) {
+      const int high = hex_value(value[i + 1]);
+      const int low = hex_value(value[i + 2]);
+      if (high >= 0 && low >= 0) {
+        decoded.push_back(static_cast<char>((high << 4) | low));
+        i += 2;
+        continue;
+      }
+    }
+    decoded.push_back(c);
+  }
+  return decoded;
+}
+
+// split "a=1&b=2" into {a: 1, b: 2}, names and values are url decoded
+std::unordered_map<std::string, std::string> parse_query(
+    const std::string& query) {
+  std::unordered_map<std::string, std::string> params;
+  size_t start = 0;
+  while (start < query.size()) {
+    size_t end = query.find('&', start);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    const std::string param = query.substr(start, end - start);
+    const size_t eq = param.find('=');
+    if (eq == std::string::npos) {
+      params[url_decode(param)] = "";
+    } else {
+      params[url_decode(param.substr(0, eq))] =
+          url_decode(param.substr(eq + 1));
+    }
+    start = end + 1;
+  }
+  return params;
+}
+
+}  // namespace
 
 bool HttpServer::register_uri(const std::string& uri,
                               HttpServer::Handler handler) {
@@ -49,15 +115,21 @@ void HttpServer::handle_request(tcp::socket& socket) {
   boost::beast::http::response<boost::beast::http::string_body> res;
   res.version(req.version());
   res.keep_alive(req.keep_alive());
-  auto it = endpoints_.find(req.target().to_string());
+  // endpoints are matched by the path without query parameters
+  const std::string target = req.target().to_string();
+  const size_t query_pos = target.find('?');
+  const std::string path = target.substr(0, query_pos);
+  auto it = endpoints_.find(path);
   if (it == endpoints_.end()) {
     res.result(boost::beast::http::status::not_found);
-    res.body() =
-        "The resource '" + req.target().to_string() + "' was not found.";
+    res.body() = "The resource '" + path + "' was not found.";
     res.set(boost::beast::http::field::content_type, "text/plain");
   } else {
     auto& handler = it->second;
-    Transport transport(&res);
+    Transport transport(&res,
+                        query_pos == std::string::npos
+                            ? std::unordered_map<std::string, std::string>()
+                            : parse_query(target.substr(query_pos + 1)));
     if (!handler(transport)) {
       res.result(boost::beast::http::status::internal_server_error);
       res.body() = "An error occurred processing the request.";
@@ -105,4 +177,11 @@ bool HttpServer::Transport::send_status(int status_code) {
   return true;
 }
 
+std::string HttpServer::Transport::get_param(
+    const std::string& name,
+    const std::string& default_value) const {
+  auto it = params_.find(name);
+  return it == params_.end() ? default_value : it->second;
+}
+
 }  // namespace llm
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <utility>
 
 namespace llm {
 using tcp = boost::asio::ip::tcp;
@@ -35,10 +36,14 @@ class HttpServer {
    private:
     boost::beast::http::response<boost::beast::http::string_body>* res_;
 
+    // query parameters of the request
+    std::unordered_map<std::string, std::string> params_;
+
    public:
     explicit Transport(
-        boost::beast::http::response<boost::beast::http::string_body>* res)
-        : res_(res) {}
+        boost::beast::http::response<boost::beast::http::string_body>* res,
+        std::unordered_map<std::string, std::string> params = {})
+        : res_(res), params_(std::move(params)) {}
 
     Transport(const Transport&) = delete;
     Transport& operator=(Transport&) = delete;
@@ -50,6 +55,11 @@ class HttpServer {
 
     // Send status code: 200 OK, 503 Service Unavailable, etc.
     bool send_status(int status_code);
+
+    // Get the value of a query parameter, e.g. "5" for "seconds" in
+    // "/trace?seconds=5". returns default_value if not present.
+    std::string get_param(const std::string& name,
+                          const std::string& default_value = "") const;
   };
 
  private:
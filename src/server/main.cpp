@@ -1,3 +1,4 @@
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_split.h>
 #include <c10/core/Device.h>
 #include <folly/init/Init.h>
@@ -10,15 +11,21 @@
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "common/metrics.h"
+#include "common/tracer.h"
 #include "engine/engine.h"
 #include "grpc_server.h"
 #include "handlers/chat_handler.h"
 #include "handlers/completion_handler.h"
+#include "handlers/embedding_handler.h"
 #include "handlers/models_handler.h"
 #include "http_server.h"
 #include "scheduler/continuous_batching_scheduler.h"
+#include "scheduler/replica_router.h"
+#include "scheduler/weight_reloader.h"
 
 using namespace llm;
 
@@ -31,11 +38,43 @@ DEFINE_string(device,
               "Device to run the model on, e.g. cpu, cuda:0, cuda:0,cuda:1, or "
               "auto to use all available gpus.");
 
+DEFINE_string(decode_device,
+              "",
+              "Devices to run decode on, e.g. cuda:1. If set, --device only "
+              "runs prefill and prefilled requests are moved to a separate "
+              "decode engine on these devices.");
+
+DEFINE_int32(pipeline_parallel_size,
+             1,
+             "Number of pipeline stages to split the model layers into. "
+             "Devices are split evenly across stages in order.");
+
+DEFINE_int32(num_replicas,
+             1,
+             "Number of data parallel replicas to serve in one process. "
+             "Devices are split evenly across replicas in order, and requests "
+             "are routed by load and prompt prefix.");
+
 DEFINE_int32(http_port, 9999, "Port for http server.");
 DEFINE_int32(grpc_port, 8888, "Port for grpc server.");
 
+DEFINE_string(lora_adapters,
+              "",
+              "comma separated name=path pairs of peft lora adapters to serve "
+              "along with the model, e.g. sql=/adapters/sql. requests select "
+              "an adapter by using its name as the model. requires "
+              "--max_loras > 0.");
+
+DEFINE_int64(trace_buffer_size,
+             0,
+             "Number of spans kept in memory for the timeline served at "
+             "/trace?seconds=N, 0 to disable tracing.");
+
 // NOLINTNEXTLINE
 static std::atomic<bool> running{true};
+// set once the engines are initialized and warmed up
+// NOLINTNEXTLINE
+static std::atomic<bool> ready{false};
 void shutdown_handler(int signal) {
   LOG(WARNING) << "Received signal " << signal << ", stopping server...";
   running.store(false, std::memory_order_relaxed);
@@ -121,34 +160,204 @@ int main(int argc, char** argv) {
       "/metrics", [](HttpServer::Transport& transport) -> bool {
         return transport.send_string(Metrics::Instance().GetString());
       });
+  if (FLAGS_trace_buffer_size > 0) {
+    Tracer::Instance().enable(FLAGS_trace_buffer_size);
+  }
+  // timeline of the last seconds in chrome trace format, open the file with
+  // https://ui.perfetto.dev or chrome://tracing
+  http_server.register_uri(
+      "/trace", [](HttpServer::Transport& transport) -> bool {
+        if (!Tracer::Instance().enabled()) {
+          transport.send_string("Tracing is disabled, set --trace_buffer_size "
+                                "to enable it.\n");
+          // 404 Not Found
+          return transport.send_status(404);
+        }
+        double seconds = 10.0;
+        if (!absl::SimpleAtod(transport.get_param("seconds", "10"),
+                              &seconds) ||
+            seconds <= 0) {
+          transport.send_string("Invalid seconds\n");
+          // 400 Bad Request
+          return transport.send_status(400);
+        }
+        return transport.send_string(
+            Tracer::Instance().dump_chrome_trace(seconds), "application/json");
+      });
+  // reload weights from a checkpoint of the same model without restarting,
+  // e.g. /reload_weights?path=/models/llama-2-7b-v2, defaults to --model_path
+  WeightReloader weight_reloader;
+  http_server.register_uri(
+      "/reload_weights",
+      [&weight_reloader](HttpServer::Transport& transport) -> bool {
+        const auto path = transport.get_param("path", FLAGS_model_path);
+        if (!std::filesystem::exists(path)) {
+          transport.send_string("Model path " + path + " does not exist\n");
+          // 400 Bad Request
+          return transport.send_status(400);
+        }
+        if (weight_reloader.in_progress()) {
+          transport.send_string("Weights are being reloaded\n");
+          // 409 Conflict
+          return transport.send_status(409);
+        }
+        if (!weight_reloader.reload_async(path)) {
+          transport.send_string("Server is not ready\n");
+          // 503 Service Unavailable
+          return transport.send_status(503);
+        }
+        transport.send_string("Reloading weights from " + path + "\n");
+        // 202 Accepted
+        return transport.send_status(202);
+      });
   http_server.register_uri("/health",
                            [](HttpServer::Transport& transport) -> bool {
-                             if (running.load(std::memory_order_relaxed)) {
+                             if (running.load(std::memory_order_relaxed) &&
+                                 ready.load(std::memory_order_relaxed)) {
                                return transport.send_string("Ok\n");
                              }
                              // 503 Service Unavailable
                              return transport.send_status(503);
                            });
 
+  // start http server early to report health while loading and warming up
+  if (!http_server.start(FLAGS_http_port, /*num_threads=*/2)) {
+    LOG(ERROR) << "Failed to start http server on port " << FLAGS_http_port;
+    return -1;
+  }
+
   // parse devices
-  const auto devices = parse_devices(FLAGS_device);
-  LOG(INFO) << "Using devices: " << to_string(devices);
+  const auto all_devices = parse_devices(FLAGS_device);
+  LOG(INFO) << "Using devices: " << to_string(all_devices);
+
+  // split devices into data parallel replicas
+  const int32_t num_replicas = FLAGS_num_replicas;
+  CHECK(num_replicas > 0 && all_devices.size() % num_replicas == 0)
+      << "Number of devices " << all_devices.size()
+      << " is not divisible by number of replicas " << num_replicas;
+  CHECK(num_replicas == 1 || FLAGS_decode_device.empty())
+      << "Replicas are not supported with prefill/decode disaggregation";
+  const size_t devices_per_replica = all_devices.size() / num_replicas;
+  const auto replica_devices = [&](int32_t replica) {
+    return std::vector<torch::Device>(
+        all_devices.begin() + replica * devices_per_replica,
+        all_devices.begin() + (replica + 1) * devices_per_replica);
+  };
+  const auto devices = replica_devices(0);
+
+  // kv caches migrated to the decode engine are sharded like the prefill
+  // engine, so both should split the model the same way
+  std::vector<torch::Device> decode_devices;
+  if (!FLAGS_decode_device.empty()) {
+    decode_devices = parse_devices(FLAGS_decode_device);
+    if (decode_devices.size() != devices.size() ||
+        FLAGS_pipeline_parallel_size != 1) {
+      LOG(ERROR) << "Prefill/decode disaggregation requires the same number "
+                 << "of prefill and decode devices without pipeline "
+                 << "parallelism, got " << devices.size() << " prefill and "
+                 << decode_devices.size() << " decode devices with "
+                 << FLAGS_pipeline_parallel_size << " pipeline stages";
+      return -1;
+    }
+  }
+
+  // lora adapters shared by all engines, checked against the model by init
+  LoRARegistry lora_registry;
+  std::vector<std::string> lora_ids;
+  const bool use_lora = !FLAGS_lora_adapters.empty();
+  if (use_lora) {
+    CHECK(lora_registry.add_all(FLAGS_lora_adapters))
+        << "Failed to load lora adapters " << FLAGS_lora_adapters;
+    for (size_t id = 0; id < lora_registry.size(); ++id) {
+      lora_ids.push_back(lora_registry.get(static_cast<int32_t>(id)).name);
+    }
+  }
 
   // create engine
-  auto engine = std::make_unique<Engine>(devices);
+  auto engine =
+      std::make_unique<Engine>(devices, FLAGS_pipeline_parallel_size);
+  if (use_lora) {
+    engine->set_lora_registry(&lora_registry);
+  }
   CHECK(engine->init(FLAGS_model_path));
 
+  // create other replicas, each with its own engine and scheduler
+  std::vector<std::unique_ptr<Engine>> replica_engines;
+  std::vector<std::unique_ptr<ContinuousBatchingScheduler>> replica_schedulers;
+  for (int32_t i = 1; i < num_replicas; ++i) {
+    LOG(INFO) << "Replica " << i << " using devices: "
+              << to_string(replica_devices(i));
+    replica_engines.push_back(std::make_unique<Engine>(
+        replica_devices(i), FLAGS_pipeline_parallel_size));
+    if (use_lora) {
+      replica_engines.back()->set_lora_registry(&lora_registry);
+    }
+    CHECK(replica_engines.back()->init(FLAGS_model_path));
+    replica_schedulers.push_back(std::make_unique<ContinuousBatchingScheduler>(
+        replica_engines.back().get()));
+  }
+
+  // create a separate engine for decode if prefill/decode are disaggregated
+  std::unique_ptr<Engine> decode_engine;
+  std::unique_ptr<KVTransport> kv_transport;
+  std::unique_ptr<ContinuousBatchingScheduler> decode_scheduler;
+  if (!decode_devices.empty()) {
+    LOG(INFO) << "Using decode devices: " << to_string(decode_devices);
+    decode_engine = std::make_unique<Engine>(decode_devices);
+    if (use_lora) {
+      decode_engine->set_lora_registry(&lora_registry);
+    }
+    CHECK(decode_engine->init(FLAGS_model_path));
+    kv_transport = std::make_unique<LocalKVTransport>(/*capacity=*/1024);
+    decode_scheduler = std::make_unique<ContinuousBatchingScheduler>(
+        decode_engine.get(), DisaggRole::DECODE, kv_transport.get());
+  }
+
   // create scheduler and grpc handlers
-  auto scheduler = std::make_unique<ContinuousBatchingScheduler>(engine.get());
+  auto scheduler =
+      decode_scheduler == nullptr
+          ? std::make_unique<ContinuousBatchingScheduler>(engine.get())
+          : std::make_unique<ContinuousBatchingScheduler>(
+                engine.get(), DisaggRole::PREFILL, kv_transport.get());
+
+  // route requests across replicas, sharing tokenizer and front end
+  std::unique_ptr<ReplicaRouter> router;
+  Scheduler* front_scheduler = scheduler.get();
+  if (!replica_schedulers.empty()) {
+    std::vector<ContinuousBatchingScheduler*> replicas = {scheduler.get()};
+    for (auto& replica_scheduler : replica_schedulers) {
+      replicas.push_back(replica_scheduler.get());
+    }
+    router = std::make_unique<ReplicaRouter>(replicas);
+    front_scheduler = router.get();
+  }
+
+  // engines with the schedulers stepping them, for weight reloads. added at
+  // once since /reload_weights is already being served.
+  std::vector<WeightReloader::Target> reload_targets = {
+      {engine.get(), scheduler.get()}};
+  for (size_t i = 0; i < replica_engines.size(); ++i) {
+    reload_targets.emplace_back(replica_engines[i].get(),
+                                replica_schedulers[i].get());
+  }
+  if (decode_scheduler != nullptr) {
+    reload_targets.emplace_back(decode_engine.get(), decode_scheduler.get());
+  }
+  weight_reloader.add_all(std::move(reload_targets));
+
   auto completion_handler =
-      std::make_unique<CompletionHandler>(scheduler.get(), engine.get());
+      std::make_unique<CompletionHandler>(front_scheduler, engine.get());
   auto chat_handler =
-      std::make_unique<ChatHandler>(scheduler.get(), engine.get());
-  auto models_handler = std::make_unique<ModelsHandler>(FLAGS_model_id);
+      std::make_unique<ChatHandler>(front_scheduler, engine.get());
+  auto embedding_handler =
+      std::make_unique<EmbeddingHandler>(front_scheduler, engine.get());
+  auto models_handler =
+      std::make_unique<ModelsHandler>(FLAGS_model_id, lora_ids);
 
   // start grpc server
   GrpcServer grpc_server(std::move(completion_handler),
                          std::move(chat_handler),
+                         std::move(embedding_handler),
                          std::move(models_handler));
   GrpcServer::Options options;
   options.address = "0.0.0.0";
@@ -159,20 +368,43 @@ int main(int argc, char** argv) {
     return -1;
   }
 
-  if (!http_server.start(FLAGS_http_port, /*num_threads=*/2)) {
-    LOG(ERROR) << "Failed to start http server on port " << FLAGS_http_port;
-    return -1;
-  }
+  // all engines are warmed up and the grpc server is serving
+  ready.store(true, std::memory_order_relaxed);
 
   // install graceful shutdown handler
   (void)signal(SIGINT, shutdown_handler);
   (void)signal(SIGTERM, shutdown_handler);
 
   const auto timeout = absl::Milliseconds(500);
+  std::thread decode_thread;
+  if (decode_scheduler != nullptr) {
+    decode_thread = std::thread([&decode_scheduler, timeout]() {
+      while (running.load(std::memory_order_relaxed)) {
+        decode_scheduler->step(timeout);
+      }
+    });
+  }
+  // step other replicas on their own threads
+  std::vector<std::thread> replica_threads;
+  for (auto& replica_scheduler : replica_schedulers) {
+    replica_threads.emplace_back([&replica_scheduler, timeout]() {
+      while (running.load(std::memory_order_relaxed)) {
+        replica_scheduler->step(timeout);
+      }
+    });
+  }
   while (running.load(std::memory_order_relaxed)) {
     // move scheduler forward
     scheduler->step(timeout);
   }
+  // abandon the reload waiting for schedulers that stopped stepping
+  weight_reloader.stop();
+  if (decode_thread.joinable()) {
+    decode_thread.join();
+  }
+  for (auto& replica_thread : replica_threads) {
+    replica_thread.join();
+  }
 
   // stop grpc server and http server
   grpc_server.stop();
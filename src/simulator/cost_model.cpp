@@ -0,0 +1,90 @@
+#include "cost_model.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace llm {
+namespace {
+
+constexpr size_t kNumFeatures = 4;
+
+std::array<double, kNumFeatures> to_features(const StepStats& stats) {
+  return {1.0,
+          static_cast<double>(stats.num_tokens),
+          static_cast<double>(stats.num_seqs),
+          static_cast<double>(stats.num_kv_tokens)};
+}
+
+}  // namespace
+
+CostModel::CostModel(double base_ms,
+                     double per_token_ms,
+                     double per_seq_ms,
+                     double per_kv_token_ms)
+    : coefficients_{base_ms, per_token_ms, per_seq_ms, per_kv_token_ms} {}
+
+bool CostModel::fit(const std::vector<StepRecord>& steps) {
+  if (steps.size() < kNumFeatures) {
+    LOG(ERROR) << "At least " << kNumFeatures << " steps are needed to fit";
+    return false;
+  }
+
+  // solve the normal equations: (X^T * X) * w = X^T * y
+  // a: [kNumFeatures, kNumFeatures + 1] augmented matrix
+  std::array<std::array<double, kNumFeatures + 1>, kNumFeatures> a{};
+  for (const auto& step : steps) {
+    const auto x = to_features(step.stats);
+    for (size_t i = 0; i < kNumFeatures; ++i) {
+      for (size_t j = 0; j < kNumFeatures; ++j) {
+        a[i][j] += x[i] * x[j];
+      }
+      a[i][kNumFeatures] += x[i] * step.latency_ms;
+    }
+  }
+
+  // gaussian elimination with partial pivoting
+  for (size_t col = 0; col < kNumFeatures; ++col) {
+    size_t pivot = col;
+    for (size_t row = col + 1; row < kNumFeatures; ++row) {
+      if (std::abs(a[row][col]) > std::abs(a[pivot][col])) {
+        pivot = row;
+      }
+    }
+    if (std::abs(a[pivot][col]) < 1e-12) {
+      LOG(ERROR) << "Steps are not diverse enough to fit the cost model";
+      return false;
+    }
+    std::swap(a[col], a[pivot]);
+    for (size_t row = 0; row < kNumFeatures; ++row) {
+      if (row == col) {
+        continue;
+      }
+      const double factor = a[row][col] / a[col][col];
+      for (size_t k = col; k <= kNumFeatures; ++k) {
+        a[row][k] -= factor * a[col][k];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < kNumFeatures; ++i) {
+    // a step can't get faster with a larger batch
+    coefficients_[i] = std::max(a[i][kNumFeatures] / a[i][i], 0.0);
+  }
+  return true;
+}
+
+double CostModel::step_latency_ms(const StepStats& stats) const {
+  const auto x = to_features(stats);
+  double latency_ms = 0.0;
+  for (size_t i = 0; i < kNumFeatures; ++i) {
+    latency_ms += coefficients_[i] * x[i];
+  }
+  return latency_ms;
+}
+
+}  // namespace llm
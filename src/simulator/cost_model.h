@@ -0,0 +1,38 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "scheduler/trace_recorder.h"
+
+namespace llm {
+
+// CostModel estimates the latency of one step from the shape of its batch with
+// a linear model:
+//   latency = base + per_token * num_tokens + per_seq * num_seqs
+//             + per_kv_token * num_kv_tokens
+// num_tokens captures the compute bound prefill, while num_kv_tokens captures
+// the memory bound attention in decode. The coefficients can be calibrated
+// from step latencies measured on real hardware.
+class CostModel final {
+ public:
+  CostModel(double base_ms,
+            double per_token_ms,
+            double per_seq_ms,
+            double per_kv_token_ms);
+
+  // fit the coefficients to measured steps with least squares.
+  // returns false if the steps are not enough to determine the coefficients.
+  bool fit(const std::vector<StepRecord>& steps);
+
+  // estimated latency of a step in milliseconds
+  double step_latency_ms(const StepStats& stats) const;
+
+  // coefficients: base, per_token, per_seq, per_kv_token
+  const std::array<double, 4>& coefficients() const { return coefficients_; }
+
+ private:
+  std::array<double, 4> coefficients_;
+};
+
+}  // namespace llm
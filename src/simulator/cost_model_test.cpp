@@ -0,0 +1,48 @@
+#include "cost_model.h"
+
+#include <gtest/gtest.h>
+
+namespace llm {
+
+TEST(CostModelTest, StepLatency) {
+  CostModel cost_model(/*base_ms=*/5.0,
+                       /*per_token_ms=*/0.1,
+                       /*per_seq_ms=*/0.5,
+                       /*per_kv_token_ms=*/0.01);
+  StepStats stats;
+  stats.num_tokens = 100;
+  stats.num_seqs = 2;
+  stats.num_kv_tokens = 300;
+  EXPECT_DOUBLE_EQ(cost_model.step_latency_ms(stats), 5.0 + 10 + 1 + 3);
+}
+
+TEST(CostModelTest, Fit) {
+  const CostModel expected(/*base_ms=*/8.0,
+                           /*per_token_ms=*/0.05,
+                           /*per_seq_ms=*/0.2,
+                           /*per_kv_token_ms=*/0.001);
+  std::vector<StepRecord> steps;
+  for (int64_t num_seqs = 1; num_seqs <= 8; num_seqs *= 2) {
+    for (int64_t num_tokens = num_seqs; num_tokens <= 2048; num_tokens *= 4) {
+      StepRecord step;
+      step.stats.num_tokens = num_tokens;
+      step.stats.num_seqs = num_seqs;
+      step.stats.num_kv_tokens = num_tokens + num_seqs * num_seqs * 100;
+      step.latency_ms = expected.step_latency_ms(step.stats);
+      steps.push_back(step);
+    }
+  }
+
+  CostModel cost_model(0.0, 0.0, 0.0, 0.0);
+  ASSERT_TRUE(cost_model.fit(steps));
+  for (size_t i = 0; i < 4; ++i) {
+    EXPECT_NEAR(cost_model.coefficients()[i],
+                expected.coefficients()[i],
+                1e-6);
+  }
+
+  // not enough steps to fit
+  EXPECT_FALSE(cost_model.fit({steps.begin(), steps.begin() + 2}));
+}
+
+}  // namespace llm
@@ -0,0 +1,96 @@
+#include "sim_engine.h"
+
+#include <glog/logging.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "scheduler/trace_recorder.h"
+
+namespace llm {
+namespace {
+
+// token id returned for all sequences
+constexpr int64_t kSimTokenId = 1;
+
+// a tokenizer that decodes everything into empty text
+class SimTokenizer final : public Tokenizer {
+ public:
+  bool encode(const std::string_view& /*text*/,
+              std::vector<int32_t>* /*ids*/) const override {
+    LOG(FATAL) << "SimTokenizer::encode shouldn't be called";
+    return false;
+  }
+
+  std::string decode(const std::vector<int32_t>& /*tokens*/) const override {
+    return "";
+  }
+
+  size_t vocab_size() const override { return 0; }
+
+  std::unique_ptr<Tokenizer> clone() const override {
+    return std::make_unique<SimTokenizer>();
+  }
+};
+
+}  // namespace
+
+SimEngine::SimEngine(const CostModel& cost_model,
+                     uint32_t num_blocks,
+                     int32_t block_size)
+    : Engine({torch::kCPU}),
+      cost_model_(cost_model),
+      num_blocks_(num_blocks),
+      block_manager_(std::make_unique<BlockManager>(num_blocks, block_size)) {
+  CHECK_GT(num_blocks_, 0);
+}
+
+bool SimEngine::init(const std::string& /*model_weights_path*/) {
+  // nothing to load
+  return true;
+}
+
+std::unique_ptr<Tokenizer> SimEngine::tokenizer() const {
+  return std::make_unique<SimTokenizer>();
+}
+
+OutputParameters SimEngine::execute_model(const std::vector<Sequence*>& batch) {
+  ++num_steps_;
+  const double num_free_blocks = block_manager_->num_free_blocks();
+  const double kv_utilization = 1.0 - num_free_blocks / num_blocks_;
+  sum_kv_utilization_ += kv_utilization;
+  max_kv_utilization_ = std::max(max_kv_utilization_, kv_utilization);
+
+  now_ms_ += cost_model_.step_latency_ms(StepStats::from_batch(batch));
+
+  for (const Sequence* seq : batch) {
+    auto& timeline = timelines_[seq->id()];
+    if (seq->is_prefill() && seq->num_generated_tokens() > 0) {
+      // the kv cache was released by preemption and is recomputed
+      ++timeline.num_preemptions;
+    }
+    if (timeline.num_generated_tokens == 0) {
+      timeline.first_token_ms = now_ms_;
+    }
+    timeline.last_token_ms = now_ms_;
+    ++timeline.num_generated_tokens;
+  }
+
+  OutputParameters output_params;
+  output_params.next_tokens = torch::full(
+      {static_cast<int64_t>(batch.size()), 1}, kSimTokenId, torch::kInt64);
+  return output_params;
+}
+
+void SimEngine::advance_to(double time_ms) {
+  now_ms_ = std::max(now_ms_, time_ms);
+}
+
+double SimEngine::mean_kv_cache_utilization() const {
+  return num_steps_ == 0 ? 0.0 : sum_kv_utilization_ / num_steps_;
+}
+
+}  // namespace llm
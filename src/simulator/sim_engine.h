@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cost_model.h"
+#include "engine/engine.h"
+#include "memory/block_manager.h"
+#include "tokenizer/tokenizer.h"
+
+namespace llm {
+
+// timeline of a sequence in the simulation, in milliseconds
+struct SequenceTimeline {
+  // time when the first token is generated
+  double first_token_ms = 0.0;
+
+  // time when the last token is generated
+  double last_token_ms = 0.0;
+
+  // number of tokens generated so far
+  int64_t num_generated_tokens = 0;
+
+  // number of times the sequence is recomputed after being preempted
+  int64_t num_preemptions = 0;
+};
+
+// SimEngine replaces the model with a cost model so that the real scheduler
+// and block manager can be driven without a GPU. Each step advances a virtual
+// clock by the estimated latency of the batch and returns a dummy token for
+// each sequence, so sequences should ignore eos and stop at max_tokens.
+class SimEngine final : public Engine {
+ public:
+  SimEngine(const CostModel& cost_model,
+            uint32_t num_blocks,
+            int32_t block_size);
+
+  bool init(const std::string& model_weights_path) override;
+
+  std::unique_ptr<Tokenizer> tokenizer() const override;
+
+  BlockManager* block_manager() const override { return block_manager_.get(); }
+
+  OutputParameters execute_model(const std::vector<Sequence*>& batch) override;
+
+  // current time of the virtual clock in milliseconds
+  double now_ms() const { return now_ms_; }
+
+  // move the virtual clock forward when the engine is idle
+  void advance_to(double time_ms);
+
+  // number of steps executed
+  int64_t num_steps() const { return num_steps_; }
+
+  // timelines keyed by sequence id
+  const std::unordered_map<int64_t, SequenceTimeline>& timelines() const {
+    return timelines_;
+  }
+
+  // kv cache utilization in [0, 1] averaged over steps, and its peak
+  double mean_kv_cache_utilization() const;
+  double max_kv_cache_utilization() const { return max_kv_utilization_; }
+
+ private:
+  CostModel cost_model_;
+
+  uint32_t num_blocks_ = 0;
+
+  std::unique_ptr<BlockManager> block_manager_;
+
+  // virtual clock in milliseconds
+  double now_ms_ = 0.0;
+
+  int64_t num_steps_ = 0;
+
+  std::unordered_map<int64_t, SequenceTimeline> timelines_;
+
+  // sum and max of kv cache utilization sampled at each step
+  double sum_kv_utilization_ = 0.0;
+  double max_kv_utilization_ = 0.0;
+};
+
+}  // namespace llm
@@ -0,0 +1,194 @@
+#include <absl/time/time.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cost_model.h"
+#include "engine/engine.h"
+#include "request/request.h"
+#include "scheduler/continuous_batching_scheduler.h"
+#include "scheduler/trace_recorder.h"
+#include "sim_engine.h"
+
+DEFINE_string(trace_path,
+              "",
+              "jsonl trace of requests to replay, each line has arrival_time "
+              "in seconds, prompt_len and output_len.");
+
+DEFINE_string(step_trace_path,
+              "",
+              "jsonl trace of measured step latencies to calibrate the cost "
+              "model, recorded with --record_step_trace_path.");
+
+DEFINE_int32(num_blocks, 4096, "number of kv cache blocks to simulate.");
+
+DEFINE_double(step_base_ms, 8.0, "fixed latency of a step in milliseconds.");
+DEFINE_double(step_per_token_ms,
+              0.05,
+              "latency per token processed in a step in milliseconds.");
+DEFINE_double(step_per_seq_ms,
+              0.1,
+              "latency per sequence in a step in milliseconds.");
+DEFINE_double(step_per_kv_token_ms,
+              0.0005,
+              "latency per token attended to in a step in milliseconds.");
+
+namespace llm {
+namespace {
+
+// nearest rank percentile of sorted values
+double percentile(const std::vector<double>& sorted_values, double p) {
+  if (sorted_values.empty()) {
+    return 0.0;
+  }
+  const auto rank = static_cast<size_t>(p / 100.0 * sorted_values.size());
+  return sorted_values[std::min(rank, sorted_values.size() - 1)];
+}
+
+void print_percentiles(const std::string& name, std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  std::cout << std::left << std::setw(24) << name << " p50: " << std::setw(10)
+            << percentile(values, 50) << " p90: " << std::setw(10)
+            << percentile(values, 90) << " p99: " << percentile(values, 99)
+            << std::endl;
+}
+
+}  // namespace
+}  // namespace llm
+
+int main(int argc, char* argv[]) {
+  using namespace llm;
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK(!FLAGS_trace_path.empty()) << "--trace_path is required";
+  std::vector<RequestRecord> trace;
+  CHECK(TraceRecorder::read_requests(FLAGS_trace_path, &trace));
+  std::stable_sort(trace.begin(),
+                   trace.end(),
+                   [](const RequestRecord& a, const RequestRecord& b) {
+                     return a.arrival_time < b.arrival_time;
+                   });
+
+  CostModel cost_model(FLAGS_step_base_ms,
+                       FLAGS_step_per_token_ms,
+                       FLAGS_step_per_seq_ms,
+                       FLAGS_step_per_kv_token_ms);
+  if (!FLAGS_step_trace_path.empty()) {
+    std::vector<StepRecord> steps;
+    CHECK(TraceRecorder::read_steps(FLAGS_step_trace_path, &steps));
+    CHECK(cost_model.fit(steps)) << "Failed to calibrate the cost model";
+  }
+  const auto& coefficients = cost_model.coefficients();
+  LOG(INFO) << "Cost model: base=" << coefficients[0]
+            << "ms, per_token=" << coefficients[1]
+            << "ms, per_seq=" << coefficients[2]
+            << "ms, per_kv_token=" << coefficients[3] << "ms";
+
+  SimEngine engine(cost_model, FLAGS_num_blocks, FLAGS_block_size);
+  CHECK(engine.init(""));
+  ContinuousBatchingScheduler scheduler(&engine);
+
+  // sequence id of each request in the trace
+  std::vector<int64_t> seq_ids(trace.size(), 0);
+  std::atomic<size_t> num_finished_requests{0};
+  size_t next = 0;
+  while (num_finished_requests.load() < trace.size()) {
+    // submit all requests arrived so far
+    while (next < trace.size() &&
+           trace[next].arrival_time * 1000.0 <= engine.now_ms()) {
+      const auto& record = trace[next];
+      CHECK_GT(record.prompt_len, 0);
+      CHECK_GT(record.output_len, 0);
+      auto request = std::make_unique<Request>(
+          "sim-" + std::to_string(next),
+          std::vector<int32_t>(record.prompt_len, 1));
+      request->stopping_criteria.max_tokens = record.output_len;
+      request->stopping_criteria.ignore_eos_token = true;
+      request->on_finish = [&num_finished_requests](
+                               const std::vector<SequenceResult>& /*results*/,
+                               const Status& /*status*/,
+                               const Statistics& /*stats*/) -> bool {
+        num_finished_requests.fetch_add(1);
+        return true;
+      };
+      request->add_sequence();
+      seq_ids[next] = request->sequences.front().id();
+      CHECK(scheduler.schedule(request)) << "request queue is full";
+      ++next;
+    }
+
+    const int64_t num_steps = engine.num_steps();
+    scheduler.step(absl::ZeroDuration());
+    if (engine.num_steps() == num_steps) {
+      if (next < trace.size()) {
+        // idle, jump to the next arrival
+        engine.advance_to(trace[next].arrival_time * 1000.0);
+      } else {
+        // wait for finished requests to be responded
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // summarize the simulation
+  const auto& timelines = engine.timelines();
+  std::vector<double> ttfts;
+  std::vector<double> tpots;
+  std::vector<double> latencies;
+  int64_t num_output_tokens = 0;
+  int64_t num_prompt_tokens = 0;
+  int64_t num_preemptions = 0;
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const auto it = timelines.find(seq_ids[i]);
+    if (it == timelines.end()) {
+      // dropped without being scheduled
+      continue;
+    }
+    const auto& timeline = it->second;
+    const double arrival_ms = trace[i].arrival_time * 1000.0;
+    ttfts.push_back(timeline.first_token_ms - arrival_ms);
+    latencies.push_back(timeline.last_token_ms - arrival_ms);
+    if (timeline.num_generated_tokens > 1) {
+      tpots.push_back((timeline.last_token_ms - timeline.first_token_ms) /
+                      static_cast<double>(timeline.num_generated_tokens - 1));
+    }
+    num_output_tokens += timeline.num_generated_tokens;
+    num_prompt_tokens += trace[i].prompt_len;
+    num_preemptions += timeline.num_preemptions;
+  }
+
+  const double duration_s = engine.now_ms() / 1000.0;
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "requests:                " << ttfts.size() << "/"
+            << trace.size() << std::endl;
+  std::cout << "steps:                   " << engine.num_steps() << std::endl;
+  std::cout << "duration (s):            " << duration_s << std::endl;
+  if (duration_s > 0) {
+    std::cout << "throughput (req/s):      " << ttfts.size() / duration_s
+              << std::endl;
+    std::cout << "output tokens/s:         " << num_output_tokens / duration_s
+              << std::endl;
+    std::cout << "total tokens/s:          "
+              << (num_prompt_tokens + num_output_tokens) / duration_s
+              << std::endl;
+  }
+  print_percentiles("ttft (ms)", ttfts);
+  print_percentiles("tpot (ms)", tpots);
+  print_percentiles("latency (ms)", latencies);
+  std::cout << "preemptions:             " << num_preemptions << std::endl;
+  std::cout << "kv cache utilization:    mean "
+            << engine.mean_kv_cache_utilization() << " max "
+            << engine.max_kv_cache_utilization() << std::endl;
+  return 0;
+}